@@ -35,11 +35,21 @@
 #include <NetKit/NKProxy.h>
 #include <NetKit/NKURI.h>
 #include <NetKit/NKString.h>
+#include <algorithm>
 #include <sstream>
+#include <fstream>
 #include <string>
 #include <vector>
+#include <chrono>
+#include <ctime>
+#include <deque>
 #include <list>
+#include <unordered_map>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
 
 struct http_parser_settings;
 struct http_parser;
@@ -125,6 +135,7 @@ struct status
 	static const std::uint16_t requested_range;
 	static const std::uint16_t expectation_failed;
 	static const std::uint16_t upgrade_required;
+	static const std::uint16_t header_fields_too_large;
 	static const std::uint16_t server_error;
 	static const std::uint16_t not_implemented;
 	static const std::uint16_t bad_gateway;
@@ -137,12 +148,389 @@ struct status
 };
 
 
+// Header names are case-insensitive. The ones we care about are interned
+// up front so that lookups compare small integers instead of strings.
+
+struct field
+{
+	static const std::string& NETKIT_DLL
+	to_string( std::uint16_t val );
+
+	static std::uint16_t NETKIT_DLL
+	intern( const char *name, std::size_t len );
+
+	inline static std::uint16_t
+	intern( const std::string &name )
+	{
+		return intern( name.c_str(), name.size() );
+	}
+
+	static const std::uint16_t unknown;
+	static const std::uint16_t accept;
+	static const std::uint16_t accept_charset;
+	static const std::uint16_t accept_encoding;
+	static const std::uint16_t accept_language;
+	static const std::uint16_t accept_ranges;
+	static const std::uint16_t age;
+	static const std::uint16_t allow;
+	static const std::uint16_t authorization;
+	static const std::uint16_t cache_control;
+	static const std::uint16_t connection;
+	static const std::uint16_t content_disposition;
+	static const std::uint16_t content_encoding;
+	static const std::uint16_t content_language;
+	static const std::uint16_t content_length;
+	static const std::uint16_t content_location;
+	static const std::uint16_t content_range;
+	static const std::uint16_t content_type;
+	static const std::uint16_t cookie;
+	static const std::uint16_t date;
+	static const std::uint16_t etag;
+	static const std::uint16_t expect;
+	static const std::uint16_t expires;
+	static const std::uint16_t host;
+	static const std::uint16_t if_match;
+	static const std::uint16_t if_modified_since;
+	static const std::uint16_t if_none_match;
+	static const std::uint16_t if_range;
+	static const std::uint16_t if_unmodified_since;
+	static const std::uint16_t keep_alive;
+	static const std::uint16_t last_modified;
+	static const std::uint16_t location;
+	static const std::uint16_t origin;
+	static const std::uint16_t pragma;
+	static const std::uint16_t proxy_authenticate;
+	static const std::uint16_t proxy_authorization;
+	static const std::uint16_t proxy_connection;
+	static const std::uint16_t range;
+	static const std::uint16_t referer;
+	static const std::uint16_t retry_after;
+	static const std::uint16_t sec_websocket_accept;
+	static const std::uint16_t sec_websocket_key;
+	static const std::uint16_t sec_websocket_protocol;
+	static const std::uint16_t sec_websocket_version;
+	static const std::uint16_t server;
+	static const std::uint16_t set_cookie;
+	static const std::uint16_t te;
+	static const std::uint16_t trailer;
+	static const std::uint16_t transfer_encoding;
+	static const std::uint16_t upgrade;
+	static const std::uint16_t user_agent;
+	static const std::uint16_t vary;
+	static const std::uint16_t via;
+	static const std::uint16_t www_authenticate;
+	static const std::uint16_t count;
+};
+
+
+// A non-owning reference to a run of characters, usually inside a
+// connection's receive buffer. It is only as good as the storage it
+// points into.
+
+class string_view
+{
+public:
+
+	inline string_view()
+	:
+		m_data( nullptr ),
+		m_size( 0 )
+	{
+	}
+
+	inline string_view( const char *data, std::size_t size )
+	:
+		m_data( data ),
+		m_size( size )
+	{
+	}
+
+	inline string_view( const std::string &s )
+	:
+		m_data( s.data() ),
+		m_size( s.size() )
+	{
+	}
+
+	inline string_view( const char *s )
+	:
+		m_data( s ),
+		m_size( strlen( s ) )
+	{
+	}
+
+	inline const char*
+	data() const
+	{
+		return m_data;
+	}
+
+	inline std::size_t
+	size() const
+	{
+		return m_size;
+	}
+
+	inline bool
+	empty() const
+	{
+		return m_size == 0;
+	}
+
+	inline std::string
+	str() const
+	{
+		return std::string( m_data, m_size );
+	}
+
+	inline char
+	operator[]( std::size_t pos ) const
+	{
+		return m_data[ pos ];
+	}
+
+	inline string_view
+	substr( std::size_t pos, std::size_t len = std::string::npos ) const
+	{
+		return string_view( m_data + pos, std::min( len, m_size - pos ) );
+	}
+
+	inline bool
+	matches( std::size_t pos, const std::string &that ) const
+	{
+		return ( ( pos + that.size() ) <= m_size ) && ( memcmp( m_data + pos, that.data(), that.size() ) == 0 );
+	}
+
+	inline std::size_t
+	find_first_of( const char *chars, std::size_t pos ) const
+	{
+		for ( ; pos < m_size; pos++ )
+		{
+			if ( strchr( chars, m_data[ pos ] ) )
+			{
+				return pos;
+			}
+		}
+
+		return std::string::npos;
+	}
+
+	inline bool
+	operator==( const std::string &that ) const
+	{
+		return ( m_size == that.size() ) && ( memcmp( m_data, that.c_str(), m_size ) == 0 );
+	}
+
+	inline bool
+	operator!=( const std::string &that ) const
+	{
+		return !( *this == that );
+	}
+
+private:
+
+	const char	*m_data;
+	std::size_t	m_size;
+};
+
+
+class NETKIT_DLL header
+{
+public:
+
+	class entry
+	{
+	public:
+
+		entry( std::uint16_t id, const char *name, std::size_t name_len, const char *val, std::size_t val_len );
+
+		inline std::uint16_t
+		id() const
+		{
+			return m_id;
+		}
+
+		inline const std::string&
+		name() const
+		{
+			return ( m_id != field::unknown ) ? field::to_string( m_id ) : m_name;
+		}
+
+		inline const std::string&
+		value() const
+		{
+			return m_value;
+		}
+
+	private:
+
+		friend class header;
+
+		std::uint16_t	m_id;
+		std::string		m_name;
+		std::string		m_value;
+	};
+
+	typedef std::vector< entry >		entries;
+	typedef entries::const_iterator		const_iterator;
+
+	header();
+
+	inline const_iterator
+	begin() const
+	{
+		return m_entries.begin();
+	}
+
+	inline const_iterator
+	end() const
+	{
+		return m_entries.end();
+	}
+
+	inline std::size_t
+	size() const
+	{
+		return m_entries.size();
+	}
+
+	inline bool
+	empty() const
+	{
+		return m_entries.empty();
+	}
+
+	inline void
+	clear()
+	{
+		m_entries.clear();
+	}
+
+	const_iterator
+	find( std::uint16_t id ) const;
+
+	const_iterator
+	find( const std::string &name ) const;
+
+	std::uint16_t
+	set( const char *name, std::size_t name_len, const char *val, std::size_t val_len );
+
+	inline std::uint16_t
+	set( const std::string &name, const std::string &val )
+	{
+		return set( name.c_str(), name.size(), val.c_str(), val.size() );
+	}
+
+	void
+	set( std::uint16_t id, const std::string &val );
+
+	void
+	erase( std::uint16_t id );
+
+	void
+	erase( const std::string &name );
+
+private:
+
+	entries::iterator
+	lookup( std::uint16_t id, const char *name, std::size_t len );
+
+	entries m_entries;
+};
+
+
+// Content-codings (RFC 7231 section 3.1.2.1), by way of zlib. Without
+// NETKIT_ZLIB only identity is spoken.
+
+struct coding
+{
+	static const std::uint8_t identity;
+	static const std::uint8_t gzip;
+	static const std::uint8_t deflate;
+	static const std::uint8_t unknown;
+
+	static const std::string& NETKIT_DLL
+	to_string( std::uint8_t val );
+
+	static std::uint8_t NETKIT_DLL
+	from_string( const std::string &val );
+
+	// Whether gzip and deflate are available in this build.
+
+	static bool NETKIT_DLL
+	supported();
+
+	// Picks the coding to answer with given an Accept-Encoding value,
+	// honoring q-values. Prefers gzip when both are equally acceptable.
+
+	static std::uint8_t NETKIT_DLL
+	negotiate( const std::string &accept_encoding );
+
+	static bool NETKIT_DLL
+	encode( std::uint8_t val, const std::uint8_t *buf, std::size_t len, std::string &out );
+
+	// Decodes a body as it arrives.
+
+	class NETKIT_DLL decoder : public counted< decoder >
+	{
+	public:
+
+		typedef smart_ref< decoder > ref;
+		typedef std::function< void ( const std::uint8_t *buf, std::size_t len ) > output_f;
+
+		// Gives up once more than max_size bytes have come out. 0 means no
+		// limit.
+
+		decoder( std::uint8_t val, std::size_t max_size = 0 );
+
+		~decoder();
+
+		// Returns false if the data is corrupt or decodes to more than
+		// max_size bytes.
+
+		bool
+		write( const std::uint8_t *buf, std::size_t len, output_f output );
+
+	private:
+
+		bool
+		reset( bool raw );
+
+		bool
+		run( const std::uint8_t *buf, std::size_t len, output_f output );
+
+		void			*m_stream;
+		std::uint8_t	m_coding;
+		std::uint8_t	m_prefix[ 2 ];
+		std::size_t		m_prefix_len;
+		std::size_t		m_max_size;
+		std::size_t		m_size;
+		bool			m_started;
+		bool			m_done;
+	};
+};
+
+
 class NETKIT_DLL message : public object
 {
 public:
 
-	typedef std::map< std::string, std::string >	header;
-	typedef smart_ref< message >					ref;
+	typedef http::header			header;
+	typedef smart_ref< message >	ref;
+
+	// Produces a streamed body. It is called each time the connection is
+	// ready for more, writes at most len bytes into buf and returns how
+	// many it wrote. Returning 0 ends the body; a negative value aborts it
+	// and closes the connection. A producer with nothing to give yet
+	// returns would_block and calls wake() on the message once it has.
+
+	typedef std::function< std::streamsize ( std::uint8_t *buf, std::size_t len ) > producer_f;
+
+	// Set by whoever is sending the body. Returns false once nobody is.
+
+	typedef std::function< bool () > wake_f;
+
+	static const std::streamsize would_block;
 	
 public:
 
@@ -179,9 +567,18 @@ public:
 	virtual void
 	add_to_header( const std::string &key, const std::string &val );
 
+	// For fields still sitting in a receive buffer. Name and value are
+	// copied once, straight into the header.
+
+	void
+	add_to_header( const char *name, std::size_t name_len, const char *val, std::size_t val_len );
+
 	virtual std::string
 	find_in_header( const std::string &key ) const;
 
+	virtual std::string
+	find_in_header( std::uint16_t id ) const;
+
 	virtual void
 	remove_from_header( const std::string &key );
 	
@@ -230,10 +627,46 @@ public:
 	virtual void
 	write( const uint8_t *buf, size_t len );
 	
-	inline std::string
-	body() const
+	std::string
+	body() const;
+
+	std::size_t
+	body_size() const;
+
+	// Copies up to len bytes of the body starting at pos into buf, without
+	// making a copy of the whole thing. Returns how many were copied.
+
+	std::size_t
+	read_body( std::size_t pos, std::uint8_t *buf, std::size_t len ) const;
+
+	void
+	clear_body();
+
+	// Bodies that grow past the spill threshold while being written are
+	// moved into a temporary file, which is removed along with the message.
+
+	inline bool
+	body_spilled() const
+	{
+		return m_spill != nullptr;
+	}
+
+	inline const std::string&
+	body_path() const
+	{
+		return m_spill_path;
+	}
+
+	inline static std::size_t
+	spill_threshold()
+	{
+		return m_spill_threshold;
+	}
+
+	inline static void
+	set_spill_threshold( std::size_t val )
 	{
-		return m_ostream.str();
+		m_spill_threshold = val;
 	}
 	
 	template < class U >
@@ -253,14 +686,88 @@ public:
 	virtual void
 	preflight();
 	
+	// The start line, including its CRLF, appended to out.
+
 	virtual void
-	send_prologue( connection_ref conn ) const = 0;
+	write_prologue( std::string &out ) const = 0;
 	
-	virtual bool
-	send_body( connection_ref conn ) const;
+	virtual void
+	write_body( std::string &out ) const;
+
+	// Set a producer to stream the body instead of sending what was
+	// written into the message. If there's no Content-Length header the
+	// body goes out with chunked transfer-encoding.
+
+	inline void
+	set_producer( producer_f val )
+	{
+		m_producer = val;
+	}
+
+	producer_f
+	producer() const;
+
+	// Starts the producer up again after it returned would_block. Returns
+	// false if the body is no longer being sent, e.g. because the peer
+	// went away; true otherwise, including before sending has started.
+
+	inline bool
+	wake()
+	{
+		return m_wake ? m_wake() : true;
+	}
+
+	inline void
+	set_wake( wake_f val )
+	{
+		m_wake = val;
+	}
+
+	// A body that lives in an open file. Connections that can hand it
+	// straight to the kernel do so; anything else reads it through the
+	// producer, which has to be set as well.
+
+	inline void
+	set_file( int file, std::uint64_t offset, std::uint64_t len )
+	{
+		m_file			= file;
+		m_file_offset	= offset;
+		m_file_length	= len;
+	}
+
+	inline int
+	file() const
+	{
+		return m_file;
+	}
+
+	inline std::uint64_t
+	file_offset() const
+	{
+		return m_file_offset;
+	}
+
+	inline std::uint64_t
+	file_length() const
+	{
+		return m_file_length;
+	}
 	
 protected:
 
+	// Called with each well-known field added to the header, already
+	// interned, so the ones a message keeps track of are picked out
+	// without looking the name up again.
+
+	virtual void
+	field_was_added( std::uint16_t id, const std::string &val );
+
+	// And its counterpart, so what was picked out doesn't outlive the
+	// field it came from.
+
+	virtual void
+	field_was_removed( std::uint16_t id );
+
 	std::uint16_t		m_major;
 	std::uint16_t		m_minor;
 	header				m_header;
@@ -269,7 +776,23 @@ protected:
 	std::string			m_upgrade;
 	std::string			m_ws_key;
 	bool				m_keep_alive;
-	std::ostringstream	m_ostream;
+	std::stringstream	m_ostream;
+	producer_f			m_producer;
+	wake_f				m_wake;
+	int					m_file;
+	std::uint64_t		m_file_offset;
+	std::uint64_t		m_file_length;
+
+private:
+
+	void
+	spill();
+
+	std::fstream		*m_spill;
+	std::string			m_spill_path;
+	std::size_t			m_spill_size;
+	bool				m_spill_failed;
+	static std::size_t	m_spill_threshold;
 };
 
 
@@ -284,17 +807,14 @@ public:
 	typedef std::function< void ( response_ref response ) >												headers_reply_f;
 	typedef std::function< void ( response_ref response, const std::uint8_t *buf, std::size_t len ) >	body_reply_f;
 	typedef std::function< void ( response_ref response ) >												reply_f;
+	typedef std::map< std::string, std::string >														params;
 	typedef smart_ref< request >																		ref;
 
 	request( int method, std::uint16_t major, std::uint16_t minor, const uri::ref &uri );
 
 	virtual ~request();
 
-	virtual void
-	add_to_header( const header& header );
-
-	virtual void
-	add_to_header( const std::string &key, const std::string &val );
+	using message::add_to_header;
 
 	template< class T > auto
 	add_to_header( const std::string &key, const T &val ) -> decltype( std::to_string( val ), void() )
@@ -350,6 +870,18 @@ public:
 		m_uri = val;
 	}
 
+	inline const params&
+	path_params() const
+	{
+		return m_path_params;
+	}
+
+	inline void
+	set_path_params( const params &val )
+	{
+		m_path_params = val;
+	}
+
 	inline const std::string&
 	expect() const
 	{
@@ -381,7 +913,7 @@ public:
 	}
 
 	virtual void
-	send_prologue( connection_ref conn ) const;
+	write_prologue( std::string &out ) const;
 	
 	inline int32_t
 	tries() const
@@ -413,6 +945,12 @@ public:
 		m_headers_reply = reply;
 	}
 
+	inline const headers_reply_f&
+	headers_reply_handler() const
+	{
+		return m_headers_reply;
+	}
+
 	void
 	body_reply( response_ref response, const std::uint8_t *buf, std::size_t len );
 
@@ -422,6 +960,12 @@ public:
 		m_body_reply = reply;
 	}
 
+	inline const body_reply_f&
+	body_reply_handler() const
+	{
+		return m_body_reply;
+	}
+
 	void
 	reply( response_ref response );
 
@@ -431,6 +975,12 @@ public:
 		m_reply = reply;
 	}
 
+	inline const reply_f&
+	reply_handler() const
+	{
+		return m_reply;
+	}
+
 	inline std::int32_t
 	max_redirects() const
 	{
@@ -459,6 +1009,12 @@ protected:
 
 	request( const request &that );
 
+	virtual void
+	field_was_added( std::uint16_t id, const std::string &val );
+
+	virtual void
+	field_was_removed( std::uint16_t id );
+
 	void
 	init();
 
@@ -473,6 +1029,7 @@ protected:
 	std::string		m_peer_ethernet_addr;
 	int				m_method;
 	uri::ref		m_uri;
+	params			m_path_params;
 	proxy::ref		m_proxy;
 	bool			m_redirect;
 	std::string		m_host;
@@ -507,7 +1064,13 @@ public:
 	}
 
 	virtual void
-	send_prologue( connection_ref conn ) const;
+	write_prologue( std::string &out ) const;
+
+	// The current time, formatted for a Date header. Each thread keeps its
+	// own copy, so the pointer stays good until this thread calls again.
+
+	static const char*
+	current_date();
 
 protected:
 
@@ -527,7 +1090,25 @@ public:
 	typedef smart_ref< connection > ref;
 	typedef std::list< ref > list;
 
-	class handler : public object
+	// Returned from handler::body_was_received() to stop reading the body
+	// until resume() is called. Calling pause() from inside the callback
+	// does the same thing.
+
+	static const int pause_body;
+
+	// Headers as they sit in the receive buffer. Only valid for the duration
+	// of handler::raw_headers_were_received().
+
+	struct raw_header
+	{
+		std::uint16_t	m_id;
+		string_view		m_name;
+		string_view		m_value;
+	};
+
+	typedef std::vector< raw_header > raw_headers;
+
+	class handler : public object
 	{
 	public:
 
@@ -545,6 +1126,13 @@ public:
 		virtual int
 		headers_were_received( connection::ref connection, message::header &header ) = 0;
 
+		// Handlers that can work straight off the receive buffer override
+		// this. The default copies everything into a message::header and
+		// calls headers_were_received().
+
+		virtual int
+		raw_headers_were_received( connection::ref connection, const raw_headers &headers );
+
 		virtual int
 		body_was_received( connection::ref connection, const char *buf, size_t len ) = 0;
 
@@ -556,6 +1144,13 @@ public:
 
 		virtual void
 		will_close( connection::ref connection ) = 0;
+
+		// The peer went over one of http::server's limits. status is the
+		// response it has earned, or zero if it is owed nothing. The
+		// default just closes the connection.
+
+		virtual void
+		limit_was_exceeded( connection::ref connection, std::uint16_t status );
 	};
 
 	connection( handler::ref handler );
@@ -568,9 +1163,18 @@ public:
 		return m_handler;
 	}
 
+	inline void
+	set_handler( handler::ref val )
+	{
+		m_handler = val;
+	}
+
 	virtual bool
 	process( const std::uint8_t *buf, std::size_t len );
 
+	virtual void
+	resume();
+
 	bool
 	upgrade_to_ws( const request::ref &request, std::function< void ( http::response::ref response, bool close ) > reply );
 
@@ -589,8 +1193,28 @@ public:
 	void
 	set_secure( bool val, bool is_server = true );
 	
+	typedef std::function< void ( int status ) > put_reply_f;
+
 	bool
 	put( message::ref message );
+
+	// Like put(), but tells you when the whole message, including a
+	// streamed body, has been handed to the source.
+
+	bool
+	put( message::ref message, put_reply_f reply );
+
+	// Like put(), but the body comes from producer rather than from the
+	// message itself.
+
+	bool
+	put( message::ref message, message::producer_f producer, put_reply_f reply );
+
+	// Sends part of a file with sendfile(). Only plain TCP connections can
+	// do this; returns false otherwise.
+
+	bool
+	send_file( int file, std::uint64_t offset, std::uint64_t len, put_reply_f reply );
 	
 	int
 	method() const;
@@ -603,24 +1227,45 @@ public:
 	
 	int
 	http_minor() const;
-	
-	template < class U >
-	inline connection&
-	operator<<( U t )
+
+	bool
+	should_keep_alive() const;
+
+	// When on, complete request heads without a body are parsed in one
+	// pass straight out of the receive buffer, scanning with SSE4.2 or
+	// AVX2 when the build targets them. Everything else, including heads
+	// split across reads, goes through http_parser as before.
+
+	inline static bool
+	fast_parse()
 	{
-		m_ostream << t;
-		return *this;
+		return m_fast_parse;
 	}
-	
-	inline connection&
-	operator<<( connection& ( *func )( connection& ) )
+
+	inline static void
+	set_fast_parse( bool val )
 	{
-		return func( *this );
+		m_fast_parse = val;
 	}
 
-	bool
-	flush();
+	// How many request heads the fast parser has taken, across all
+	// connections.
+
+	inline static std::size_t
+	fast_parsed()
+	{
+		return m_fast_parsed;
+	}
+
+	// The request target. Like the raw headers, this points into the
+	// receive buffer and is only valid while headers are being delivered.
 
+	inline string_view
+	target() const
+	{
+		return resolve( m_target );
+	}
+	
 	virtual void
 	close();
 
@@ -658,11 +1303,69 @@ protected:
 	
 	void
 	init();
+
+	// A piece of the message head. It points into the buffer being parsed
+	// until that buffer goes away, at which point it is spilled into
+	// m_spill and addressed by offset instead.
+
+	struct piece
+	{
+		const char	*m_ptr;
+		std::size_t	m_off;
+		std::size_t	m_len;
+	};
+
+	struct raw_field
+	{
+		piece m_name;
+		piece m_value;
+	};
+
+	struct stream
+	{
+		message::producer_f			m_producer;
+		put_reply_f					m_reply;
+		std::vector< std::uint8_t >	m_buf;
+		bool						m_chunked;
+		bool						m_close;
+		bool						m_in_send;
+		bool						m_sent;
+		bool						m_blocked;
+	};
+
+	void
+	pump( std::shared_ptr< stream > s );
+
+	// Delivers the requests at the front of buf that the fast parser can
+	// take, and returns how many bytes they took up. done is set when
+	// process() shouldn't look at the rest, ok when it went well.
+
+	std::size_t
+	parse_fast( const std::uint8_t *buf, std::size_t len, bool &done, bool &ok );
+
+	void
+	extend( piece &p, const char *buf, std::size_t len );
+
+	bool
+	head_fits( std::size_t len, bool new_field );
+
+	void
+	spill( piece &p );
+
+	inline string_view
+	resolve( const piece &p ) const
+	{
+		return p.m_ptr ? string_view( p.m_ptr, p.m_len ) : string_view( m_spill.data() + p.m_off, p.m_len );
+	}
 	
 	friend class				server;
 	
-	std::string					m_header_field;
-	std::string					m_header_value;
+	std::vector< std::uint8_t >	m_stash;
+	piece						m_target;
+	std::vector< raw_field >	m_fields;
+	raw_headers					m_raw_headers;
+	std::string					m_spill;
+	bool						m_in_head;
 	time_t						m_start;
 	bool						m_okay;
 	std::vector< std::uint8_t >	m_body;
@@ -671,200 +1374,1501 @@ protected:
 	http_parser_settings		*m_settings;
 	http_parser					*m_parser;
 	int							m_parse_state;
+
+	// m_in_message is set while http_parser is partway through a message,
+	// which is when the fast parser has to stay out of its way. m_fast is
+	// set when the current message came through the fast parser instead,
+	// and the m_fast_ fields stand in for what http_parser would know.
+
+	bool						m_in_message;
+	bool						m_fast;
+	std::uint8_t				m_fast_method;
+	std::uint16_t				m_fast_major;
+	std::uint16_t				m_fast_minor;
+	bool						m_fast_keep_alive;
+
+	static bool					m_fast_parse;
+	static std::atomic< std::size_t >	m_fast_parsed;
 	
 	message::header				m_header;
 
-	std::ostringstream			m_ostream;
+	// Where put() builds the outgoing head. It is reused from one message
+	// to the next so it rarely has to grow.
+
+	std::string					m_obuf;
+
+	// Server connections check the first bytes for the HTTP/2 preface,
+	// holding on to them until there are enough to tell.
+
+	bool						m_detect_h2;
+	std::string					m_preface;
+
+	// Copied from http::server by server::adopt(). Zero means no limit.
+	// m_rejected is the status a limit tripped inside the parser left for
+	// process() to hand to the handler.
+
+	std::size_t					m_max_head_bytes;
+	std::size_t					m_max_head_fields;
+	std::size_t					m_head_bytes;
+	std::uint16_t				m_rejected;
 
 	handler::ref				m_handler;
 };
 
 
-class NETKIT_DLL server
+// Compressed copies of response bodies, so the same body isn't compressed
+// over and over. Keyed by coding, body size and either the ETag or, when
+// there is no ETag, a hash of the body. Only the encoded copy is kept.
+
+class NETKIT_DLL compression_cache
 {
 public:
 
-	typedef std::function< void ( http::response::ref response, bool close ) >													response_f;
-	typedef std::function< http::request::ref ( int method, std::uint16_t major, std::uint16_t minor, const uri::ref &uri ) >	request_will_begin_f;
-	typedef std::function< int ( http::request::ref request, const std::uint8_t *buf, size_t len, response_f response ) >		request_body_was_received_f;
-	typedef std::function< int ( http::request::ref request, response_f func ) >												request_f;
+	static compression_cache&
+	instance();
 
-	class binding : public netkit::object
+	inline std::size_t
+	max_bytes() const
+	{
+		return m_max_bytes;
+	}
+
+	inline void
+	set_max_bytes( std::size_t val )
+	{
+		std::lock_guard< std::mutex > guard( m_mutex );
+		m_max_bytes = val;
+		evict();
+	}
+
+	inline std::size_t
+	bytes() const
+	{
+		std::lock_guard< std::mutex > guard( m_mutex );
+		return m_bytes;
+	}
+
+	inline std::size_t
+	size() const
+	{
+		std::lock_guard< std::mutex > guard( m_mutex );
+		return m_lru.size();
+	}
+
+	bool
+	get( const std::string &key, std::string &val );
+
+	void
+	put( const std::string &key, const std::string &val );
+
+	void
+	clear();
+
+private:
+
+	struct item
+	{
+		std::string m_key;
+		std::string m_encoded;
+	};
+
+	typedef std::list< item >									lru;
+	typedef std::unordered_map< std::string, lru::iterator >	index;
+
+	compression_cache();
+
+	compression_cache( const compression_cache &that );	// Not implemented
+
+	void
+	evict();
+
+	lru					m_lru;
+	index				m_index;
+	std::size_t			m_bytes;
+	std::size_t			m_max_bytes;
+	mutable std::mutex	m_mutex;
+};
+
+
+// Backs server::bind_files(). Small files are mapped into memory and kept
+// in a size-bounded LRU. Larger ones are opened per request and streamed,
+// or handed to sendfile() when the connection allows it.
+
+class NETKIT_DLL file_cache
+{
+public:
+
+	class entry : public counted< entry >
 	{
 	public:
 
-		typedef smart_ref< binding > ref;
-		typedef std::list< ref > list;
+		typedef smart_ref< entry > ref;
 
-		binding( const std::string &path, const std::string &type, request_f r )
-		:
-			m_path( path ),
-			m_type( type ),
-			m_r( r )
+		entry( const std::string &path, int file, std::uint64_t size, std::time_t mtime );
+
+		~entry();
+
+		inline const std::string&
+		path() const
 		{
-			m_rwb = [=]( int method, std::uint16_t major, std::uint16_t minor, const uri::ref &uri )
-			{
-				return new http::request( method, major, minor, uri );
-			};
+			return m_path;
+		}
 
-			m_rbwr = [=]( http::request::ref request, const std::uint8_t *buf, size_t len, response_f response )
-			{
-				return 0;
-			};
+		inline int
+		file() const
+		{
+			return m_file;
 		}
-	
-		binding( const std::string &path, const std::string &type, request_body_was_received_f rbwr, request_f r )
-		:
-			m_path( path ),
-			m_type( type ),
-			m_rbwr( rbwr ),
-			m_r( r )
+
+		inline std::uint64_t
+		size() const
 		{
-			m_rwb = [=]( int method, std::uint16_t major, std::uint16_t minor, const uri::ref &uri )
-			{
-				return new http::request( method, major, minor, uri );
-			};
+			return m_size;
 		}
-	
-		binding( const std::string &path, const std::string &type, request_will_begin_f rwb, request_body_was_received_f rbwr, request_f r )
-		:
-			m_path( path ),
-			m_type( type ),
-			m_rwb( rwb ),
-			m_rbwr( rbwr ),
-			m_r( r )
+
+		inline std::time_t
+		mtime() const
 		{
+			return m_mtime;
 		}
 
-		std::string					m_path;
-		std::string					m_type;
-		request_will_begin_f		m_rwb;
-		request_body_was_received_f	m_rbwr;
-		request_f					m_r;
-	};
+		inline const std::string&
+		etag() const
+		{
+			return m_etag;
+		}
 
-	static sink::ref
-	adopt( source::ref source );
+		inline const std::string&
+		last_modified() const
+		{
+			return m_last_modified;
+		}
 
-	static void
-	bind( std::uint8_t method, const std::string &path, const std::string &type, request_f r );
-	
-	static void
-	bind( std::uint8_t method, const std::string &path, const std::string &type, request_body_was_received_f rbwr, request_f r );
-	
-	static void
-	bind( std::uint8_t method, const std::string &path, const std::string &type, request_will_begin_f rwb, request_body_was_received_f rbwr, request_f r );
-	
-	static void
-	bind( std::uint8_t method, const std::string &path, sink::ref sink );
+		// Null unless the file is mapped.
 
-	static binding::ref
-	resolve( connection::ref conn, const message::header &header );
+		inline const std::uint8_t*
+		data() const
+		{
+			return m_data;
+		}
 
-	inline static connection::ref
-	active_connection()
+		std::size_t
+		read( std::uint64_t offset, std::uint8_t *buf, std::size_t len ) const;
+
+	private:
+
+		friend class file_cache;
+
+		bool
+		map();
+
+		std::string		m_path;
+		int				m_file;
+		std::uint64_t	m_size;
+		std::time_t		m_mtime;
+		std::string		m_etag;
+		std::string		m_last_modified;
+		std::uint8_t	*m_data;
+	};
+
+	static file_cache&
+	instance();
+
+	inline std::uint64_t
+	max_bytes() const
 	{
-		return m_active_connection;
+		return m_max_bytes;
 	}
 
-	inline static void
-	set_active_connection( connection *c )
+	inline void
+	set_max_bytes( std::uint64_t val )
 	{
-		m_active_connection = c;
+		std::lock_guard< std::mutex > guard( m_mutex );
+		m_max_bytes = val;
+		evict();
 	}
 
-	inline static connection::list::iterator
-	begin_connections()
+	inline std::uint64_t
+	max_file_size() const
 	{
-		return m_connections->begin();
+		return m_max_file_size;
 	}
-	
-	inline static connection::list::iterator
-	end_connections()
+
+	inline void
+	set_max_file_size( std::uint64_t val )
 	{
-		return m_connections->end();
+		m_max_file_size = val;
 	}
 
-protected:
-
-	class handler : public connection::handler
+	inline std::uint64_t
+	bytes() const
 	{
-	public:
+		std::lock_guard< std::mutex > guard( m_mutex );
+		return m_bytes;
+	}
 
-		typedef smart_ref< handler > ref;
+	inline std::size_t
+	size() const
+	{
+		std::lock_guard< std::mutex > guard( m_mutex );
+		return m_lru.size();
+	}
 
-		handler();
+	// Returns the file at path, or null if it isn't a readable regular
+	// file. A cached entry is reloaded if the file changed on disk.
 
-		virtual ~handler();
-	
-		virtual void
-		process_will_begin( connection::ref connection );
+	entry::ref
+	get( const std::string &path );
 
-		virtual void
-		message_will_begin( connection::ref connection );
+	void
+	clear();
 
-		virtual int
-		uri_was_received( connection::ref connection, const char *buf, size_t len );
+private:
 
-		virtual int
-		headers_were_received( connection::ref connection, message::header &header );
+	typedef std::list< entry::ref >								lru;
+	typedef std::unordered_map< std::string, lru::iterator >	index;
 
-		virtual int
-		body_was_received( connection::ref connection, const char *buf, size_t len );
+	file_cache();
 
-		virtual int
-		message_was_received( connection::ref connection );
+	file_cache( const file_cache &that );	// Not implemented
 
-		virtual void
-		process_did_end( connection::ref connection );
+	void
+	evict();
 
-		virtual void
-		will_close( connection::ref connection );
+	void
+	erase( index::iterator it );
+
+	lru					m_lru;
+	index				m_index;
+	std::uint64_t		m_bytes;
+	std::uint64_t		m_max_bytes;
+	std::uint64_t		m_max_file_size;
+	mutable std::mutex	m_mutex;
+};
 
-		std::string		m_uri;
-		binding::ref	m_binding;
-		request::ref	m_request;
-	};
 
-	friend void					netkit::initialize();
+// Fans Server-Sent Events out to the clients that asked for them through
+// server::bind_events(). An event is formatted once and that one buffer is
+// queued for every subscriber. A subscriber that falls more than
+// max_queued bytes behind loses events according to the overflow policy.
+// Call publish(), ping() and close() on the thread that runs the
+// subscribers' connections.
 
-	static void
-	bind( std::uint8_t method, binding::ref binding );
+class NETKIT_DLL event_channel : public object
+{
+public:
 
-	static std::string
-	regexify( const std::string &s );
+	typedef smart_ref< event_channel > ref;
 
-	static void
-	replace( std::string& str, const std::string& oldStr, const std::string& newStr);
-	
-	typedef std::map< std::uint8_t, binding::list > bindings;
+	enum class overflow
+	{
+		drop_oldest,	// Throw away the oldest events
+		compact,		// Keep only the newest event of each type, then drop the oldest
+		close			// Hang up on the subscriber
+	};
 
-	static connection::ref		m_active_connection;
+	event_channel( std::size_t max_queued = 256 * 1024, overflow policy = overflow::compact );
 
-	static connection::list		*m_connections;
-	static bindings				m_bindings;
-};
+	~event_channel();
 
+	void
+	publish( const std::string &data, const std::string &event = std::string(), const std::string &id = std::string() );
 
-class NETKIT_DLL client : public connection::handler
-{
-public:
+	// Sends a comment line. That keeps proxies from timing the stream out,
+	// and is how subscribers that went away get noticed when there's
+	// nothing to publish.
 
-	typedef smart_ref< client > ref;
+	void
+	ping();
 
-	static request::ref
-	request( int method, const uri::ref &uri );
+	// Ends every stream. Browsers reconnect on their own unless the page
+	// closes its EventSource.
+
+	void
+	close();
+
+	inline std::size_t
+	subscribers() const
+	{
+		return m_subscribers.size();
+	}
+
+	// Events thrown away for being too far behind, over all subscribers.
+
+	inline std::uint64_t
+	dropped() const
+	{
+		return m_dropped;
+	}
+
+	inline std::size_t
+	max_queued() const
+	{
+		return m_max_queued;
+	}
+
+	inline void
+	set_max_queued( std::size_t val )
+	{
+		m_max_queued = val;
+	}
+
+	// Adds a subscriber whose stream is the body of response, and returns
+	// the producer for it.
+
+	message::producer_f
+	subscribe( response::ref response );
+
+private:
+
+	struct event
+	{
+		std::string	m_type;
+		std::string	m_wire;
+		bool		m_ping;
+	};
+
+	typedef std::shared_ptr< const event > event_ref;
+
+	struct subscriber
+	{
+		response::ref			m_response;
+		std::deque< event_ref >	m_queue;
+		std::size_t				m_front_pos;
+		std::size_t				m_queued;
+		bool					m_closed;
+		bool					m_failed;
+	};
+
+	typedef std::list< std::shared_ptr< subscriber > > list;
+
+	void
+	deliver( event_ref e );
+
+	void
+	trim( subscriber &s );
+
+	list			m_subscribers;
+	std::size_t		m_max_queued;
+	overflow		m_policy;
+	std::uint64_t	m_dropped;
+};
+
+
+// Parses a multipart/form-data body (RFC 7578) as it arrives. Each part's
+// headers are handed over once they're complete, and its content in the
+// chunks it came in, so a file part can go straight to disk without the
+// whole body ever being held in memory.
+
+class NETKIT_DLL multipart : public object
+{
+public:
+
+	typedef smart_ref< multipart > ref;
+
+	class part
+	{
+	public:
+
+		inline const http::header&
+		heeder() const
+		{
+			return m_header;
+		}
+
+		// The name and filename parameters of Content-Disposition.
+
+		inline const std::string&
+		name() const
+		{
+			return m_name;
+		}
+
+		inline const std::string&
+		filename() const
+		{
+			return m_filename;
+		}
+
+		// A part without a Content-Type of its own is text/plain.
+
+		std::string
+		content_type() const;
+
+		inline bool
+		is_file() const
+		{
+			return m_is_file;
+		}
+
+	private:
+
+		friend class multipart;
+
+		http::header	m_header;
+		std::string		m_name;
+		std::string		m_filename;
+		bool			m_is_file;
+	};
+
+	// A callback that returns anything other than 0 stops the parse.
+
+	typedef std::function< int ( const part &p ) >											part_will_begin_f;
+	typedef std::function< int ( const part &p, const std::uint8_t *buf, std::size_t len ) >	part_body_f;
+	typedef std::function< int ( const part &p ) >											part_did_end_f;
+
+	// The boundary parameter of a multipart Content-Type, or an empty
+	// string if there isn't a usable one.
+
+	static std::string
+	boundary( const std::string &content_type );
+
+	multipart( const std::string &boundary, part_will_begin_f wb, part_body_f body, part_did_end_f de );
+
+	~multipart();
+
+	// Returns false once the body turns out to be malformed or a callback
+	// has asked to stop. Nothing more is parsed after that.
+
+	bool
+	write( const std::uint8_t *buf, std::size_t len );
+
+	// True once the close delimiter has been seen. A body that ends
+	// before that was cut short.
+
+	inline bool
+	done() const
+	{
+		return ( m_state == state::done );
+	}
+
+	inline bool
+	failed() const
+	{
+		return m_failed;
+	}
+
+private:
+
+	enum class state
+	{
+		preamble,	// Before the first delimiter, thrown away
+		body,
+		delimiter,	// Just past a delimiter: either "--" or padding follows
+		close,
+		padding,
+		crlf,
+		headers,
+		done		// Past the close delimiter, the epilogue is thrown away
+	};
+
+	bool
+	scan( const std::uint8_t *&p, const std::uint8_t *end );
+
+	bool
+	emit( const std::uint8_t *buf, std::size_t len );
+
+	bool
+	parse_headers();
+
+	static const std::size_t	m_max_head;
+
+	std::string			m_delimiter;
+	std::string			m_carry;
+	std::string			m_head;
+	part				m_part;
+	part_will_begin_f	m_wb;
+	part_body_f			m_body;
+	part_did_end_f		m_de;
+	state				m_state;
+	bool				m_in_part;
+	bool				m_failed;
+};
+
+
+class NETKIT_DLL server
+{
+public:
+
+	typedef std::function< void ( http::response::ref response, bool close ) >													response_f;
+	typedef std::function< http::request::ref ( int method, std::uint16_t major, std::uint16_t minor, const uri::ref &uri ) >	request_will_begin_f;
+	typedef std::function< int ( http::request::ref request, const std::uint8_t *buf, size_t len, response_f response ) >		request_body_was_received_f;
+	typedef std::function< int ( http::request::ref request, response_f func ) >												request_f;
+
+	// What bind_upload() hands to its callback. Files are removed once the
+	// request goes away, so move any that should be kept.
+
+	struct upload
+	{
+		struct file
+		{
+			std::string		m_name;
+			std::string		m_filename;
+			std::string		m_content_type;
+			std::string		m_path;
+			std::uint64_t	m_size;
+		};
+
+		std::multimap< std::string, std::string >	m_fields;
+		std::vector< file >							m_files;
+	};
+
+	typedef std::function< int ( http::request::ref request, const upload &upload, response_f func ) > upload_f;
+
+	class binding : public netkit::object
+	{
+	public:
+
+		typedef smart_ref< binding > ref;
+		typedef std::list< ref > list;
+
+		binding( const std::string &path, const std::string &type, request_f r )
+		:
+			m_path( path ),
+			m_type( type ),
+			m_r( r ),
+			m_cache_ttl( 0 ),
+			m_cache_query( true )
+		{
+			m_rwb = [=]( int method, std::uint16_t major, std::uint16_t minor, const uri::ref &uri )
+			{
+				return new http::request( method, major, minor, uri );
+			};
+
+			m_rbwr = [=]( http::request::ref request, const std::uint8_t *buf, size_t len, response_f response )
+			{
+				request->write( buf, len );
+				return 0;
+			};
+		}
+	
+		binding( const std::string &path, const std::string &type, request_body_was_received_f rbwr, request_f r )
+		:
+			m_path( path ),
+			m_type( type ),
+			m_rbwr( rbwr ),
+			m_r( r ),
+			m_cache_ttl( 0 ),
+			m_cache_query( true )
+		{
+			m_rwb = [=]( int method, std::uint16_t major, std::uint16_t minor, const uri::ref &uri )
+			{
+				return new http::request( method, major, minor, uri );
+			};
+		}
+	
+		binding( const std::string &path, const std::string &type, request_will_begin_f rwb, request_body_was_received_f rbwr, request_f r )
+		:
+			m_path( path ),
+			m_type( type ),
+			m_rwb( rwb ),
+			m_rbwr( rbwr ),
+			m_r( r ),
+			m_cache_ttl( 0 ),
+			m_cache_query( true )
+		{
+		}
+
+		// Answers GETs from memory for ttl milliseconds once a response has
+		// been produced, without calling the binding. Entries are keyed by
+		// path, plus the query string and the values of the named request
+		// headers when asked for. Requests that miss while a response is
+		// being produced wait for it instead of calling the binding again.
+		// Only 200 responses with an in-memory body, no Set-Cookie and no
+		// no-store, no-cache or private directive are kept. The binding
+		// holds on to at most 1024 of them, dropping the least recently
+		// used first.
+
+		inline void
+		set_cache_policy( std::time_t ttl, bool query = true, const std::vector< std::string > &headers = std::vector< std::string >() )
+		{
+			std::lock_guard< std::mutex > guard( m_cache_mutex );
+
+			m_cache_ttl		= ttl;
+			m_cache_query	= query;
+			m_cache_headers	= headers;
+			m_cached.clear();
+			m_cache_lru.clear();
+		}
+
+		// Called with the cached status line and everything after the Date
+		// header, or with nulls if the response could not be cached. Only
+		// requests on the thread producing the response wait for it; other
+		// threads produce their own.
+
+		typedef std::function< void ( const std::string *status_line, const std::string *rest ) > cache_waiter_f;
+
+		std::string					m_path;
+		std::string					m_type;
+		request_will_begin_f		m_rwb;
+		request_body_was_received_f	m_rbwr;
+		request_f					m_r;
+
+	protected:
+
+		friend class server;
+
+		struct cached
+		{
+			std::string								m_status_line;
+			std::string								m_rest;
+			std::chrono::steady_clock::time_point	m_expires;
+			std::vector< cache_waiter_f >			m_waiters;
+			std::thread::id							m_fetcher;
+			std::list< std::string >::iterator		m_lru;
+			bool									m_fetching;
+		};
+
+		typedef std::unordered_map< std::string, cached > cache_map;
+
+		std::string
+		cache_key( request::ref request, std::uint8_t coding, string_view target ) const;
+
+		// Returns 1 on a hit, 0 when waiting on a fetch already under way
+		// and -1 when the caller should produce the response itself.
+
+		int
+		cache_lookup( const std::string &key, cache_waiter_f waiter, std::string &status_line, std::string &rest );
+
+		void
+		cache_store( const std::string &key, response::ref response );
+
+		std::time_t					m_cache_ttl;
+		bool						m_cache_query;
+		std::vector< std::string >	m_cache_headers;
+		cache_map					m_cached;
+		std::list< std::string >	m_cache_lru;
+		std::mutex					m_cache_mutex;
+	};
+
+	// Bindings are compiled into one radix tree per method. A path may
+	// contain '*' (any run of characters), '?' (any single character) and
+	// '{name}' (a path parameter running up to the next '/' or '?').
+	// Like the old regex search, a binding matches any request target that
+	// starts with its path, and the earliest registered binding wins.
+	// Literal routes are resolved in time proportional to the length of
+	// the request target, regardless of how many bindings there are.
+	//
+	// A router is never changed once published. Binding builds a new one
+	// with the extra route and swaps it in, so any number of threads can
+	// resolve against whichever table they picked up without locking.
+
+	class router
+	{
+	public:
+
+		typedef std::shared_ptr< const router > ref;
+
+		router();
+
+		~router();
+
+		// Only for a table nobody else can see yet.
+
+		void
+		add( std::uint8_t method, binding::ref binding );
+
+		// Returns a new table holding every route in this one, plus binding.
+
+		ref
+		with( std::uint8_t method, binding::ref binding ) const;
+
+		binding::ref
+		resolve( std::uint8_t method, string_view target, string_view content_type, request::params &params ) const;
+
+		static bool
+		type_matches( const std::string &pattern, string_view content_type );
+
+	private:
+
+		struct node;
+		struct match;
+
+		router( const router &that );	// Not implemented
+
+		router&
+		operator=( const router &that );	// Not implemented
+
+		static node*
+		insert_literal( node *parent, const std::string &literal );
+
+		static void
+		walk( const node *n, string_view target, std::size_t pos, string_view content_type, request::params &params, match &best );
+
+		typedef std::vector< std::pair< std::uint8_t, binding::ref > > added;
+
+		node			*m_roots[ 256 ];
+		std::uint64_t	m_count;
+		added			m_added;
+	};
+
+	static sink::ref
+	adopt( source::ref source );
+
+	// The binding is returned so it can be given a cache policy.
+
+	static binding::ref
+	bind( std::uint8_t method, const std::string &path, const std::string &type, request_f r );
+	
+	static binding::ref
+	bind( std::uint8_t method, const std::string &path, const std::string &type, request_body_was_received_f rbwr, request_f r );
+	
+	static binding::ref
+	bind( std::uint8_t method, const std::string &path, const std::string &type, request_will_begin_f rwb, request_body_was_received_f rbwr, request_f r );
+	
+	static void
+	bind( std::uint8_t method, const std::string &path, sink::ref sink );
+
+	// Serves GET and HEAD requests under prefix from the files in root,
+	// with conditional (ETag/Last-Modified) and Range support.
+
+	static void
+	bind_files( const std::string &prefix, const std::string &root );
+
+	// Serves GET requests for path as a text/event-stream fed by channel.
+
+	static binding::ref
+	bind_events( const std::string &path, event_channel::ref channel );
+
+	// Accepts multipart/form-data POSTs to path. File parts are streamed
+	// into folder as they arrive and the other parts are collected as
+	// fields, then f is called with both.
+
+	static binding::ref
+	bind_upload( const std::string &path, const std::string &folder, upload_f f );
+
+	static binding::ref
+	resolve( connection::ref conn, string_view target, string_view content_type );
+
+	// For connections that don't go through http_parser, like HTTP/2 ones.
+
+	static binding::ref
+	resolve( std::uint8_t method, string_view target, string_view content_type, request::params &params );
+
+	// The route table as of now. Later bindings go into a new table, so
+	// this one never changes underneath whoever holds on to it.
+
+	inline static router::ref
+	routes()
+	{
+		return std::atomic_load( &m_routes );
+	}
+
+	// Responses are compressed when the client accepts it, the body is in
+	// memory, at least compression_threshold() bytes long, and of a type
+	// added with add_compressible_type(). Types ending in '/' match any
+	// subtype. A threshold of zero turns compression off.
+
+	inline static std::size_t
+	compression_threshold()
+	{
+		return m_compression_threshold;
+	}
+
+	inline static void
+	set_compression_threshold( std::size_t val )
+	{
+		m_compression_threshold = val;
+	}
+
+	static void
+	add_compressible_type( const std::string &type );
+
+	static bool
+	is_compressible( const std::string &type );
+
+	// Limits that keep slow or greedy clients from tying up connections.
+	// A request head has to arrive within header_timeout() milliseconds of
+	// the server starting to wait for it, which includes the time an idle
+	// keep-alive connection sits there. After that the body has to average
+	// min_body_rate() bytes a second, ignoring time the binding has it
+	// paused. Late heads and slow bodies get a 408, heads over
+	// max_header_bytes() or with more than max_headers() fields a 431, and
+	// connections beyond max_connections() a 503. Zero turns a limit off.
+	// The timeout and the rate start out that way, since what's slow
+	// depends on who the clients are.
+
+	inline static std::time_t
+	header_timeout()
+	{
+		return m_header_timeout;
+	}
+
+	inline static void
+	set_header_timeout( std::time_t msec )
+	{
+		m_header_timeout = msec;
+	}
+
+	inline static std::size_t
+	min_body_rate()
+	{
+		return m_min_body_rate;
+	}
+
+	inline static void
+	set_min_body_rate( std::size_t bytes_per_sec )
+	{
+		m_min_body_rate = bytes_per_sec;
+	}
+
+	inline static std::size_t
+	max_header_bytes()
+	{
+		return m_max_header_bytes;
+	}
+
+	inline static void
+	set_max_header_bytes( std::size_t val )
+	{
+		m_max_header_bytes = val;
+	}
+
+	inline static std::size_t
+	max_headers()
+	{
+		return m_max_headers;
+	}
+
+	inline static void
+	set_max_headers( std::size_t val )
+	{
+		m_max_headers = val;
+	}
+
+	inline static std::size_t
+	max_connections()
+	{
+		return m_max_connections;
+	}
+
+	inline static void
+	set_max_connections( std::size_t val )
+	{
+		m_max_connections = val;
+	}
+
+	// Open connections across all threads, not counting ones turned away.
+
+	inline static std::size_t
+	connections()
+	{
+		return m_connection_count;
+	}
+
+	// Connections, and the one whose request is being handled, are kept
+	// per thread, so each runloop only ever sees its own.
+
+	inline static connection::ref
+	active_connection()
+	{
+		return local().m_active_connection;
+	}
+
+	inline static void
+	set_active_connection( connection *c )
+	{
+		local().m_active_connection = c;
+	}
+
+	inline static connection::list::iterator
+	begin_connections()
+	{
+		return local().m_connections.begin();
+	}
+	
+	inline static connection::list::iterator
+	end_connections()
+	{
+		return local().m_connections.end();
+	}
+
+protected:
+
+	class handler : public connection::handler
+	{
+	public:
+
+		typedef smart_ref< handler > ref;
+
+		handler();
+
+		virtual ~handler();
+	
+		virtual void
+		process_will_begin( connection::ref connection );
+
+		virtual void
+		message_will_begin( connection::ref connection );
+
+		virtual int
+		uri_was_received( connection::ref connection, const char *buf, size_t len );
+
+		virtual int
+		headers_were_received( connection::ref connection, message::header &header );
+
+		virtual int
+		raw_headers_were_received( connection::ref connection, const connection::raw_headers &headers );
+
+		virtual int
+		body_was_received( connection::ref connection, const char *buf, size_t len );
+
+		virtual int
+		message_was_received( connection::ref connection );
+
+		virtual void
+		process_did_end( connection::ref connection );
+
+		virtual void
+		will_close( connection::ref connection );
+
+		virtual void
+		limit_was_exceeded( connection::ref connection, std::uint16_t status );
+
+		// Called about once a second to hold the client to the header
+		// timeout and minimum body rate.
+
+		void
+		check_limits( connection::ref connection, std::chrono::steady_clock::time_point now );
+
+		// One slot per request read off the connection. Pipelined requests
+		// may be answered in any order, but responses are written strictly
+		// in the order their requests arrived. Slots never leave the
+		// connection's thread, so their count needn't be atomic.
+
+		struct pending : public counted< pending, thread_confined >
+		{
+			typedef smart_ref< pending > ref;
+
+			pending()
+			:
+				m_coding( coding::identity ),
+				m_head( false ),
+				m_close( false ),
+				m_ready( false )
+			{
+			}
+
+			~pending();
+
+			response::ref	m_response;
+			std::string		m_raw;
+			binding::ref	m_cache_binding;
+			std::string		m_cache_key;
+			std::uint8_t	m_coding;
+			bool			m_head;
+			bool			m_close;
+			bool			m_ready;
+		};
+
+		typedef std::deque< pending::ref > pending_queue;
+
+		void
+		reply( connection::ref connection, pending::ref slot, response::ref response, bool close );
+
+		void
+		flush( connection::ref connection );
+
+		void
+		compress( std::uint8_t c, response::ref response );
+
+		void
+		reply_cached( connection::ref connection, pending::ref slot, const std::string &status_line, const std::string &rest );
+
+		request::params							m_params;
+		binding::ref							m_binding;
+		request::ref							m_request;
+		pending::ref							m_slot;
+		pending_queue							m_pending;
+		bool									m_closing;
+		bool									m_writing;
+		bool									m_flushing;
+
+		// m_waiting_since is when we started waiting on the client for the
+		// head being read.
+
+		std::chrono::steady_clock::time_point	m_waiting_since;
+		std::chrono::steady_clock::time_point	m_body_since;
+		std::uint64_t							m_body_bytes;
+		bool									m_in_body;
+	};
+
+	struct registry
+	{
+		registry()
+		:
+			m_sweeping( false )
+		{
+		}
+
+		connection::list	m_connections;
+		connection::ref		m_active_connection;
+		runloop::ref		m_runloop;
+		bool				m_sweeping;
+	};
+
+	static void
+	bind( std::uint8_t method, binding::ref binding );
+
+	static registry&
+	local();
+
+	static void
+	sweep( registry *r );
+
+	static router::ref			m_routes;
+	static std::mutex			m_routes_mutex;
+	static std::size_t			m_compression_threshold;
+	static std::time_t			m_header_timeout;
+	static std::size_t			m_min_body_rate;
+	static std::size_t			m_max_header_bytes;
+	static std::size_t			m_max_headers;
+	static std::size_t			m_max_connections;
+	static std::atomic< std::size_t >	m_connection_count;
+	static std::vector< std::string >	m_compressible_types;
+};
+
+
+class NETKIT_DLL client : public connection::handler
+{
+public:
+
+	typedef smart_ref< client > ref;
+
+	// Idle keep-alive connections, keyed by scheme, host, port and proxy.
+	// client::send() checks a connection out of here before dialing, and
+	// hands it back once a response completes and both sides agreed to
+	// keep it open.
+
+	class NETKIT_DLL pool
+	{
+	public:
+
+		static pool&
+		instance();
+
+		inline std::size_t
+		max_idle() const
+		{
+			return m_max_idle;
+		}
+
+		inline void
+		set_max_idle( std::size_t val )
+		{
+			m_max_idle = val;
+		}
+
+		inline std::size_t
+		max_per_host() const
+		{
+			return m_max_per_host;
+		}
+
+		inline void
+		set_max_per_host( std::size_t val )
+		{
+			m_max_per_host = val;
+		}
+
+		inline std::time_t
+		idle_timeout() const
+		{
+			return m_idle_timeout;
+		}
+
+		inline void
+		set_idle_timeout( std::time_t msec )
+		{
+			m_idle_timeout = msec;
+		}
+
+		inline std::size_t
+		idle() const
+		{
+			return m_count;
+		}
+
+		// No more than this many requests to one host are in flight at
+		// once. The rest wait their turn in the order they were sent. 0
+		// lifts the limit.
+
+		inline std::size_t
+		max_active_per_host() const
+		{
+			return m_max_active_per_host;
+		}
+
+		inline void
+		set_max_active_per_host( std::size_t val )
+		{
+			m_max_active_per_host = val;
+		}
+
+		// A request that has waited this long for its turn fails. 0 waits
+		// for as long as it takes.
+
+		inline std::time_t
+		queue_timeout() const
+		{
+			return m_queue_timeout;
+		}
+
+		inline void
+		set_queue_timeout( std::time_t msec )
+		{
+			m_queue_timeout = msec;
+		}
+
+		inline std::size_t
+		queued() const
+		{
+			return m_queued;
+		}
+
+		std::size_t
+		active( const std::string &key ) const;
+
+		static std::string
+		key_for( const uri::ref &uri );
+
+		connection::ref
+		checkout( const std::string &key );
+
+		void
+		checkin( const std::string &key, connection::ref conn );
+
+		void
+		clear();
+
+	private:
+
+		friend class client;
+
+		struct entry
+		{
+			connection::ref							m_connection;
+			std::chrono::steady_clock::time_point	m_since;
+			netkit::cookie::ref						m_on_close;
+		};
+
+		struct waiter
+		{
+			client::ref								m_client;
+			std::chrono::steady_clock::time_point	m_since;
+		};
+
+		struct host_limit
+		{
+			host_limit()
+			:
+				m_active( 0 )
+			{
+			}
+
+			std::size_t								m_active;
+			std::deque< waiter >					m_waiting;
+		};
+
+		typedef std::list< entry >						entries;
+		typedef std::map< std::string, entries >		hosts;
+		typedef std::map< std::string, host_limit >		limits;
+
+		pool();
+
+		void
+		acquire( const std::string &key, client::ref c );
+
+		void
+		release( const std::string &key );
+
+		void
+		schedule_expire( std::time_t msec );
+
+		void
+		expire();
+
+		void
+		remove( const std::string &key, connection *conn );
+
+		void
+		evict_oldest();
+
+		void
+		schedule_prune();
+
+		void
+		prune();
+
+		hosts			m_hosts;
+		limits			m_limits;
+		std::size_t		m_count;
+		std::size_t		m_queued;
+		std::size_t		m_max_idle;
+		std::size_t		m_max_per_host;
+		std::size_t		m_max_active_per_host;
+		std::time_t		m_idle_timeout;
+		std::time_t		m_queue_timeout;
+		bool			m_prune_scheduled;
+		bool			m_expire_scheduled;
+		std::uint64_t	m_expire_timer;
+
+		std::chrono::steady_clock::time_point	m_expire_at;
+	};
+
+	// An opt-in private response cache (RFC 7234) in front of send(). Fresh
+	// responses to GET are answered from memory, or from a folder of mapped
+	// files when one is set. Stale ones are revalidated with a conditional
+	// request, and concurrent requests for a URL share a single fetch.
+	// Requests with a body_reply handler always go to the network.
+	//
+	// The cache is shared by everyone in the process, so requests that
+	// carry Authorization or a Cookie are never answered from it and don't
+	// share fetches. What they get back is only kept when the response says
+	// it may be shared (public or s-maxage).
+
+	class NETKIT_DLL cache
+	{
+	public:
+
+		static cache&
+		instance();
+
+		inline bool
+		enabled() const
+		{
+			return m_enabled;
+		}
+
+		inline void
+		set_enabled( bool val )
+		{
+			m_enabled = val;
+		}
+
+		inline std::size_t
+		max_bytes() const
+		{
+			return m_max_bytes;
+		}
+
+		inline void
+		set_max_bytes( std::size_t val )
+		{
+			m_max_bytes = val;
+			evict();
+		}
+
+		inline std::size_t
+		bytes() const
+		{
+			return m_bytes;
+		}
+
+		inline std::size_t
+		size() const
+		{
+			return m_lru.size();
+		}
+
+		// Where the disk tier keeps its files. Empty, the default, keeps
+		// everything in memory.
+
+		inline const std::string&
+		folder() const
+		{
+			return m_folder;
+		}
+
+		inline void
+		set_folder( const std::string &val )
+		{
+			m_folder = val;
+		}
+
+		// Drops everything, including what is on disk.
+
+		void
+		clear();
+
+	private:
+
+		friend class client;
+
+		struct entry : public counted< entry >
+		{
+			typedef smart_ref< entry > ref;
+
+			std::string		m_key;
+			std::uint16_t	m_status;
+			http::header	m_header;
+			std::string		m_body;
+			std::time_t		m_response_time;
+			std::time_t		m_corrected_age;
+			std::time_t		m_lifetime;
+			bool			m_no_cache;
+		};
+
+		struct fetch
+		{
+			std::vector< request::ref >	m_waiters;
+			entry::ref					m_stale;
+		};
+
+		typedef std::list< entry::ref >								lru;
+		typedef std::unordered_map< std::string, lru::iterator >	index;
+		typedef std::unordered_map< std::string, fetch >			fetches;
+
+		cache();
+
+		cache( const cache &that );	// Not implemented
+
+		bool
+		send( request::ref request );
+
+		void
+		complete( const std::string &key, request::ref request, response::ref response );
+
+		entry::ref
+		lookup( const std::string &key );
+
+		void
+		store( const entry::ref &e );
+
+		void
+		erase( const std::string &key );
+
+		void
+		evict();
+
+		std::string
+		path_for( const std::string &key ) const;
+
+		entry::ref
+		load( const std::string &key );
+
+		void
+		save( const entry::ref &e );
+
+		lru				m_lru;
+		index			m_index;
+		fetches			m_fetches;
+		std::string		m_folder;
+		std::size_t		m_bytes;
+		std::size_t		m_max_bytes;
+		bool			m_enabled;
+	};
+
+	static request::ref
+	request( int method, const uri::ref &uri );
 
 	static void
 	send( const request::ref &request );
 
+	// When on, requests without an Accept-Encoding ask for gzip or deflate
+	// and the response body is decoded before it is handed back.
+
+	inline static bool
+	decompress()
+	{
+		return m_decompress;
+	}
+
+	inline static void
+	set_decompress( bool val )
+	{
+		m_decompress = val;
+	}
+
+	// The most a decoded body may grow to. A small gzip body can inflate
+	// to gigabytes, so a response that decodes to more than this fails.
+	// 0 means no limit.
+
+	inline static std::size_t
+	max_decoded_size()
+	{
+		return m_max_decoded_size;
+	}
+
+	inline static void
+	set_max_decoded_size( std::size_t val )
+	{
+		m_max_decoded_size = val;
+	}
+
+	// Bodies of at least this many bytes are sent with Expect:
+	// 100-continue and held back until the server asks for them, so one
+	// that is going to be turned away isn't uploaded for nothing. Requests
+	// that ask for it themselves get it whatever their size. 0 turns it
+	// off for everyone else. If a server answers an Expect we added with
+	// 417, the request is sent again without it.
+
+	inline static std::size_t
+	expect_threshold()
+	{
+		return m_expect_threshold;
+	}
+
+	inline static void
+	set_expect_threshold( std::size_t val )
+	{
+		m_expect_threshold = val;
+	}
+
+	// How long to wait for 100 Continue before sending the body anyway.
+	// Not every server answers it.
+
+	inline static std::time_t
+	continue_timeout()
+	{
+		return m_continue_timeout;
+	}
+
+	inline static void
+	set_continue_timeout( std::time_t msec )
+	{
+		m_continue_timeout = msec;
+	}
+
 protected:
 
+	// Where a body held back for 100 Continue is at.
+
+	enum class hold
+	{
+		none,
+		waiting,
+		released,
+		withheld	// Answered before it went out, so it never will
+	};
+
 	client( const request::ref &request );
 
+	// Straight to the network. Redirects and retries come through here so
+	// they don't go back through the cache. When expect is false the body
+	// goes out without an Expect: 100-continue of our own, as it must after
+	// a server answered one with 417.
+
+	static void
+	start( const request::ref &request, bool expect = true );
+
 	void
 	really_send();
 
+	void
+	put_request();
+
+	// Sends the head with Expect: 100-continue and holds the body back
+	// until the server says go, or continue_timeout() passes.
+
+	void
+	put_expecting();
+
+	// Gives this request's turn at its host to whoever is next in line.
+
+	void
+	release_slot();
+
 	virtual ~client();
 
 	virtual void
@@ -891,28 +2895,29 @@ protected:
 	virtual void
 	will_close( connection::ref connection );
 
-	connection::ref	m_connection;
-	request::ref	m_request;
-	response::ref	m_response;
-	std::string		m_redirect;
-	bool			m_done;
+	connection::ref			m_connection;
+	request::ref			m_request;
+	response::ref			m_response;
+	coding::decoder::ref	m_decoder;
+	std::string				m_redirect;
+	std::string				m_pool_key;
+	bool					m_accept_added;
+	bool					m_expect;
+	bool					m_expect_added;
+	bool					m_expect_failed;
+	bool					m_reused;
+	bool					m_done;
+	bool					m_has_slot;
+	bool					m_interim;
+	std::shared_ptr< hold >	m_hold;
+
+	static bool				m_decompress;
+	static std::size_t		m_max_decoded_size;
+	static std::size_t		m_expect_threshold;
+	static std::time_t		m_continue_timeout;
 };
 
 
-inline connection&
-endl( connection &conn )
-{
-	conn << "\r\n";
-	return conn;
-}
-
-inline connection&
-flush( connection &conn )
-{
-	conn.flush();
-	return conn;
-}
-
 }
 
 
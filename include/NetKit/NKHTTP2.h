@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2013, Porchdog Software Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are those
+ * of the authors and should not be interpreted as representing official policies,
+ * either expressed or implied, of the FreeBSD Project.
+ *
+ */
+ 
+#ifndef _netkit_http2_h
+#define _netkit_http2_h
+
+#include <NetKit/NKHTTP.h>
+#include <NetKit/NKSink.h>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <ctime>
+
+namespace netkit {
+
+namespace http2 {
+
+// The first thing a client sends. A server connection that starts with
+// this instead of a request line is switched over to HTTP/2.
+
+extern const char *preface;
+extern const std::size_t preface_len;
+
+struct frame
+{
+	static const std::uint8_t data;
+	static const std::uint8_t headers;
+	static const std::uint8_t priority;
+	static const std::uint8_t rst_stream;
+	static const std::uint8_t settings;
+	static const std::uint8_t push_promise;
+	static const std::uint8_t ping;
+	static const std::uint8_t goaway;
+	static const std::uint8_t window_update;
+	static const std::uint8_t continuation;
+
+	// Flags. ack and end_stream share a bit; which one it is depends on
+	// the frame type.
+
+	static const std::uint8_t end_stream;
+	static const std::uint8_t ack;
+	static const std::uint8_t end_headers;
+	static const std::uint8_t padded;
+	static const std::uint8_t prioritized;
+
+	static const std::size_t header_size;
+
+	static void
+	write_header( std::string &out, std::size_t len, std::uint8_t type, std::uint8_t flags, std::uint32_t stream );
+};
+
+struct error
+{
+	static const std::uint32_t no_error;
+	static const std::uint32_t protocol_error;
+	static const std::uint32_t internal_error;
+	static const std::uint32_t flow_control_error;
+	static const std::uint32_t settings_timeout;
+	static const std::uint32_t stream_closed;
+	static const std::uint32_t frame_size_error;
+	static const std::uint32_t refused_stream;
+	static const std::uint32_t cancel;
+	static const std::uint32_t compression_error;
+	static const std::uint32_t connect_error;
+	static const std::uint32_t enhance_your_calm;
+	static const std::uint32_t inadequate_security;
+	static const std::uint32_t http_1_1_required;
+};
+
+struct setting
+{
+	static const std::uint16_t header_table_size;
+	static const std::uint16_t enable_push;
+	static const std::uint16_t max_concurrent_streams;
+	static const std::uint16_t initial_window_size;
+	static const std::uint16_t max_frame_size;
+	static const std::uint16_t max_header_list_size;
+};
+
+// Header compression (RFC 7541). Names are always lower case.
+
+namespace hpack {
+
+typedef std::pair< std::string, std::string >	field;
+typedef std::vector< field >					fields;
+
+// The static table followed by a dynamic table. Indexes start at 1, and
+// the most recently added dynamic entry comes right after the static ones.
+
+class NETKIT_DLL table
+{
+public:
+
+	table();
+
+	const field*
+	get( std::size_t index ) const;
+
+	// Returns the index of an entry matching both name and value, or 0. If
+	// there's no such entry, name_index is set to the first entry with the
+	// same name, or 0.
+
+	std::size_t
+	find( const std::string &name, const std::string &value, std::size_t &name_index ) const;
+
+	void
+	add( const std::string &name, const std::string &value );
+
+	void
+	set_max_size( std::size_t val );
+
+	inline std::size_t
+	size() const
+	{
+		return m_size;
+	}
+
+	inline std::size_t
+	max_size() const
+	{
+		return m_max_size;
+	}
+
+	inline std::size_t
+	count() const
+	{
+		return m_entries.size();
+	}
+
+private:
+
+	void
+	evict( std::size_t room );
+
+	std::deque< field >	m_entries;
+	std::size_t			m_size;
+	std::size_t			m_max_size;
+};
+
+
+class NETKIT_DLL encoder
+{
+public:
+
+	encoder();
+
+	void
+	encode( const fields &in, std::string &out );
+
+	// The peer's SETTINGS_HEADER_TABLE_SIZE. A smaller table is announced
+	// at the start of the next header block.
+
+	void
+	set_max_table_size( std::size_t val );
+
+private:
+
+	table		m_table;
+	std::size_t	m_pending_size;
+	std::size_t	m_smallest_size;
+	bool		m_size_changed;
+};
+
+
+class NETKIT_DLL decoder
+{
+public:
+
+	decoder();
+
+	// Returns false on a malformed block, which is fatal to the connection
+	// since the dynamic table can no longer be trusted.
+
+	bool
+	decode( const std::uint8_t *buf, std::size_t len, fields &out );
+
+	inline std::size_t
+	table_size() const
+	{
+		return m_table.size();
+	}
+
+	// The most a block may decode to, counted the way
+	// SETTINGS_MAX_HEADER_LIST_SIZE counts it. Zero means no limit.
+
+	inline std::size_t
+	max_list_size() const
+	{
+		return m_max_list_size;
+	}
+
+	inline void
+	set_max_list_size( std::size_t val )
+	{
+		m_max_list_size = val;
+	}
+
+	// Whether the last block went over. It is still decoded to the end so
+	// the table stays in step with the peer's, but no fields come back.
+
+	inline bool
+	too_large() const
+	{
+		return m_too_large;
+	}
+
+private:
+
+	table		m_table;
+	std::size_t	m_max_table_size;
+	std::size_t	m_max_list_size;
+	bool		m_too_large;
+};
+
+}
+
+// One HTTP/2 connection, either side. A server connection dispatches each
+// stream through server::resolve() to the same bindings HTTP/1 requests
+// go to. A client connection carries any number of requests at once, each
+// on its own stream, calling back through the request's reply handlers.
+
+class NETKIT_DLL connection : public sink
+{
+public:
+
+	typedef smart_ref< connection > ref;
+
+	connection( bool is_server );
+
+	virtual ~connection();
+
+	inline bool
+	is_server() const
+	{
+		return m_is_server;
+	}
+
+	// Server side. Hands over what has already been read off the source,
+	// starting with the preface.
+
+	bool
+	accept( const std::uint8_t *buf, std::size_t len );
+
+	// Client side. Frames are queued until the connection is bound.
+
+	bool
+	send( http::request::ref request );
+
+	// Sends out whatever has been queued.
+
+	void
+	flush();
+
+	// True if another request can be started without waiting.
+
+	bool
+	can_send() const;
+
+	inline std::size_t
+	streams() const
+	{
+		return m_streams.size();
+	}
+
+	// Client side, over TLS. When the peer first says something, checks
+	// that ALPN settled on h2. If it didn't, the requests go out again over
+	// HTTP/1.1, apart from ones whose body was streamed, which fail.
+
+	inline void
+	set_require_h2( bool val )
+	{
+		m_require_h2 = val;
+	}
+
+	inline bool
+	fell_back() const
+	{
+		return m_fell_back;
+	}
+
+	// Also fails any requests still waiting on a connection that never
+	// got bound.
+
+	virtual void
+	close();
+
+protected:
+
+	// Streams live and die on the connection's thread, so a plain counter
+	// will do.
+
+	struct stream : public counted< stream, thread_confined >
+	{
+		typedef smart_ref< stream > ref;
+
+		stream( std::uint32_t id, std::int64_t send_window, std::int64_t recv_window );
+
+		std::uint32_t					m_id;
+		std::int64_t					m_send_window;
+		std::int64_t					m_recv_window;
+		std::int64_t					m_recv_unacked;
+		http::request::ref				m_request;
+		http::response::ref				m_response;
+		http::server::binding::ref		m_binding;
+		http::message::producer_f		m_producer;
+		std::string						m_body;
+		std::size_t						m_body_pos;
+		bool							m_head;
+		bool							m_sending;
+		bool							m_blocked;
+		bool							m_local_closed;
+		bool							m_remote_closed;
+	};
+
+	typedef std::map< std::uint32_t, stream::ref > stream_map;
+
+	virtual bool
+	process( const std::uint8_t *buf, std::size_t len );
+
+	bool
+	frame_was_received( std::uint8_t type, std::uint8_t flags, std::uint32_t id, const std::uint8_t *buf, std::size_t len );
+
+	bool
+	data_was_received( std::uint8_t flags, std::uint32_t id, const std::uint8_t *buf, std::size_t len );
+
+	bool
+	settings_were_received( std::uint8_t flags, const std::uint8_t *buf, std::size_t len );
+
+	bool
+	header_block_was_received( std::uint32_t id, bool end_stream );
+
+	void
+	request_was_received( stream::ref s, hpack::fields &fields, bool end_stream );
+
+	void
+	response_was_received( stream::ref s, hpack::fields &fields, bool end_stream );
+
+	void
+	stream_did_end( stream::ref s );
+
+	http::server::response_f
+	reply_to( stream::ref s );
+
+	void
+	respond( stream::ref s, http::response::ref response );
+
+	void
+	write_headers( std::uint32_t id, const hpack::fields &fields, bool end_stream );
+
+	void
+	write_window_update( std::uint32_t id, std::uint32_t increment );
+
+	void
+	reset( stream::ref s, std::uint32_t code );
+
+	void
+	go_away( std::uint32_t code );
+
+	void
+	pump();
+
+	void
+	finish( stream::ref s );
+
+	void
+	fail_streams();
+
+	void
+	fall_back();
+
+	static void
+	add_fields( const http::message &message, hpack::fields &fields );
+
+	bool			m_is_server;
+	std::size_t		m_preface_left;
+	std::string		m_in;
+	std::string		m_out;
+	hpack::encoder	m_encoder;
+	hpack::decoder	m_decoder;
+	stream_map		m_streams;
+	std::string		m_header_block;
+	std::uint32_t	m_header_stream;
+	bool			m_header_end_stream;
+	std::uint32_t	m_next_stream;
+	std::uint32_t	m_last_stream;
+	std::int64_t	m_send_window;
+	std::int64_t	m_recv_window;
+	std::int64_t	m_recv_unacked;
+	std::int64_t	m_initial_window;
+	std::size_t		m_max_frame_size;
+	std::size_t		m_max_streams;
+	std::size_t		m_queued_acks;
+	std::size_t		m_pending_acks;
+	std::size_t		m_resets;
+	std::time_t		m_reset_second;
+	bool			m_going_away;
+	bool			m_pumping;
+	bool			m_require_h2;
+	bool			m_fell_back;
+};
+
+// Requests sent through here share one connection per host. Plain http
+// URIs are spoken to with prior knowledge; https ones offer h2 via ALPN.
+// A host that turns h2 down is sent this and later requests with
+// http::client instead.
+
+class NETKIT_DLL client
+{
+public:
+
+	static void
+	send( http::request::ref request );
+
+	static std::size_t
+	connections();
+
+	static void
+	clear();
+
+private:
+
+	typedef std::map< std::string, connection::ref > connection_map;
+
+	static connection_map&
+	shared();
+
+	static std::set< std::string >&
+	http1_hosts();
+};
+
+}
+
+}
+
+#endif
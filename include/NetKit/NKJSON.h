@@ -65,6 +65,8 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
 
 class array_map;
 class object_map;
@@ -73,7 +75,7 @@ namespace netkit {
 
 namespace json {
 
-class NETKIT_DLL value : public netkit::object
+class NETKIT_DLL value : public netkit::counted< value >
 {
 public:
 
@@ -427,9 +429,13 @@ protected:
 	
 	void
 	shutdown();
+
+	friend class server;
 	
 	reply_handlers						m_reply_handlers;
 	netkit::cookie::ref					m_cookie;
+	list								*m_registry;
+	list::iterator						m_registered;
 	static std::atomic< std::int32_t >	m_id;
 };
 
@@ -464,28 +470,32 @@ public:
 	static void
 	reply_with_error( reply_f reply, netkit::status status, bool close );
 	
+	// Like http::server, connections are kept per thread and the handler
+	// table is swapped whole when it changes, so the server can run on
+	// several loops at once.
+
 	inline static connection::ref
 	active_connection()
 	{
-		return m_active_connection;
+		return local().m_active_connection;
 	}
 
 	inline static void
 	set_active_connection( connection *c )
 	{
-		m_active_connection = c;
+		local().m_active_connection = c;
 	}
 	
 	inline static connection::list::iterator
 	begin_connections()
 	{
-		return m_connections->begin();
+		return local().m_connections.begin();
 	}
 	
 	inline static connection::list::iterator
 	end_connections()
 	{
-		return m_connections->end();
+		return local().m_connections.end();
 	}
 
 	static void
@@ -493,19 +503,40 @@ public:
 	
 private:
 
-	friend void												netkit::initialize();
-	
 	typedef std::pair< std::size_t, notification_f >		notification_target;
 	typedef std::map< std::string, notification_target >	notification_handlers;
 	typedef std::pair< std::size_t, request_f >				request_target;
 	typedef std::map< std::string, request_target >			request_handlers;
-	
-	static connection::list									*m_connections;
-	static connection::ref									m_active_connection;
 
-	static preflight_f										m_preflight_handler;
-	static notification_handlers							*m_notification_handlers;
-	static request_handlers									*m_request_handlers;
+	struct handlers
+	{
+		handlers();
+
+		preflight_f				m_preflight_handler;
+		notification_handlers	m_notification_handlers;
+		request_handlers		m_request_handlers;
+	};
+
+	typedef std::shared_ptr< const handlers >				handlers_ref;
+	typedef std::function< void ( handlers &next ) >		update_f;
+
+	struct registry
+	{
+		connection::list	m_connections;
+		connection::ref		m_active_connection;
+	};
+
+	static registry&
+	local();
+
+	static handlers_ref
+	current();
+
+	static void
+	update( update_f func );
+	
+	static handlers_ref										m_handlers;
+	static std::mutex										m_handlers_mutex;
 };
 
 
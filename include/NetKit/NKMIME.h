@@ -39,6 +39,12 @@ namespace mime {
 
 extern const std::string null;
 
+// Best guess at a content type from a file extension (without the dot).
+// Unknown extensions map to application/octet-stream.
+
+const std::string&
+from_extension( const std::string &ext );
+
 namespace text {
 
 extern const std::string plain;
@@ -35,6 +35,16 @@
 
 #define netkit_translate_errno( TEST, ERRNO, ALTERNATE_ERROR )		( ( TEST ) ? 0 : ( ERRNO ) ? ( ERRNO ) : ( ALTERNATE_ERROR ) )
 
+// Visual Studio didn't get thread_local until 2015. Its older keyword only
+// takes plain data, so keep anything declared with this to pointers and
+// scalars.
+
+#if defined( _MSC_VER ) && ( _MSC_VER < 1900 )
+#	define NETKIT_THREAD_LOCAL __declspec( thread )
+#else
+#	define NETKIT_THREAD_LOCAL thread_local
+#endif
+
 #if defined( DEBUG )
 #	define	netkit_check( X )							\
 	do 													\
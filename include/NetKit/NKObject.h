@@ -67,7 +67,93 @@ typedef smart_ref< value > value_ref;
 
 }
 
-class object
+// Reference count policies for counted<>. Objects that never leave the
+// runloop thread that created them can use thread_confined and skip the
+// atomic read-modify-write on every retain() and release(). Defining
+// NETKIT_THREAD_CONFINED_REFS makes that the default for everything.
+
+struct thread_safe
+{
+	typedef std::atomic< int > count_t;
+};
+
+struct thread_confined
+{
+	typedef int count_t;
+};
+
+#if defined( NETKIT_THREAD_CONFINED_REFS )
+typedef thread_confined default_ref_policy;
+#else
+typedef thread_safe default_ref_policy;
+#endif
+
+template < class T, class Policy = default_ref_policy >
+class counted
+{
+public:
+
+	inline void
+	retain()
+	{
+		m_refs++;
+	}
+	
+	inline int
+	release()
+	{
+		int refs = --m_refs;
+	
+		if ( refs == 0 )
+		{
+			delete static_cast< T* >( this );
+		}
+		
+		return refs;
+	}
+
+	inline int
+	refs() const
+	{
+		return m_refs;
+	}
+
+#if defined( NETKIT_REF_COUNT_DEBUG )
+
+	inline bool
+	ref_count_debug()
+	{
+		return false;
+	}
+
+#endif
+
+protected:
+
+	inline counted()
+	:
+		m_refs( 0 )
+	{
+	}
+
+	inline counted( const counted &that )
+	:
+		m_refs( 0 )
+	{
+	}
+
+	inline counted&
+	operator=( const counted &that )
+	{
+		return *this;
+	}
+
+	typedef typename Policy::count_t	count_t;
+	mutable count_t						m_refs;
+};
+
+
+class object : public counted< object >
 {
 public:
 
@@ -83,6 +169,9 @@ public:
 
 	virtual ~object() = 0;
 
+	object&
+	operator=( const object &that );
+
 	virtual void
 	flatten( json::value_ref &root ) const;
 
@@ -151,53 +240,34 @@ public:
 	void
 	remove_value_for_key( const std::string &key );
 
+	inline bool
+	has_attrs() const
+	{
+		return ( m_attrs && !m_attrs->empty() );
+	}
+
 	inline attrs::iterator
 	attrs_begin()
 	{
-		return m_attrs.begin();
+		return m_attrs ? m_attrs->begin() : empty_attrs().begin();
 	}
 	
 	inline attrs::iterator
 	attrs_end()
 	{
-		return m_attrs.end();
+		return m_attrs ? m_attrs->end() : empty_attrs().end();
 	}
 	
 	inline attrs::const_iterator
 	attrs_begin() const
 	{
-		return m_attrs.begin();
+		return m_attrs ? m_attrs->begin() : empty_attrs().begin();
 	}
 	
 	inline attrs::const_iterator
 	attrs_end() const
 	{
-		return m_attrs.end();
-	}
-	
-	inline void
-	retain()
-	{
-		m_refs++;
-	}
-	
-	inline int
-	release()
-	{
-		int refs = --m_refs;
-	
-		if ( refs == 0 )
-		{
-			delete this;
-		}
-		
-		return refs;
-	}
-
-	inline int
-	refs() const
-	{
-		return m_refs.fetch_add( 0 );
+		return m_attrs ? m_attrs->end() : empty_attrs().end();
 	}
 	
 #if defined( NETKIT_REF_COUNT_DEBUG )
@@ -218,9 +288,22 @@ protected:
 	void
 	inflate( const json::value_ref &root );
 
-	typedef std::atomic< int >	atomic_int_t;
-	attrs						m_attrs;
-	mutable atomic_int_t		m_refs;
+	void
+	transfer_attrs( object &to );
+
+	const std::string*
+	find_attr( const std::string &key ) const;
+
+	attrs&
+	writable_attrs();
+
+	static attrs&
+	empty_attrs();
+
+	// Almost no objects carry attrs, so the map is only allocated
+	// the first time somebody stores a value.
+
+	attrs						*m_attrs;
 };
 
 extern void initialize();
@@ -88,6 +88,9 @@ file_exists( const std::string &name );
 bool NETKIT_DLL
 directory_exists( const std::string &name );
 
+std::string NETKIT_DLL
+temp_folder();
+
 inline int
 catnap( int msec )
 {
@@ -77,6 +77,16 @@ public:
 		virtual void
 		recvfrom( recvfrom_reply_f reply ) = 0;
 
+		// Sends len bytes of an open file starting at offset without copying
+		// them through user space. Returns false, without calling reply, if
+		// this platform can't.
+
+		virtual bool
+		sendfile( int file, std::uint64_t offset, std::size_t len, send_reply_f reply )
+		{
+			return false;
+		}
+
 		virtual void
 		close() = 0;
 	};
@@ -104,6 +114,11 @@ public:
 	static runloop::ref
 	main();
 
+	// The runloop running on the calling thread, or main() if none is.
+
+	static runloop::ref
+	current();
+
 	virtual fd::ref
 	create( std::int32_t domain, std::int32_t type, std::int32_t protocol ) = 0;
 
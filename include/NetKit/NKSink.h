@@ -69,6 +69,22 @@ public:
 
 	bool
 	is_open() const;
+
+	// Stop reading from the source until resume() is called. Whatever is
+	// already in flight is still delivered to process(); after that the
+	// source is left alone and the peer is held back by flow control.
+
+	void
+	pause();
+
+	virtual void
+	resume();
+
+	inline bool
+	paused() const
+	{
+		return m_paused;
+	}
 	
 	virtual void
 	close();
@@ -95,6 +111,8 @@ protected:
 	close_handlers		m_close_handlers;
 	netkit::cookie::ref	m_on_close;
 	source::ref			m_source;
+	bool				m_paused;
+	bool				m_parked;
 	std::uint8_t		m_buf[ 4192 ];
 };
 
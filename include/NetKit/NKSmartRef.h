@@ -33,6 +33,7 @@
 
 #include <unordered_map>
 #include <functional>
+#include <utility>
 #include <assert.h>
 #include <stdio.h>
 #include <typeinfo>
@@ -94,6 +95,36 @@ public:
 		}
 	}
 
+	inline smart_ref( smart_ref<T> &&that )
+	:
+		m_ref( that.m_ref )
+	{
+		that.m_ref = NULL;
+
+#if defined( NETKIT_REF_COUNT_DEBUG )
+		if ( m_ref && m_ref->ref_count_debug() )
+		{
+			auto it = ref_count_map.find( &that );
+
+			if ( it != ref_count_map.end() )
+			{
+				ref_count_map[ this ] = it->second;
+				ref_count_map.erase( it );
+			}
+		}
+#endif
+	}
+
+	// Takes ownership of a reference that the caller already holds,
+	// so no retain() is done here. The matching release() happens when
+	// this smart_ref goes away.
+
+	static inline smart_ref<T>
+	adopt( T *ref )
+	{
+		return smart_ref<T>( ref, adopt_tag() );
+	}
+
 	inline ~smart_ref()
 	{
 		if ( m_ref )
@@ -192,6 +223,35 @@ public:
 		return *this;
 	}
 	
+	inline smart_ref<T>&
+	operator=( smart_ref<T> &&that )
+	{
+		if ( this != &that )
+		{
+			smart_ref<T> tmp( std::move( that ) );
+
+			swap( tmp );
+		}
+		
+		return *this;
+	}
+
+	// Gives up ownership without calling release(). The caller is now
+	// responsible for the reference, typically by handing it to adopt().
+
+	inline T*
+	detach()
+	{
+		T *ref = m_ref;
+
+#if defined( NETKIT_REF_COUNT_DEBUG )
+		ref_count_map.erase( this );
+#endif
+		m_ref = NULL;
+
+		return ref;
+	}
+	
 	inline bool
 	operator==( const smart_ref<T> &that )
 	{
@@ -238,6 +298,16 @@ public:
 	
 private:
 
+	struct adopt_tag
+	{
+	};
+
+	inline smart_ref( T *ref, adopt_tag )
+	:
+		m_ref( ref )
+	{
+	}
+
 	T *m_ref;
 };
 
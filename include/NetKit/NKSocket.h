@@ -94,6 +94,11 @@ public:
 	
 	void
 	on_event( runloop::event_mask mask, runloop::event_f func );
+
+	// Bypasses any adapters, so only use this when raw() is true.
+
+	bool
+	send_file( int file, std::uint64_t offset, std::size_t len, source::send_reply_f reply );
 	
 	virtual endpoint::ref
 	peer() const;
@@ -37,6 +37,8 @@
 #include <NetKit/NKCookie.h>
 #include <queue>
 #include <list>
+#include <string>
+#include <vector>
 #include <ios>
 
 namespace netkit {
@@ -81,6 +83,12 @@ public:
 		virtual void
 		recv( const std::uint8_t *in_buf, std::size_t in_len, recv_reply_f reply );
 
+		// What was agreed on with ALPN, or an empty string if nothing was
+		// (or hasn't been yet).
+
+		virtual std::string
+		protocol() const;
+
 	protected:
 	
 		friend class source;
@@ -97,6 +105,12 @@ public:
 	
 	void
 	connect( const uri::ref &uri, connect_reply_f reply );
+
+	// Offers protocols, most preferred first, with ALPN if the connection
+	// ends up using TLS.
+
+	void
+	connect( const uri::ref &uri, const std::vector< std::string > &protocols, connect_reply_f reply );
 		
 	void
 	send( const std::uint8_t *buf, std::size_t len, send_reply_f reply );
@@ -119,11 +133,44 @@ public:
 	virtual endpoint::ref
 	peer() const;
 
+	// The protocol the first adapter that negotiated one settled on.
+
+	std::string
+	protocol() const;
+
 	inline bool
 	closed() const
 	{
 		return m_closed;
 	}
+
+	// True if nothing sits between send() and the wire, i.e. no TLS,
+	// proxy or WebSocket framing.
+
+	inline bool
+	raw() const
+	{
+		return m_adapters.head() && ( m_adapters.head() == m_adapters.tail() );
+	}
+
+	// The adapter of type T nearest send(), or nullptr if there isn't one.
+
+	template< class T >
+	T*
+	find_adapter() const
+	{
+		for ( adapter *a = m_adapters.head(); a; a = a->m_next )
+		{
+			T *t = dynamic_cast< T* >( a );
+
+			if ( t )
+			{
+				return t;
+			}
+		}
+
+		return nullptr;
+	}
 	
 protected:
 
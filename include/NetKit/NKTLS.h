@@ -32,6 +32,8 @@
 #define _netkit_tls_h
 
 #include <NetKit/NKSource.h>
+#include <string>
+#include <vector>
 
 namespace netkit {
 
@@ -42,6 +44,13 @@ namespace server {
 source::adapter::ref
 create();
 
+// Picks one of protocols, in our order of preference, from those a client
+// offers with ALPN. Without them nothing is picked, so only ask for what
+// will actually be spoken on the connection.
+
+source::adapter::ref
+create( const std::vector< std::string > &protocols );
+
 }
 
 namespace client {
@@ -49,6 +58,11 @@ namespace client {
 source::adapter::ref
 create();
 
+// Offers protocols, most preferred first, with ALPN.
+
+source::adapter::ref
+create( const std::vector< std::string > &protocols );
+
 }
 
 }
@@ -37,19 +37,111 @@ namespace netkit {
 
 namespace ws {
 
+// XORs len bytes of buf with a frame's masking key (RFC 6455 section 5.3).
+// Masking and unmasking are the same operation. pos is how far into the
+// payload buf starts, for payloads that are handled in pieces.
+
+void
+mask( std::uint8_t *buf, std::size_t len, const std::uint8_t key[ 4 ], std::uint64_t pos = 0 );
+
+// What ws::server::create() and ws::client::create() return. Each buffer
+// sent through the source goes out as one whole message and, unless a
+// message handler is set, each message received comes back whole from the
+// source's recv(). Find it on a source with find_adapter< ws::adapter >().
+
+class adapter : public source::adapter
+{
+public:
+
+	typedef adapter *ref;
+
+	enum class type
+	{
+		text,
+		binary
+	};
+
+	// Gets each received message in the pieces it comes off the wire in,
+	// so a large one is never held whole. last is true for a message's
+	// final piece, which may be empty.
+
+	typedef std::function< void ( type t, const std::uint8_t *buf, std::size_t len, bool last ) > message_f;
+
+	// What the source's send() sends messages as. Text unless told
+	// otherwise.
+
+	inline type
+	send_type() const
+	{
+		return m_send_type;
+	}
+
+	inline void
+	set_send_type( type t )
+	{
+		m_send_type = t;
+	}
+
+	// Once set, messages go to f instead of through the source's recv(),
+	// which from then on only reports errors and the other side closing.
+	// It still has to be called to keep data coming in.
+
+	inline void
+	set_message_handler( message_f f )
+	{
+		m_message_handler = f;
+	}
+
+	// Without a message handler, the most a message can grow to before the
+	// connection is closed with 1009 (message too big). Zero means no
+	// limit.
+
+	inline std::size_t
+	max_message_size() const
+	{
+		return m_max_message_size;
+	}
+
+	inline void
+	set_max_message_size( std::size_t val )
+	{
+		m_max_message_size = val;
+	}
+
+	// Sends part of a message as a frame of its own. The message's type is
+	// the one given with its first part; last ends it. Until it has ended,
+	// no other message may be sent.
+
+	virtual void
+	send_fragment( type t, const std::uint8_t *buf, std::size_t len, bool last, source::send_reply_f reply ) = 0;
+
+protected:
+
+	adapter()
+	:
+		m_send_type( type::text ),
+		m_max_message_size( 16 * 1024 * 1024 )
+	{
+	}
+
+	type		m_send_type;
+	message_f	m_message_handler;
+	std::size_t	m_max_message_size;
+};
+
 namespace server {
 
 std::string
 accept_key( const std::string &input );
 
-source::adapter::ref
+adapter::ref
 create();
 
 }
 
 namespace client {
 
-source::adapter::ref
+adapter::ref
 create();
 
 }
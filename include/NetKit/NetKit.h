@@ -43,6 +43,7 @@
 #include <NetKit/NKComponent.h>
 #include <NetKit/NKMIME.h>
 #include <NetKit/NKHTTP.h>
+#include <NetKit/NKHTTP2.h>
 #include <NetKit/NKBase64.h>
 #include <NetKit/NKString.h>
 #include <NetKit/NKPlatform.h>
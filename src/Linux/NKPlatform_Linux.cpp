@@ -46,12 +46,6 @@ netkit::initialize()
 	{
 		netkit::component::m_instances                = new netkit::component::list;
 
-		netkit::http::server::m_connections           = new netkit::http::connection::list;
-
-		netkit::json::server::m_connections           = new netkit::json::connection::list;
-		netkit::json::server::m_notification_handlers = new netkit::json::server::notification_handlers;
-		netkit::json::server::m_request_handlers      = new netkit::json::server::request_handlers;
-
 		first = false;
 	}
 }
@@ -78,6 +72,15 @@ platform::machine_description()
 }
 
 
+std::string
+platform::temp_folder()
+{
+	const char *dir = getenv( "TMPDIR" );
+
+	return ( dir && *dir ) ? dir : "/tmp";
+}
+
+
 uuid::ref
 uuid::create()
 {
@@ -44,6 +44,15 @@ runloop::main()
 }
 
 
+runloop::ref
+runloop::current()
+{
+	// run() doesn't do anything yet, so there is only ever main().
+
+	return main();
+}
+
+
 runloop_linux::runloop_linux()
 {
 	m_epoll_instance_fd = ::epoll_create( 100 );
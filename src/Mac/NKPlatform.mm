@@ -87,12 +87,6 @@ netkit::initialize()
 	{
 		netkit::component::m_instances					= new netkit::component::list;
 		
-		netkit::http::server::m_connections				= new netkit::http::connection::list;
-		
-		netkit::json::server::m_connections				= new netkit::json::connection::list;
-		netkit::json::server::m_notification_handlers	= new netkit::json::server::notification_handlers;
-		netkit::json::server::m_request_handlers		= new netkit::json::server::request_handlers;
-		
 		first = false;
 	}
 }
@@ -235,6 +229,13 @@ platform::file_exists( const std::string &name )
 }
 
 
+std::string
+platform::temp_folder()
+{
+	return [ NSTemporaryDirectory() UTF8String ];
+}
+
+
 // Returns an iterator containing the primary (built-in) Ethernet interface. The caller is responsible for
 // releasing the iterator after the caller is done with it.
 static kern_return_t
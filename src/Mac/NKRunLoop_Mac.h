@@ -34,7 +34,7 @@
 #include <NetKit/NKRunLoop.h>
 #include <dispatch/dispatch.h>
 #include <vector>
-#include <stack>
+#include <queue>
 
 namespace netkit {
 
@@ -83,15 +83,33 @@ public:
 				m_to_len = static_cast< socklen_t >( to->to_sockaddr( m_to ) );
 			}
 			
+			send_context( int file, std::uint64_t offset, std::size_t len, send_reply_f reply )
+			:
+				m_reply( reply ),
+				m_file( file ),
+				m_offset( offset ),
+				m_file_len( len )
+			{
+			}
+
 			~send_context()
 			{
 			}
+
+			inline std::uint64_t
+			size() const
+			{
+				return ( m_file != -1 ) ? m_file_len : m_buffer.size();
+			}
 			
 			std::vector< std::uint8_t >	m_buffer;
 			sockaddr_storage			m_to;
 			socklen_t					m_to_len;
-			std::uint32_t				m_bytes_written = 0;
+			std::uint64_t				m_bytes_written = 0;
 			send_reply_f				m_reply;
+			int							m_file = -1;
+			std::uint64_t				m_offset = 0;
+			std::uint64_t				m_file_len = 0;
 		};
 	
 		typedef std::function< ssize_t ( send_context::ref &context ) > send_f;
@@ -121,6 +139,9 @@ public:
 		virtual void
 		recvfrom( recvfrom_reply_f reply );
 
+		virtual bool
+		sendfile( int file, std::uint64_t offset, std::size_t len, send_reply_f reply );
+
 		virtual void
 		close();
 		
@@ -164,7 +185,7 @@ public:
 			m_send_queue.pop();
 		}
 	
-		std::stack< send_context::ref >	m_send_queue;
+		std::queue< send_context::ref >	m_send_queue;
 		std::vector< std::uint8_t >	m_out_buf;
 		std::vector< std::uint8_t >	m_in_buf;
 		int							m_domain;
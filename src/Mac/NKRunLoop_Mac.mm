@@ -32,12 +32,17 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <NetKit/NKSocket.h>
 #include <NetKit/NKLog.h>
+#include <NetKit/NKMacros.h>
 #include <dispatch/dispatch.h>
 #include <sys/errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <thread>
 
 using namespace netkit;
 
+static NETKIT_THREAD_LOCAL runloop *g_current = nullptr;
+
 runloop::ref
 runloop::main()
 {
@@ -47,6 +52,13 @@ runloop::main()
 }
 
 
+runloop::ref
+runloop::current()
+{
+	return g_current ? runloop::ref( g_current ) : main();
+}
+
+
 runloop_mac::runloop_mac()
 {
 	// Make sure there is at least one thing added to runloop
@@ -202,7 +214,11 @@ runloop_mac::dispatch( dispatch_f f )
 void
 runloop_mac::run( mode how )
 {
+	runloop *prev = g_current;
+
+	g_current = this;
 	CFRunLoopRun();
+	g_current = prev;
 }
 
 	
@@ -434,16 +450,48 @@ runloop_mac::fd_mac::sendto( const std::uint8_t *buf, std::size_t len, netkit::e
 }
 
 
+bool
+runloop_mac::fd_mac::sendfile( int file, std::uint64_t offset, std::size_t len, send_reply_f reply )
+{
+	m_send_queue.push( std::make_shared< send_context >( file, offset, len, reply ) );
+	
+	if ( m_send_queue.size() == 1 )
+	{
+		try_send( [=]( send_context::ref &context ) -> ssize_t
+		{
+			return ::send( m_fd, context->m_buffer.data() + context->m_bytes_written, context->m_buffer.size() - context->m_bytes_written, 0 );
+		} );
+	}
+
+	return true;
+}
+
+
 void
 runloop_mac::fd_mac::try_send( send_f func )
 {
 	while ( !m_send_queue.empty() )
 	{
-		auto context = m_send_queue.top();
+		auto context = m_send_queue.front();
 	
-		while ( context->m_bytes_written < context->m_buffer.size() )
+		while ( context->m_bytes_written < context->size() )
 		{
-			auto ret = func( context );
+			ssize_t ret;
+
+			if ( context->m_file != -1 )
+			{
+				// sendfile() reports partial progress through len even when
+				// it fails with EAGAIN.
+
+				off_t len = context->m_file_len - context->m_bytes_written;
+
+				ret = ::sendfile( context->m_file, m_fd, context->m_offset + context->m_bytes_written, &len, nullptr, 0 );
+				ret = ( len > 0 ) ? len : ret;
+			}
+			else
+			{
+				ret = func( context );
+			}
 			
 			if ( ret > 0 )
 			{
@@ -465,6 +513,7 @@ runloop_mac::fd_mac::try_send( send_f func )
 				} );
 		
 				resume_send();
+				goto exit;
 			}
 			else
 			{
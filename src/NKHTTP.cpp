@@ -29,6 +29,7 @@
  */
  
 #include <NetKit/NKHTTP.h>
+#include <NetKit/NKHTTP2.h>
 #include <NetKit/NKSource.h>
 #include <NetKit/NKWebSocket.h>
 #include <NetKit/NKTLS.h>
@@ -37,22 +38,42 @@
 #include <NetKit/NKPlatform.h>
 #include <NetKit/NKProxy.h>
 #include <NetKit/NKLog.h>
+#include <NetKit/NKSocket.h>
+#include <NetKit/NKMIME.h>
+#include <NetKit/NKMacros.h>
 #include <http_parser.h>
+#if defined( NETKIT_ZLIB )
+#	include <zlib.h>
+#endif
 #include <algorithm>
 #include <fstream>
-#include <regex>
+#include <mutex>
+#include <set>
 #include <assert.h>
 #include <stdarg.h>
+#if defined( __SSE4_2__ )
+#	include <nmmintrin.h>
+#endif
+#if defined( __AVX2__ )
+#	include <immintrin.h>
+#endif
+#if defined( _MSC_VER )
+#	include <intrin.h>
+#endif
 #if defined(WIN32)
 #	include <shlwapi.h>
 #	include <tchar.h>
 #	include <errno.h>
 #	define strcasecmp _stricmp
+#	define strncasecmp _strnicmp
 #else
 #	include <arpa/inet.h>
 #	include <netdb.h>
 #	include <sys/stat.h>
 #	include <sys/errno.h>
+#	include <sys/mman.h>
+#	include <fcntl.h>
+#	include <unistd.h>
 #	define TCHAR char
 #	define TEXT( X ) X
 #endif
@@ -145,6 +166,7 @@ const std::uint16_t status::unsupported_media_type	= 415;
 const std::uint16_t status::requested_range			= 416;
 const std::uint16_t status::expectation_failed		= 417;
 const std::uint16_t status::upgrade_required		= 426;
+const std::uint16_t status::header_fields_too_large	= 431;
 const std::uint16_t status::server_error			= 500;
 const std::uint16_t status::not_implemented			= 501;
 const std::uint16_t status::bad_gateway				= 502;
@@ -471,6 +493,13 @@ status::to_string( std::uint16_t val )
 		}
 		break;
 
+		case status::header_fields_too_large:
+		{
+			static std::string s( "Error" );
+			return s;
+		}
+		break;
+
 		case status::server_error:
 		{
 			static std::string s( "Error" );
@@ -543,1199 +572,7376 @@ status::to_string( std::uint16_t val )
 	}
 }
 
-#if defined( __APPLE__ )
-#	pragma mark message implementation
-#endif
 
-message::message( std::uint16_t major, std::uint16_t minor )
-:
-	m_major( major ),
-	m_minor( minor ),
-	m_content_type( "text/plain" ),
-	m_content_length( 0 ),
-	m_keep_alive( false )
+static std::string
+format_date( std::time_t t )
 {
-}
+	static const char	*days[]		= { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static const char	*months[]	= { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	char				buf[ 64 ];
+	struct tm			tm;
 
+#if defined( WIN32 )
+	gmtime_s( &tm, &t );
+#else
+	gmtime_r( &t, &tm );
+#endif
 
-message::message( const message &that )
-:
-	m_major( that.m_major ),
-	m_minor( that.m_minor ),
-	m_content_type( that.m_content_type ),
-	m_content_length( that.m_content_length ),
-	m_upgrade( that.m_upgrade ),
-	m_ws_key( that.m_ws_key ),
-	m_keep_alive( that.m_keep_alive )
-{
-}
-	
-	
-message::~message()
-{
+	snprintf( buf, sizeof( buf ), "%s, %02d %s %04d %02d:%02d:%02d GMT", days[ tm.tm_wday ], tm.tm_mday, months[ tm.tm_mon ], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec );
+
+	return buf;
 }
 
 
-void
-message::add_to_header( const header &heeder )
+const char*
+response::current_date()
 {
-	for ( auto it = heeder.begin(); it != heeder.end(); it++ )
-	{
-		add_to_header( it->first, it->second );
-	}
-}
+	// Every response wants one and it only changes once a second.
 
-	
-void
-message::add_to_header( const std::string &key, int val )
-{
-	m_header[ key ] = std::to_string( val );
-	
-	if ( key == "Content-Length" )
+	static NETKIT_THREAD_LOCAL std::time_t	last	= 0;
+	static NETKIT_THREAD_LOCAL char			date[ 64 ];
+	std::time_t								now		= time( nullptr );
+
+	if ( now != last )
 	{
-		m_content_length = val;
+		std::string formatted = format_date( now );
+
+		strncpy( date, formatted.c_str(), sizeof( date ) - 1 );
+		last = now;
 	}
+
+	return date;
 }
 
 
-void
-message::add_to_header( const std::string &key, const std::string &val )
+static void
+write_status_line( std::string &out, std::uint16_t major, std::uint16_t minor, std::uint16_t val )
 {
-	m_header[ key ] = val;
+	// The lines for HTTP/1.0 and HTTP/1.1 are built once, up front.
 
-	if ( key == "Content-Length" )
-	{
-		m_content_length = atoi( val.c_str() );
-	}
-	else if ( key == "Content-Type" )
+	static const std::uint16_t				first	= 100;
+	static const std::uint16_t				last	= 599;
+	static const std::vector< std::string >	lines	= []()
 	{
-		m_content_type = val;
-	}
-	else if ( key == "Upgrade" )
+		std::vector< std::string > lines;
+
+		for ( std::uint16_t minor = 0; minor <= 1; minor++ )
+		{
+			for ( std::uint16_t code = first; code <= last; code++ )
+			{
+				lines.push_back( "HTTP/1." + std::to_string( minor ) + " " + std::to_string( code ) + " " + status::to_string( code ) + "\r\n" );
+			}
+		}
+
+		return lines;
+	}();
+
+	if ( ( major == 1 ) && ( minor <= 1 ) && ( val >= first ) && ( val <= last ) )
 	{
-		m_upgrade = val;
+		out += lines[ minor * ( last - first + 1 ) + ( val - first ) ];
 	}
-	else if ( key == "Sec-WebSocket-Key" )
+	else
 	{
-		m_ws_key = val;
+		out += "HTTP/" + std::to_string( major ) + "." + std::to_string( minor ) + " " + std::to_string( val ) + " " + status::to_string( val ) + "\r\n";
 	}
 }
 
+#if defined( __APPLE__ )
+#	pragma mark field implementation
+#endif
 
-std::string
-message::find_in_header( const std::string &key ) const
+const std::uint16_t field::unknown						= 0;
+const std::uint16_t field::accept							= 1;
+const std::uint16_t field::accept_charset					= 2;
+const std::uint16_t field::accept_encoding				= 3;
+const std::uint16_t field::accept_language				= 4;
+const std::uint16_t field::accept_ranges					= 5;
+const std::uint16_t field::age							= 6;
+const std::uint16_t field::allow							= 7;
+const std::uint16_t field::authorization					= 8;
+const std::uint16_t field::cache_control					= 9;
+const std::uint16_t field::connection						= 10;
+const std::uint16_t field::content_disposition			= 11;
+const std::uint16_t field::content_encoding				= 12;
+const std::uint16_t field::content_language				= 13;
+const std::uint16_t field::content_length					= 14;
+const std::uint16_t field::content_location				= 15;
+const std::uint16_t field::content_range					= 16;
+const std::uint16_t field::content_type					= 17;
+const std::uint16_t field::cookie							= 18;
+const std::uint16_t field::date							= 19;
+const std::uint16_t field::etag							= 20;
+const std::uint16_t field::expect							= 21;
+const std::uint16_t field::expires						= 22;
+const std::uint16_t field::host							= 23;
+const std::uint16_t field::if_match						= 24;
+const std::uint16_t field::if_modified_since				= 25;
+const std::uint16_t field::if_none_match					= 26;
+const std::uint16_t field::if_range						= 27;
+const std::uint16_t field::if_unmodified_since			= 28;
+const std::uint16_t field::keep_alive						= 29;
+const std::uint16_t field::last_modified					= 30;
+const std::uint16_t field::location						= 31;
+const std::uint16_t field::origin							= 32;
+const std::uint16_t field::pragma							= 33;
+const std::uint16_t field::proxy_authenticate				= 34;
+const std::uint16_t field::proxy_authorization			= 35;
+const std::uint16_t field::proxy_connection				= 36;
+const std::uint16_t field::range							= 37;
+const std::uint16_t field::referer						= 38;
+const std::uint16_t field::retry_after					= 39;
+const std::uint16_t field::sec_websocket_accept			= 40;
+const std::uint16_t field::sec_websocket_key				= 41;
+const std::uint16_t field::sec_websocket_protocol			= 42;
+const std::uint16_t field::sec_websocket_version			= 43;
+const std::uint16_t field::server							= 44;
+const std::uint16_t field::set_cookie						= 45;
+const std::uint16_t field::te								= 46;
+const std::uint16_t field::trailer						= 47;
+const std::uint16_t field::transfer_encoding				= 48;
+const std::uint16_t field::upgrade						= 49;
+const std::uint16_t field::user_agent						= 50;
+const std::uint16_t field::vary							= 51;
+const std::uint16_t field::via							= 52;
+const std::uint16_t field::www_authenticate				= 53;
+const std::uint16_t field::count						= 54;
+
+static const char *g_field_names[] =
 {
-	std::string val;
-	auto		it = m_header.find( key );
+	"",
+		"Accept",
+		"Accept-Charset",
+		"Accept-Encoding",
+		"Accept-Language",
+		"Accept-Ranges",
+		"Age",
+		"Allow",
+		"Authorization",
+		"Cache-Control",
+		"Connection",
+		"Content-Disposition",
+		"Content-Encoding",
+		"Content-Language",
+		"Content-Length",
+		"Content-Location",
+		"Content-Range",
+		"Content-Type",
+		"Cookie",
+		"Date",
+		"ETag",
+		"Expect",
+		"Expires",
+		"Host",
+		"If-Match",
+		"If-Modified-Since",
+		"If-None-Match",
+		"If-Range",
+		"If-Unmodified-Since",
+		"Keep-Alive",
+		"Last-Modified",
+		"Location",
+		"Origin",
+		"Pragma",
+		"Proxy-Authenticate",
+		"Proxy-Authorization",
+		"Proxy-Connection",
+		"Range",
+		"Referer",
+		"Retry-After",
+		"Sec-WebSocket-Accept",
+		"Sec-WebSocket-Key",
+		"Sec-WebSocket-Protocol",
+		"Sec-WebSocket-Version",
+		"Server",
+		"Set-Cookie",
+		"TE",
+		"Trailer",
+		"Transfer-Encoding",
+		"Upgrade",
+		"User-Agent",
+		"Vary",
+		"Via",
+		"WWW-Authenticate",
+};
+
+
+static inline char
+field_fold( char c )
+{
+	return ( ( c >= 'A' ) && ( c <= 'Z' ) ) ? c + ( 'a' - 'A' ) : c;
+}
 
-	if ( it != m_header.end() )
+
+static inline bool
+field_equals( const char *a, const char *b, std::size_t len )
+{
+	for ( std::size_t i = 0; i < len; i++ )
 	{
-		val = it->second;
+		if ( field_fold( a[ i ] ) != field_fold( b[ i ] ) )
+		{
+			return false;
+		}
 	}
 
-	return val;
+	return true;
 }
 
 
-void
-message::remove_from_header( const std::string &key )
+const std::string&
+field::to_string( std::uint16_t val )
 {
-	m_header.erase( key );
+	static const std::vector< std::string > names( g_field_names, g_field_names + field::count );
+
+	return ( val < field::count ) ? names[ val ] : names[ field::unknown ];
 }
 
 
-void
-message::write( const uint8_t *buf, size_t len )
+std::uint16_t
+field::intern( const char *name, std::size_t len )
 {
-	m_ostream.write( reinterpret_cast< const char* >( buf ), len );
-}
+	// Bucket the well-known names by length so a lookup only compares against
+	// a handful of candidates.
 
+	typedef std::vector< std::vector< std::uint16_t > > buckets_t;
 
-void
-message::preflight()
-{
-}
+	static const std::size_t	max_len = 32;
+	static const buckets_t		buckets = []()
+	{
+		buckets_t buckets( max_len );
 
+		for ( std::uint16_t id = 1; id < field::count; id++ )
+		{
+			buckets[ strlen( g_field_names[ id ] ) ].push_back( id );
+		}
 
-bool
-message::send_body( connection_ref conn ) const
-{
-	std::string body = m_ostream.str();
-	
-	if ( body.size() > 0 )
+		return buckets;
+	}();
+
+	if ( len < max_len )
 	{
-		conn->send( reinterpret_cast< const uint8_t* >( body.c_str() ), body.size(), [=]( int status )
+		for ( auto id : buckets[ len ] )
 		{
-			if ( status != 0 )
+			if ( field_equals( g_field_names[ id ], name, len ) )
 			{
+				return id;
 			}
-		} );
+		}
 	}
-	
-	return true;
+
+	return field::unknown;
 }
 
 #if defined( __APPLE__ )
-#	pragma mark request implementation
+#	pragma mark header implementation
 #endif
 
-request::request( int method, std::uint16_t major, std::uint16_t minor, const netkit::uri::ref &uri )
+header::entry::entry( std::uint16_t id, const char *name, std::size_t name_len, const char *val, std::size_t val_len )
 :
-	message( major, minor ),
-	m_max_redirects( 3 ),
-	m_num_redirects( 0 ),
-	m_method( method ),
-	m_uri( uri )
+	m_id( id ),
+	m_value( val, val_len )
 {
-	init();
-	
-	if ( ( major == 1 ) && ( minor == 1 ) )
+	if ( id == field::unknown )
 	{
-		m_keep_alive = true;
+		m_name.assign( name, name_len );
 	}
 }
 
-	
-request::request( const request &that )
-:
-	message( that ),
-	m_method( that.m_method ),
-	m_uri( that.m_uri )
-{
-	init();
-}
-
 
-request::~request()
+header::header()
 {
-	nklog( log::verbose, "" );
 }
 
 
-void
-request::init()
+header::const_iterator
+header::find( std::uint16_t id ) const
 {
+	return const_cast< header* >( this )->lookup( id, nullptr, 0 );
 }
 
 
-void
-request::add_to_header( const header& header )
+header::const_iterator
+header::find( const std::string &name ) const
 {
-	message::add_to_header( header );
+	return const_cast< header* >( this )->lookup( field::intern( name ), name.c_str(), name.size() );
 }
 
 
-void
-request::add_to_header( const std::string &key, const std::string &val )
+std::uint16_t
+header::set( const char *name, std::size_t name_len, const char *val, std::size_t val_len )
 {
-	message::add_to_header( key, val );
-	
-	if ( key == "Host" )
-    {
-		m_host = val;
-    }
-    else if ( key == "Expect" )
-    {
-		m_expect = val;
-    }
-    else if ( key == "Authorization" )
-    {
-		std::string base64Encoded;
-		std::string decoded;
-		size_t      pos;
-
-		m_authorization = val;
-		
-        base64Encoded	= m_authorization.substr( m_authorization.find( ' ' ) + 1 );
+	std::uint16_t	id	= field::intern( name, name_len );
+	auto			it	= lookup( id, name, name_len );
 
-        decoded			= codec::base64::decode( base64Encoded );
-		pos				= decoded.find( ':' );
-
-		if ( pos != -1 )
+	if ( it != m_entries.end() )
+	{
+		it->m_value.assign( val, val_len );
+	}
+	else
+	{
+		if ( m_entries.capacity() == 0 )
 		{
-			m_username  = decoded.substr( 0, pos );
-			m_password  = decoded.substr( pos + 1 );
-        }
+			m_entries.reserve( 16 );
+		}
+
+		m_entries.emplace_back( id, name, name_len, val, val_len );
 	}
+
+	return id;
 }
 
 
 void
-request::send_prologue( connection_ref conn ) const
+header::set( std::uint16_t id, const std::string &val )
 {
-	*conn << method::to_string( m_method ) << " ";
-	
-	if ( proxy::get()->is_null() || !proxy::get()->is_http() || ( m_uri->scheme() == "https" ) )
+	assert( id != field::unknown );
+
+	auto it = lookup( id, nullptr, 0 );
+
+	if ( it != m_entries.end() )
 	{
-		*conn << m_uri->path();
+		it->m_value = val;
 	}
 	else
 	{
-		*conn << m_uri->to_string();
-	}
-
-	if ( !m_uri->query().empty() )
-	{
-		*conn << "?" << m_uri->query();
+		m_entries.emplace_back( id, nullptr, 0, val.c_str(), val.size() );
 	}
-
-	*conn << " HTTP/1.1" << http::endl;
 }
 
 
 void
-request::auth( int status )
+header::erase( std::uint16_t id )
 {
-	if ( m_auth )
+	auto it = lookup( id, nullptr, 0 );
+
+	if ( it != m_entries.end() )
 	{
-		m_auth( status );
+		m_entries.erase( it );
 	}
 }
 
 
 void
-request::headers_reply( response_ref response )
+header::erase( const std::string &name )
 {
-	if ( m_headers_reply )
+	auto it = lookup( field::intern( name ), name.c_str(), name.size() );
+
+	if ( it != m_entries.end() )
 	{
-		m_headers_reply( response );
+		m_entries.erase( it );
 	}
 }
 
 
-void
-request::body_reply( response_ref response, const std::uint8_t *buf, std::size_t len )
+header::entries::iterator
+header::lookup( std::uint16_t id, const char *name, std::size_t len )
 {
-	if ( m_body_reply )
+	auto it = m_entries.begin();
+
+	if ( id != field::unknown )
 	{
-		m_body_reply( response, buf, len );
+		for ( ; it != m_entries.end(); it++ )
+		{
+			if ( it->m_id == id )
+			{
+				break;
+			}
+		}
 	}
-	else
+	else if ( name )
 	{
-		response->write( buf, len );
+		for ( ; it != m_entries.end(); it++ )
+		{
+			if ( ( it->m_id == field::unknown ) && ( it->m_name.size() == len ) && field_equals( it->m_name.c_str(), name, len ) )
+			{
+				break;
+			}
+		}
 	}
-}
-
-
-void
-request::reply( response_ref response )
-{
-	if ( m_reply )
+	else
 	{
-		m_reply( response );
+		it = m_entries.end();
 	}
-}
 
+	return it;
+}
 
 #if defined( __APPLE__ )
-#	pragma mark response implementation
+#	pragma mark coding implementation
 #endif
 
-response::response( std::uint16_t major, std::uint16_t minor, uint16_t status, bool keep_alive )
-:
-	message( major, minor ),
-	m_status( status )
+const std::uint8_t coding::identity	= 0;
+const std::uint8_t coding::gzip		= 1;
+const std::uint8_t coding::deflate	= 2;
+const std::uint8_t coding::unknown	= 0xff;
+
+const std::string&
+coding::to_string( std::uint8_t val )
 {
-	m_keep_alive = keep_alive;
-	init();
+	static const std::string names[] = { "identity", "gzip", "deflate", "unknown" };
+
+	return ( val <= coding::deflate ) ? names[ val ] : names[ 3 ];
 }
 
 
-response::response( const response &that )
-:
-	message( that ),
-	m_status( that.m_status )
+std::uint8_t
+coding::from_string( const std::string &val )
 {
-}
+	std::uint8_t ret = coding::unknown;
 
+	if ( ( strcasecmp( val.c_str(), "gzip" ) == 0 ) || ( strcasecmp( val.c_str(), "x-gzip" ) == 0 ) )
+	{
+		ret = coding::gzip;
+	}
+	else if ( strcasecmp( val.c_str(), "deflate" ) == 0 )
+	{
+		ret = coding::deflate;
+	}
+	else if ( val.empty() || ( strcasecmp( val.c_str(), "identity" ) == 0 ) )
+	{
+		ret = coding::identity;
+	}
 
-response::~response()
-{
-	nklog( log::verbose, "" );
+	return ret;
 }
 
 
-void
-response::init()
+bool
+coding::supported()
 {
-	time_t     now = time(0);
-    struct tm  tstruct;
-    char       buf[80];
-#if defined( WIN32 )
-	localtime_s( &tstruct, &now );
+#if defined( NETKIT_ZLIB )
+	return true;
 #else
-    tstruct = *localtime( &now );
+	return false;
 #endif
-    strftime(buf, sizeof(buf), "%a, % %b %Y %I:%M:%S %Z", &tstruct);
-	
-	add_to_header( "Date", buf );
-
-	if ( m_keep_alive )
-	{
-		add_to_header( "Connection", "Keep-Alive" );
-		add_to_header( "Keep-Alive", "timeout=10" );
-	}
 }
 
 
-void
-response::send_prologue( connection::ref conn ) const
+std::uint8_t
+coding::negotiate( const std::string &accept_encoding )
 {
-	*conn << "HTTP/" << m_major << "." << m_minor << " " << m_status << " " << status::to_string( m_status ) << endl;
-}
+	double			q[ 3 ]	= { -1, -1, -1 };
+	double			any_q	= -1;
+	double			best_q	= 0;
+	std::uint8_t	best	= coding::identity;
+	std::size_t		pos		= 0;
 
+	if ( !supported() )
+	{
+		return coding::identity;
+	}
 
-#if defined( __APPLE__ )
-#	pragma mark connection implementation
-#endif
+	while ( pos < accept_encoding.size() )
+	{
+		std::size_t	end		= accept_encoding.find( ',', pos );
+		std::string	item;
+		std::string	name;
+		std::size_t	semi;
+		double		weight	= 1;
 
+		if ( end == std::string::npos )
+		{
+			end = accept_encoding.size();
+		}
 
-connection::connection( handler::ref h )
-:
-	m_secure( false ),
-	m_okay( true ),
-	m_handler( h )
-{
-	init();
-}
+		item	= accept_encoding.substr( pos, end - pos );
+		pos		= end + 1;
+		semi	= item.find( ';' );
+		name	= item.substr( 0, semi );
 
+		name.erase( 0, name.find_first_not_of( " \t" ) );
+		name.erase( name.find_last_not_of( " \t" ) + 1 );
 
-connection::~connection()
+		if ( semi != std::string::npos )
+		{
+			std::size_t qpos = item.find( "q=", semi );
+
+			if ( qpos != std::string::npos )
+			{
+				weight = atof( item.c_str() + qpos + 2 );
+			}
+		}
+
+		if ( name == "*" )
+		{
+			any_q = weight;
+		}
+		else
+		{
+			std::uint8_t c = from_string( name );
+
+			if ( c != coding::unknown )
+			{
+				q[ c ] = weight;
+			}
+		}
+	}
+
+	// A wildcard covers whatever wasn't named.
+
+	for ( std::uint8_t c = coding::gzip; c <= coding::deflate; c++ )
+	{
+		double weight = ( q[ c ] >= 0 ) ? q[ c ] : any_q;
+
+		if ( weight > best_q )
+		{
+			best_q	= weight;
+			best	= c;
+		}
+	}
+
+	return best;
+}
+
+
+#if defined( NETKIT_ZLIB )
+
+bool
+coding::encode( std::uint8_t val, const std::uint8_t *buf, std::size_t len, std::string &out )
+{
+	z_stream	stream;
+	int			err;
+	bool		ok = false;
+
+	memset( &stream, 0, sizeof( stream ) );
+
+	// deflate means the zlib format, not a raw deflate stream.
+
+	if ( deflateInit2( &stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, ( val == coding::gzip ) ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+	{
+		nklog( log::error, "unable to initialize zlib" );
+		goto exit;
+	}
+
+	out.resize( deflateBound( &stream, static_cast< uLong >( len ) ) );
+
+	stream.next_in		= const_cast< Bytef* >( buf );
+	stream.avail_in		= static_cast< uInt >( len );
+	stream.next_out		= reinterpret_cast< Bytef* >( &out[ 0 ] );
+	stream.avail_out	= static_cast< uInt >( out.size() );
+
+	err = ::deflate( &stream, Z_FINISH );
+
+	if ( err != Z_STREAM_END )
+	{
+		nklog( log::error, "unable to compress body (%)", err );
+		deflateEnd( &stream );
+		goto exit;
+	}
+
+	out.resize( stream.total_out );
+	deflateEnd( &stream );
+
+	ok = true;
+
+exit:
+
+	return ok;
+}
+
+
+coding::decoder::decoder( std::uint8_t val, std::size_t max_size )
+:
+	m_stream( nullptr ),
+	m_coding( val ),
+	m_prefix_len( 0 ),
+	m_max_size( max_size ),
+	m_size( 0 ),
+	m_started( val != coding::deflate ),
+	m_done( false )
+{
+	reset( false );
+}
+
+
+coding::decoder::~decoder()
+{
+	if ( m_stream )
+	{
+		inflateEnd( reinterpret_cast< z_stream* >( m_stream ) );
+		delete reinterpret_cast< z_stream* >( m_stream );
+	}
+}
+
+
+bool
+coding::decoder::reset( bool raw )
+{
+	z_stream *stream = reinterpret_cast< z_stream* >( m_stream );
+
+	if ( stream )
+	{
+		inflateEnd( stream );
+	}
+	else
+	{
+		stream		= new z_stream;
+		m_stream	= stream;
+	}
+
+	memset( stream, 0, sizeof( z_stream ) );
+
+	// 32 lets zlib tell gzip from zlib by the header.
+
+	return ( inflateInit2( stream, raw ? -15 : 15 + 32 ) == Z_OK );
+}
+
+
+bool
+coding::decoder::write( const std::uint8_t *buf, std::size_t len, output_f output )
+{
+	if ( !m_started )
+	{
+		bool zlib;
+
+		// deflate is supposed to mean the zlib format, but some servers send
+		// a raw deflate stream. The first two bytes tell us which.
+
+		while ( ( m_prefix_len < 2 ) && ( len > 0 ) )
+		{
+			m_prefix[ m_prefix_len++ ] = *buf++;
+			len--;
+		}
+
+		if ( m_prefix_len < 2 )
+		{
+			return true;
+		}
+
+		m_started	= true;
+		zlib		= ( ( m_prefix[ 0 ] & 0x0f ) == Z_DEFLATED ) && ( ( ( m_prefix[ 0 ] << 8 ) | m_prefix[ 1 ] ) % 31 == 0 );
+
+		if ( !reset( !zlib ) || !run( m_prefix, m_prefix_len, output ) )
+		{
+			return false;
+		}
+	}
+
+	return run( buf, len, output );
+}
+
+
+bool
+coding::decoder::run( const std::uint8_t *buf, std::size_t len, output_f output )
+{
+	z_stream		*stream = reinterpret_cast< z_stream* >( m_stream );
+	std::uint8_t	chunk[ 16 * 1024 ];
+	bool			ok		= true;
+
+	stream->next_in		= const_cast< Bytef* >( buf );
+	stream->avail_in	= static_cast< uInt >( len );
+
+	// Keep going while there is input, or while the last pass filled the
+	// output chunk, since zlib may be holding more.
+
+	while ( !m_done && ( ( stream->avail_in > 0 ) || ( stream->avail_out == 0 ) ) )
+	{
+		int err;
+
+		stream->next_out	= chunk;
+		stream->avail_out	= sizeof( chunk );
+
+		err = inflate( stream, Z_NO_FLUSH );
+
+		if ( ( err != Z_OK ) && ( err != Z_STREAM_END ) && ( err != Z_BUF_ERROR ) )
+		{
+			nklog( log::error, "unable to decode % body (%)", to_string( m_coding ), err );
+			ok = false;
+			break;
+		}
+
+		if ( stream->avail_out < sizeof( chunk ) )
+		{
+			std::size_t n = sizeof( chunk ) - stream->avail_out;
+
+			m_size += n;
+
+			if ( ( m_max_size > 0 ) && ( m_size > m_max_size ) )
+			{
+				nklog( log::error, "% body decodes to more than % bytes", to_string( m_coding ), m_max_size );
+				ok = false;
+				break;
+			}
+
+			output( chunk, n );
+		}
+
+		if ( err == Z_STREAM_END )
+		{
+			m_done = true;
+		}
+		else if ( err == Z_BUF_ERROR )
+		{
+			break;
+		}
+	}
+
+	return ok;
+}
+
+#else
+
+// Built without zlib. negotiate() never picks anything but identity and the
+// client doesn't ask for anything else, so these only see bodies a peer
+// coded unasked.
+
+bool
+coding::encode( std::uint8_t val, const std::uint8_t *buf, std::size_t len, std::string &out )
+{
+	nklog( log::error, "built without zlib, can't encode % bodies", to_string( val ) );
+	return false;
+}
+
+
+coding::decoder::decoder( std::uint8_t val, std::size_t max_size )
+:
+	m_stream( nullptr ),
+	m_coding( val ),
+	m_prefix_len( 0 ),
+	m_max_size( max_size ),
+	m_size( 0 ),
+	m_started( false ),
+	m_done( false )
+{
+}
+
+
+coding::decoder::~decoder()
+{
+}
+
+
+bool
+coding::decoder::reset( bool raw )
+{
+	return false;
+}
+
+
+bool
+coding::decoder::write( const std::uint8_t *buf, std::size_t len, output_f output )
+{
+	nklog( log::error, "built without zlib, can't decode % bodies", to_string( m_coding ) );
+	return false;
+}
+
+
+bool
+coding::decoder::run( const std::uint8_t *buf, std::size_t len, output_f output )
+{
+	return false;
+}
+
+#endif
+
+#if defined( __APPLE__ )
+#	pragma mark message implementation
+#endif
+
+std::size_t message::m_spill_threshold = 1024 * 1024;
+const std::streamsize message::would_block = -2;
+
+message::message( std::uint16_t major, std::uint16_t minor )
+:
+	m_major( major ),
+	m_minor( minor ),
+	m_content_type( "text/plain" ),
+	m_content_length( 0 ),
+	m_keep_alive( false ),
+	m_file( -1 ),
+	m_file_offset( 0 ),
+	m_file_length( 0 ),
+	m_spill( nullptr ),
+	m_spill_size( 0 ),
+	m_spill_failed( false )
+{
+}
+
+
+message::message( const message &that )
+:
+	m_major( that.m_major ),
+	m_minor( that.m_minor ),
+	m_content_type( that.m_content_type ),
+	m_content_length( that.m_content_length ),
+	m_upgrade( that.m_upgrade ),
+	m_ws_key( that.m_ws_key ),
+	m_keep_alive( that.m_keep_alive ),
+	m_file( -1 ),
+	m_file_offset( 0 ),
+	m_file_length( 0 ),
+	m_spill( nullptr ),
+	m_spill_size( 0 ),
+	m_spill_failed( false )
+{
+}
+	
+	
+message::~message()
+{
+	if ( m_spill )
+	{
+		delete m_spill;
+		remove( m_spill_path.c_str() );
+	}
+}
+
+
+void
+message::add_to_header( const header &heeder )
+{
+	for ( auto it = heeder.begin(); it != heeder.end(); it++ )
+	{
+		add_to_header( it->name(), it->value() );
+	}
+}
+
+	
+void
+message::add_to_header( const std::string &key, int val )
+{
+	add_to_header( key, std::to_string( val ) );
+}
+
+
+void
+message::add_to_header( const std::string &key, const std::string &val )
+{
+	field_was_added( m_header.set( key, val ), val );
+}
+
+
+void
+message::add_to_header( const char *name, std::size_t name_len, const char *val, std::size_t val_len )
+{
+	std::uint16_t id = m_header.set( name, name_len, val, val_len );
+
+	// The header holds the only copy of the value, so hand that one on.
+
+	if ( id != field::unknown )
+	{
+		field_was_added( id, m_header.find( id )->value() );
+	}
+}
+
+
+void
+message::field_was_added( std::uint16_t id, const std::string &val )
+{
+	switch ( id )
+	{
+		case field::content_length:
+		{
+			m_content_length = static_cast< std::size_t >( strtoull( val.c_str(), nullptr, 10 ) );
+		}
+		break;
+
+		case field::content_type:
+		{
+			m_content_type = val;
+		}
+		break;
+
+		case field::upgrade:
+		{
+			m_upgrade = val;
+		}
+		break;
+
+		case field::sec_websocket_key:
+		{
+			m_ws_key = val;
+		}
+		break;
+	}
+}
+
+
+std::string
+message::find_in_header( const std::string &key ) const
+{
+	std::string val;
+	auto		it = m_header.find( key );
+
+	if ( it != m_header.end() )
+	{
+		val = it->value();
+	}
+
+	return val;
+}
+
+
+std::string
+message::find_in_header( std::uint16_t id ) const
+{
+	std::string val;
+	auto		it = m_header.find( id );
+
+	if ( it != m_header.end() )
+	{
+		val = it->value();
+	}
+
+	return val;
+}
+
+
+void
+message::remove_from_header( const std::string &key )
+{
+	std::uint16_t id = field::intern( key );
+
+	if ( id != field::unknown )
+	{
+		m_header.erase( id );
+		field_was_removed( id );
+	}
+	else
+	{
+		m_header.erase( key );
+	}
+}
+
+
+void
+message::field_was_removed( std::uint16_t id )
+{
+	switch ( id )
+	{
+		case field::content_length:
+		{
+			m_content_length = 0;
+		}
+		break;
+
+		case field::content_type:
+		{
+			m_content_type.clear();
+		}
+		break;
+
+		case field::upgrade:
+		{
+			m_upgrade.clear();
+		}
+		break;
+
+		case field::sec_websocket_key:
+		{
+			m_ws_key.clear();
+		}
+		break;
+	}
+}
+
+
+void
+message::write( const uint8_t *buf, size_t len )
+{
+	if ( !m_spill && !m_spill_failed && ( ( body_size() + len ) > m_spill_threshold ) )
+	{
+		spill();
+	}
+
+	if ( m_spill )
+	{
+		m_spill->write( reinterpret_cast< const char* >( buf ), len );
+		m_spill_size += len;
+	}
+	else
+	{
+		m_ostream.write( reinterpret_cast< const char* >( buf ), len );
+	}
+}
+
+
+std::string
+message::body() const
+{
+	std::string body;
+
+	if ( m_spill )
+	{
+		m_spill->flush();
+
+		std::ifstream in( m_spill_path.c_str(), std::ios::in | std::ios::binary );
+
+		body.resize( m_spill_size );
+
+		if ( m_spill_size > 0 )
+		{
+			in.read( &body[ 0 ], m_spill_size );
+		}
+	}
+	else
+	{
+		body = m_ostream.str();
+	}
+
+	return body;
+}
+
+
+message::producer_f
+message::producer() const
+{
+	if ( m_producer || !m_spill )
+	{
+		return m_producer;
+	}
+
+	// A spilled body is streamed back out of its file rather than being
+	// read into memory.
+
+	std::shared_ptr< std::ifstream > in = std::make_shared< std::ifstream >( m_spill_path.c_str(), std::ios::in | std::ios::binary );
+
+	m_spill->flush();
+
+	return [=]( std::uint8_t *buf, std::size_t len ) -> std::streamsize
+	{
+		if ( !*in )
+		{
+			return in->eof() ? 0 : -1;
+		}
+
+		in->read( reinterpret_cast< char* >( buf ), len );
+
+		return in->gcount();
+	};
+}
+
+
+std::size_t
+message::body_size() const
+{
+	return m_spill ? m_spill_size : static_cast< std::size_t >( const_cast< std::stringstream& >( m_ostream ).tellp() );
+}
+
+
+std::size_t
+message::read_body( std::size_t pos, std::uint8_t *buf, std::size_t len ) const
+{
+	std::size_t size = body_size();
+
+	if ( pos >= size )
+	{
+		return 0;
+	}
+
+	len = std::min( len, size - pos );
+
+	if ( m_spill )
+	{
+		m_spill->flush();
+
+		std::ifstream in( m_spill_path.c_str(), std::ios::in | std::ios::binary );
+
+		in.seekg( pos );
+		in.read( reinterpret_cast< char* >( buf ), len );
+
+		return static_cast< std::size_t >( in.gcount() );
+	}
+
+	// The read position of the stream is separate from where writes go, so
+	// this leaves the body as it is.
+
+	std::stringbuf *sb = const_cast< std::stringstream& >( m_ostream ).rdbuf();
+
+	if ( sb->pubseekpos( pos, std::ios::in ) != std::streampos( pos ) )
+	{
+		return 0;
+	}
+
+	return static_cast< std::size_t >( sb->sgetn( reinterpret_cast< char* >( buf ), len ) );
+}
+
+
+void
+message::clear_body()
+{
+	if ( m_spill )
+	{
+		delete m_spill;
+		remove( m_spill_path.c_str() );
+		m_spill = nullptr;
+		m_spill_path.clear();
+		m_spill_size = 0;
+	}
+
+	m_ostream.str( std::string() );
+	m_ostream.clear();
+}
+
+
+void
+message::spill()
+{
+	std::string body = m_ostream.str();
+
+	m_spill_path	= platform::temp_folder() + "/netkit-" + uuid::create()->to_string() + ".body";
+	m_spill			= new std::fstream( m_spill_path.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc );
+
+	if ( !m_spill->is_open() )
+	{
+		nklog( log::error, "unable to create % for spilling message body, keeping it in memory", m_spill_path );
+		delete m_spill;
+		m_spill = nullptr;
+		m_spill_path.clear();
+		m_spill_failed = true;
+		return;
+	}
+
+	nklog( log::verbose, "spilling message body to %", m_spill_path );
+
+	m_spill->write( body.c_str(), body.size() );
+	m_spill_size = body.size();
+	m_ostream.str( std::string() );
+}
+
+
+void
+message::preflight()
+{
+}
+
+
+void
+message::write_body( std::string &out ) const
+{
+	out += m_ostream.str();
+}
+
+#if defined( __APPLE__ )
+#	pragma mark request implementation
+#endif
+
+request::request( int method, std::uint16_t major, std::uint16_t minor, const netkit::uri::ref &uri )
+:
+	message( major, minor ),
+	m_max_redirects( 3 ),
+	m_num_redirects( 0 ),
+	m_method( method ),
+	m_uri( uri ),
+	m_tries( 0 )
+{
+	init();
+	
+	if ( ( major == 1 ) && ( minor == 1 ) )
+	{
+		m_keep_alive = true;
+	}
+}
+
+	
+request::request( const request &that )
+:
+	message( that ),
+	m_method( that.m_method ),
+	m_uri( that.m_uri ),
+	m_tries( 0 )
+{
+	init();
+}
+
+
+request::~request()
+{
+	nklog( log::verbose, "" );
+}
+
+
+void
+request::init()
+{
+}
+
+
+void
+request::field_was_added( std::uint16_t id, const std::string &val )
+{
+	message::field_was_added( id, val );
+
+	if ( id == field::host )
+    {
+		m_host = val;
+    }
+    else if ( id == field::expect )
+    {
+		m_expect = val;
+    }
+    else if ( id == field::authorization )
+    {
+		std::string base64Encoded;
+		std::string decoded;
+		size_t      pos;
+
+		m_authorization = val;
+		
+        base64Encoded	= m_authorization.substr( m_authorization.find( ' ' ) + 1 );
+
+        decoded			= codec::base64::decode( base64Encoded );
+		pos				= decoded.find( ':' );
+
+		if ( pos != -1 )
+		{
+			m_username  = decoded.substr( 0, pos );
+			m_password  = decoded.substr( pos + 1 );
+        }
+	}
+}
+
+
+void
+request::field_was_removed( std::uint16_t id )
+{
+	message::field_was_removed( id );
+
+	if ( id == field::host )
+	{
+		m_host.clear();
+	}
+	else if ( id == field::expect )
+	{
+		m_expect.clear();
+	}
+	else if ( id == field::authorization )
+	{
+		m_authorization.clear();
+		m_username.clear();
+		m_password.clear();
+	}
+}
+
+
+void
+request::write_prologue( std::string &out ) const
+{
+	out += method::to_string( m_method );
+	out += " ";
+	
+	if ( proxy::get()->is_null() || !proxy::get()->is_http() || ( m_uri->scheme() == "https" ) )
+	{
+		out += m_uri->path();
+	}
+	else
+	{
+		out += m_uri->to_string();
+	}
+
+	if ( !m_uri->query().empty() )
+	{
+		out += "?";
+		out += m_uri->query();
+	}
+
+	out += " HTTP/1.1\r\n";
+}
+
+
+void
+request::auth( int status )
+{
+	if ( m_auth )
+	{
+		m_auth( status );
+	}
+}
+
+
+void
+request::headers_reply( response_ref response )
+{
+	if ( m_headers_reply )
+	{
+		m_headers_reply( response );
+	}
+}
+
+
+void
+request::body_reply( response_ref response, const std::uint8_t *buf, std::size_t len )
+{
+	if ( m_body_reply )
+	{
+		m_body_reply( response, buf, len );
+	}
+	else
+	{
+		response->write( buf, len );
+	}
+}
+
+
+void
+request::reply( response_ref response )
+{
+	if ( m_reply )
+	{
+		m_reply( response );
+	}
+}
+
+
+#if defined( __APPLE__ )
+#	pragma mark response implementation
+#endif
+
+response::response( std::uint16_t major, std::uint16_t minor, uint16_t status, bool keep_alive )
+:
+	message( major, minor ),
+	m_status( status )
+{
+	m_keep_alive = keep_alive;
+	init();
+}
+
+
+response::response( const response &that )
+:
+	message( that ),
+	m_status( that.m_status )
+{
+}
+
+
+response::~response()
+{
+	nklog( log::verbose, "" );
+}
+
+
+void
+response::init()
+{
+	// Date is filled in when the response is written out.
+
+	if ( m_keep_alive )
+	{
+		add_to_header( "Connection", "Keep-Alive" );
+		add_to_header( "Keep-Alive", "timeout=10" );
+	}
+}
+
+
+void
+response::write_prologue( std::string &out ) const
+{
+	write_status_line( out, m_major, m_minor, m_status );
+
+	if ( m_header.find( field::date ) == m_header.end() )
+	{
+		out += "Date: ";
+		out += current_date();
+		out += "\r\n";
+	}
+}
+
+
+#if defined( __APPLE__ )
+#	pragma mark fast request parser
+#endif
+
+// A request head is mostly long runs of ordinary characters (targets,
+// cookies, user agents), so the scanning looks at 32 or 16 bytes at a time
+// where the build allows it, the way picohttpparser does. The choice is
+// made when compiling; build with -mavx2 or -msse4.2 to get it.
+
+struct fast_head
+{
+	int			m_method;
+	int			m_minor;
+	string_view	m_target;
+	bool		m_keep_alive;
+	const char	*m_end;
+};
+
+
+#if defined( __AVX2__ )
+
+static inline unsigned
+first_bit( unsigned mask )
+{
+#	if defined( _MSC_VER )
+	unsigned long index;
+
+	_BitScanForward( &index, mask );
+
+	return index;
+#	else
+	return __builtin_ctz( mask );
+#	endif
+}
+
+#endif
+
+
+static const char*
+scan( const char *p, const char *end, char stop )
+{
+	// Finds stop, or a control character other than HT, whichever comes
+	// first. Returns end if there's neither.
+
+#if defined( __AVX2__ )
+
+	const __m256i stops	= _mm256_set1_epi8( stop );
+	const __m256i ctl	= _mm256_set1_epi8( 0x1f );
+	const __m256i del	= _mm256_set1_epi8( 0x7f );
+	const __m256i tab	= _mm256_set1_epi8( '\t' );
+
+	while ( ( end - p ) >= 32 )
+	{
+		__m256i		v		= _mm256_loadu_si256( reinterpret_cast< const __m256i* >( p ) );
+		__m256i		low		= _mm256_cmpeq_epi8( _mm256_min_epu8( v, ctl ), v );
+		__m256i		hits	= _mm256_or_si256( _mm256_cmpeq_epi8( v, stops ), _mm256_cmpeq_epi8( v, del ) );
+		unsigned	mask;
+
+		hits = _mm256_or_si256( hits, _mm256_andnot_si256( _mm256_cmpeq_epi8( v, tab ), low ) );
+		mask = static_cast< unsigned >( _mm256_movemask_epi8( hits ) );
+
+		if ( mask )
+		{
+			return p + first_bit( mask );
+		}
+
+		p += 32;
+	}
+
+#endif
+
+#if defined( __SSE4_2__ )
+
+	// Byte ranges for _mm_cmpestri: the control characters either side of
+	// HT, DEL, and stop.
+
+	const char		bounds[ 16 ]	= { '\x00', '\x08', '\x0a', '\x1f', '\x7f', '\x7f', stop, stop };
+	const __m128i	ranges			= _mm_loadu_si128( reinterpret_cast< const __m128i* >( bounds ) );
+
+	while ( ( end - p ) >= 16 )
+	{
+		__m128i	v		= _mm_loadu_si128( reinterpret_cast< const __m128i* >( p ) );
+		int		index	= _mm_cmpestri( ranges, 8, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT );
+
+		if ( index != 16 )
+		{
+			return p + index;
+		}
+
+		p += 16;
+	}
+
+#endif
+
+	for ( ; p < end; p++ )
+	{
+		unsigned char c = static_cast< unsigned char >( *p );
+
+		if ( ( c == static_cast< unsigned char >( stop ) ) || ( ( c < 0x20 ) && ( c != '\t' ) ) || ( c == 0x7f ) )
+		{
+			break;
+		}
+	}
+
+	return p;
+}
+
+
+static inline bool
+is_tchar( char c )
+{
+	return ( ( c >= 'a' ) && ( c <= 'z' ) ) || ( ( c >= 'A' ) && ( c <= 'Z' ) ) || ( ( c >= '0' ) && ( c <= '9' ) ) || ( c && strchr( "!#$%&'*+-.^_`|~", c ) );
+}
+
+
+static int
+fast_method( const char *p, std::size_t len )
+{
+	// Only the common ones. Anything else is left to http_parser.
+
+	switch ( len )
+	{
+		case 3:
+		{
+			if ( memcmp( p, "GET", 3 ) == 0 )
+			{
+				return HTTP_GET;
+			}
+			else if ( memcmp( p, "PUT", 3 ) == 0 )
+			{
+				return HTTP_PUT;
+			}
+		}
+		break;
+
+		case 4:
+		{
+			if ( memcmp( p, "HEAD", 4 ) == 0 )
+			{
+				return HTTP_HEAD;
+			}
+			else if ( memcmp( p, "POST", 4 ) == 0 )
+			{
+				return HTTP_POST;
+			}
+		}
+		break;
+
+		case 5:
+		{
+			if ( memcmp( p, "PATCH", 5 ) == 0 )
+			{
+				return HTTP_PATCH;
+			}
+		}
+		break;
+
+		case 6:
+		{
+			if ( memcmp( p, "DELETE", 6 ) == 0 )
+			{
+				return HTTP_DELETE;
+			}
+		}
+		break;
+
+		case 7:
+		{
+			if ( memcmp( p, "OPTIONS", 7 ) == 0 )
+			{
+				return HTTP_OPTIONS;
+			}
+		}
+		break;
+	}
+
+	return -1;
+}
+
+
+static bool
+has_token( string_view list, const char *token )
+{
+	std::size_t len = strlen( token );
+	std::size_t pos = 0;
+
+	while ( pos < list.size() )
+	{
+		std::size_t end = list.find_first_of( ",", pos );
+
+		if ( end == std::string::npos )
+		{
+			end = list.size();
+		}
+
+		while ( ( pos < end ) && ( ( list[ pos ] == ' ' ) || ( list[ pos ] == '\t' ) ) )
+		{
+			pos++;
+		}
+
+		std::size_t last = end;
+
+		while ( ( last > pos ) && ( ( list[ last - 1 ] == ' ' ) || ( list[ last - 1 ] == '\t' ) ) )
+		{
+			last--;
+		}
+
+		if ( ( ( last - pos ) == len ) && ( strncasecmp( list.data() + pos, token, len ) == 0 ) )
+		{
+			return true;
+		}
+
+		pos = end + 1;
+	}
+
+	return false;
+}
+
+
+static bool
+read_head( const char *p, const char *end, fast_head &head, connection::raw_headers &headers )
+{
+	// Reads a whole request head that has no body to follow. Returns false
+	// for one that isn't all there, or that has anything unusual about it,
+	// without having told anybody anything.
+
+	const char	*q		= scan( p, end, ' ' );
+	bool		ok		= false;
+
+	headers.clear();
+
+	if ( ( q == end ) || ( *q != ' ' ) || ( ( head.m_method = fast_method( p, q - p ) ) < 0 ) )
+	{
+		goto exit;
+	}
+
+	p = q + 1;
+	q = scan( p, end, ' ' );
+
+	if ( ( q == end ) || ( *q != ' ' ) || ( q == p ) )
+	{
+		goto exit;
+	}
+
+	head.m_target = string_view( p, q - p );
+	q++;
+
+	if ( ( ( end - q ) < 10 ) || ( memcmp( q, "HTTP/1.", 7 ) != 0 ) || ( ( q[ 7 ] != '0' ) && ( q[ 7 ] != '1' ) ) || ( q[ 8 ] != '\r' ) || ( q[ 9 ] != '\n' ) )
+	{
+		goto exit;
+	}
+
+	head.m_minor		= q[ 7 ] - '0';
+	head.m_keep_alive	= ( head.m_minor == 1 );
+	q += 10;
+
+	for ( ;; )
+	{
+		const char			*name = q;
+		const char			*value;
+		const char			*value_end;
+		connection::raw_header	header;
+
+		if ( ( end - q ) < 2 )
+		{
+			goto exit;
+		}
+
+		if ( *q == '\r' )
+		{
+			if ( q[ 1 ] != '\n' )
+			{
+				goto exit;
+			}
+
+			head.m_end = q + 2;
+			break;
+		}
+
+		while ( ( q < end ) && is_tchar( *q ) )
+		{
+			q++;
+		}
+
+		if ( ( q == end ) || ( *q != ':' ) || ( q == name ) )
+		{
+			goto exit;
+		}
+
+		header.m_name = string_view( name, q - name );
+
+		for ( q++; ( q < end ) && ( ( *q == ' ' ) || ( *q == '\t' ) ); q++ )
+		{
+		}
+
+		value	= q;
+		q		= scan( q, end, '\r' );
+
+		// A bare LF, a stray control character, or a line folded onto the
+		// next are all http_parser's to deal with.
+
+		if ( ( ( end - q ) < 3 ) || ( q[ 0 ] != '\r' ) || ( q[ 1 ] != '\n' ) || ( q[ 2 ] == ' ' ) || ( q[ 2 ] == '\t' ) )
+		{
+			goto exit;
+		}
+
+		for ( value_end = q; ( value_end > value ) && ( ( value_end[ -1 ] == ' ' ) || ( value_end[ -1 ] == '\t' ) ); value_end-- )
+		{
+		}
+
+		header.m_value	= string_view( value, value_end - value );
+		header.m_id		= field::intern( header.m_name.data(), header.m_name.size() );
+		q += 2;
+
+		if ( ( header.m_id == field::transfer_encoding ) || ( header.m_id == field::upgrade ) || ( ( header.m_id == field::content_length ) && ( header.m_value != "0" ) ) )
+		{
+			// There's a body, or the connection is about to change hands.
+
+			goto exit;
+		}
+		else if ( header.m_id == field::connection )
+		{
+			head.m_keep_alive = ( head.m_minor == 1 ) ? !has_token( header.m_value, "close" ) : has_token( header.m_value, "keep-alive" );
+		}
+
+		if ( !header.m_value.empty() )
+		{
+			headers.push_back( header );
+		}
+	}
+
+	ok = true;
+
+exit:
+
+	return ok;
+}
+
+
+std::size_t
+connection::parse_fast( const std::uint8_t *buf, std::size_t len, bool &done, bool &ok )
+{
+	const char		*start	= reinterpret_cast< const char* >( buf );
+	const char		*end	= start + len;
+	const char		*p		= start;
+	handler::ref	h		= m_handler;
+	fast_head		head;
+
+	done	= false;
+	ok		= true;
+
+	// A handler that pauses us wants nothing more until it resumes, just
+	// as http_parser would stop for it.
+
+	while ( ( p < end ) && !m_in_message && !paused() && ( m_handler == h ) && is_open() && read_head( p, end, head, m_raw_headers ) )
+	{
+		int rc;
+
+		m_fast_parsed++;
+
+		// The same calls, in the same order, that http_parser would have
+		// made for this message.
+
+		message_will_begin( m_parser );
+
+		m_fast				= true;
+		m_fast_method		= static_cast< std::uint8_t >( head.m_method );
+		m_fast_major		= 1;
+		m_fast_minor		= static_cast< std::uint16_t >( head.m_minor );
+		m_fast_keep_alive	= head.m_keep_alive;
+
+		extend( m_target, head.m_target.data(), head.m_target.size() );
+
+		if ( !head_fits( head.m_target.size(), false ) )
+		{
+			goto rejected;
+		}
+
+		if ( h->uri_was_received( this, head.m_target.data(), head.m_target.size() ) != 0 )
+		{
+			goto failed;
+		}
+
+		for ( auto it = m_raw_headers.begin(); it != m_raw_headers.end(); it++ )
+		{
+			raw_field f = { { it->m_name.data(), 0, it->m_name.size() }, { it->m_value.data(), 0, it->m_value.size() } };
+
+			if ( !head_fits( it->m_name.size(), true ) )
+			{
+				goto rejected;
+			}
+
+			m_fields.push_back( f );
+
+			if ( !head_fits( it->m_value.size(), false ) )
+			{
+				goto rejected;
+			}
+		}
+
+		m_in_head = false;
+
+		rc = h->raw_headers_were_received( this, m_raw_headers );
+
+		if ( ( rc < 0 ) || ( rc > 2 ) )
+		{
+			goto failed;
+		}
+
+		if ( message_was_received( m_parser ) != 0 )
+		{
+			goto failed;
+		}
+
+		p = head.m_end;
+
+		if ( !head.m_keep_alive )
+		{
+			// http_parser won't take anything after a message that ends
+			// the connection, and neither will we.
+
+			p		= end;
+			done	= true;
+			break;
+		}
+	}
+
+	return p - start;
+
+rejected:
+
+	pause();
+	h->limit_was_exceeded( this, m_rejected );
+	done = true;
+
+	return p - start;
+
+failed:
+
+	nklog( log::error, "handler failed request, closing connection" );
+	done	= true;
+	ok		= false;
+
+	return p - start;
+}
+
+
+#if defined( __APPLE__ )
+#	pragma mark connection implementation
+#endif
+
+int
+connection::handler::raw_headers_were_received( connection::ref connection, const raw_headers &headers )
+{
+	message::header &header = connection->m_header;
+
+	for ( auto it = headers.begin(); it != headers.end(); it++ )
+	{
+		header.set( it->m_name.data(), it->m_name.size(), it->m_value.data(), it->m_value.size() );
+	}
+
+	return headers_were_received( connection, header );
+}
+
+
+void
+connection::handler::limit_was_exceeded( connection::ref connection, std::uint16_t status )
+{
+	connection->close();
+}
+
+
+
+const int connection::pause_body = 2;
+bool connection::m_fast_parse = true;
+std::atomic< std::size_t > connection::m_fast_parsed( 0 );
+
+
+connection::connection( handler::ref h )
+:
+	m_in_head( false ),
+	m_secure( false ),
+	m_okay( true ),
+	m_in_message( false ),
+	m_fast( false ),
+	m_fast_method( 0 ),
+	m_fast_major( 0 ),
+	m_fast_minor( 0 ),
+	m_fast_keep_alive( false ),
+	m_detect_h2( false ),
+	m_max_head_bytes( 0 ),
+	m_max_head_fields( 0 ),
+	m_head_bytes( 0 ),
+	m_rejected( 0 ),
+	m_handler( h )
+{
+	init();
+}
+
+
+connection::~connection()
+{
+	nklog( log::verbose, "" );
+
+	if ( m_settings )
+	{
+		delete m_settings;
+	}
+	
+	if ( m_parser )
+	{
+		delete m_parser;
+	}
+}
+
+
+void
+connection::init()
+{
+	m_settings = new http_parser_settings;
+	memset( m_settings, 0, sizeof( http_parser_settings ) );
+	
+	m_parser = new http_parser;
+	memset( m_parser, 0, sizeof( http_parser ) );
+
+	m_settings->on_message_begin 	= message_will_begin;
+	m_settings->on_url				= uri_was_received;
+	m_settings->on_header_field		= header_field_was_received;
+	m_settings->on_header_value		= header_value_was_received;
+	m_settings->on_body				= body_was_received;
+	m_settings->on_headers_complete	= headers_were_received;
+	m_settings->on_message_complete	= message_was_received;
+	
+	http_parser_init( m_parser, HTTP_BOTH );
+	m_parser->data = this;
+
+	m_target.m_ptr	= nullptr;
+	m_target.m_off	= 0;
+	m_target.m_len	= 0;
+}
+
+
+void
+connection::set_secure( bool val, bool is_server )
+{
+	if ( !m_secure && val )
+	{
+		if ( is_server && m_detect_h2 )
+		{
+			// Nothing has been read yet, so an HTTP/2 preface will still
+			// be picked up.
+
+			std::vector< std::string > protocols;
+
+			protocols.push_back( "h2" );
+			protocols.push_back( "http/1.1" );
+
+			m_source->add( tls::server::create( protocols ) );
+		}
+		else if ( is_server )
+		{
+			m_source->add( tls::server::create() );
+		}
+		else
+		{
+			m_source->add( tls::client::create() );
+		}
+
+		m_secure = true;
+	}
+}
+
+
+int
+connection::method() const
+{
+	return m_fast ? m_fast_method : m_parser->method;
+}
+
+
+int
+connection::status_code() const
+{
+	return m_parser->status_code;
+}
+
+
+int
+connection::http_major() const
+{
+	return m_fast ? m_fast_major : m_parser->http_major;
+}
+
+
+int
+connection::http_minor() const
+{
+	return m_fast ? m_fast_minor : m_parser->http_minor;
+}
+
+
+bool
+connection::should_keep_alive() const
+{
+	return m_fast ? m_fast_keep_alive : ( http_should_keep_alive( m_parser ) ? true : false );
+}
+
+
+bool
+connection::put( message::ref message )
+{
+	return put( message, nullptr );
+}
+
+
+bool
+connection::put( message::ref message, put_reply_f reply )
+{
+	return put( message, message->producer(), reply );
+}
+
+
+bool
+connection::put( message::ref message, message::producer_f producer, put_reply_f reply )
+{
+	std::shared_ptr< stream > s;
+
+	message->preflight();
+
+	if ( producer )
+	{
+		s = std::make_shared< stream >();
+
+		s->m_producer	= producer;
+		s->m_reply		= reply;
+		s->m_chunked	= false;
+		s->m_close		= false;
+		s->m_in_send	= false;
+		s->m_sent		= false;
+		s->m_blocked	= false;
+
+		if ( message->heeder().find( field::content_length ) == message->heeder().end() )
+		{
+			if ( ( message->major() > 1 ) || ( ( message->major() == 1 ) && ( message->minor() >= 1 ) ) )
+			{
+				message->add_to_header( "Transfer-Encoding", "chunked" );
+				s->m_chunked = true;
+			}
+			else
+			{
+				// HTTP/1.0 has no chunking, so the end of the body is the
+				// end of the connection.
+
+				message->add_to_header( "Connection", "close" );
+				s->m_close = true;
+			}
+		}
+	}
+	
+	// The head, and the body when we have it in hand, go out in a single
+	// send.
+
+	m_obuf.clear();
+
+	message->write_prologue( m_obuf );
+	
+	for ( auto it = message->heeder().begin(); it != message->heeder().end(); it++ )
+	{
+		m_obuf += it->name();
+		m_obuf += ": ";
+		m_obuf += it->value();
+		m_obuf += "\r\n";
+	}
+			
+	m_obuf += "\r\n";
+
+	if ( !s )
+	{
+		message->write_body( m_obuf );
+	}
+
+	send( reinterpret_cast< const std::uint8_t* >( m_obuf.data() ), m_obuf.size(), [=]( int status )
+	{
+		if ( status != 0 )
+		{
+			nklog( log::error, "send failed (%)", status );
+		}
+	} );
+
+	if ( s && !s->m_chunked && !s->m_close && ( message->file() != -1 ) )
+	{
+		// Try to have the kernel send the body straight from the file. The
+		// message holds on to whoever owns the file until that is done.
+
+		bool sent = send_file( message->file(), message->file_offset(), message->file_length(), [=]( int status )
+		{
+			message::ref hold( message );
+
+			if ( reply )
+			{
+				reply( status );
+			}
+		} );
+
+		if ( sent )
+		{
+			return true;
+		}
+	}
+
+	if ( s )
+	{
+		connection::ref self( this );
+
+		message->set_wake( [=]() mutable
+		{
+			if ( !self->is_open() || !s->m_producer )
+			{
+				return false;
+			}
+
+			if ( s->m_blocked )
+			{
+				s->m_blocked = false;
+				self->pump( s );
+			}
+
+			return true;
+		} );
+
+		pump( s );
+	}
+	else if ( reply )
+	{
+		reply( 0 );
+	}
+	
+	return true;
+}
+
+
+bool
+connection::send_file( int file, std::uint64_t offset, std::uint64_t len, put_reply_f reply )
+{
+	socket *sock = dynamic_cast< socket* >( m_source.get() );
+
+	return sock && sock->raw() && sock->send_file( file, offset, static_cast< std::size_t >( len ), [=]( int status )
+	{
+		if ( reply )
+		{
+			reply( status );
+		}
+	} );
+}
+
+
+void
+connection::pump( std::shared_ptr< stream > s )
+{
+	// Room in front of the data for the chunk size line, which is written
+	// right-aligned against it once we know how much we got.
+
+	static const std::size_t	prefix	= 18;
+	static const std::size_t	size	= 16 * 1024;
+	connection::ref				self( this );
+
+	if ( s->m_buf.empty() )
+	{
+		s->m_buf.resize( prefix + size + 2 );
+	}
+
+	for ( ;; )
+	{
+		std::streamsize	produced	= s->m_producer( &s->m_buf[ prefix ], size );
+		std::size_t		start		= prefix;
+		std::size_t		len			= 0;
+		bool			last		= ( produced <= 0 );
+
+		if ( produced == message::would_block )
+		{
+			// Nothing yet. The message's wake() picks this up again.
+
+			s->m_blocked = true;
+			return;
+		}
+
+		if ( produced < 0 )
+		{
+			nklog( log::error, "body producer failed, closing connection" );
+
+			s->m_producer = nullptr;
+			close();
+
+			if ( s->m_reply )
+			{
+				s->m_reply( -1 );
+			}
+
+			return;
+		}
+
+		if ( last )
+		{
+			// Let go of whatever the producer holds on to; the message's
+			// wake() may outlive us.
+
+			s->m_producer = nullptr;
+		}
+
+		if ( s->m_chunked )
+		{
+			char		line[ prefix + 1 ];
+			std::size_t	line_len = snprintf( line, sizeof( line ), "%lx\r\n", static_cast< unsigned long >( produced ) );
+
+			start = prefix - line_len;
+			memcpy( &s->m_buf[ start ], line, line_len );
+			len = line_len + produced;
+
+			// Every chunk ends in CRLF. For the zero length one that is
+			// also the end of the (empty) trailer.
+
+			memcpy( &s->m_buf[ prefix + produced ], "\r\n", 2 );
+			len += 2;
+		}
+		else
+		{
+			len = static_cast< std::size_t >( produced );
+		}
+
+		if ( len == 0 )
+		{
+			if ( s->m_close )
+			{
+				close();
+			}
+
+			if ( s->m_reply )
+			{
+				s->m_reply( 0 );
+			}
+
+			return;
+		}
+
+		// Only ask for more once the source has taken this piece. If it
+		// completes right away we loop here instead of recursing.
+
+		s->m_in_send	= true;
+		s->m_sent		= false;
+
+		send( &s->m_buf[ start ], len, [=]( int status ) mutable
+		{
+			if ( status != 0 )
+			{
+				nklog( log::error, "send failed (%) while streaming body", status );
+
+				s->m_producer = nullptr;
+
+				if ( s->m_reply )
+				{
+					s->m_reply( status );
+				}
+			}
+			else if ( last )
+			{
+				if ( s->m_close )
+				{
+					self->close();
+				}
+
+				if ( s->m_reply )
+				{
+					s->m_reply( 0 );
+				}
+			}
+			else if ( s->m_in_send )
+			{
+				s->m_sent = true;
+			}
+			else
+			{
+				self->pump( s );
+			}
+		} );
+
+		s->m_in_send = false;
+
+		if ( last || !s->m_sent )
+		{
+			return;
+		}
+	}
+}
+
+
+void
+connection::close()
+{
+	handler::ref h = m_handler;
+
+	if ( h )
+	{
+		h->will_close( this );
+	}
+
+	sink::close();
+}
+
+
+bool
+connection::process( const std::uint8_t *buf, size_t len )
+{
+	// Hold on to the handler for the duration of this call. It is allowed
+	// to detach itself from us (see client::process_did_end()). A connection
+	// without a handler is sitting idle and shouldn't be receiving anything.
+
+	handler::ref	h = m_handler;
+	std::streamsize	processed;
+	bool			ok = true;
+
+	if ( !h )
+	{
+		nklog( log::verbose, "received % bytes on an idle connection", len );
+		return false;
+	}
+
+	if ( m_rejected )
+	{
+		// Turned away by server::adopt(). Answer whatever this is and go.
+
+		pause();
+		h->limit_was_exceeded( this, m_rejected );
+		return true;
+	}
+
+	if ( m_detect_h2 )
+	{
+		std::size_t held	= m_preface.size();
+		std::size_t n		= std::min( len, http2::preface_len - held );
+
+		if ( memcmp( buf, http2::preface + held, n ) == 0 )
+		{
+			m_preface.append( reinterpret_cast< const char* >( buf ), len );
+
+			if ( m_preface.size() >= http2::preface_len )
+			{
+				http2::connection::ref	h2 = new http2::connection( true );
+				std::string				in;
+
+				nklog( log::verbose, "switching to HTTP/2" );
+
+				in.swap( m_preface );
+				m_detect_h2 = false;
+
+				upgrade( h2.get() );
+
+				if ( !h2->accept( reinterpret_cast< const std::uint8_t* >( in.data() ), in.size() ) )
+				{
+					h2->close();
+				}
+			}
+
+			return true;
+		}
+
+		m_detect_h2 = false;
+
+		if ( held > 0 )
+		{
+			// Looked like the preface for a while, but it's HTTP/1 after all.
+
+			std::string in;
+
+			in.swap( m_preface );
+			in.append( reinterpret_cast< const char* >( buf ), len );
+
+			return process( reinterpret_cast< const std::uint8_t* >( in.data() ), in.size() );
+		}
+	}
+
+	h->process_will_begin( this );
+
+	if ( m_fast_parse && !m_in_message )
+	{
+		bool		done;
+		std::size_t	taken = parse_fast( buf, len, done, ok );
+
+		// Whatever is left is the start of something the fast parser
+		// couldn't take, or nothing at all. An empty buffer isn't passed
+		// on: to http_parser that means end of file.
+
+		if ( done || ( ( taken > 0 ) && ( taken == len ) ) )
+		{
+			h->process_did_end( this );
+			return ok;
+		}
+
+		buf += taken;
+		len -= taken;
+
+		if ( paused() )
+		{
+			// Same as a pause out of http_parser below: the rest is fed
+			// back in by resume().
+
+			m_stash.assign( buf, buf + len );
+			h->process_did_end( this );
+			return ok;
+		}
+	}
+
+	processed = http_parser_execute( m_parser, m_settings, ( const char* ) buf, len );
+
+	if ( m_rejected )
+	{
+		// A head limit stopped the parser. Don't read any more of this.
+
+		pause();
+		h->limit_was_exceeded( this, m_rejected );
+	}
+	else if ( HTTP_PARSER_ERRNO( m_parser ) == HPE_PAUSED )
+	{
+		// A handler asked us to stop. Hang on to whatever the parser didn't
+		// get to; it is fed back in by resume().
+
+		m_stash.assign( buf + processed, buf + len );
+	}
+	else if ( processed != len )
+	{
+		nklog( log::error, "http_parser_execute() failed: bytes read = %ld, processed = %ld", len, processed );
+		ok = false;
+	}
+	else if ( m_in_head )
+	{
+		// The message head isn't complete and buf is about to be reused, so
+		// copy out whatever still points into it.
+
+		spill( m_target );
+
+		for ( auto it = m_fields.begin(); it != m_fields.end(); it++ )
+		{
+			spill( it->m_name );
+			spill( it->m_value );
+		}
+	}
+
+	h->process_did_end( this );
+
+	return ok;
+}
+
+
+void
+connection::resume()
+{
+	connection::ref self( this );
+
+	if ( !is_open() )
+	{
+		return;
+	}
+
+	http_parser_pause( m_parser, 0 );
+	m_paused = false;
+
+	if ( !m_stash.empty() )
+	{
+		std::vector< std::uint8_t > stash;
+
+		stash.swap( m_stash );
+
+		if ( !process( &stash[ 0 ], stash.size() ) )
+		{
+			close();
+			return;
+		}
+	}
+
+	// Replaying the stash may have paused us again.
+
+	if ( !m_paused )
+	{
+		sink::resume();
+	}
+}
+
+
+bool
+connection::upgrade_to_ws( const request::ref &request, server::response_f reply )
+{
+	http::response::ref response;
+
+	nklog( log::verbose, "upgrading http connection to websocket" );
+
+	response = new http::response( 1, 1, http::status::switching_protocols, false );
+	response->add_to_header( "Upgrade", "websocket" );
+	response->add_to_header( "Connection", "Upgrade" );
+	response->add_to_header( "Sec-WebSocket-Accept", ws::server::accept_key( request->ws_key() ) );
+
+	reply( response, false );
+
+	m_source->add( ws::server::create() );
+
+	return true;
+}
+
+
+bool
+connection::upgrade_to_tls( const request::ref &request, server::response_f reply )
+{
+	http::response::ref response;
+
+	nklog( log::verbose, "upgrading http connection to tls" );
+
+	response = new http::response( 1, 1, http::status::switching_protocols, false );
+	response->add_to_header( "Connection", "Upgrade" );
+	response->add_to_header( "Upgrade", "TLS/1.0, HTTP/1.1" );
+
+	reply( response, false );
+
+	m_source->add( tls::server::create() );
+
+	return true;
+}
+
+
+void
+connection::upgrade( sink::ref sink )
+{
+	transfer_attrs( *sink );
+
+	sink->bind( m_source );
+
+	unbind();
+}
+
+
+int
+connection::message_will_begin( http_parser *parser )
+{
+	static const piece empty = { nullptr, 0, 0 };
+
+	connection *self = reinterpret_cast< connection* >( parser->data );
+	assert( self );
+	assert( self->m_handler );
+	
+	nklog( log::verbose, "reading new message" );
+
+	self->m_parser->upgrade = 0;
+	self->m_parse_state	= NONE;
+	self->m_in_head		= true;
+	self->m_in_message	= true;
+	self->m_fast		= false;
+	self->m_target		= empty;
+	self->m_head_bytes	= 0;
+	
+	self->m_fields.clear();
+	self->m_spill.clear();
+	self->m_header.clear();
+
+	self->m_handler->message_will_begin( self );
+	
+	return 0;
+}
+
+
+int
+connection::uri_was_received( http_parser *parser, const char *buf, size_t len )
+{
+	connection *self = reinterpret_cast< connection* >( parser->data );
+	assert( self );
+	assert( self->m_handler );
+
+	self->extend( self->m_target, buf, len );
+
+	if ( !self->head_fits( len, false ) )
+	{
+		return 1;
+	}
+
+	return self->m_handler->uri_was_received( self, buf, len );
+}
+
+
+int
+connection::header_field_was_received( http_parser *parser, const char *buf, size_t len )
+{
+	connection	*self = reinterpret_cast< connection* >( parser->data );
+	assert( self );
+	assert( self->m_handler );
+
+	if ( !self->head_fits( len, self->m_parse_state != FIELD ) )
+	{
+		return 1;
+	}
+
+	if ( self->m_parse_state != FIELD )
+	{
+		raw_field f = { { buf, 0, len }, { nullptr, 0, 0 } };
+
+		self->m_fields.push_back( f );
+		self->m_parse_state = FIELD;
+	}
+	else
+	{
+		self->extend( self->m_fields.back().m_name, buf, len );
+	}
+
+	return 0;
+}
+
+
+int
+connection::header_value_was_received( http_parser *parser, const char *buf, size_t len )
+{
+	connection *self = reinterpret_cast< connection* >( parser->data );
+	assert( self );
+	assert( self->m_handler );
+	assert( !self->m_fields.empty() );
+
+	if ( !self->head_fits( len, false ) )
+	{
+		return 1;
+	}
+
+	self->extend( self->m_fields.back().m_value, buf, len );
+	self->m_parse_state = VALUE;
+
+	return 0;
+}
+
+
+bool
+connection::head_fits( std::size_t len, bool new_field )
+{
+	// Checked as the head arrives, so an oversized one is turned away
+	// before we have buffered much of it.
+
+	m_head_bytes += len;
+
+	if ( ( m_max_head_bytes > 0 ) && ( m_head_bytes > m_max_head_bytes ) )
+	{
+		nklog( log::warning, "request head is over % bytes", m_max_head_bytes );
+		m_rejected = status::header_fields_too_large;
+	}
+	else if ( new_field && ( m_max_head_fields > 0 ) && ( m_fields.size() >= m_max_head_fields ) )
+	{
+		nklog( log::warning, "request head has more than % fields", m_max_head_fields );
+		m_rejected = status::header_fields_too_large;
+	}
+
+	return ( m_rejected == 0 );
+}
+
+	
+int
+connection::headers_were_received( http_parser *parser )
+{
+	connection *self = reinterpret_cast< connection* >( parser->data );
+	assert( self );
+	assert( self->m_handler );
+
+	self->m_in_head = false;
+	self->m_raw_headers.clear();
+
+	for ( auto it = self->m_fields.begin(); it != self->m_fields.end(); it++ )
+	{
+		if ( ( it->m_name.m_len > 0 ) && ( it->m_value.m_len > 0 ) )
+		{
+			raw_header	header;
+			string_view	name = self->resolve( it->m_name );
+
+			header.m_id		= field::intern( name.data(), name.size() );
+			header.m_name	= name;
+			header.m_value	= self->resolve( it->m_value );
+
+			self->m_raw_headers.push_back( header );
+		}
+	}
+
+	return self->m_handler->raw_headers_were_received( self, self->m_raw_headers );
+}
+
+
+void
+connection::extend( piece &p, const char *buf, std::size_t len )
+{
+	if ( p.m_len == 0 )
+	{
+		p.m_ptr = buf;
+		p.m_len = len;
+	}
+	else if ( p.m_ptr && ( ( p.m_ptr + p.m_len ) == buf ) )
+	{
+		p.m_len += len;
+	}
+	else
+	{
+		// The piece straddles two reads. Whatever we had is already in the
+		// spill buffer (see process()), and since it was the last thing put
+		// there we can simply keep appending.
+
+		spill( p );
+		assert( ( p.m_off + p.m_len ) == m_spill.size() );
+		m_spill.append( buf, len );
+		p.m_len += len;
+	}
+}
+
+
+void
+connection::spill( piece &p )
+{
+	if ( p.m_ptr )
+	{
+		p.m_off = m_spill.size();
+		m_spill.append( p.m_ptr, p.m_len );
+		p.m_ptr = nullptr;
+	}
+}
+
+	
+int
+connection::body_was_received( http_parser *parser, const char *buf, size_t len )
+{
+	connection *self = reinterpret_cast< connection* >( parser->data );
+	assert( self );
+	assert( self->m_handler );
+
+	int ret = self->m_handler->body_was_received( self, buf, len );
+
+	if ( ret == pause_body )
+	{
+		self->pause();
+		ret = 0;
+	}
+
+	if ( self->paused() )
+	{
+		http_parser_pause( parser, 1 );
+	}
+
+	return ret;
+}
+
+	
+int
+connection::message_was_received( http_parser *parser )
+{
+	connection *self = reinterpret_cast< connection* >( parser->data );
+	assert( self );
+	assert( self->m_handler );
+
+	self->m_in_message = false;
+
+	return self->m_handler->message_was_received( self );
+}
+
+
+#if defined( __APPLE__ )
+#	pragma mark compression_cache implementation
+#endif
+
+compression_cache&
+compression_cache::instance()
+{
+	static compression_cache *cache = new compression_cache;
+
+	return *cache;
+}
+
+
+compression_cache::compression_cache()
+:
+	m_bytes( 0 ),
+	m_max_bytes( 16 * 1024 * 1024 )
+{
+}
+
+
+bool
+compression_cache::get( const std::string &key, std::string &val )
+{
+	std::lock_guard< std::mutex > guard( m_mutex );
+
+	auto it = m_index.find( key );
+
+	if ( it == m_index.end() )
+	{
+		return false;
+	}
+
+	m_lru.splice( m_lru.begin(), m_lru, it->second );
+	val = it->second->m_encoded;
+
+	return true;
+}
+
+
+void
+compression_cache::put( const std::string &key, const std::string &val )
+{
+	std::lock_guard< std::mutex > guard( m_mutex );
+
+	auto		it		= m_index.find( key );
+	std::size_t	size	= key.size() + val.size();
+
+	if ( it != m_index.end() )
+	{
+		m_bytes -= it->second->m_key.size() + it->second->m_encoded.size();
+		m_lru.erase( it->second );
+		m_index.erase( it );
+	}
+
+	if ( size > m_max_bytes )
+	{
+		return;
+	}
+
+	m_lru.push_front( item() );
+	m_lru.front().m_key		= key;
+	m_lru.front().m_encoded	= val;
+	m_index[ key ]			= m_lru.begin();
+	m_bytes					+= size;
+
+	evict();
+}
+
+
+void
+compression_cache::clear()
+{
+	std::lock_guard< std::mutex > guard( m_mutex );
+
+	m_index.clear();
+	m_lru.clear();
+	m_bytes = 0;
+}
+
+
+void
+compression_cache::evict()
+{
+	while ( !m_lru.empty() && ( m_bytes > m_max_bytes ) )
+	{
+		m_bytes -= m_lru.back().m_key.size() + m_lru.back().m_encoded.size();
+		m_index.erase( m_lru.back().m_key );
+		m_lru.pop_back();
+	}
+}
+
+
+#if defined( __APPLE__ )
+#	pragma mark file_cache implementation
+#endif
+
+static const std::size_t	max_cached_files	= 1024;
+static const std::size_t	max_ranges			= 16;
+
+struct byte_range
+{
+	std::uint64_t m_first;
+	std::uint64_t m_last;
+};
+
+
+static std::time_t
+parse_date( const std::string &val )
+{
+	// Only the IMF-fixdate form. Anything else is treated as if the header
+	// wasn't there, which just means a full response.
+
+	static const char	*months		= "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char				month[ 4 ]	= { 0 };
+	const char			*found;
+	struct tm			tm;
+	std::time_t			ret			= -1;
+
+	memset( &tm, 0, sizeof( tm ) );
+
+	if ( sscanf( val.c_str(), "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, month, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec ) != 6 )
+	{
+		goto exit;
+	}
+
+	found = strstr( months, month );
+
+	if ( !found || ( strlen( month ) != 3 ) || ( ( found - months ) % 3 ) )
+	{
+		goto exit;
+	}
+
+	tm.tm_mon	= static_cast< int >( ( found - months ) / 3 );
+	tm.tm_year	-= 1900;
+
+#if defined( WIN32 )
+	ret = _mkgmtime( &tm );
+#else
+	ret = timegm( &tm );
+#endif
+
+exit:
+
+	return ret;
+}
+
+
+static bool
+etag_matches( const std::string &list, const std::string &etag )
+{
+	// Weak comparison, which is what If-None-Match calls for.
+
+	std::string	opaque	= ( etag.compare( 0, 2, "W/" ) == 0 ) ? etag.substr( 2 ) : etag;
+	std::size_t	pos		= 0;
+
+	while ( pos < list.size() )
+	{
+		std::size_t end		= list.find( ',', pos );
+		std::string	candidate;
+
+		if ( end == std::string::npos )
+		{
+			end = list.size();
+		}
+
+		candidate = list.substr( pos, end - pos );
+		candidate.erase( 0, candidate.find_first_not_of( " \t" ) );
+		candidate.erase( candidate.find_last_not_of( " \t" ) + 1 );
+
+		if ( candidate.compare( 0, 2, "W/" ) == 0 )
+		{
+			candidate.erase( 0, 2 );
+		}
+
+		if ( ( candidate == "*" ) || ( candidate == opaque ) )
+		{
+			return true;
+		}
+
+		pos = end + 1;
+	}
+
+	return false;
+}
+
+
+static int
+parse_ranges( const std::string &val, std::uint64_t size, std::vector< byte_range > &ranges )
+{
+	// Returns 1 if there are ranges to send, 0 if the header should be
+	// ignored, and -1 if none of the ranges can be satisfied.
+
+	std::size_t pos = 6;
+
+	if ( val.compare( 0, 6, "bytes=" ) != 0 )
+	{
+		return 0;
+	}
+
+	while ( pos < val.size() )
+	{
+		std::size_t		end		= val.find( ',', pos );
+		std::string		spec;
+		std::size_t		dash;
+		char			*stop;
+		byte_range		range;
+
+		if ( end == std::string::npos )
+		{
+			end = val.size();
+		}
+
+		spec = val.substr( pos, end - pos );
+		spec.erase( 0, spec.find_first_not_of( " \t" ) );
+		spec.erase( spec.find_last_not_of( " \t" ) + 1 );
+		pos = end + 1;
+
+		dash = spec.find( '-' );
+
+		if ( spec.empty() || ( dash == std::string::npos ) )
+		{
+			return 0;
+		}
+
+		if ( dash == 0 )
+		{
+			std::uint64_t suffix = strtoull( spec.c_str() + 1, &stop, 10 );
+
+			if ( *stop || ( spec.size() == 1 ) )
+			{
+				return 0;
+			}
+
+			if ( suffix == 0 )
+			{
+				continue;
+			}
+
+			range.m_first	= ( suffix < size ) ? size - suffix : 0;
+			range.m_last	= size - 1;
+		}
+		else
+		{
+			range.m_first = strtoull( spec.c_str(), &stop, 10 );
+
+			if ( stop != spec.c_str() + dash )
+			{
+				return 0;
+			}
+
+			if ( dash + 1 < spec.size() )
+			{
+				range.m_last = strtoull( spec.c_str() + dash + 1, &stop, 10 );
+
+				if ( *stop || ( range.m_last < range.m_first ) )
+				{
+					return 0;
+				}
+			}
+			else
+			{
+				range.m_last = size - 1;
+			}
+
+			if ( range.m_first >= size )
+			{
+				continue;
+			}
+
+			range.m_last = std::min( range.m_last, size - 1 );
+		}
+
+		ranges.push_back( range );
+
+		if ( ranges.size() > max_ranges )
+		{
+			// Lots of little ranges is more likely abuse than a real client.
+
+			ranges.clear();
+			return 0;
+		}
+	}
+
+	return ranges.empty() ? -1 : 1;
+}
+
+
+file_cache::entry::entry( const std::string &path, int file, std::uint64_t size, std::time_t mtime )
+:
+	m_path( path ),
+	m_file( file ),
+	m_size( size ),
+	m_mtime( mtime ),
+	m_data( nullptr )
+{
+	std::ostringstream os;
+
+	os << "\"" << std::hex << size << "-" << static_cast< std::uint64_t >( mtime ) << "\"";
+
+	m_etag			= os.str();
+	m_last_modified	= format_date( mtime );
+}
+
+
+file_cache::entry::~entry()
+{
+	if ( m_data )
+	{
+#if defined( WIN32 )
+		free( m_data );
+#else
+		munmap( m_data, static_cast< std::size_t >( m_size ) );
+#endif
+	}
+
+	if ( m_file != -1 )
+	{
+#if defined( WIN32 )
+		_close( m_file );
+#else
+		::close( m_file );
+#endif
+	}
+}
+
+
+bool
+file_cache::entry::map()
+{
+	bool ok = false;
+
+	if ( m_size == 0 )
+	{
+		goto exit;
+	}
+
+#if defined( WIN32 )
+
+	{
+		// No mmap() here, so read the whole file in. Straight from the
+		// descriptor: read() would serve it out of m_data.
+
+		std::uint8_t	*data	= reinterpret_cast< std::uint8_t* >( malloc( static_cast< std::size_t >( m_size ) ) );
+		std::uint64_t	total	= 0;
+
+		if ( !data )
+		{
+			goto exit;
+		}
+
+		_lseeki64( m_file, 0, SEEK_SET );
+
+		while ( total < m_size )
+		{
+			int n = _read( m_file, data + total, static_cast< unsigned >( std::min< std::uint64_t >( m_size - total, INT_MAX ) ) );
+
+			if ( n <= 0 )
+			{
+				break;
+			}
+
+			total += n;
+		}
+
+		if ( total != m_size )
+		{
+			nklog( log::warning, "short read of % (% of % bytes)", m_path, total, m_size );
+			free( data );
+			goto exit;
+		}
+
+		m_data = data;
+	}
+
+#else
+
+	{
+		void *addr = mmap( nullptr, static_cast< std::size_t >( m_size ), PROT_READ, MAP_SHARED, m_file, 0 );
+
+		if ( addr == MAP_FAILED )
+		{
+			nklog( log::warning, "unable to map % (%)", m_path, errno );
+			goto exit;
+		}
+
+		m_data = reinterpret_cast< std::uint8_t* >( addr );
+	}
+
+#endif
+
+	ok = true;
+
+exit:
+
+	return ok;
+}
+
+
+std::size_t
+file_cache::entry::read( std::uint64_t offset, std::uint8_t *buf, std::size_t len ) const
+{
+	std::size_t total = 0;
+
+	if ( m_data )
+	{
+		memcpy( buf, m_data + offset, len );
+		total = len;
+		goto exit;
+	}
+
+	while ( total < len )
+	{
+#if defined( WIN32 )
+		_lseeki64( m_file, offset + total, SEEK_SET );
+
+		int n = _read( m_file, buf + total, static_cast< unsigned >( len - total ) );
+#else
+		ssize_t n = pread( m_file, buf + total, len - total, static_cast< off_t >( offset + total ) );
+#endif
+
+		if ( n <= 0 )
+		{
+			break;
+		}
+
+		total += n;
+	}
+
+exit:
+
+	return total;
+}
+
+
+file_cache&
+file_cache::instance()
+{
+	static file_cache *cache = new file_cache;
+
+	return *cache;
+}
+
+
+file_cache::file_cache()
+:
+	m_bytes( 0 ),
+	m_max_bytes( 64 * 1024 * 1024 ),
+	m_max_file_size( 8 * 1024 * 1024 )
+{
+}
+
+
+file_cache::entry::ref
+file_cache::get( const std::string &path )
+{
+	std::lock_guard< std::mutex > guard( m_mutex );
+
+	auto		it = m_index.find( path );
+	struct stat	st;
+	entry::ref	e;
+	int			file;
+
+	if ( ( stat( path.c_str(), &st ) != 0 ) || ( ( st.st_mode & S_IFMT ) != S_IFREG ) )
+	{
+		if ( it != m_index.end() )
+		{
+			erase( it );
+		}
+
+		goto exit;
+	}
+
+	if ( it != m_index.end() )
+	{
+		entry::ref cached = *it->second;
+
+		if ( ( cached->size() == static_cast< std::uint64_t >( st.st_size ) ) && ( cached->mtime() == st.st_mtime ) )
+		{
+			m_lru.splice( m_lru.begin(), m_lru, it->second );
+			e = cached;
+			goto exit;
+		}
+
+		erase( it );
+	}
+
+#if defined( WIN32 )
+	file = _open( path.c_str(), _O_RDONLY | _O_BINARY );
+#else
+	file = open( path.c_str(), O_RDONLY );
+#endif
+
+	if ( file < 0 )
+	{
+		nklog( log::warning, "unable to open % (%)", path, errno );
+		goto exit;
+	}
+
+	e = new entry( path, file, st.st_size, st.st_mtime );
+
+	if ( ( e->size() <= m_max_file_size ) && e->map() )
+	{
+		m_bytes += e->size();
+	}
+
+	m_lru.push_front( e );
+	m_index[ path ] = m_lru.begin();
+
+	evict();
+
+exit:
+
+	return e;
+}
+
+
+void
+file_cache::clear()
+{
+	std::lock_guard< std::mutex > guard( m_mutex );
+
+	m_index.clear();
+	m_lru.clear();
+	m_bytes = 0;
+}
+
+
+void
+file_cache::evict()
+{
+	// Entries still being sent hold their own reference, so dropping them
+	// here never pulls a mapping out from under a response.
+
+	while ( ( m_lru.size() > 1 ) && ( ( m_bytes > m_max_bytes ) || ( m_lru.size() > max_cached_files ) ) )
+	{
+		erase( m_index.find( m_lru.back()->path() ) );
+	}
+}
+
+
+void
+file_cache::erase( index::iterator it )
+{
+	entry::ref e = *it->second;
+
+	if ( e->data() )
+	{
+		m_bytes -= e->size();
+	}
+
+	m_lru.erase( it->second );
+	m_index.erase( it );
+}
+
+
+// These live in the namespace so they can lean on its names the way the
+// member functions do.
+
+namespace netkit {
+
+namespace http {
+
+static void
+serve_ranges( file_cache::entry::ref entry, const std::vector< byte_range > &ranges, response::ref response, bool head )
+{
+	// Each part is a text header followed by a slice of the file. The
+	// closing delimiter is a part with no slice.
+
+	struct part
+	{
+		std::string		m_text;
+		std::uint64_t	m_offset;
+		std::uint64_t	m_len;
+	};
+
+	struct state
+	{
+		std::vector< part >	m_parts;
+		std::size_t			m_index;
+		std::uint64_t		m_done;
+	};
+
+	static std::uint32_t		counter		= 0;
+	std::shared_ptr< state >	s			= std::make_shared< state >();
+	std::string					type		= response->find_in_header( field::content_type );
+	std::uint64_t				total		= 0;
+	std::ostringstream			boundary;
+
+	boundary << "NetKit" << std::hex << static_cast< std::uint64_t >( time( nullptr ) ) << ++counter;
+
+	for ( auto it = ranges.begin(); it != ranges.end(); it++ )
+	{
+		std::ostringstream	os;
+		part				p;
+
+		os << "\r\n--" << boundary.str() << "\r\nContent-Type: " << type << "\r\nContent-Range: bytes " << it->m_first << "-" << it->m_last << "/" << entry->size() << "\r\n\r\n";
+
+		p.m_text	= os.str();
+		p.m_offset	= it->m_first;
+		p.m_len		= it->m_last - it->m_first + 1;
+
+		total += p.m_text.size() + p.m_len;
+		s->m_parts.push_back( p );
+	}
+
+	part last = { "\r\n--" + boundary.str() + "--\r\n", 0, 0 };
+
+	total += last.m_text.size();
+	s->m_parts.push_back( last );
+	s->m_index	= 0;
+	s->m_done	= 0;
+
+	response->set_status( status::partial_content );
+	response->remove_from_header( "Content-Type" );
+	response->add_to_header( "Content-Type", "multipart/byteranges; boundary=" + boundary.str() );
+	response->add_to_header( "Content-Length", std::to_string( total ) );
+
+	if ( head )
+	{
+		return;
+	}
+
+	response->set_producer( [=]( std::uint8_t *buf, std::size_t len ) -> std::streamsize
+	{
+		std::size_t n = 0;
+
+		while ( ( n < len ) && ( s->m_index < s->m_parts.size() ) )
+		{
+			const part		&p		= s->m_parts[ s->m_index ];
+			std::uint64_t	size	= p.m_text.size() + p.m_len;
+			std::size_t		chunk	= static_cast< std::size_t >( std::min< std::uint64_t >( len - n, size - s->m_done ) );
+
+			if ( s->m_done < p.m_text.size() )
+			{
+				chunk = std::min< std::size_t >( chunk, p.m_text.size() - static_cast< std::size_t >( s->m_done ) );
+				memcpy( buf + n, p.m_text.data() + s->m_done, chunk );
+			}
+			else if ( entry->read( p.m_offset + s->m_done - p.m_text.size(), buf + n, chunk ) != chunk )
+			{
+				nklog( log::error, "short read from %", entry->path() );
+				return -1;
+			}
+
+			n			+= chunk;
+			s->m_done	+= chunk;
+
+			if ( s->m_done == size )
+			{
+				s->m_index++;
+				s->m_done = 0;
+			}
+		}
+
+		return n;
+	} );
+}
+
+
+static int
+serve_file( const std::string &prefix, const std::string &root, request::ref request, server::response_f reply )
+{
+	std::string					path	= request->uri()->path();
+	bool						head	= ( request->method() == method::head );
+	file_cache::entry::ref		entry;
+	response::ref				response;
+	std::vector< byte_range >	ranges;
+	std::string					val;
+	std::time_t					since;
+	std::size_t					pos;
+	int							ret		= 0;
+
+	if ( path.compare( 0, prefix.size(), prefix ) == 0 )
+	{
+		path.erase( 0, prefix.size() );
+	}
+
+	// Nothing is allowed to climb out of root.
+
+	for ( pos = 0; pos < path.size(); )
+	{
+		std::size_t end = path.find_first_of( "/\\", pos );
+
+		if ( end == std::string::npos )
+		{
+			end = path.size();
+		}
+
+		if ( path.compare( pos, end - pos, ".." ) == 0 )
+		{
+			response = new http::response( request->major(), request->minor(), status::forbidden, true );
+			goto exit;
+		}
+
+		pos = end + 1;
+	}
+
+	if ( path.empty() || ( path.back() == '/' ) )
+	{
+		path += "index.html";
+	}
+
+	if ( path[ 0 ] != '/' )
+	{
+		path.insert( 0, "/" );
+	}
+
+	entry = file_cache::instance().get( root + path );
+
+	if ( !entry )
+	{
+		response = new http::response( request->major(), request->minor(), status::not_found, true );
+		goto exit;
+	}
+
+	response = new http::response( request->major(), request->minor(), status::ok, true );
+	response->add_to_header( "ETag", entry->etag() );
+	response->add_to_header( "Last-Modified", entry->last_modified() );
+	response->add_to_header( "Accept-Ranges", "bytes" );
+
+	// If-None-Match wins over If-Modified-Since when both are present.
+
+	val = request->find_in_header( field::if_none_match );
+
+	if ( !val.empty() )
+	{
+		if ( etag_matches( val, entry->etag() ) )
+		{
+			response->set_status( status::not_modified );
+			goto exit;
+		}
+	}
+	else if ( !( val = request->find_in_header( field::if_modified_since ) ).empty() )
+	{
+		since = parse_date( val );
+
+		if ( ( since != -1 ) && ( entry->mtime() <= since ) )
+		{
+			response->set_status( status::not_modified );
+			goto exit;
+		}
+	}
+
+	response->add_to_header( "Content-Type", mime::from_extension( path.substr( path.find_last_of( "./" ) + 1 ) ) );
+
+	val = request->find_in_header( field::range );
+
+	if ( !val.empty() )
+	{
+		std::string if_range = request->find_in_header( field::if_range );
+
+		// A stale If-Range means the client wants the whole thing.
+
+		if ( if_range.empty() || ( if_range == entry->etag() ) || ( parse_date( if_range ) == entry->mtime() ) )
+		{
+			ret = parse_ranges( val, entry->size(), ranges );
+		}
+	}
+
+	if ( ret < 0 )
+	{
+		std::ostringstream os;
+
+		os << "bytes */" << entry->size();
+		response->set_status( status::requested_range );
+		response->add_to_header( "Content-Range", os.str() );
+		ret = 0;
+		goto exit;
+	}
+
+	if ( ranges.size() > 1 )
+	{
+		serve_ranges( entry, ranges, response, head );
+	}
+	else
+	{
+		std::uint64_t first	= ranges.empty() ? 0 : ranges[ 0 ].m_first;
+		std::uint64_t len	= ranges.empty() ? entry->size() : ranges[ 0 ].m_last - first + 1;
+
+		if ( !ranges.empty() )
+		{
+			std::ostringstream os;
+
+			os << "bytes " << first << "-" << ( first + len - 1 ) << "/" << entry->size();
+			response->set_status( status::partial_content );
+			response->add_to_header( "Content-Range", os.str() );
+		}
+
+		response->add_to_header( "Content-Length", std::to_string( len ) );
+
+		if ( !head && ( len > 0 ) )
+		{
+			std::shared_ptr< std::uint64_t > offset = std::make_shared< std::uint64_t >( first );
+			std::uint64_t end = first + len;
+
+			// The file is the fast path. The producer is there for sources
+			// that can't take it, and it keeps the entry alive either way.
+
+			response->set_file( entry->file(), first, len );
+			response->set_producer( [=]( std::uint8_t *buf, std::size_t size ) -> std::streamsize
+			{
+				std::size_t n = static_cast< std::size_t >( std::min< std::uint64_t >( size, end - *offset ) );
+
+				if ( n == 0 )
+				{
+					return 0;
+				}
+
+				if ( entry->read( *offset, buf, n ) != n )
+				{
+					nklog( log::error, "short read from %", entry->path() );
+					return -1;
+				}
+
+				*offset += n;
+
+				return n;
+			} );
+		}
+	}
+
+	ret = 0;
+
+exit:
+
+	if ( ( response->status() != status::ok ) && ( response->status() != status::partial_content ) && ( response->status() != status::not_modified ) )
+	{
+		response->add_to_header( "Content-Length", "0" );
+	}
+
+	reply( response, false );
+
+	return ret;
+}
+
+}
+
+}
+
+
+#if defined( __APPLE__ )
+#	pragma mark event_channel implementation
+#endif
+
+static std::string
+one_line( const std::string &val )
+{
+	// A line break in an id or event name would start a field of its own.
+
+	return val.substr( 0, val.find_first_of( "\r\n" ) );
+}
+
+
+event_channel::event_channel( std::size_t max_queued, overflow policy )
+:
+	m_max_queued( max_queued ),
+	m_policy( policy ),
+	m_dropped( 0 )
+{
+}
+
+
+event_channel::~event_channel()
+{
+	close();
+}
+
+
+void
+event_channel::publish( const std::string &data, const std::string &event, const std::string &id )
+{
+	std::shared_ptr< struct event >	e = std::make_shared< struct event >();
+	std::size_t						pos = 0;
+
+	e->m_type	= one_line( event );
+	e->m_ping	= false;
+
+	e->m_wire.reserve( data.size() + e->m_type.size() + id.size() + 32 );
+
+	if ( !id.empty() )
+	{
+		e->m_wire += "id: ";
+		e->m_wire += one_line( id );
+		e->m_wire += "\n";
+	}
+
+	if ( !e->m_type.empty() )
+	{
+		e->m_wire += "event: ";
+		e->m_wire += e->m_type;
+		e->m_wire += "\n";
+	}
+
+	// Every line of data gets a field of its own, whatever it ended in.
+
+	do
+	{
+		std::size_t end = data.find_first_of( "\r\n", pos );
+
+		if ( end == std::string::npos )
+		{
+			end = data.size();
+		}
+
+		e->m_wire += "data: ";
+		e->m_wire.append( data, pos, end - pos );
+		e->m_wire += "\n";
+
+		if ( ( end < data.size() ) && ( data[ end ] == '\r' ) && ( ( end + 1 ) < data.size() ) && ( data[ end + 1 ] == '\n' ) )
+		{
+			end++;
+		}
+
+		pos = end + 1;
+	}
+	while ( pos <= data.size() );
+
+	e->m_wire += "\n";
+
+	deliver( e );
+}
+
+
+void
+event_channel::ping()
+{
+	std::shared_ptr< event > e = std::make_shared< event >();
+
+	e->m_wire	= ":\n\n";
+	e->m_ping	= true;
+
+	deliver( e );
+}
+
+
+void
+event_channel::close()
+{
+	list subscribers;
+
+	subscribers.swap( m_subscribers );
+
+	for ( auto it = subscribers.begin(); it != subscribers.end(); it++ )
+	{
+		( *it )->m_closed = true;
+		( *it )->m_response->wake();
+		( *it )->m_response = nullptr;
+	}
+}
+
+
+message::producer_f
+event_channel::subscribe( response::ref response )
+{
+	std::shared_ptr< subscriber > s = std::make_shared< subscriber >();
+
+	s->m_response	= response;
+	s->m_front_pos	= 0;
+	s->m_queued		= 0;
+	s->m_closed		= false;
+	s->m_failed		= false;
+
+	m_subscribers.push_back( s );
+
+	// The connection pulls whatever is queued into its own buffer, so a
+	// subscriber that has fallen behind gets several events in one write.
+
+	return [=]( std::uint8_t *buf, std::size_t len ) -> std::streamsize
+	{
+		std::size_t n = 0;
+
+		if ( s->m_failed )
+		{
+			return -1;
+		}
+
+		while ( ( n < len ) && !s->m_queue.empty() )
+		{
+			const std::string	&wire	= s->m_queue.front()->m_wire;
+			std::size_t			take	= std::min( len - n, wire.size() - s->m_front_pos );
+
+			memcpy( buf + n, wire.data() + s->m_front_pos, take );
+
+			n				+= take;
+			s->m_front_pos	+= take;
+			s->m_queued		-= take;
+
+			if ( s->m_front_pos == wire.size() )
+			{
+				s->m_queue.pop_front();
+				s->m_front_pos = 0;
+			}
+		}
+
+		if ( n > 0 )
+		{
+			return static_cast< std::streamsize >( n );
+		}
+
+		return s->m_closed ? 0 : message::would_block;
+	};
+}
+
+
+void
+event_channel::deliver( event_ref e )
+{
+	for ( auto it = m_subscribers.begin(); it != m_subscribers.end(); )
+	{
+		subscriber &s = **it;
+
+		s.m_queue.push_back( e );
+		s.m_queued += e->m_wire.size();
+
+		if ( s.m_queued > m_max_queued )
+		{
+			trim( s );
+		}
+
+		// The subscriber goes once nobody is sending its stream any more.
+		// Letting go of the response is what frees the connection's side.
+
+		if ( !s.m_response->wake() || s.m_failed )
+		{
+			s.m_response = nullptr;
+			it = m_subscribers.erase( it );
+		}
+		else
+		{
+			it++;
+		}
+	}
+}
+
+
+void
+event_channel::trim( subscriber &s )
+{
+	// An event the connection has started on has to go out whole, so the
+	// front one is off limits once any of it is gone.
+
+	std::size_t first = ( s.m_front_pos > 0 ) ? 1 : 0;
+
+	if ( m_policy == overflow::close )
+	{
+		nklog( log::warning, "event subscriber is % bytes behind, closing", s.m_queued );
+		s.m_failed = true;
+		return;
+	}
+
+	if ( m_policy == overflow::compact )
+	{
+		std::deque< event_ref >	kept;
+		std::vector< std::string >	seen;
+
+		// Walk back from the newest. A ping behind anything else is
+		// pointless, and only the newest event of each type survives.
+
+		for ( std::size_t i = s.m_queue.size(); i > first; i-- )
+		{
+			const event_ref &e = s.m_queue[ i - 1 ];
+
+			if ( e->m_ping ? !kept.empty() : ( std::find( seen.begin(), seen.end(), e->m_type ) != seen.end() ) )
+			{
+				s.m_queued -= e->m_wire.size();
+				m_dropped++;
+				continue;
+			}
+
+			if ( !e->m_ping )
+			{
+				seen.push_back( e->m_type );
+			}
+
+			kept.push_front( e );
+		}
+
+		if ( first )
+		{
+			kept.push_front( s.m_queue.front() );
+		}
+
+		s.m_queue.swap( kept );
+	}
+
+	while ( ( s.m_queued > m_max_queued ) && ( s.m_queue.size() > first ) )
+	{
+		auto it = s.m_queue.begin() + first;
+
+		s.m_queued -= ( *it )->m_wire.size();
+		s.m_queue.erase( it );
+		m_dropped++;
+	}
+}
+
+
+#if defined( __APPLE__ )
+#	pragma mark multipart implementation
+#endif
+
+// Roomy enough for any sane set of part headers. A head that grows past
+// this is taken to be garbage.
+
+const std::size_t multipart::m_max_head = 16 * 1024;
+
+
+// Finds parameter name in a header value of the form "token; a=b; c="d"",
+// undoing quoted-string escapes.
+
+static bool
+find_param( const std::string &value, const char *name, std::string &out )
+{
+	std::size_t len = strlen( name );
+	std::size_t pos = value.find( ';' );
+
+	while ( pos != std::string::npos )
+	{
+		std::size_t start;
+		std::size_t end;
+		std::string val;
+
+		pos = value.find_first_not_of( " \t", pos + 1 );
+
+		if ( pos == std::string::npos )
+		{
+			break;
+		}
+
+		start	= pos;
+		pos		= value.find_first_of( "=;", pos );
+		end		= ( pos == std::string::npos ) ? value.size() : pos;
+
+		while ( ( end > start ) && ( ( value[ end - 1 ] == ' ' ) || ( value[ end - 1 ] == '\t' ) ) )
+		{
+			end--;
+		}
+
+		if ( ( pos == std::string::npos ) || ( value[ pos ] == ';' ) )
+		{
+			continue;
+		}
+
+		pos = value.find_first_not_of( " \t", pos + 1 );
+
+		if ( ( pos != std::string::npos ) && ( value[ pos ] == '"' ) )
+		{
+			for ( pos++; ( pos < value.size() ) && ( value[ pos ] != '"' ); pos++ )
+			{
+				if ( ( value[ pos ] == '\\' ) && ( ( pos + 1 ) < value.size() ) )
+				{
+					pos++;
+				}
+
+				val += value[ pos ];
+			}
+
+			pos = value.find( ';', pos );
+		}
+		else if ( pos != std::string::npos )
+		{
+			std::size_t last = value.find( ';', pos );
+
+			val = value.substr( pos, ( last == std::string::npos ) ? std::string::npos : last - pos );
+			val.erase( val.find_last_not_of( " \t" ) + 1 );
+			pos = last;
+		}
+
+		if ( ( ( end - start ) == len ) && ( strncasecmp( value.c_str() + start, name, len ) == 0 ) )
+		{
+			out = val;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+std::string
+multipart::part::content_type() const
+{
+	auto it = m_header.find( field::content_type );
+
+	return ( it != m_header.end() ) ? it->value() : std::string( "text/plain" );
+}
+
+
+std::string
+multipart::boundary( const std::string &content_type )
+{
+	std::string ret;
+
+	if ( ( strncasecmp( content_type.c_str(), "multipart/", 10 ) != 0 ) || !find_param( content_type, "boundary", ret ) )
+	{
+		return std::string();
+	}
+
+	// RFC 2046 caps it at 70 characters. A CR or LF in it would break the
+	// scan, which counts on CR only ever starting a delimiter.
+
+	if ( ret.empty() || ( ret.size() > 70 ) || ( ret.find_first_of( "\r\n" ) != std::string::npos ) )
+	{
+		return std::string();
+	}
+
+	return ret;
+}
+
+
+// The first delimiter needn't follow a CRLF, so the preamble starts out
+// as if it had just seen one.
+
+multipart::multipart( const std::string &boundary, part_will_begin_f wb, part_body_f body, part_did_end_f de )
+:
+	m_delimiter( "\r\n--" + boundary ),
+	m_carry( "\r\n" ),
+	m_wb( wb ),
+	m_body( body ),
+	m_de( de ),
+	m_state( state::preamble ),
+	m_in_part( false ),
+	m_failed( false )
+{
+	m_part.m_is_file = false;
+}
+
+
+multipart::~multipart()
+{
+}
+
+
+bool
+multipart::write( const std::uint8_t *buf, std::size_t len )
+{
+	const std::uint8_t	*p		= buf;
+	const std::uint8_t	*end	= buf + len;
+
+	while ( ( p < end ) && !m_failed )
+	{
+		switch ( m_state )
+		{
+			case state::preamble:
+			case state::body:
+			{
+				if ( scan( p, end ) && !m_failed )
+				{
+					if ( m_in_part )
+					{
+						m_in_part = false;
+
+						if ( m_de && ( m_de( m_part ) != 0 ) )
+						{
+							m_failed = true;
+						}
+					}
+
+					m_state = state::delimiter;
+				}
+			}
+			break;
+
+			case state::delimiter:
+			{
+				m_state = ( *p == '-' ) ? state::close : state::padding;
+
+				if ( m_state == state::close )
+				{
+					p++;
+				}
+			}
+			break;
+
+			case state::close:
+			{
+				if ( *p++ == '-' )
+				{
+					m_state = state::done;
+				}
+				else
+				{
+					nklog( log::warning, "malformed multipart close delimiter" );
+					m_failed = true;
+				}
+			}
+			break;
+
+			case state::padding:
+			{
+				std::uint8_t c = *p++;
+
+				if ( c == '\r' )
+				{
+					m_state = state::crlf;
+				}
+				else if ( ( c != ' ' ) && ( c != '\t' ) )
+				{
+					nklog( log::warning, "multipart delimiter followed by garbage" );
+					m_failed = true;
+				}
+			}
+			break;
+
+			case state::crlf:
+			{
+				if ( *p++ == '\n' )
+				{
+					m_head.clear();
+					m_state = state::headers;
+				}
+				else
+				{
+					nklog( log::warning, "multipart delimiter not followed by CRLF" );
+					m_failed = true;
+				}
+			}
+			break;
+
+			case state::headers:
+			{
+				const std::uint8_t	*lf = reinterpret_cast< const std::uint8_t* >( memchr( p, '\n', end - p ) );
+				std::size_t			n	= lf ? ( lf - p + 1 ) : ( end - p );
+
+				if ( ( m_head.size() + n ) > m_max_head )
+				{
+					nklog( log::warning, "multipart part headers too large" );
+					m_failed = true;
+					break;
+				}
+
+				m_head.append( reinterpret_cast< const char* >( p ), n );
+				p += n;
+
+				if ( lf && ( ( m_head == "\r\n" ) || ( ( m_head.size() >= 4 ) && ( m_head.compare( m_head.size() - 4, 4, "\r\n\r\n" ) == 0 ) ) ) )
+				{
+					if ( !parse_headers() )
+					{
+						m_failed = true;
+						break;
+					}
+
+					m_in_part	= true;
+					m_state		= state::body;
+					m_carry.clear();
+
+					if ( m_wb && ( m_wb( m_part ) != 0 ) )
+					{
+						m_failed = true;
+					}
+				}
+			}
+			break;
+
+			case state::done:
+			{
+				p = end;
+			}
+			break;
+		}
+	}
+
+	return !m_failed;
+}
+
+
+bool
+multipart::scan( const std::uint8_t *&p, const std::uint8_t *end )
+{
+	const char			*delim	= m_delimiter.c_str();
+	std::size_t			dlen	= m_delimiter.size();
+	const std::uint8_t	*start;
+
+	// Finish off a delimiter that straddled the last write. CR only ever
+	// starts the delimiter, so when this turns out not to be one none of
+	// what was held back can start one either.
+
+	while ( !m_carry.empty() && ( p < end ) )
+	{
+		if ( *p == static_cast< std::uint8_t >( delim[ m_carry.size() ] ) )
+		{
+			m_carry += static_cast< char >( *p++ );
+
+			if ( m_carry.size() == dlen )
+			{
+				m_carry.clear();
+				return true;
+			}
+		}
+		else
+		{
+			std::string held;
+
+			held.swap( m_carry );
+
+			if ( !emit( reinterpret_cast< const std::uint8_t* >( held.data() ), held.size() ) )
+			{
+				return false;
+			}
+		}
+	}
+
+	// memchr() is vectorized in every libc worth using, and CR is rare in
+	// most uploads, so this spends its time in there.
+
+	start = p;
+
+	while ( p < end )
+	{
+		const std::uint8_t	*cr = reinterpret_cast< const std::uint8_t* >( memchr( p, '\r', end - p ) );
+		std::size_t			n;
+
+		if ( !cr )
+		{
+			break;
+		}
+
+		n = std::min< std::size_t >( end - cr, dlen );
+
+		if ( memcmp( cr, delim, n ) == 0 )
+		{
+			if ( !emit( start, cr - start ) )
+			{
+				return false;
+			}
+
+			if ( n == dlen )
+			{
+				p = cr + n;
+				return true;
+			}
+
+			m_carry.assign( reinterpret_cast< const char* >( cr ), n );
+			p = end;
+
+			return false;
+		}
+
+		p = cr + 1;
+	}
+
+	p = end;
+
+	emit( start, end - start );
+
+	return false;
+}
+
+
+bool
+multipart::emit( const std::uint8_t *buf, std::size_t len )
+{
+	if ( ( len > 0 ) && m_in_part && m_body && ( m_body( m_part, buf, len ) != 0 ) )
+	{
+		m_failed = true;
+	}
+
+	return !m_failed;
+}
+
+
+bool
+multipart::parse_headers()
+{
+	std::size_t pos = 0;
+
+	m_part = part();
+	m_part.m_is_file = false;
+
+	while ( pos < m_head.size() )
+	{
+		std::size_t eol = m_head.find( "\r\n", pos );
+		std::size_t colon;
+		std::size_t vstart;
+		std::size_t vend;
+
+		if ( eol == pos )
+		{
+			break;
+		}
+
+		colon = m_head.find( ':', pos );
+
+		if ( ( eol == std::string::npos ) || ( colon == std::string::npos ) || ( colon > eol ) || ( colon == pos ) || ( m_head[ pos ] == ' ' ) || ( m_head[ pos ] == '\t' ) )
+		{
+			nklog( log::warning, "malformed multipart part header" );
+			return false;
+		}
+
+		vstart	= m_head.find_first_not_of( " \t", colon + 1 );
+		vend	= eol;
+
+		if ( ( vstart == std::string::npos ) || ( vstart > eol ) )
+		{
+			vstart = eol;
+		}
+
+		while ( ( vend > vstart ) && ( ( m_head[ vend - 1 ] == ' ' ) || ( m_head[ vend - 1 ] == '\t' ) ) )
+		{
+			vend--;
+		}
+
+		m_part.m_header.set( m_head.c_str() + pos, colon - pos, m_head.c_str() + vstart, vend - vstart );
+
+		pos = eol + 2;
+	}
+
+	auto it = m_part.m_header.find( field::content_disposition );
+
+	if ( it != m_part.m_header.end() )
+	{
+		find_param( it->value(), "name", m_part.m_name );
+		m_part.m_is_file = find_param( it->value(), "filename", m_part.m_filename );
+	}
+
+	return true;
+}
+
+
+#if defined( __APPLE__ )
+#	pragma mark server implementation
+#endif
+
+// A body isn't judged against server::min_body_rate() until it has had
+// this long to get going.
+
+static const std::int64_t body_rate_grace = 5000;
+
+server::router::ref			server::m_routes;
+std::mutex					server::m_routes_mutex;
+std::size_t					server::m_compression_threshold = 1024;
+std::time_t					server::m_header_timeout = 0;
+std::size_t					server::m_min_body_rate = 0;
+std::size_t					server::m_max_header_bytes = 32 * 1024;
+std::size_t					server::m_max_headers = 100;
+std::size_t					server::m_max_connections = 0;
+std::atomic< std::size_t >	server::m_connection_count( 0 );
+std::vector< std::string >	server::m_compressible_types = { "text/", "application/json", "application/javascript", "application/xml", "image/svg+xml" };
+
+netkit::sink::ref
+server::adopt( netkit::source::ref source )
+{
+	registry			*r				= &local();
+	connection::list	*connections	= &r->m_connections;
+	connection			*sink;
+	bool				counted			= true;
+	
+	sink = new connection( new server::handler );
+	sink->m_detect_h2		= true;
+	sink->m_max_head_bytes	= m_max_header_bytes;
+	sink->m_max_head_fields	= m_max_headers;
+
+	if ( ( ++m_connection_count > m_max_connections ) && ( m_max_connections > 0 ) )
+	{
+		// It still gets read from, so the client hears why, and the sweep
+		// closes it if it never says anything.
+
+		nklog( log::warning, "already have % connections, turning one away", m_max_connections );
+		m_connection_count--;
+		sink->m_rejected	= status::service_unavailable;
+		counted				= false;
+	}
+
+	auto it = connections->insert( connections->end(), sink );
+
+	sink->on_close( nullptr, [=]() mutable
+	{
+		connections->erase( it );
+
+		if ( counted )
+		{
+			m_connection_count--;
+		}
+	} );
+
+	if ( !r->m_sweeping && ( ( m_header_timeout > 0 ) || ( m_min_body_rate > 0 ) ) )
+	{
+		// The sweep runs on the thread whose connections it looks at.
+
+		r->m_runloop	= runloop::current();
+		r->m_sweeping	= true;
+		sweep( r );
+	}
+	
+	return sink;
+}
+
+
+void
+server::sweep( registry *r )
+{
+	// One timer for every connection on this thread rather than one each.
+	// It ticks often enough to catch a short header timeout, and stops
+	// when there is nothing left to watch.
+
+	std::time_t tick = ( m_header_timeout > 0 ) ? std::max< std::time_t >( 50, std::min< std::time_t >( 1000, m_header_timeout / 2 ) ) : 1000;
+
+	r->m_runloop->schedule_oneshot_timer( tick, [=]( runloop::event e )
+	{
+		auto							now = std::chrono::steady_clock::now();
+		std::vector< connection::ref >	connections( r->m_connections.begin(), r->m_connections.end() );
+
+		for ( auto it = connections.begin(); it != connections.end(); it++ )
+		{
+			handler::ref h = dynamic_cast< handler* >( ( *it )->handler().get() );
+
+			if ( h && ( *it )->is_open() )
+			{
+				h->check_limits( *it, now );
+			}
+		}
+
+		if ( !r->m_connections.empty() && ( ( m_header_timeout > 0 ) || ( m_min_body_rate > 0 ) ) )
+		{
+			sweep( r );
+		}
+		else
+		{
+			r->m_sweeping = false;
+		}
+	} );
+}
+
+
+server::registry&
+server::local()
+{
+	// One per thread that has ever adopted a connection. Like the list it
+	// replaced, it is never freed.
+
+	static NETKIT_THREAD_LOCAL registry *r = nullptr;
+
+	if ( !r )
+	{
+		r = new registry;
+	}
+
+	return *r;
+}
+
+	
+server::binding::ref
+server::bind( std::uint8_t m, const std::string &path, const std::string &type, request_f r )
+{
+	binding::ref b = new binding( path, type, r );
+	
+	bind( m, b );
+
+	return b;
+}
+
+
+server::binding::ref
+server::bind( std::uint8_t m, const std::string &path, const std::string &type, request_body_was_received_f rbwr, request_f r )
+{
+	binding::ref b = new binding( path, type, rbwr, r );
+	
+	bind( m, b );
+
+	return b;
+}
+
+
+server::binding::ref
+server::bind( std::uint8_t m, const std::string &path, const std::string &type, request_will_begin_f rwb, request_body_was_received_f rbwr, request_f r )
+{
+	binding::ref b = new binding( path, type, rwb, rbwr, r );
+	
+	bind( m, b );
+
+	return b;
+}
+
+
+void
+server::bind( std::uint8_t m, const std::string &path, netkit::sink::ref s )
+{
+//	binding::ref b = new binding( path, s );
+	
+//	bind( m, b );
+}
+
+
+void
+server::bind( std::uint8_t m, binding::ref b )
+{
+	std::lock_guard< std::mutex >	guard( m_routes_mutex );
+	router::ref						current = std::atomic_load( &m_routes );
+
+	std::atomic_store( &m_routes, current ? current->with( m, b ) : router().with( m, b ) );
+}
+
+
+void
+server::bind_files( const std::string &prefix, const std::string &root )
+{
+	std::string		base	= ( !prefix.empty() && ( prefix.back() == '/' ) ) ? prefix.substr( 0, prefix.size() - 1 ) : prefix;
+	binding::ref	b		= new binding( base + "/*", "*", [=]( http::request::ref request, response_f reply )
+	{
+		return serve_file( base, root, request, reply );
+	} );
+
+	bind( method::get, b );
+	bind( method::head, b );
+}
+
+
+server::binding::ref
+server::bind_events( const std::string &path, event_channel::ref channel )
+{
+	binding::ref b = new binding( path, "*", [=]( http::request::ref request, response_f reply ) mutable
+	{
+		response::ref response = new http::response( request->major(), request->minor(), status::ok, true );
+
+		response->add_to_header( "Content-Type", "text/event-stream" );
+		response->add_to_header( "Cache-Control", "no-cache" );
+		response->add_to_header( "X-Accel-Buffering", "no" );
+		response->set_producer( channel->subscribe( response ) );
+
+		// Nothing pipelined behind a stream that only ends when the channel
+		// does is ever going to be answered, so the connection goes with it.
+
+		reply( response, true );
+
+		return 0;
+	} );
+
+	bind( method::get, b );
+
+	return b;
+}
+
+
+// The request bind_upload() parses into. It owns the files it wrote and
+// removes whatever is still there when it goes away.
+
+class upload_request : public request
+{
+public:
+
+	upload_request( int method, std::uint16_t major, std::uint16_t minor, const netkit::uri::ref &uri )
+	:
+		request( method, major, minor, uri ),
+		m_failed( 0 )
+	{
+	}
+
+	~upload_request()
+	{
+		if ( m_file.is_open() )
+		{
+			m_file.close();
+		}
+
+		for ( auto it = m_upload.m_files.begin(); it != m_upload.m_files.end(); it++ )
+		{
+			remove( it->m_path.c_str() );
+		}
+	}
+
+	multipart::ref		m_parser;
+	server::upload		m_upload;
+	std::string			m_field;
+	std::ofstream		m_file;
+	std::uint16_t		m_failed;
+};
+
+
+// Field values are held in memory, so they get a cap. Files don't.
+
+static const std::size_t max_upload_field = 1024 * 1024;
+
+
+server::binding::ref
+server::bind_upload( const std::string &path, const std::string &folder, upload_f f )
+{
+	auto fail = []( upload_request *request, std::uint16_t code, response_f reply )
+	{
+		response::ref response = new http::response( request->major(), request->minor(), code, false );
+
+		response->add_to_header( "Content-Length", "0" );
+		request->m_failed = code;
+
+		// Whatever is left of the body is ignored, so the connection can't
+		// be used for anything else.
+
+		reply( response, true );
+	};
+
+	binding::ref b = new binding( path, "*", [=]( int method, std::uint16_t major, std::uint16_t minor, const uri::ref &uri )
+	{
+		return new upload_request( method, major, minor, uri );
+	},
+	[=]( http::request::ref request, const std::uint8_t *buf, size_t len, response_f reply )
+	{
+		upload_request *r = dynamic_cast< upload_request* >( request.get() );
+
+		if ( r->m_failed )
+		{
+			return 0;
+		}
+
+		if ( !r->m_parser )
+		{
+			std::string boundary = multipart::boundary( request->find_in_header( field::content_type ) );
+
+			if ( boundary.empty() )
+			{
+				fail( r, status::unsupported_media_type, reply );
+				return 0;
+			}
+
+			r->m_parser = new multipart( boundary, [=]( const multipart::part &p )
+			{
+				if ( !p.is_file() )
+				{
+					r->m_field.clear();
+					return 0;
+				}
+
+				server::upload::file file;
+
+				file.m_name			= p.name();
+				file.m_filename		= p.filename();
+				file.m_content_type	= p.content_type();
+				file.m_path			= folder + "/netkit-" + uuid::create()->to_string() + ".upload";
+				file.m_size			= 0;
+
+				r->m_file.open( file.m_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+
+				if ( !r->m_file.is_open() )
+				{
+					nklog( log::error, "unable to create % for upload", file.m_path );
+					r->m_failed = status::server_error;
+					return -1;
+				}
+
+				r->m_upload.m_files.push_back( file );
+
+				return 0;
+			},
+			[=]( const multipart::part &p, const std::uint8_t *buf, std::size_t len )
+			{
+				if ( p.is_file() )
+				{
+					r->m_file.write( reinterpret_cast< const char* >( buf ), len );
+					r->m_upload.m_files.back().m_size += len;
+
+					if ( !r->m_file )
+					{
+						nklog( log::error, "unable to write to %", r->m_upload.m_files.back().m_path );
+						r->m_failed = status::server_error;
+						return -1;
+					}
+				}
+				else if ( ( r->m_field.size() + len ) > max_upload_field )
+				{
+					r->m_failed = status::request_too_large;
+					return -1;
+				}
+				else
+				{
+					r->m_field.append( reinterpret_cast< const char* >( buf ), len );
+				}
+
+				return 0;
+			},
+			[=]( const multipart::part &p )
+			{
+				if ( p.is_file() )
+				{
+					r->m_file.close();
+				}
+				else
+				{
+					r->m_upload.m_fields.emplace( p.name(), r->m_field );
+					r->m_field.clear();
+				}
+
+				return 0;
+			} );
+		}
+
+		if ( !r->m_parser->write( buf, len ) )
+		{
+			fail( r, r->m_failed ? r->m_failed : status::bad_request, reply );
+		}
+
+		return 0;
+	},
+	[=]( http::request::ref request, response_f reply )
+	{
+		upload_request *r = dynamic_cast< upload_request* >( request.get() );
+
+		if ( r->m_failed )
+		{
+			return 0;
+		}
+
+		if ( !r->m_parser )
+		{
+			// No body at all.
+
+			fail( r, multipart::boundary( request->find_in_header( field::content_type ) ).empty() ? status::unsupported_media_type : status::bad_request, reply );
+			return 0;
+		}
+
+		if ( !r->m_parser->done() )
+		{
+			nklog( log::warning, "multipart body ended before its close delimiter" );
+			fail( r, status::bad_request, reply );
+			return 0;
+		}
+
+		return f( request, r->m_upload, reply );
+	} );
+
+	bind( method::post, b );
+
+	return b;
+}
+
+
+void
+server::add_compressible_type( const std::string &type )
+{
+	if ( !is_compressible( type ) )
+	{
+		m_compressible_types.push_back( type );
+	}
+}
+
+
+bool
+server::is_compressible( const std::string &type )
+{
+	std::string base = type.substr( 0, type.find( ';' ) );
+
+	base.erase( base.find_last_not_of( " \t" ) + 1 );
+
+	for ( auto it = m_compressible_types.begin(); it != m_compressible_types.end(); it++ )
+	{
+		if ( ( it->back() == '/' ) ? ( strncasecmp( base.c_str(), it->c_str(), it->size() ) == 0 ) : ( strcasecmp( base.c_str(), it->c_str() ) == 0 ) )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+server::binding::ref
+server::resolve( connection::ref conn, string_view target, string_view content_type )
+{
+	server::binding::ref	binding;
+	handler::ref			handler = dynamic_cast< server::handler* >( conn->handler().get() );
+
+	binding = resolve( conn->method(), target, content_type, handler->m_params );
+	
+	if ( !binding )
+	{
+		nklog( log::error, "unable to find binding for method % -> %", conn->method(), target.str() );
+	}
+
+	return binding;
+}
+
+
+server::binding::ref
+server::resolve( std::uint8_t method, string_view target, string_view content_type, request::params &params )
+{
+	router::ref routes = std::atomic_load( &m_routes );
+
+	params.clear();
+
+	return routes ? routes->resolve( method, target, content_type, params ) : binding::ref();
+}
+
+#if defined( __APPLE__ )
+#	pragma mark server::binding implementation
+#endif
+
+// Keys can come from the query string, so there have to be only so many.
+
+static const std::size_t max_cached_responses = 1024;
+
+static bool
+cache_directive( const std::string &cache_control, const char *name, std::time_t *val = nullptr )
+{
+	std::size_t len = strlen( name );
+	std::size_t pos = 0;
+
+	while ( pos < cache_control.size() )
+	{
+		std::size_t	end = cache_control.find( ',', pos );
+		std::string	item;
+
+		if ( end == std::string::npos )
+		{
+			end = cache_control.size();
+		}
+
+		item = cache_control.substr( pos, end - pos );
+		item.erase( 0, item.find_first_not_of( " \t" ) );
+		item.erase( item.find_last_not_of( " \t" ) + 1 );
+		pos = end + 1;
+
+		if ( ( strncasecmp( item.c_str(), name, len ) == 0 ) && ( ( item.size() == len ) || ( item[ len ] == '=' ) ) )
+		{
+			if ( val )
+			{
+				if ( item.size() == len )
+				{
+					return false;
+				}
+
+				*val = static_cast< std::time_t >( strtoll( item.c_str() + len + 1 + ( item[ len + 1 ] == '"' ? 1 : 0 ), nullptr, 10 ) );
+			}
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+std::string
+server::binding::cache_key( request::ref request, std::uint8_t coding, string_view target ) const
+{
+	std::string key;
+
+	key += static_cast< char >( '0' + coding );
+	key += static_cast< char >( '0' + request->major() );
+	key += static_cast< char >( '0' + request->minor() );
+
+	if ( m_cache_query )
+	{
+		key.append( target.data(), target.size() );
+	}
+	else
+	{
+		std::size_t end = target.find_first_of( "?", 0 );
+
+		key.append( target.data(), ( end == std::string::npos ) ? target.size() : end );
+	}
+
+	for ( auto it = m_cache_headers.begin(); it != m_cache_headers.end(); it++ )
+	{
+		key += '\n';
+		key += request->find_in_header( *it );
+	}
+
+	return key;
+}
+
+
+int
+server::binding::cache_lookup( const std::string &key, cache_waiter_f waiter, std::string &status_line, std::string &rest )
+{
+	std::lock_guard< std::mutex > guard( m_cache_mutex );
+
+	auto	now	= std::chrono::steady_clock::now();
+	auto	it	= m_cached.find( key );
+
+	if ( it != m_cached.end() )
+	{
+		if ( it->second.m_fetching )
+		{
+			// The waiter would be called back on the fetching thread, which
+			// may be running some other loop.
+
+			if ( it->second.m_fetcher != std::this_thread::get_id() )
+			{
+				return -1;
+			}
+
+			it->second.m_waiters.push_back( waiter );
+			return 0;
+		}
+
+		m_cache_lru.splice( m_cache_lru.begin(), m_cache_lru, it->second.m_lru );
+
+		if ( now < it->second.m_expires )
+		{
+			status_line	= it->second.m_status_line;
+			rest		= it->second.m_rest;
+			return 1;
+		}
+	}
+	else
+	{
+		// Make room by dropping whatever was used longest ago. Entries
+		// being fetched have waiters hanging off them, so they stay.
+
+		auto l = m_cache_lru.end();
+
+		while ( ( m_cached.size() >= max_cached_responses ) && ( l != m_cache_lru.begin() ) )
+		{
+			auto victim = m_cached.find( *--l );
+
+			if ( !victim->second.m_fetching )
+			{
+				m_cached.erase( victim );
+				l = m_cache_lru.erase( l );
+			}
+		}
+
+		if ( m_cached.size() >= max_cached_responses )
+		{
+			return -1;
+		}
+
+		m_cache_lru.push_front( key );
+		it = m_cached.insert( std::make_pair( key, cached() ) ).first;
+		it->second.m_lru = m_cache_lru.begin();
+	}
+
+	it->second.m_fetching	= true;
+	it->second.m_fetcher	= std::this_thread::get_id();
+	it->second.m_waiters.clear();
+
+	return -1;
+}
+
+
+void
+server::binding::cache_store( const std::string &key, response::ref response )
+{
+	std::unique_lock< std::mutex >	guard( m_cache_mutex );
+	auto							it		= m_cached.find( key );
+	std::vector< cache_waiter_f >	waiters;
+	std::string						cache_control;
+	bool							ok;
+
+	// A thread that missed while another was fetching made its own
+	// response. Leave the entry to the thread that owns it.
+
+	if ( ( it == m_cached.end() ) || !it->second.m_fetching || ( it->second.m_fetcher != std::this_thread::get_id() ) )
+	{
+		return;
+	}
+
+	waiters = it->second.m_waiters;
+	it->second.m_waiters.clear();
+	it->second.m_fetching = false;
+
+	cache_control = response ? response->find_in_header( field::cache_control ) : std::string();
+	ok = response && ( response->status() == status::ok ) && !response->body_spilled() && !response->producer() && ( response->file() == -1 ) &&
+	     response->find_in_header( field::set_cookie ).empty() && !cache_directive( cache_control, "no-store" ) && !cache_directive( cache_control, "no-cache" ) &&
+	     !cache_directive( cache_control, "private" );
+
+	if ( ok )
+	{
+		cached &entry = it->second;
+
+		entry.m_status_line.clear();
+		entry.m_rest.clear();
+
+		write_status_line( entry.m_status_line, response->major(), response->minor(), response->status() );
+
+		for ( auto h = response->heeder().begin(); h != response->heeder().end(); h++ )
+		{
+			if ( h->id() != field::date )
+			{
+				entry.m_rest += h->name();
+				entry.m_rest += ": ";
+				entry.m_rest += h->value();
+				entry.m_rest += "\r\n";
+			}
+		}
+
+		entry.m_rest += "\r\n";
+		response->write_body( entry.m_rest );
+		entry.m_expires = std::chrono::steady_clock::now() + std::chrono::milliseconds( m_cache_ttl );
+
+		std::string status_line( entry.m_status_line );
+		std::string rest( entry.m_rest );
+
+		guard.unlock();
+
+		for ( auto w = waiters.begin(); w != waiters.end(); w++ )
+		{
+			( *w )( &status_line, &rest );
+		}
+	}
+	else
+	{
+		m_cache_lru.erase( it->second.m_lru );
+		m_cached.erase( it );
+
+		guard.unlock();
+
+		for ( auto w = waiters.begin(); w != waiters.end(); w++ )
+		{
+			( *w )( nullptr, nullptr );
+		}
+	}
+}
+
+
+#if defined( __APPLE__ )
+#	pragma mark server::router implementation
+#endif
+
+struct server::router::node
+{
+	node()
+	:
+		m_param( nullptr ),
+		m_any_one( nullptr ),
+		m_any_many( nullptr )
+	{
+	}
+
+	~node()
+	{
+		for ( auto it = m_literals.begin(); it != m_literals.end(); it++ )
+		{
+			delete *it;
+		}
+
+		delete m_param;
+		delete m_any_one;
+		delete m_any_many;
+	}
+
+	typedef std::pair< std::uint64_t, binding::ref > entry;
+
+	std::string				m_label;
+	std::vector< node* >	m_literals;
+	node					*m_param;
+	std::string				m_param_name;
+	node					*m_any_one;
+	node					*m_any_many;
+	std::vector< entry >	m_entries;
+};
+
+
+struct server::router::match
+{
+	match()
+	:
+		m_order( 0 )
+	{
+	}
+
+	std::uint64_t	m_order;
+	binding::ref	m_binding;
+	request::params	m_params;
+
+	// Where each '*' has already been tried from. Trying again can't find
+	// anything new, and with several stars in a pattern it would cost
+	// exponential time.
+
+	std::set< std::pair< const node*, std::size_t > >	m_tried;
+};
+
+
+server::router::router()
+:
+	m_count( 0 )
+{
+	memset( m_roots, 0, sizeof( m_roots ) );
+}
+
+
+server::router::~router()
+{
+	for ( auto i = 0; i < 256; i++ )
+	{
+		delete m_roots[ i ];
+	}
+}
+
+
+void
+server::router::add( std::uint8_t method, binding::ref binding )
+{
+	const std::string	&path = binding->m_path;
+	node				*n;
+	std::size_t			pos = 0;
+
+	if ( !m_roots[ method ] )
+	{
+		m_roots[ method ] = new node;
+	}
+
+	n = m_roots[ method ];
+
+	while ( pos < path.size() )
+	{
+		if ( path[ pos ] == '*' )
+		{
+			if ( !n->m_any_many )
+			{
+				n->m_any_many = new node;
+			}
+
+			n = n->m_any_many;
+			pos++;
+		}
+		else if ( path[ pos ] == '?' )
+		{
+			if ( !n->m_any_one )
+			{
+				n->m_any_one = new node;
+			}
+
+			n = n->m_any_one;
+			pos++;
+		}
+		else if ( ( path[ pos ] == '{' ) && ( path.find( '}', pos ) != std::string::npos ) )
+		{
+			std::size_t close = path.find( '}', pos );
+
+			if ( !n->m_param )
+			{
+				n->m_param				= new node;
+				n->m_param->m_param_name	= path.substr( pos + 1, close - pos - 1 );
+			}
+			else if ( n->m_param->m_param_name != path.substr( pos + 1, close - pos - 1 ) )
+			{
+				nklog( log::warning, "binding % reuses a path parameter position under the name '%'", path.c_str(), n->m_param->m_param_name.c_str() );
+			}
+
+			n	= n->m_param;
+			pos	= close + 1;
+		}
+		else
+		{
+			std::size_t end = path.find_first_of( "*?{", pos );
+
+			if ( end == pos )
+			{
+				end = pos + 1;
+			}
+			else if ( end == std::string::npos )
+			{
+				end = path.size();
+			}
+
+			n	= insert_literal( n, path.substr( pos, end - pos ) );
+			pos	= end;
+		}
+	}
+
+	n->m_entries.push_back( std::make_pair( ++m_count, binding ) );
+	m_added.push_back( std::make_pair( method, binding ) );
+}
+
+
+server::router::ref
+server::router::with( std::uint8_t method, binding::ref binding ) const
+{
+	// Bindings are added at startup, so rebuilding the whole tree each
+	// time is cheaper than making the tree itself safe to share while it
+	// changes.
+
+	router *r = new router;
+
+	for ( auto it = m_added.begin(); it != m_added.end(); it++ )
+	{
+		r->add( it->first, it->second );
+	}
+
+	r->add( method, binding );
+
+	return ref( r );
+}
+
+
+server::router::node*
+server::router::insert_literal( node *parent, const std::string &literal )
+{
+	for ( auto it = parent->m_literals.begin(); it != parent->m_literals.end(); it++ )
+	{
+		node		*child = *it;
+		std::size_t	common = 0;
+
+		while ( ( common < child->m_label.size() ) && ( common < literal.size() ) && ( child->m_label[ common ] == literal[ common ] ) )
+		{
+			common++;
+		}
+
+		if ( common == 0 )
+		{
+			continue;
+		}
+
+		if ( common < child->m_label.size() )
+		{
+			// Split the edge so the shared prefix gets its own node
+
+			node *split = new node;
+
+			split->m_label = child->m_label.substr( 0, common );
+			child->m_label.erase( 0, common );
+			split->m_literals.push_back( child );
+			*it = split;
+			child = split;
+		}
+
+		if ( common == literal.size() )
+		{
+			return child;
+		}
+
+		return insert_literal( child, literal.substr( common ) );
+	}
+
+	node *child = new node;
+
+	child->m_label = literal;
+	parent->m_literals.push_back( child );
+
+	return child;
+}
+
+
+server::binding::ref
+server::router::resolve( std::uint8_t method, string_view target, string_view content_type, request::params &params ) const
+{
+	match best;
+
+	if ( m_roots[ method ] )
+	{
+		request::params scratch;
+
+		walk( m_roots[ method ], target, 0, content_type, scratch, best );
+	}
+
+	if ( best.m_binding )
+	{
+		params = best.m_params;
+	}
+
+	return best.m_binding;
+}
+
+
+void
+server::router::walk( const node *n, string_view target, std::size_t pos, string_view content_type, request::params &params, match &best )
+{
+	// Every node we reach has matched a prefix of the target, so any
+	// binding that ends here is a candidate. The first way found to a
+	// binding is the one whose params it gets.
+
+	for ( auto it = n->m_entries.begin(); it != n->m_entries.end(); it++ )
+	{
+		if ( ( best.m_order && ( best.m_order <= it->first ) ) || !type_matches( it->second->m_type, content_type ) )
+		{
+			continue;
+		}
+
+		best.m_order	= it->first;
+		best.m_binding	= it->second;
+		best.m_params	= params;
+	}
+
+	if ( pos == target.size() )
+	{
+		if ( n->m_any_many && best.m_tried.insert( std::make_pair( n->m_any_many, pos ) ).second )
+		{
+			walk( n->m_any_many, target, pos, content_type, params, best );
+		}
+
+		return;
+	}
+
+	for ( auto it = n->m_literals.begin(); it != n->m_literals.end(); it++ )
+	{
+		const std::string &label = ( *it )->m_label;
+
+		if ( label[ 0 ] == target[ pos ] )
+		{
+			if ( target.matches( pos, label ) )
+			{
+				walk( *it, target, pos + label.size(), content_type, params, best );
+			}
+
+			break;
+		}
+	}
+
+	if ( n->m_param )
+	{
+		std::size_t end = target.find_first_of( "/?", pos );
+
+		if ( end == std::string::npos )
+		{
+			end = target.size();
+		}
+
+		if ( end > pos )
+		{
+			params[ n->m_param->m_param_name ] = target.substr( pos, end - pos ).str();
+			walk( n->m_param, target, end, content_type, params, best );
+			params.erase( n->m_param->m_param_name );
+		}
+	}
+
+	if ( n->m_any_one )
+	{
+		walk( n->m_any_one, target, pos + 1, content_type, params, best );
+	}
+
+	if ( n->m_any_many )
+	{
+		for ( std::size_t end = target.size() + 1; end > pos; end-- )
+		{
+			if ( best.m_tried.insert( std::make_pair( n->m_any_many, end - 1 ) ).second )
+			{
+				walk( n->m_any_many, target, end - 1, content_type, params, best );
+			}
+		}
+	}
+}
+
+
+bool
+server::router::type_matches( const std::string &pattern, string_view content_type )
+{
+	std::size_t p		= 0;
+	std::size_t t		= 0;
+	std::size_t star_p	= std::string::npos;
+	std::size_t star_t	= 0;
+
+	// Glob match of pattern against a prefix of content_type
+
+	while ( p < pattern.size() )
+	{
+		if ( pattern[ p ] == '*' )
+		{
+			star_p = p++;
+			star_t = t;
+		}
+		else if ( ( t < content_type.size() ) && ( ( pattern[ p ] == '?' ) || ( pattern[ p ] == content_type[ t ] ) ) )
+		{
+			p++;
+			t++;
+		}
+		else if ( ( star_p != std::string::npos ) && ( star_t < content_type.size() ) )
+		{
+			p = star_p + 1;
+			t = ++star_t;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+#if defined( __APPLE__ )
+#	pragma mark server::handler implementation
+#endif
+
+// An origin-form target is only a path and a query, so split it here rather
+// than running it through the general URI parser again. Anything else, like
+// an absolute URI sent to a proxy, still goes through uri::assign().
+
+static netkit::uri::ref
+target_uri( string_view target )
+{
+	netkit::uri::ref	u;
+	string_view			path;
+	std::size_t			query;
+
+	if ( ( target.size() < 1 ) || ( target[ 0 ] != '/' ) || ( ( target.size() > 1 ) && ( target[ 1 ] == '/' ) ) )
+	{
+		return new netkit::uri( target.str() );
+	}
+
+	query	= target.find_first_of( "?", 0 );
+	path	= target.substr( 0, query );
+	u		= new netkit::uri( std::string(), std::string(), 0 );
+
+	u->set_path( ( path.find_first_of( "%", 0 ) == std::string::npos ) ? path.str() : netkit::uri::decode( path.str() ) );
+
+	if ( query != std::string::npos )
+	{
+		u->set_query( target.substr( query + 1 ).str() );
+	}
+
+	return u;
+}
+
+
+server::handler::handler()
+:
+	m_closing( false ),
+	m_writing( false ),
+	m_flushing( false ),
+	m_waiting_since( std::chrono::steady_clock::now() ),
+	m_body_bytes( 0 ),
+	m_in_body( false )
+{
+}
+
+
+server::handler::~handler()
+{
+	nklog( log::verbose, "" );
+}
+
+
+void
+server::handler::process_will_begin( connection::ref connection )
+{
+	server::set_active_connection( connection.get() );
+}
+
+
+void
+server::handler::message_will_begin( connection::ref connection )
+{
+	// With nothing outstanding, the clock has been running since the last
+	// response went out. Otherwise the client was waiting on us until now.
+
+	if ( !m_pending.empty() )
+	{
+		m_waiting_since = std::chrono::steady_clock::now();
+	}
+
+	m_binding	= nullptr;
+	m_request	= nullptr;
+	m_in_body	= false;
+	m_slot		= new pending;
+
+	m_pending.push_back( m_slot );
+}
+
+
+int
+server::handler::uri_was_received( connection::ref connection, const char *buf, size_t len )
+{
+	// We pick up the whole target from connection::target() once the
+	// headers are in.
+
+	return 0;
+}
+
+
+int
+server::handler::headers_were_received( connection::ref connection, message::header &header )
+{
+	connection::raw_headers headers;
+
+	for ( auto it = header.begin(); it != header.end(); it++ )
+	{
+		connection::raw_header raw = { it->id(), it->name(), it->value() };
+		headers.push_back( raw );
+	}
+
+	return raw_headers_were_received( connection, headers );
+}
+
+
+int
+server::handler::raw_headers_were_received( connection::ref connection, const connection::raw_headers &headers )
+{
+	string_view content_type;
+	string_view target = connection->target();
+
+	m_in_body		= true;
+	m_body_since	= std::chrono::steady_clock::now();
+	m_body_bytes	= 0;
+
+	if ( m_closing )
+	{
+		// An earlier request on this connection asked for it to be closed,
+		// so anything pipelined behind it is never answered.
+
+		goto exit;
+	}
+
+	m_slot->m_head = ( connection->method() == method::head );
+
+	for ( auto it = headers.begin(); it != headers.end(); it++ )
+	{
+		if ( it->m_id == field::content_type )
+		{
+			content_type = it->m_value;
+		}
+		else if ( ( it->m_id == field::accept_encoding ) && ( server::m_compression_threshold > 0 ) )
+		{
+			m_slot->m_coding = coding::negotiate( it->m_value.str() );
+		}
+	}
+
+	m_binding = server::resolve( connection, target, content_type );
+	
+	if ( m_binding )
+	{
+		m_request = m_binding->m_rwb( connection->method(), connection->http_major(), connection->http_minor(), target_uri( target ) );
+	}
+
+	if ( !m_request )
+	{
+		response::ref response = new http::response( connection->http_major(), connection->http_minor(), http::status::not_found, false );
+		response->add_to_header( "Connection", "Close" );
+		response->add_to_header( "Content-Type", "text/html" );
+		*response << "<html>Error 404: Content Not Found</html>";
+		response->add_to_header( "Content-Length", static_cast< int >( response->body().size() ) );
+		m_binding = nullptr;
+		reply( connection, m_slot, response, true );
+		goto exit;
+	}
+
+	// This is the one copy: the request outlives the receive buffer.
+
+	for ( auto it = headers.begin(); it != headers.end(); it++ )
+	{
+		m_request->add_to_header( it->m_name.data(), it->m_name.size(), it->m_value.data(), it->m_value.size() );
+	}
+
+	m_request->set_path_params( m_params );
+
+	if ( m_binding->m_cache_ttl && ( connection->method() == method::get ) )
+	{
+		handler::ref	self( this );
+		pending::ref	slot( m_slot );
+		binding::ref	binding( m_binding );
+		request::ref	request( m_request );
+		std::string		key = binding->cache_key( request, slot->m_coding, target );
+		std::string		status_line;
+		std::string		rest;
+		int				found;
+
+		found = binding->cache_lookup( key, [=]( const std::string *status_line, const std::string *rest ) mutable
+		{
+			if ( status_line )
+			{
+				self->reply_cached( connection, slot, *status_line, *rest );
+			}
+			else
+			{
+				binding->m_r( request, [=]( response::ref response, bool close ) mutable
+				{
+					self->reply( connection, slot, response, close );
+				} );
+			}
+		}, status_line, rest );
+
+		if ( found < 0 )
+		{
+			slot->m_cache_binding	= binding;
+			slot->m_cache_key		= key;
+		}
+		else
+		{
+			// Either answered already or waiting on someone else's answer.
+			// The binding isn't called for this request.
+
+			if ( found > 0 )
+			{
+				reply_cached( connection, slot, status_line, rest );
+			}
+
+			m_binding	= nullptr;
+			m_request	= nullptr;
+
+			goto exit;
+		}
+	}
+	
+	if ( ( m_request->expect() == "100-continue" ) && ( m_pending.size() == 1 ) )
+	{
+		// An interim response may only go out while this request is at the
+		// head of the queue. Otherwise the client will send the body once its
+		// own wait expires.
+
+		response::ref response = new http::response( connection->http_major(), connection->http_minor(), http::status::cont, false );
+		connection->put( response.get() );
+	}
+
+exit:
+
+	// Stop parsing if a reply has already closed the connection.
+
+	return connection->is_open() ? 0 : -1;
+}
+
+
+int
+server::handler::body_was_received( connection::ref connection, const char *buf, size_t len )
+{
+	m_body_bytes += len;
+
+	if ( !m_binding || !m_request )
+	{
+		return 0;
+	}
+
+	handler::ref	self( this );
+	pending::ref	slot( m_slot );
+
+	return m_binding->m_rbwr( m_request, ( const uint8_t* ) buf, len, [=]( response::ref response, bool close ) mutable
+	{
+		self->reply( connection, slot, response, close );
+	} );
+}
+
+
+int
+server::handler::message_was_received( connection::ref connection )
+{
+	m_in_body = false;
+
+	if ( !m_binding || !m_request )
+	{
+		return 0;
+	}
+
+	handler::ref	self( this );
+	pending::ref	slot( m_slot );
+	binding::ref	binding( m_binding );
+	request::ref	request( m_request );
+
+	m_binding	= nullptr;
+	m_request	= nullptr;
+
+	return binding->m_r( request, [=]( response::ref response, bool close ) mutable
+	{
+		self->reply( connection, slot, response, close );
+	} );
+}
+
+
+void
+server::handler::reply( connection::ref connection, pending::ref slot, response::ref response, bool close )
+{
+	if ( slot->m_ready )
+	{
+		nklog( log::warning, "request was already answered, dropping response" );
+		return;
+	}
+
+	if ( ( slot->m_coding != coding::identity ) && !slot->m_head )
+	{
+		compress( slot->m_coding, response );
+	}
+
+	if ( slot->m_cache_binding )
+	{
+		binding::ref binding = slot->m_cache_binding;
+
+		slot->m_cache_binding = nullptr;
+		binding->cache_store( slot->m_cache_key, response );
+	}
+
+	slot->m_response	= response;
+	slot->m_close		= close;
+	slot->m_ready		= true;
+
+	if ( close )
+	{
+		m_closing = true;
+	}
+
+	flush( connection );
+}
+
+
+void
+server::handler::compress( std::uint8_t c, response::ref response )
+{
+	std::string		etag;
+	std::string		vary;
+	std::string		body;
+	std::string		encoded;
+	std::string		key;
+
+	// Only whole, in-memory bodies. Streamed and file-backed responses and
+	// anything already encoded go out as they are.
+
+	if ( ( response->status() != status::ok ) || response->body_spilled() || response->producer() || ( response->file() != -1 ) )
+	{
+		return;
+	}
+
+	if ( ( m_compression_threshold == 0 ) || ( response->body_size() < m_compression_threshold ) )
+	{
+		return;
+	}
+
+	if ( !response->find_in_header( field::content_encoding ).empty() || !is_compressible( response->find_in_header( field::content_type ) ) )
+	{
+		return;
+	}
+
+	body	= response->body();
+	etag	= response->find_in_header( field::etag );
+
+	if ( !etag.empty() )
+	{
+		key = coding::to_string( c ) + " " + std::to_string( body.size() ) + " " + etag;
+	}
+	else
+	{
+		// FNV-1a. Identical bodies without an ETag, like a popular API
+		// answer, still only get compressed once.
+
+		std::uint64_t		hash = 14695981039346656037ULL;
+		std::ostringstream	os;
+
+		for ( auto it = body.begin(); it != body.end(); it++ )
+		{
+			hash ^= static_cast< std::uint8_t >( *it );
+			hash *= 1099511628211ULL;
+		}
+
+		os << coding::to_string( c ) << " " << body.size() << " #" << std::hex << hash;
+		key = os.str();
+	}
+
+	if ( !compression_cache::instance().get( key, encoded ) )
+	{
+		if ( !coding::encode( c, reinterpret_cast< const std::uint8_t* >( body.data() ), body.size(), encoded ) )
+		{
+			return;
+		}
+
+		compression_cache::instance().put( key, encoded );
+	}
+
+	if ( encoded.size() >= body.size() )
+	{
+		return;
+	}
+
+	response->clear_body();
+	response->write( reinterpret_cast< const std::uint8_t* >( encoded.data() ), encoded.size() );
+	response->add_to_header( "Content-Encoding", coding::to_string( c ) );
+	response->add_to_header( "Content-Length", std::to_string( encoded.size() ) );
+
+	vary = response->find_in_header( field::vary );
+	response->add_to_header( "Vary", vary.empty() ? "Accept-Encoding" : vary + ", Accept-Encoding" );
+
+	// The bytes differ from the identity body, so a strong validator no
+	// longer holds. Weakening it keeps If-None-Match working, since that
+	// compares weakly, without the binding having to know about the coding.
+
+	if ( ( etag.size() > 1 ) && ( etag.back() == '"' ) && ( etag.compare( 0, 2, "W/" ) != 0 ) )
+	{
+		response->add_to_header( "ETag", "W/" + etag );
+	}
+}
+
+
+void
+server::handler::reply_cached( connection::ref connection, pending::ref slot, const std::string &status_line, const std::string &rest )
+{
+	if ( slot->m_ready )
+	{
+		return;
+	}
+
+	slot->m_raw.reserve( status_line.size() + rest.size() + 64 );
+	slot->m_raw	= status_line;
+	slot->m_raw	+= "Date: ";
+	slot->m_raw	+= response::current_date();
+	slot->m_raw	+= "\r\n";
+	slot->m_raw	+= rest;
+	slot->m_ready = true;
+
+	flush( connection );
+}
+
+
+void
+server::handler::flush( connection::ref connection )
+{
+	handler::ref self( this );
+
+	if ( m_flushing )
+	{
+		// We got here from a put() that completed right away. The loop
+		// below will pick up where it left off.
+
+		return;
+	}
+
+	m_flushing = true;
+
+	while ( !m_writing && !m_pending.empty() && m_pending.front()->m_ready )
+	{
+		pending::ref slot = m_pending.front();
+
+		m_pending.pop_front();
+
+		if ( !connection->is_open() )
+		{
+			continue;
+		}
+
+		// A streamed response holds up everything behind it until it has
+		// been written out.
+
+		m_writing = true;
+
+		connection::put_reply_f done = [=]( int status ) mutable
+		{
+			self->m_writing = false;
+
+			if ( self->m_pending.empty() )
+			{
+				self->m_waiting_since = std::chrono::steady_clock::now();
+			}
+
+			if ( slot->m_close || ( status != 0 ) )
+			{
+				self->m_pending.clear();
+
+				if ( connection->is_open() )
+				{
+					connection->close();
+				}
+			}
+			else if ( !self->m_flushing )
+			{
+				self->flush( connection );
+			}
+		};
+
+		if ( slot->m_response )
+		{
+			connection->put( slot->m_response.get(), done );
+		}
+		else
+		{
+			// Already serialized by a binding's cache.
+
+			connection->send( reinterpret_cast< const std::uint8_t* >( slot->m_raw.data() ), slot->m_raw.size(), done );
+		}
+	}
+
+	m_flushing = false;
+}
+
+
+void
+server::handler::process_did_end( connection::ref connection )
+{
+	server::set_active_connection( nullptr );
+}
+
+
+void
+server::handler::will_close( connection::ref connection )
+{
+}
+
+
+void
+server::handler::limit_was_exceeded( connection::ref connection, std::uint16_t status )
+{
+	std::ostringstream	os;
+	response::ref		response;
+
+	if ( !status || m_closing || ( m_slot && m_slot->m_ready ) )
+	{
+		connection->close();
+		return;
+	}
+
+	if ( !m_slot )
+	{
+		// Nothing was parsed before we decided, so there is no slot yet.
+
+		m_slot = new pending;
+		m_pending.push_back( m_slot );
+	}
+
+	m_binding	= nullptr;
+	m_request	= nullptr;
+	m_in_body	= false;
+
+	os << "<html>Error " << status << "</html>";
+
+	response = new http::response( 1, 1, status, false );
+	response->add_to_header( "Connection", "Close" );
+	response->add_to_header( "Content-Type", "text/html" );
+	*response << os.str();
+	response->add_to_header( "Content-Length", static_cast< int >( response->body().size() ) );
+
+	reply( connection, m_slot, response, true );
+}
+
+
+void
+server::handler::check_limits( connection::ref connection, std::chrono::steady_clock::time_point now )
+{
+	if ( m_closing )
+	{
+		return;
+	}
+
+	if ( ( m_header_timeout > 0 ) && ( connection->m_in_head || ( m_pending.empty() && !m_writing ) ) && ( ( now - m_waiting_since ) >= std::chrono::milliseconds( m_header_timeout ) ) )
+	{
+		// A client that hasn't started a request is owed nothing. One that
+		// is still getting a response (an event stream, say) isn't idle.
+
+		nklog( log::warning, "request head took longer than % msec", m_header_timeout );
+		connection->pause();
+		limit_was_exceeded( connection, connection->m_in_head ? status::request_timeout : 0 );
+	}
+	else if ( ( m_min_body_rate > 0 ) && m_in_body )
+	{
+		auto elapsed = std::chrono::duration_cast< std::chrono::milliseconds >( now - m_body_since ).count();
+
+		if ( connection->paused() )
+		{
+			// Held back by the binding, not the client. Start over once it
+			// lets go.
+
+			m_body_since	= now;
+			m_body_bytes	= 0;
+		}
+		else if ( ( elapsed >= body_rate_grace ) && ( ( m_body_bytes * 1000 ) < ( m_min_body_rate * static_cast< std::uint64_t >( elapsed ) ) ) )
+		{
+			nklog( log::warning, "request body is arriving at under % bytes/sec", m_min_body_rate );
+			connection->pause();
+			limit_was_exceeded( connection, status::request_timeout );
+		}
+	}
+}
+
+
+server::handler::pending::~pending()
+{
+	// This slot was going to produce a cached response and never did. Anyone
+	// waiting on it has to produce their own.
+
+	if ( m_cache_binding )
+	{
+		m_cache_binding->cache_store( m_cache_key, nullptr );
+	}
+}
+
+
+#if defined( __APPLE__ )
+#	pragma mark client implementation
+#endif
+
+bool		client::m_decompress		= true;
+std::size_t	client::m_max_decoded_size	= 64 * 1024 * 1024;
+std::size_t	client::m_expect_threshold	= 1024 * 1024;
+std::time_t	client::m_continue_timeout	= 1000;
+
+client::client( const request::ref &request )
+:
+	m_request( request ),
+	m_accept_added( false ),
+	m_expect( true ),
+	m_expect_added( false ),
+	m_expect_failed( false ),
+	m_reused( false ),
+	m_done( false ),
+	m_has_slot( false ),
+	m_interim( false ),
+	m_hold( std::make_shared< hold >( hold::none ) )
+{
+}
+
+
+client::~client()
+{
+	nklog( log::verbose, "" );
+
+	release_slot();
+}
+
+
+void
+client::send( const request::ref &request )
+{
+	if ( cache::instance().enabled() && cache::instance().send( request ) )
+	{
+		return;
+	}
+
+	start( request );
+}
+
+
+void
+client::start( const request::ref &request, bool expect )
+{
+	client::ref self = new client( request );
+
+	self->m_expect		= expect;
+	self->m_pool_key	= pool::instance().key_for( request->uri() );
+
+	pool::instance().acquire( self->m_pool_key, self );
+}
+
+
+void
+client::really_send()
+{
+	m_connection = pool::instance().checkout( m_pool_key );
+
+	if ( m_connection )
+	{
+		nklog( log::verbose, "reusing idle connection for %", m_pool_key.c_str() );
+
+		m_reused = true;
+		m_connection->set_handler( this );
+		put_request();
+		return;
+	}
+
+	m_reused		= false;
+	m_connection	= new connection( this );
+
+	m_connection->connect( m_request->uri(), [=]( int status, const endpoint::ref &peer )
+	{
+		if ( status == 0 )
+		{
+			put_request();
+		}
+		else
+		{
+			nklog( log::error, "received error % trying to connect to uri '%'", status, m_request->uri()->to_string().c_str() );
+			release_slot();
+			m_request->reply( nullptr );
+		}
+	} );
+}
+
+
+void
+client::put_request()
+{
+	m_request->add_to_header( "Host", m_request->uri()->host() );
+	m_request->add_to_header( "User-Agent", "NetKit/2 " + platform::machine_description() );
+	m_request->add_to_header( "Connection", "keep-alive" );
+
+	if ( m_decompress && coding::supported() )
+	{
+		// Redirects and retries come back through here with the header we
+		// added last time, so that counts as ours too.
+
+		static const std::string accept = "gzip, deflate";
+
+		std::string val = m_request->find_in_header( field::accept_encoding );
+
+		if ( val.empty() || ( val == accept ) )
+		{
+			m_request->add_to_header( "Accept-Encoding", accept );
+			m_accept_added = true;
+		}
+	}
+
+	if ( proxy::get()->is_http() && ( proxy::get()->authorization().size() > 0 ) )
+	{
+		m_request->add_to_header( "Proxy-Authorization", "basic " + proxy::get()->authorization() );
+		m_request->add_to_header( "Proxy-Connection", "keep-alive" );
+	}
+
+	if ( m_request->body_size() > 0 )
+	{
+		m_request->add_to_header( "Content-Length", m_request->body_size() );
+	}
+
+	bool expect = ( m_request->expect() == "100-continue" );
+
+	m_expect_added = false;
+
+	if ( !expect && m_expect && ( m_expect_threshold > 0 ) && ( m_request->body_size() >= m_expect_threshold ) && ( m_request->major() == 1 ) && ( m_request->minor() >= 1 ) )
+	{
+		m_request->add_to_header( "Expect", "100-continue" );
+		expect			= true;
+		m_expect_added	= true;
+	}
+
+	if ( expect && ( ( m_request->body_size() > 0 ) || m_request->producer() ) )
+	{
+		put_expecting();
+	}
+	else
+	{
+		m_connection->put( m_request.get() );
+	}
+
+	// The head has been written by now. An Expect we added was only for
+	// the wire, and mustn't ride along on the caller's request if it gets
+	// sent again.
+
+	if ( m_expect_added )
+	{
+		m_request->remove_from_header( "Expect" );
+	}
+}
+
+
+void
+client::put_expecting()
+{
+	message::producer_f		body	= m_request->producer();
+	std::shared_ptr< hold >	h		= m_hold;
+	request::ref			request( m_request );
+
+	if ( !body )
+	{
+		// The body is in memory. It is read straight out of the request as
+		// the connection asks for it, so a large upload isn't held twice.
+
+		std::shared_ptr< std::size_t > pos = std::make_shared< std::size_t >( 0 );
+
+		body = [=]( std::uint8_t *buf, std::size_t len ) -> std::streamsize
+		{
+			std::size_t n = request->read_body( *pos, buf, len );
+
+			*pos += n;
+
+			return n;
+		};
+	}
+
+	*h = hold::waiting;
+
+	m_connection->put( m_request.get(), [=]( std::uint8_t *buf, std::size_t len ) -> std::streamsize
+	{
+		return ( *h == hold::released ) ? body( buf, len ) : message::would_block;
+	}, nullptr );
+
+	runloop::main()->schedule_oneshot_timer( m_continue_timeout, [=]( runloop::event e ) mutable
+	{
+		if ( *h == hold::waiting )
+		{
+			nklog( log::verbose, "no 100 Continue after % msec, sending body anyway", m_continue_timeout );
+
+			*h = hold::released;
+			request->wake();
+		}
+	} );
+}
+
+
+void
+client::release_slot()
+{
+	if ( m_has_slot )
+	{
+		m_has_slot = false;
+		pool::instance().release( m_pool_key );
+	}
+}
+
+
+void
+client::process_will_begin( connection::ref connection )
+{
+}
+
+
+void
+client::message_will_begin( connection::ref connection )
+{
+	m_request->set_redirect( "" );
+}
+
+
+int
+client::uri_was_received( connection::ref connection, const char *buf, size_t len )
+{
+	assert( 0 );
+	return 0;
+}
+
+
+int
+client::headers_were_received( connection::ref connection, message::header &header )
+{
+	int ret = 0;
+
+	if ( ( connection->status_code() >= 100 ) && ( connection->status_code() < 200 ) && ( connection->status_code() != status::switching_protocols ) )
+	{
+		// An interim response. The only one we care about is the go-ahead
+		// for a body we held back.
+
+		m_interim = true;
+
+		if ( ( connection->status_code() == status::cont ) && ( *m_hold == hold::waiting ) )
+		{
+			*m_hold = hold::released;
+			m_request->wake();
+		}
+
+		return 0;
+	}
+
+	if ( *m_hold == hold::waiting )
+	{
+		// Turned down (or redirected) without having to send the body. The
+		// server still expects Content-Length bytes, so the connection
+		// can't be used again.
+
+		nklog( log::verbose, "got % before sending body, withholding it", connection->status_code() );
+		*m_hold = hold::withheld;
+	}
+
+	if ( ( connection->status_code() == status::expectation_failed ) && m_expect_added )
+	{
+		// The caller never asked for the Expect, so they don't get to hear
+		// it was turned down. Send it again without (RFC 7231 5.1.1).
+
+		nklog( log::verbose, "Expect refused by %, retrying without it", m_pool_key.c_str() );
+		m_expect_failed = true;
+		return 0;
+	}
+
+	m_response = new response( connection->http_major(), connection->http_minor(), connection->status_code(), false );
+	m_response->add_to_header( header );
+	m_decoder = nullptr;
+
+	if ( m_accept_added )
+	{
+		std::uint8_t c = coding::from_string( m_response->find_in_header( field::content_encoding ) );
+
+		// We asked for it, so we undo it. The caller sees the body as if it
+		// had been sent as is.
+
+		if ( ( c == coding::gzip ) || ( c == coding::deflate ) )
+		{
+			m_decoder = new coding::decoder( c, m_max_decoded_size );
+			m_response->remove_from_header( "Content-Encoding" );
+			m_response->remove_from_header( "Content-Length" );
+		}
+	}
+
+	if ( ( connection->status_code() == http::status::moved_permanently ) ||
+	     ( connection->status_code() == http::status::moved_temporarily ) )
+	{
+		auto it = header.find( field::location );
+
+		if ( it != header.end() )
+		{
+			if ( m_request->can_redirect() )
+			{
+				m_redirect = it->value();
+				m_request->redirect();
+			}
+
+			ret = 1;
+		}
+	}
+	
+	if ( m_redirect.size() > 0 )
+	{
+		nklog( log::verbose, "redirecting HTTP request to %", m_redirect.c_str() );
+		
+		m_request->set_uri( new netkit::uri( m_redirect ) );
+
+		client::start( m_request );
+
+		m_request = nullptr;
+	}
+	else if ( connection->status_code() != http::status::proxy_authentication )
+	{
+		m_request->headers_reply( m_response );
+		m_request->on_headers_reply( nullptr );
+	}
+	else
+	{
+		ret = 1;
+	}
+
+	return ret;
+}
+
+
+int
+client::body_was_received( connection::ref connection, const char *buf, size_t len )
 {
-	nklog( log::verbose, "" );
+	int ret = 0;
 
-	if ( m_settings )
+	if ( !m_interim && !m_expect_failed && ( m_redirect.size() == 0 ) && ( connection->status_code() != http::status::proxy_authentication ) )
 	{
-		delete m_settings;
+		if ( m_decoder )
+		{
+			request::ref	request( m_request );
+			response::ref	response( m_response );
+
+			if ( !m_decoder->write( reinterpret_cast< const std::uint8_t* >( buf ), len, [=]( const std::uint8_t *out, std::size_t out_len ) mutable
+			{
+				request->body_reply( response, out, out_len );
+			} ) )
+			{
+				ret = -1;
+			}
+		}
+		else
+		{
+			m_request->body_reply( m_response, ( std::uint8_t* ) buf, len );
+		}
 	}
 	
-	if ( m_parser )
+	return ret;
+}
+
+
+int
+client::message_was_received( connection::ref connection )
+{
+	if ( m_interim )
 	{
-		delete m_parser;
+		m_interim = false;
+		return 0;
+	}
+
+	if ( m_request && ( *m_hold != hold::none ) )
+	{
+		// The connection's wake() holds on to the connection.
+
+		m_request->set_wake( nullptr );
+	}
+
+	if ( ( connection->status_code() == http::status::proxy_authentication ) && proxy::auth_challenge() )
+	{
+		m_request->add_to_header( "Proxy-Authorization", "basic " + proxy::get()->authorization() );
+		m_request->add_to_header( "Proxy-Connection", "keep-alive" );
+		
+		client::start( m_request );
+	}
+	else if ( m_expect_failed )
+	{
+		client::start( m_request, false );
 	}
+	else if ( m_redirect.size() == 0 )
+	{
+		m_request->reply( m_response );
+		m_request->on_auth( nullptr );
+		m_request->on_body_reply( nullptr );
+		m_request->on_reply( nullptr );
+	}
+
+	m_done = true;
+
+	return 0;
 }
 
 
 void
-connection::init()
+client::process_did_end( connection::ref connection )
 {
-	m_settings = new http_parser_settings;
-	memset( m_settings, 0, sizeof( http_parser_settings ) );
-	
-	m_parser = new http_parser;
-	memset( m_parser, 0, sizeof( http_parser ) );
+	if ( m_done && m_connection )
+	{
+		http::connection::ref conn = m_connection;
 
-	m_settings->on_message_begin 	= message_will_begin;
-	m_settings->on_url				= uri_was_received;
-	m_settings->on_header_field		= header_field_was_received;
-	m_settings->on_header_value		= header_value_was_received;
-	m_settings->on_body				= body_was_received;
-	m_settings->on_headers_complete	= headers_were_received;
-	m_settings->on_message_complete	= message_was_received;
-	
-	http_parser_init( m_parser, HTTP_BOTH );
-	m_parser->data = this;
-}
+		m_connection = nullptr;
+
+		if ( conn->should_keep_alive() && conn->is_open() && ( *m_hold != hold::withheld ) )
+		{
+			pool::instance().checkin( m_pool_key, conn );
+		}
+		else
+		{
+			conn->close();
+		}
+
+		// After the checkin, so that the next request in line gets the
+		// connection we just gave back.
+
+		release_slot();
+	}
+}	
 
 
 void
-connection::set_secure( bool val, bool is_server )
+client::will_close( connection::ref connection )
 {
-	if ( !m_secure && val )
+	if ( !m_done && m_request )
 	{
-		if ( is_server )
+		if ( m_reused && !m_response && ( m_request->tries() == 0 ) )
 		{
-			m_source->add( tls::server::create() );
+			// The server gave up on an idle connection right as we reused it.
+			// Nothing was answered, so send the request again on a fresh one.
+
+			nklog( log::verbose, "idle connection for % was closed by peer, retrying", m_pool_key.c_str() );
+
+			m_request->new_try();
+			m_connection->set_handler( nullptr );
+			m_connection = nullptr;
+
+			release_slot();
+			client::start( m_request );
 		}
 		else
 		{
-			m_source->add( tls::client::create() );
+			release_slot();
+			m_request->reply( nullptr );
 		}
-
-		m_secure = true;
 	}
+
+	release_slot();
 }
 
 
-int
-connection::method() const
+#if defined( __APPLE__ )
+#	pragma mark client::pool implementation
+#endif
+
+client::pool&
+client::pool::instance()
 {
-	return m_parser->method;
+	static pool *singleton = new pool;
+
+	return *singleton;
 }
 
 
-int
-connection::status_code() const
+client::pool::pool()
+:
+	m_count( 0 ),
+	m_queued( 0 ),
+	m_max_idle( 64 ),
+	m_max_per_host( 8 ),
+	m_max_active_per_host( 16 ),
+	m_idle_timeout( 10000 ),
+	m_queue_timeout( 30000 ),
+	m_prune_scheduled( false ),
+	m_expire_scheduled( false ),
+	m_expire_timer( 0 )
 {
-	return m_parser->status_code;
 }
 
 
-int
-connection::http_major() const
+std::size_t
+client::pool::active( const std::string &key ) const
 {
-	return m_parser->http_major;
+	auto it = m_limits.find( key );
+
+	return ( it != m_limits.end() ) ? it->second.m_active : 0;
 }
 
 
-int
-connection::http_minor() const
+std::string
+client::pool::key_for( const uri::ref &uri )
 {
-	return m_parser->http_minor;
+	std::ostringstream os;
+
+	os << uri->scheme() << "://" << uri->host() << ":" << uri->port();
+
+	if ( !proxy::get()->is_null() && !proxy::get()->bypass( uri ) )
+	{
+		os << " via " << proxy::get()->uri()->to_string();
+	}
+
+	return os.str();
 }
 
 
-bool
-connection::put( message::ref message )
+connection::ref
+client::pool::checkout( const std::string &key )
 {
-	m_ostream.clear();
-	
-	message->preflight();
-	
-	message->send_prologue( this );
-	
-	for ( auto it = message->heeder().begin(); it != message->heeder().end(); it++ )
+	connection::ref	conn;
+	auto			it = m_hosts.find( key );
+
+	if ( it != m_hosts.end() )
 	{
-		*this << it->first << ": " << it->second << http::endl;
+		auto now = std::chrono::steady_clock::now();
+
+		// Most recently used connections live at the back
+
+		while ( !conn && !it->second.empty() )
+		{
+			entry &e = it->second.back();
+
+			e.m_on_close = nullptr;
+
+			if ( e.m_connection->is_open() && ( ( now - e.m_since ) < std::chrono::milliseconds( m_idle_timeout ) ) )
+			{
+				conn = e.m_connection;
+			}
+			else
+			{
+				e.m_connection->close();
+			}
+
+			it->second.pop_back();
+			m_count--;
+		}
+
+		if ( it->second.empty() )
+		{
+			m_hosts.erase( it );
+		}
 	}
-			
-	*this << http::endl << http::flush;
-	
-	message->send_body( this );
-	
-	return true;
+
+	return conn;
 }
 
 
-bool
-connection::flush()
+void
+client::pool::checkin( const std::string &key, connection::ref conn )
 {
-	std::string msg = m_ostream.str();
-		
-	if ( msg.size() > 0 )
+	if ( ( m_max_idle == 0 ) || ( m_max_per_host == 0 ) || ( m_idle_timeout <= 0 ) )
 	{
-		nklog( log::verbose, "sending msg: %", msg.c_str() );
-		
-		send( reinterpret_cast< const std::uint8_t* >( msg.c_str() ), msg.size(), [=]( int status )
+		conn->close();
+		return;
+	}
+
+	auto it = m_hosts.find( key );
+
+	if ( ( it != m_hosts.end() ) && ( it->second.size() >= m_max_per_host ) )
+	{
+		it->second.front().m_on_close = nullptr;
+		it->second.front().m_connection->close();
+		it->second.pop_front();
+		m_count--;
+	}
+	else if ( m_count >= m_max_idle )
+	{
+		// This may erase the node for key, so don't take a reference to it until afterwards
+
+		evict_oldest();
+	}
+
+	entries &host = m_hosts[ key ];
+
+	conn->set_handler( nullptr );
+
+	host.push_back( entry() );
+	host.back().m_connection	= conn;
+	host.back().m_since			= std::chrono::steady_clock::now();
+	m_count++;
+
+	connection *naked = conn.get();
+
+	conn->on_close( &host.back().m_on_close, [=]()
+	{
+		remove( key, naked );
+	} );
+
+	schedule_prune();
+}
+
+
+void
+client::pool::clear()
+{
+	hosts hosts;
+
+	hosts.swap( m_hosts );
+	m_count = 0;
+
+	for ( auto it1 = hosts.begin(); it1 != hosts.end(); it1++ )
+	{
+		for ( auto it2 = it1->second.begin(); it2 != it1->second.end(); it2++ )
 		{
-			if ( status != 0 )
+			it2->m_on_close = nullptr;
+			it2->m_connection->close();
+		}
+	}
+}
+
+
+void
+client::pool::remove( const std::string &key, connection *conn )
+{
+	auto it1 = m_hosts.find( key );
+
+	if ( it1 != m_hosts.end() )
+	{
+		for ( auto it2 = it1->second.begin(); it2 != it1->second.end(); it2++ )
+		{
+			if ( it2->m_connection.get() == conn )
 			{
+				// We're being called from inside the connection's close handler list,
+				// so make sure the cookie doesn't try to unregister itself from it.
+
+				it2->m_on_close->invalidate();
+				it1->second.erase( it2 );
+				m_count--;
+				break;
 			}
+		}
+
+		if ( it1->second.empty() )
+		{
+			m_hosts.erase( it1 );
+		}
+	}
+}
+
+
+void
+client::pool::evict_oldest()
+{
+	auto oldest = m_hosts.end();
+
+	for ( auto it = m_hosts.begin(); it != m_hosts.end(); it++ )
+	{
+		if ( !it->second.empty() && ( ( oldest == m_hosts.end() ) || ( it->second.front().m_since < oldest->second.front().m_since ) ) )
+		{
+			oldest = it;
+		}
+	}
+
+	if ( oldest != m_hosts.end() )
+	{
+		connection::ref conn = oldest->second.front().m_connection;
+
+		oldest->second.front().m_on_close = nullptr;
+		oldest->second.pop_front();
+		m_count--;
+
+		if ( oldest->second.empty() )
+		{
+			m_hosts.erase( oldest );
+		}
+
+		conn->close();
+	}
+}
+
+
+void
+client::pool::schedule_prune()
+{
+	if ( !m_prune_scheduled )
+	{
+		m_prune_scheduled = true;
+
+		runloop::main()->schedule_oneshot_timer( m_idle_timeout, [=]( runloop::event e )
+		{
+			m_prune_scheduled = false;
+			prune();
 		} );
-		
-		m_ostream.str( "" );
-		m_ostream.clear();
 	}
-		
-	return true;
 }
 
 
 void
-connection::close()
+client::pool::prune()
 {
-	if ( m_handler )
+	auto							now = std::chrono::steady_clock::now();
+	std::vector< connection::ref >	expired;
+
+	for ( auto it1 = m_hosts.begin(); it1 != m_hosts.end(); )
+	{
+		while ( !it1->second.empty() && ( ( now - it1->second.front().m_since ) >= std::chrono::milliseconds( m_idle_timeout ) ) )
+		{
+			it1->second.front().m_on_close = nullptr;
+			expired.push_back( it1->second.front().m_connection );
+			it1->second.pop_front();
+			m_count--;
+		}
+
+		if ( it1->second.empty() )
+		{
+			it1 = m_hosts.erase( it1 );
+		}
+		else
+		{
+			it1++;
+		}
+	}
+
+	for ( auto it = expired.begin(); it != expired.end(); it++ )
 	{
-		m_handler->will_close( this );
+		( *it )->close();
 	}
 
-	sink::close();
+	if ( m_count > 0 )
+	{
+		schedule_prune();
+	}
 }
 
 
-bool
-connection::process( const std::uint8_t *buf, size_t len )
+void
+client::pool::acquire( const std::string &key, client::ref c )
+{
+	host_limit &h = m_limits[ key ];
+
+	if ( ( m_max_active_per_host == 0 ) || ( ( h.m_active < m_max_active_per_host ) && h.m_waiting.empty() ) )
+	{
+		h.m_active++;
+		c->m_has_slot = true;
+		c->really_send();
+	}
+	else
+	{
+		nklog( log::verbose, "% requests to % in flight, queueing", h.m_active, key );
+
+		h.m_waiting.push_back( waiter() );
+		h.m_waiting.back().m_client	= c;
+		h.m_waiting.back().m_since	= std::chrono::steady_clock::now();
+		m_queued++;
+
+		schedule_expire( m_queue_timeout );
+	}
+}
+
+
+void
+client::pool::release( const std::string &key )
 {
-	m_handler->process_will_begin( this );
+	auto it = m_limits.find( key );
+
+	if ( it == m_limits.end() )
+	{
+		return;
+	}
 
-	std::streamsize processed	= http_parser_execute( m_parser, m_settings, ( const char* ) buf, len );
-	bool			ok			= true;
+	host_limit &h = it->second;
 
-	if ( processed != len )
+	if ( h.m_active > 0 )
 	{
-		nklog( log::error, "http_parser_execute() failed: bytes read = %ld, processed = %ld", len, processed );
-		ok = false;
+		h.m_active--;
 	}
 
-	m_handler->process_did_end( this );
+	if ( !h.m_waiting.empty() && ( ( m_max_active_per_host == 0 ) || ( h.m_active < m_max_active_per_host ) ) )
+	{
+		client::ref next = h.m_waiting.front().m_client;
 
-	return ok;
+		h.m_waiting.pop_front();
+		m_queued--;
+
+		h.m_active++;
+		next->m_has_slot = true;
+		next->really_send();
+	}
+	else if ( ( h.m_active == 0 ) && h.m_waiting.empty() )
+	{
+		m_limits.erase( it );
+	}
 }
 
 
-bool
-connection::upgrade_to_ws( const request::ref &request, server::response_f reply )
+void
+client::pool::schedule_expire( std::time_t msec )
 {
-	http::response::ref response;
+	auto at = std::chrono::steady_clock::now() + std::chrono::milliseconds( msec );
 
-	nklog( log::verbose, "upgrading http connection to websocket" );
-
-	response = new http::response( 1, 1, http::status::switching_protocols, false );
-	response->add_to_header( "Upgrade", "websocket" );
-	response->add_to_header( "Connection", "Upgrade" );
-	response->add_to_header( "Sec-WebSocket-Accept", ws::server::accept_key( request->ws_key() ) );
+	// The timeout may have been shortened since the last timer was set. A
+	// timer that has been overtaken by a sooner one does nothing.
 
-	reply( response, false );
+	if ( ( m_queue_timeout > 0 ) && ( !m_expire_scheduled || ( at < m_expire_at ) ) )
+	{
+		std::uint64_t timer = ++m_expire_timer;
 
-	m_source->add( ws::server::create() );
+		m_expire_scheduled	= true;
+		m_expire_at			= at;
 
-	return true;
+		runloop::main()->schedule_oneshot_timer( msec, [=]( runloop::event e )
+		{
+			if ( timer == m_expire_timer )
+			{
+				m_expire_scheduled = false;
+				expire();
+			}
+		} );
+	}
 }
 
 
-bool
-connection::upgrade_to_tls( const request::ref &request, server::response_f reply )
+void
+client::pool::expire()
 {
-	http::response::ref response;
+	auto						now		= std::chrono::steady_clock::now();
+	auto						timeout	= std::chrono::milliseconds( m_queue_timeout );
+	auto						next	= timeout;
+	std::vector< client::ref >	expired;
 
-	nklog( log::verbose, "upgrading http connection to tls" );
+	// Queues are in arrival order, so the ones that waited too long are
+	// all at the front, and the one after them is the next to go.
 
-	response = new http::response( 1, 1, http::status::switching_protocols, false );
-	response->add_to_header( "Connection", "Upgrade" );
-	response->add_to_header( "Upgrade", "TLS/1.0, HTTP/1.1" );
+	for ( auto it = m_limits.begin(); it != m_limits.end(); )
+	{
+		host_limit &h = it->second;
 
-	reply( response, false );
+		while ( !h.m_waiting.empty() && ( ( now - h.m_waiting.front().m_since ) >= timeout ) )
+		{
+			expired.push_back( h.m_waiting.front().m_client );
+			h.m_waiting.pop_front();
+			m_queued--;
+		}
 
-	m_source->add( tls::server::create() );
+		if ( !h.m_waiting.empty() )
+		{
+			next = std::min( next, std::chrono::duration_cast< std::chrono::milliseconds >( timeout - ( now - h.m_waiting.front().m_since ) ) );
+		}
 
-	return true;
-}
+		if ( ( h.m_active == 0 ) && h.m_waiting.empty() )
+		{
+			it = m_limits.erase( it );
+		}
+		else
+		{
+			it++;
+		}
+	}
 
+	if ( m_queued > 0 )
+	{
+		schedule_expire( std::max< std::time_t >( 1, static_cast< std::time_t >( next.count() ) ) );
+	}
 
-void
-connection::upgrade( sink::ref sink )
-{
-	for ( auto it = attrs_begin(); it != attrs_end(); it++ )
+	for ( auto it = expired.begin(); it != expired.end(); it++ )
 	{
-		sink->set_value_for_key( it->first, it->second );
+		nklog( log::warning, "request for % waited more than % msec for a connection", ( *it )->m_request->uri()->to_string(), m_queue_timeout );
+		( *it )->m_request->reply( nullptr );
 	}
+}
 
-	sink->bind( m_source );
 
-	unbind();
+#if defined( __APPLE__ )
+#	pragma mark client::cache implementation
+#endif
+
+static std::time_t
+cache_current_age( std::time_t corrected_age, std::time_t response_time, std::time_t now )
+{
+	return corrected_age + ( ( now > response_time ) ? now - response_time : 0 );
 }
 
 
-int
-connection::message_will_begin( http_parser *parser )
+static bool
+cache_credentialed( const request::ref &request )
 {
-	connection *self = reinterpret_cast< connection* >( parser->data );
-	assert( self );
-	assert( self->m_handler );
-	
-	nklog( log::verbose, "reading new message" );
-
-	self->m_parser->upgrade = 0;
-	self->m_parse_state	= NONE;
-	
-	self->m_header_field.clear();
-	self->m_header_value.clear();
-	self->m_header.clear();
+	// The answer may be meant for whoever these belong to alone.
 
-	self->m_handler->message_will_begin( self );
-	
-	return 0;
+	return !request->find_in_header( field::authorization ).empty() || !request->find_in_header( field::cookie ).empty();
 }
 
 
-int
-connection::uri_was_received( http_parser *parser, const char *buf, size_t len )
+client::cache&
+client::cache::instance()
 {
-	connection *self = reinterpret_cast< connection* >( parser->data );
-	assert( self );
-	assert( self->m_handler );
+	static cache *singleton = new cache;
 
-	return self->m_handler->uri_was_received( self, buf, len );
+	return *singleton;
 }
 
 
-int
-connection::header_field_was_received( http_parser *parser, const char *buf, size_t len )
+client::cache::cache()
+:
+	m_bytes( 0 ),
+	m_max_bytes( 8 * 1024 * 1024 ),
+	m_enabled( false )
 {
-	connection	*self = reinterpret_cast< connection* >( parser->data );
-	assert( self );
-	assert( self->m_handler );
+}
 
-	if ( self->m_parse_state != FIELD )
+
+bool
+client::cache::send( request::ref request )
+{
+	std::string		key				= request->uri()->to_string();
+	std::string		cache_control	= request->find_in_header( field::cache_control );
+	std::time_t		now				= time( nullptr );
+	std::time_t		max_age			= 0;
+	bool			credentialed	= cache_credentialed( request );
+	entry::ref		e;
+
+	if ( request->method() != method::get )
 	{
-		if ( ( self->m_header_field.size() > 0 ) && ( self->m_header_value.size() > 0 ) )
+		// A write to a URL makes whatever we had for it suspect.
+
+		if ( request->method() != method::head )
 		{
-			self->m_header[ self->m_header_field ] = self->m_header_value;
+			erase( key );
 		}
-		
-		self->m_header_field.assign( buf, buf + len );
-		self->m_parse_state = FIELD;
+
+		return false;
 	}
-	else
+
+	if ( request->body_reply_handler() || cache_directive( cache_control, "no-store" ) )
 	{
-		self->m_header_field.append( buf, buf + len );
+		return false;
 	}
 
-	return 0;
-}
-
-
-int
-connection::header_value_was_received( http_parser *parser, const char *buf, size_t len )
-{
-	connection *self = reinterpret_cast< connection* >( parser->data );
-	assert( self );
-	assert( self->m_handler );
+	// A caller making its own conditional request wants to see the answer.
 
-	if ( self->m_parse_state != VALUE )
+	if ( !request->find_in_header( field::if_none_match ).empty() || !request->find_in_header( field::if_modified_since ).empty() || !request->find_in_header( field::range ).empty() )
 	{
-		self->m_header_value.assign( buf, buf + len );
-		self->m_parse_state = VALUE;
+		return false;
 	}
-	else
+
+	if ( credentialed )
 	{
-		self->m_header_value.append( buf, buf + len );
-	}
+		// Neither served from the cache nor joined to someone else's fetch,
+		// and nobody joins this one. complete() decides whether what comes
+		// back may be kept.
 
-	return 0;
-}
+		request::headers_reply_f	headers_reply	= request->headers_reply_handler();
+		request::reply_f			reply			= request->reply_handler();
 
-	
-int
-connection::headers_were_received( http_parser *parser )
-{
-	connection *self = reinterpret_cast< connection* >( parser->data );
-	assert( self );
-	assert( self->m_handler );
+		request->on_headers_reply( nullptr );
+		request->on_reply( [=]( response::ref response ) mutable
+		{
+			request->on_headers_reply( headers_reply );
+			request->on_reply( reply );
+			complete( key, request, response );
+		} );
 
-	if ( ( self->m_header_field.size() > 0 ) && ( self->m_header_value.size() > 0 ) )
+		client::start( request );
+
+		return true;
+	}
+
+	auto it = m_fetches.find( key );
+
+	if ( it != m_fetches.end() )
 	{
-		self->m_header[ self->m_header_field ] = self->m_header_value;
+		nklog( log::verbose, "joining fetch already under way for %", key );
+		it->second.m_waiters.push_back( request );
+		return true;
 	}
 
-	return self->m_handler->headers_were_received( self, self->m_header );
-}
+	e = lookup( key );
 
-	
-int
-connection::body_was_received( http_parser *parser, const char *buf, size_t len )
-{
-	connection *self = reinterpret_cast< connection* >( parser->data );
-	assert( self );
-	assert( self->m_handler );
+	if ( e && !e->m_no_cache && !cache_directive( cache_control, "no-cache" ) )
+	{
+		std::time_t age		= cache_current_age( e->m_corrected_age, e->m_response_time, now );
+		bool		fresh	= ( age < e->m_lifetime );
 
-	return self->m_handler->body_was_received( self, buf, len );
-}
+		if ( fresh && cache_directive( cache_control, "max-age", &max_age ) )
+		{
+			fresh = ( age <= max_age );
+		}
 
-	
-int
-connection::message_was_received( http_parser *parser )
-{
-	connection *self = reinterpret_cast< connection* >( parser->data );
-	assert( self );
-	assert( self->m_handler );
+		if ( fresh )
+		{
+			nklog( log::verbose, "answering % from cache", key );
 
-	return self->m_handler->message_was_received( self );
-}
+			runloop::main()->dispatch( [=]() mutable
+			{
+				response::ref response = new http::response( 1, 1, e->m_status, false );
 
+				response->add_to_header( e->m_header );
+				response->add_to_header( "Age", std::to_string( cache_current_age( e->m_corrected_age, e->m_response_time, time( nullptr ) ) ) );
+				response->write( reinterpret_cast< const std::uint8_t* >( e->m_body.data() ), e->m_body.size() );
 
-#if defined( __APPLE__ )
-#	pragma mark server implementation
-#endif
+				request->headers_reply( response );
+				request->reply( response );
+			} );
+
+			return true;
+		}
+	}
 
-connection::ref			server::m_active_connection;
-connection::list		*server::m_connections;
-server::bindings		server::m_bindings;
+	// Going to the network. Everyone else asking for this URL until the
+	// answer arrives waits on this fetch.
 
-netkit::sink::ref
-server::adopt( netkit::source::ref source )
-{
-	connection *sink;
-	
-	sink = new connection( new server::handler );
+	fetch &f = m_fetches[ key ];
 
-	m_connections->push_back( sink );
+	f.m_stale = e;
+	f.m_waiters.push_back( request );
 
-	sink->on_close( nullptr, [=]() mutable
+	// Validators only go on this fetch. They come off again when it is
+	// done, so the caller's request is left as it was handed to us.
+
+	bool added_etag = false;
+	bool added_last = false;
+
+	if ( e )
 	{
-		auto it = std::find_if( m_connections->begin(), m_connections->end(), [=]( connection::ref inserted )
+		auto etag = e->m_header.find( field::etag );
+		auto last = e->m_header.find( field::last_modified );
+
+		if ( ( etag != e->m_header.end() ) && request->find_in_header( field::if_none_match ).empty() )
 		{
-			return ( inserted.get() == sink );
-		} );
+			request->add_to_header( "If-None-Match", etag->value() );
+			added_etag = true;
+		}
 
-		assert( it != m_connections->end() );
+		if ( ( last != e->m_header.end() ) && request->find_in_header( field::if_modified_since ).empty() )
+		{
+			request->add_to_header( "If-Modified-Since", last->value() );
+			added_last = true;
+		}
+	}
 
-		m_connections->erase( it );
-	} );
-	
-	return sink;
-}
+	request::headers_reply_f	headers_reply	= request->headers_reply_handler();
+	request::reply_f			reply			= request->reply_handler();
 
-	
-void
-server::bind( std::uint8_t m, const std::string &path, const std::string &type, request_f r )
-{
-	binding::ref b = new binding( path, type, r );
-	
-	bind( m, b );
-}
+	request->on_headers_reply( nullptr );
+	request->on_reply( [=]( response::ref response ) mutable
+	{
+		if ( added_etag )
+		{
+			request->remove_from_header( "If-None-Match" );
+		}
 
+		if ( added_last )
+		{
+			request->remove_from_header( "If-Modified-Since" );
+		}
 
-void
-server::bind( std::uint8_t m, const std::string &path, const std::string &type, request_body_was_received_f rbwr, request_f r )
-{
-	binding::ref b = new binding( path, type, rbwr, r );
-	
-	bind( m, b );
-}
+		request->on_headers_reply( headers_reply );
+		request->on_reply( reply );
+		complete( key, request, response );
+	} );
 
+	client::start( request );
 
-void
-server::bind( std::uint8_t m, const std::string &path, const std::string &type, request_will_begin_f rwb, request_body_was_received_f rbwr, request_f r )
-{
-	binding::ref b = new binding( path, type, rwb, rbwr, r );
-	
-	bind( m, b );
+	return true;
 }
 
 
 void
-server::bind( std::uint8_t m, const std::string &path, netkit::sink::ref s )
+client::cache::complete( const std::string &key, request::ref request, response::ref response )
 {
-//	binding::ref b = new binding( path, s );
-	
-//	bind( m, b );
-}
+	static const std::uint16_t	cacheable[]		= { 200, 203, 204, 300, 301, 404, 405, 410, 414, 501 };
+	fetch						f;
+	entry::ref					e;
+	std::time_t					now				= time( nullptr );
 
+	bool						credentialed	= cache_credentialed( request );
 
-void
-server::bind( std::uint8_t m, binding::ref b )
-{
-	bindings::iterator it = m_bindings.find( m );
-	
-	if ( it != m_bindings.end() )
+	auto it = credentialed ? m_fetches.end() : m_fetches.find( key );
+
+	if ( it != m_fetches.end() )
 	{
-		it->second.push_back( b );
+		f = it->second;
+		m_fetches.erase( it );
 	}
 	else
 	{
-		binding::list l;
-		
-		l.push_back( b );
-		
-		m_bindings[ m ] = l;
+		f.m_waiters.push_back( request );
 	}
-}
 
-
-server::binding::ref
-server::resolve( connection::ref conn, const message::header &header )
-{
-	server::binding::ref	binding;
-//	handler::ref	handler = dynamic_pointer_cast< handler::ref >( conn->handler() );
-	handler::ref			handler = dynamic_cast< server::handler* >( conn->handler().get() );
-	
-	auto it1 = m_bindings.find( conn->m_parser->method );
-	
-	if ( it1 != m_bindings.end() )
+	if ( response && ( response->status() == status::not_modified ) && f.m_stale )
 	{
-		std::string content_type;
-		auto it2 = header.find( "Content-Type" );
+		// Still good. Take the new validators and freshness and answer from
+		// what we have.
 
-		if ( it2 != header.end() )
-		{
-			content_type = it2->second;
-		}
+		static const std::uint16_t refreshed[] = { field::cache_control, field::date, field::etag, field::expires, field::last_modified };
+
+		e = new entry( *f.m_stale );
 
-		for ( auto it3 = it1->second.begin(); it3 != it1->second.end(); it3++ )
+		for ( auto i = 0u; i < sizeof( refreshed ) / sizeof( refreshed[ 0 ] ); i++ )
 		{
-			try
-			{
-				std::regex	regex1( regexify( ( *it3 )->m_path ) );
-				std::regex	regex2( regexify( ( *it3 )->m_type ) );
+			std::string val = response->find_in_header( refreshed[ i ] );
 
-				if ( ( ( *it3 )->m_type == "*" && std::regex_search( handler->m_uri, regex1 ) ) ||
-					( std::regex_search( handler->m_uri, regex1 ) && std::regex_search( content_type, regex2 ) ) )
-				{
-					binding = ( *it3 ).get();
-					break;
-				}
-			}
-			catch ( std::exception &exc )
+			if ( !val.empty() )
 			{
-				nklog( log::error, "caught exception in regex: %", exc.what() );
+				e->m_header.set( refreshed[ i ], val );
 			}
 		}
 	}
-	
-	if ( !binding )
+	else if ( response && ( request->uri()->to_string() == key ) && ( std::find( std::begin( cacheable ), std::end( cacheable ), response->status() ) != std::end( cacheable ) ) )
 	{
-		nklog( log::error, "unable to find binding for method % -> %", conn->method(), handler->m_uri.c_str() );
-		goto exit;
+		std::string	cache_control	= response->find_in_header( field::cache_control );
+		std::string	vary			= response->find_in_header( field::vary );
+
+		// RFC 7234 3.2: an answer to a request with credentials is only
+		// kept in a shared cache when the origin says it may be.
+
+		bool		shareable		= !credentialed || cache_directive( cache_control, "public" ) || cache_directive( cache_control, "s-maxage" );
+
+		// We always send the same Accept-Encoding and decode what comes back,
+		// so that is the only Vary we can safely ignore.
+
+		if ( shareable && !cache_directive( cache_control, "no-store" ) && !cache_directive( request->find_in_header( field::cache_control ), "no-store" ) &&
+		     ( vary.empty() || ( strcasecmp( vary.c_str(), "Accept-Encoding" ) == 0 ) ) && ( response->body_size() <= m_max_bytes / 8 ) )
+		{
+			e = new entry;
+
+			e->m_key	= key;
+			e->m_status	= response->status();
+			e->m_header	= response->heeder();
+			e->m_body	= response->body();
+
+			e->m_header.erase( field::connection );
+			e->m_header.erase( field::keep_alive );
+			e->m_header.erase( field::transfer_encoding );
+			e->m_header.erase( field::age );
+		}
 	}
-	
-exit:
 
-	return binding;
-}
+	if ( e )
+	{
+		std::string		cache_control	= e->m_header.find( field::cache_control ) != e->m_header.end() ? e->m_header.find( field::cache_control )->value() : std::string();
+		std::string		date_val		= response->find_in_header( field::date );
+		std::time_t		date			= date_val.empty() ? -1 : parse_date( date_val );
+		std::time_t		age				= 0;
+		std::time_t		max_age			= 0;
+
+		if ( date == -1 )
+		{
+			date = now;
+		}
 
+		age = atol( response->find_in_header( field::age ).c_str() );
 
-std::string
-server::regexify( const std::string &in )
-{
-	std::string out( in );
+		e->m_response_time	= now;
+		e->m_corrected_age	= std::max< std::time_t >( ( now > date ) ? now - date : 0, age );
+		e->m_no_cache		= cache_directive( cache_control, "no-cache" );
+		e->m_lifetime		= 0;
 
-	replace( out, "\\", "\\\\" );
-    replace( out, "^", "\\^");
-	replace( out, ".", "\\.");
-	replace( out, "$", "\\$");
-	replace( out, "|", "\\|");
-    replace( out, "(", "\\(");
-    replace( out, ")", "\\)");
-    replace( out, "[", "\\[");
-    replace( out, "]", "\\]");
-    replace( out, "*", "\\*");
-    replace( out, "+", "\\+");
-    replace( out, "?", "\\?");
-    replace( out, "/", "\\/");
-	replace( out, "\\?", ".");
-    replace( out, "\\*", ".*");
+		if ( cache_directive( cache_control, "max-age", &max_age ) )
+		{
+			e->m_lifetime = max_age;
+		}
+		else if ( e->m_header.find( field::expires ) != e->m_header.end() )
+		{
+			std::time_t expires = parse_date( e->m_header.find( field::expires )->value() );
 
-	return out;
-}
+			e->m_lifetime = ( expires > date ) ? expires - date : 0;
+		}
+		else if ( e->m_header.find( field::last_modified ) != e->m_header.end() )
+		{
+			// The usual heuristic: a tenth of how long it had gone unchanged,
+			// and never more than a day.
 
+			std::time_t last = parse_date( e->m_header.find( field::last_modified )->value() );
 
-void
-server::replace( std::string& str, const std::string& oldStr, const std::string& newStr)
-{
-	size_t pos = 0;
+			if ( ( last != -1 ) && ( last < date ) )
+			{
+				e->m_lifetime = std::min< std::time_t >( ( date - last ) / 10, 24 * 60 * 60 );
+			}
+		}
 
-	while ( ( pos = str.find( oldStr, pos ) ) != std::string::npos )
-	{
-		str.replace(pos, oldStr.length(), newStr);
-		pos += newStr.length();
+		if ( ( e->m_lifetime > 0 ) || ( e->m_header.find( field::etag ) != e->m_header.end() ) || ( e->m_header.find( field::last_modified ) != e->m_header.end() ) )
+		{
+			store( e );
+		}
+		else
+		{
+			erase( key );
+		}
 	}
-}
-
-#if defined( __APPLE__ )
-#	pragma mark server::handler implementation
-#endif
 
-server::handler::handler()
-{
-}
+	for ( auto it = f.m_waiters.begin(); it != f.m_waiters.end(); it++ )
+	{
+		response::ref answer = response;
 
+		// Each waiter gets its own copy when we have one to hand out.
 
-server::handler::~handler()
-{
-	nklog( log::verbose, "" );
-}
+		if ( e )
+		{
+			answer = new http::response( 1, 1, e->m_status, false );
+			answer->add_to_header( e->m_header );
+			answer->write( reinterpret_cast< const std::uint8_t* >( e->m_body.data() ), e->m_body.size() );
+		}
 
+		if ( answer )
+		{
+			( *it )->headers_reply( answer );
+		}
 
-void
-server::handler::process_will_begin( connection::ref connection )
-{
-	server::set_active_connection( connection.get() );
+		( *it )->reply( answer );
+	}
 }
 
 
-void
-server::handler::message_will_begin( connection::ref connection )
+client::cache::entry::ref
+client::cache::lookup( const std::string &key )
 {
-	m_binding = nullptr;
-	m_uri.clear();
-}
+	auto		it = m_index.find( key );
+	entry::ref	e;
 
+	if ( it != m_index.end() )
+	{
+		m_lru.splice( m_lru.begin(), m_lru, it->second );
+		e = *it->second;
+	}
+	else if ( !m_folder.empty() )
+	{
+		e = load( key );
 
-int
-server::handler::uri_was_received( connection::ref connection, const char *buf, size_t len )
-{
-	nklog( log::verbose, "uri was received" );
-	
-	m_uri.append( buf, buf + len );
+		if ( e )
+		{
+			m_lru.push_front( e );
+			m_index[ key ] = m_lru.begin();
+			m_bytes += e->m_body.size();
+			evict();
+		}
+	}
 
-	return 0;
+	return e;
 }
 
 
-int
-server::handler::headers_were_received( connection::ref connection, message::header &header )
+void
+client::cache::store( const entry::ref &e )
 {
-	int ret = -1;
+	auto it = m_index.find( e->m_key );
 
-	m_binding = server::resolve( connection, header );
-	
-	if ( !m_binding )
+	if ( it != m_index.end() )
 	{
-		response::ref response = new http::response( connection->http_major(), connection->http_minor(), http::status::not_found, false );
-		response->add_to_header( "Connection", "Close" );
-		response->add_to_header( "Content-Type", "text/html" );
-		*response << "<html>Error 404: Content Not Found</html>";
-		response->add_to_header( "Content-Length", static_cast< int >( response->body().size() ) );
-		connection->put( response.get() );
-		goto exit;
+		m_bytes -= ( *it->second )->m_body.size();
+		m_lru.erase( it->second );
+		m_index.erase( it );
 	}
 
-	m_request = m_binding->m_rwb( connection->method(), connection->http_major(), connection->http_minor(), new uri( m_uri ) );
+	m_lru.push_front( e );
+	m_index[ e->m_key ] = m_lru.begin();
+	m_bytes += e->m_body.size();
 
-	if ( !m_request )
-	{
-		response::ref response = new http::response( connection->http_major(), connection->http_minor(), http::status::not_found, false );
-		response->add_to_header( "Connection", "Close" );
-		response->add_to_header( "Content-Type", "text/html" );
-		*response << "<html>Error 404: Content Not Found</html>";
-		connection->put( response.get() );
-		goto exit;
-	}
-
-	m_request->add_to_header( header );
-	
-	if ( m_request->expect() == "100-continue" )
+	if ( !m_folder.empty() )
 	{
-		response::ref response = new http::response( connection->http_major(), connection->http_minor(), http::status::cont, false );
-		connection->put( response.get() );
+		save( e );
 	}
 
-	ret = 0;
-
-exit:
-
-	return ret;
+	evict();
 }
 
 
-int
-server::handler::body_was_received( connection::ref connection, const char *buf, size_t len )
+void
+client::cache::erase( const std::string &key )
 {
-	assert( m_binding );
-	assert( m_request );
+	auto it = m_index.find( key );
 
-	return m_binding->m_rbwr( m_request, ( const uint8_t* ) buf, len, [=]( response::ref response, bool close ) mutable
+	if ( it != m_index.end() )
 	{
-		connection->put( response.get() );
-		
-		if ( close )
-		{
-			connection->close();
-		}
+		m_bytes -= ( *it->second )->m_body.size();
+		m_lru.erase( it->second );
+		m_index.erase( it );
+	}
 
-		m_request = nullptr;
-	} );
+	if ( !m_folder.empty() )
+	{
+		remove( path_for( key ).c_str() );
+	}
 }
 
 
-int
-server::handler::message_was_received( connection::ref connection )
+void
+client::cache::clear()
 {
-	assert( m_binding );
-	assert( m_request );
-
-	return m_binding->m_r( m_request, [=]( response::ref response, bool close ) mutable
+	if ( !m_folder.empty() )
 	{
-		connection->put( response.get() );
-
-		if ( close )
+		for ( auto it = m_lru.begin(); it != m_lru.end(); it++ )
 		{
-			connection->close();
+			remove( path_for( ( *it )->m_key ).c_str() );
 		}
+	}
 
-		m_request = nullptr;
-	} );
+	m_index.clear();
+	m_lru.clear();
+	m_bytes = 0;
 }
 
 
 void
-server::handler::process_did_end( connection::ref connection )
+client::cache::evict()
 {
-	server::set_active_connection( nullptr );
+	// Only the memory tier is bounded here. What was saved to disk stays
+	// there until it is replaced or erased.
+
+	while ( !m_lru.empty() && ( m_bytes > m_max_bytes ) )
+	{
+		m_bytes -= m_lru.back()->m_body.size();
+		m_index.erase( m_lru.back()->m_key );
+		m_lru.pop_back();
+	}
 }
 
 
-void
-server::handler::will_close( connection::ref connection )
+std::string
+client::cache::path_for( const std::string &key ) const
 {
-}
+	std::uint64_t		hash = 14695981039346656037ULL;
+	std::ostringstream	os;
 
+	for ( auto it = key.begin(); it != key.end(); it++ )
+	{
+		hash ^= static_cast< std::uint8_t >( *it );
+		hash *= 1099511628211ULL;
+	}
 
-#if defined( __APPLE__ )
-#	pragma mark client implementation
-#endif
+	os << m_folder << "/" << std::hex << hash << ".nkcache";
 
-client::client( const request::ref &request )
-:
-	m_connection( new connection( this ) ),
-	m_request( request ),
-	m_done( false )
-{
+	return os.str();
 }
 
 
-client::~client()
+client::cache::entry::ref
+client::cache::load( const std::string &key )
 {
-	nklog( log::verbose, "" );
-}
+	// The file is the key, a line of bookkeeping, the headers as they would
+	// go on the wire, and then the body.
+
+	std::string		path	= path_for( key );
+	const char		*data	= nullptr;
+	std::size_t		size	= 0;
+	entry::ref		e;
+	std::string		contents;
+	const char		*pos;
+	const char		*end;
+	const char		*eol;
+	unsigned		no_cache;
+	long long		response_time;
+	long long		corrected_age;
+	long long		lifetime;
+	unsigned		status;
 
+#if defined( WIN32 )
 
-void
-client::send( const request::ref &request )
-{
-	client *self = new client( request );
-	
-	self->really_send();
-}
+	std::ifstream in( path.c_str(), std::ios::in | std::ios::binary );
 
+	if ( !in )
+	{
+		goto exit;
+	}
+
+	contents.assign( std::istreambuf_iterator< char >( in ), std::istreambuf_iterator< char >() );
+	data = contents.data();
+	size = contents.size();
+
+#else
 
-void
-client::really_send()
-{
-	m_connection->connect( m_request->uri(), [=]( int status, const endpoint::ref &peer )
 	{
-		if ( status == 0 )
+		int			file = open( path.c_str(), O_RDONLY );
+		struct stat	st;
+
+		if ( file < 0 )
 		{
-			m_request->add_to_header( "Host", m_request->uri()->host() );
-			m_request->add_to_header( "User-Agent", "NetKit/2 " + platform::machine_description() );
-			m_request->add_to_header( "Connection", "keep-alive" );
+			goto exit;
+		}
 
-			if ( proxy::get()->is_http() && ( proxy::get()->authorization().size() > 0 ) )
-			{
-				m_request->add_to_header( "Proxy-Authorization", "basic " + proxy::get()->authorization() );
-				m_request->add_to_header( "Proxy-Connection", "keep-alive" );
-			}
+		if ( ( fstat( file, &st ) == 0 ) && ( st.st_size > 0 ) )
+		{
+			void *addr = mmap( nullptr, static_cast< std::size_t >( st.st_size ), PROT_READ, MAP_PRIVATE, file, 0 );
 
-			if ( m_request->body().length() > 0 )
+			if ( addr != MAP_FAILED )
 			{
-				m_request->add_to_header( "Content-Length", m_request->body().length() );
+				data = reinterpret_cast< const char* >( addr );
+				size = static_cast< std::size_t >( st.st_size );
 			}
-
-			m_connection->put( m_request.get() );
 		}
-		else
+
+		::close( file );
+
+		if ( !data )
 		{
-			nklog( log::error, "received error % trying to connect to uri '%'", status, m_request->uri()->to_string().c_str() );
-			m_request->reply( nullptr );
+			goto exit;
 		}
-	} );
-}
+	}
 
+#endif
 
-void
-client::process_will_begin( connection::ref connection )
-{
-}
+	pos = data;
+	end = data + size;
+	eol = reinterpret_cast< const char* >( memchr( pos, '\n', end - pos ) );
 
+	if ( !eol || ( std::string( pos, eol ) != key ) )
+	{
+		goto unmap;
+	}
 
-void
-client::message_will_begin( connection::ref connection )
-{
-	m_request->set_redirect( "" );
-}
+	pos = eol + 1;
+	eol = reinterpret_cast< const char* >( memchr( pos, '\n', end - pos ) );
 
+	if ( !eol || ( sscanf( std::string( pos, eol ).c_str(), "%u %lld %lld %lld %u", &status, &response_time, &corrected_age, &lifetime, &no_cache ) != 5 ) )
+	{
+		goto unmap;
+	}
 
-int
-client::uri_was_received( connection::ref connection, const char *buf, size_t len )
-{
-	assert( 0 );
-	return 0;
-}
+	e = new entry;
 
+	e->m_key			= key;
+	e->m_status			= static_cast< std::uint16_t >( status );
+	e->m_response_time	= static_cast< std::time_t >( response_time );
+	e->m_corrected_age	= static_cast< std::time_t >( corrected_age );
+	e->m_lifetime		= static_cast< std::time_t >( lifetime );
+	e->m_no_cache		= no_cache ? true : false;
 
-int
-client::headers_were_received( connection::ref connection, message::header &header )
-{
-	int ret = 0;
+	for ( pos = eol + 1; pos < end; pos = eol + 2 )
+	{
+		const char *colon;
 
-	m_response = new response( connection->http_major(), connection->http_minor(), connection->status_code(), false );
-	m_response->add_to_header( header );
+		eol = reinterpret_cast< const char* >( memchr( pos, '\r', end - pos ) );
 
-	if ( ( connection->status_code() == http::status::moved_permanently ) ||
-	     ( connection->status_code() == http::status::moved_temporarily ) )
-	{
-		for ( auto it = header.begin(); it != header.end(); it++ )
+		if ( !eol || ( eol == pos ) )
 		{
-			if ( it->first == "Location" )
-			{
-				if ( m_request->can_redirect() )
-				{
-					m_redirect = it->second;
-					m_request->redirect();
-				}
+			break;
+		}
+
+		colon = reinterpret_cast< const char* >( memchr( pos, ':', eol - pos ) );
 
-				ret = 1;
+		if ( colon )
+		{
+			const char *val = colon + 1;
+
+			while ( ( val < eol ) && ( *val == ' ' ) )
+			{
+				val++;
 			}
+
+			e->m_header.set( pos, colon - pos, val, eol - val );
 		}
 	}
-	
-	if ( m_redirect.size() > 0 )
-	{
-		nklog( log::verbose, "redirecting HTTP request to %", m_redirect.c_str() );
-		
-		m_request->set_uri( new netkit::uri( m_redirect ) );
 
-		client::send( m_request );
-
-		m_request = nullptr;
-	}
-	else if ( connection->status_code() != http::status::proxy_authentication )
-	{
-		m_request->headers_reply( m_response );
-		m_request->on_headers_reply( nullptr );
-	}
-	else
+	if ( !eol || ( eol + 2 > end ) )
 	{
-		ret = 1;
+		e = nullptr;
+		goto unmap;
 	}
 
-	return ret;
-}
+	e->m_body.assign( eol + 2, end );
 
+unmap:
 
-int
-client::body_was_received( connection::ref connection, const char *buf, size_t len )
-{
-	if ( ( m_redirect.size() == 0 ) && ( connection->status_code() != http::status::proxy_authentication ) )
-	{
-		m_request->body_reply( m_response, ( std::uint8_t* ) buf, len );
-	}
-	
-	return 0;
+#if !defined( WIN32 )
+	munmap( const_cast< char* >( data ), size );
+#endif
+
+exit:
+
+	return e;
 }
 
 
-int
-client::message_was_received( connection::ref connection )
+void
+client::cache::save( const entry::ref &e )
 {
-	if ( ( connection->status_code() == http::status::proxy_authentication ) && proxy::auth_challenge() )
-	{
-		m_request->add_to_header( "Proxy-Authorization", "basic " + proxy::get()->authorization() );
-		m_request->add_to_header( "Proxy-Connection", "keep-alive" );
-		
-		client::send( m_request );
-	}
-	else if ( m_redirect.size() == 0 )
+	std::string		path	= path_for( e->m_key );
+	std::string		temp	= path + ".tmp";
+	std::ofstream	out( temp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+
+	if ( !out )
 	{
-		m_request->reply( m_response );
-		m_request->on_auth( nullptr );
-		m_request->on_body_reply( nullptr );
-		m_request->on_reply( nullptr );
+		nklog( log::warning, "unable to write cache file %", temp );
+		return;
 	}
 
-	m_done = true;
-
-	return 0;
-}
+	out << e->m_key << "\n";
+	out << e->m_status << " " << static_cast< long long >( e->m_response_time ) << " " << static_cast< long long >( e->m_corrected_age ) << " " << static_cast< long long >( e->m_lifetime ) << " " << ( e->m_no_cache ? 1 : 0 ) << "\n";
 
-
-void
-client::process_did_end( connection::ref connection )
-{
-	if ( m_done )
+	for ( auto it = e->m_header.begin(); it != e->m_header.end(); it++ )
 	{
-		m_connection->close();
-		m_connection = nullptr;
+		out << it->name() << ": " << it->value() << "\r\n";
 	}
-}	
 
+	out << "\r\n";
+	out.write( e->m_body.data(), e->m_body.size() );
+	out.close();
 
-void
-client::will_close( connection::ref connection )
-{
-	if ( !m_done && m_request )
+	// Readers only ever see a whole file.
+
+	remove( path.c_str() );
+
+	if ( rename( temp.c_str(), path.c_str() ) != 0 )
 	{
-		m_request->reply( nullptr );
+		nklog( log::warning, "unable to move cache file into place at %", path );
+		remove( temp.c_str() );
 	}
 }
@@ -0,0 +1,2445 @@
+/*
+ * Copyright (c) 2013, Porchdog Software Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are those
+ * of the authors and should not be interpreted as representing official policies,
+ * either expressed or implied, of the FreeBSD Project.
+ *
+ */
+ 
+#include <NetKit/NKHTTP2.h>
+#include <NetKit/NKSocket.h>
+#include <NetKit/NKLog.h>
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+using namespace netkit::http2;
+
+#if defined( min )
+#	undef min
+#endif
+
+const char			*netkit::http2::preface		= "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const std::size_t	netkit::http2::preface_len	= 24;
+
+// Where we stand on things the peer can't change. Our windows are a lot
+// bigger than the 64K the protocol starts out with, so a single stream can
+// keep a fast link busy.
+
+static const std::int64_t	default_window			= 65535;
+static const std::int64_t	local_window			= 1 << 24;
+static const std::int64_t	local_stream_window		= 1 << 20;
+static const std::uint32_t	local_max_streams		= 128;
+static const std::size_t	default_frame_size		= 16384;
+static const std::size_t	default_table_size		= 4096;
+static const std::size_t	max_header_block		= 256 * 1024;
+static const std::size_t	local_max_header_list	= 64 * 1024;
+static const std::uint32_t	max_stream_id			= 0x7fffffff;
+
+// What a peer gets away with before we hang up on it. Resets in any one
+// second, which each may have cost a binding call ("rapid reset"), and
+// PING and SETTINGS acks queued while it isn't reading what we send.
+
+static const std::size_t	max_resets_per_second	= 100;
+static const std::size_t	max_pending_acks		= 1000;
+
+#if defined( __APPLE__ )
+#	pragma mark frame implementation
+#endif
+
+const std::uint8_t frame::data					= 0x0;
+const std::uint8_t frame::headers				= 0x1;
+const std::uint8_t frame::priority				= 0x2;
+const std::uint8_t frame::rst_stream			= 0x3;
+const std::uint8_t frame::settings				= 0x4;
+const std::uint8_t frame::push_promise			= 0x5;
+const std::uint8_t frame::ping					= 0x6;
+const std::uint8_t frame::goaway				= 0x7;
+const std::uint8_t frame::window_update			= 0x8;
+const std::uint8_t frame::continuation			= 0x9;
+
+const std::uint8_t frame::end_stream			= 0x1;
+const std::uint8_t frame::ack					= 0x1;
+const std::uint8_t frame::end_headers			= 0x4;
+const std::uint8_t frame::padded				= 0x8;
+const std::uint8_t frame::prioritized			= 0x20;
+
+const std::size_t frame::header_size			= 9;
+
+const std::uint32_t error::no_error				= 0x0;
+const std::uint32_t error::protocol_error		= 0x1;
+const std::uint32_t error::internal_error		= 0x2;
+const std::uint32_t error::flow_control_error	= 0x3;
+const std::uint32_t error::settings_timeout		= 0x4;
+const std::uint32_t error::stream_closed		= 0x5;
+const std::uint32_t error::frame_size_error		= 0x6;
+const std::uint32_t error::refused_stream		= 0x7;
+const std::uint32_t error::cancel				= 0x8;
+const std::uint32_t error::compression_error	= 0x9;
+const std::uint32_t error::connect_error		= 0xa;
+const std::uint32_t error::enhance_your_calm	= 0xb;
+const std::uint32_t error::inadequate_security	= 0xc;
+const std::uint32_t error::http_1_1_required	= 0xd;
+
+const std::uint16_t setting::header_table_size		= 0x1;
+const std::uint16_t setting::enable_push			= 0x2;
+const std::uint16_t setting::max_concurrent_streams	= 0x3;
+const std::uint16_t setting::initial_window_size	= 0x4;
+const std::uint16_t setting::max_frame_size			= 0x5;
+const std::uint16_t setting::max_header_list_size	= 0x6;
+
+
+static inline std::uint32_t
+read32( const std::uint8_t *p )
+{
+	return ( std::uint32_t( p[ 0 ] ) << 24 ) | ( std::uint32_t( p[ 1 ] ) << 16 ) | ( std::uint32_t( p[ 2 ] ) << 8 ) | std::uint32_t( p[ 3 ] );
+}
+
+
+static inline void
+write32( std::string &out, std::uint32_t val )
+{
+	char buf[ 4 ] = { char( val >> 24 ), char( val >> 16 ), char( val >> 8 ), char( val ) };
+
+	out.append( buf, sizeof( buf ) );
+}
+
+
+static inline void
+write_setting( std::string &out, std::uint16_t id, std::uint32_t val )
+{
+	char buf[ 2 ] = { char( id >> 8 ), char( id ) };
+
+	out.append( buf, sizeof( buf ) );
+	write32( out, val );
+}
+
+
+void
+frame::write_header( std::string &out, std::size_t len, std::uint8_t type, std::uint8_t flags, std::uint32_t stream )
+{
+	char buf[ 5 ] = { char( len >> 16 ), char( len >> 8 ), char( len ), char( type ), char( flags ) };
+
+	out.append( buf, sizeof( buf ) );
+	write32( out, stream & max_stream_id );
+}
+
+#if defined( __APPLE__ )
+#	pragma mark hpack implementation
+#endif
+
+// RFC 7541 appendix A.
+
+static const struct { const char *m_name; const char *m_value; } g_static_table[] =
+{
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+// RFC 7541 appendix B. EOS, the 257th code, is thirty 1 bits.
+
+static const std::uint32_t g_huffman_codes[ 256 ] =
+{
+	0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5, 0x0fffffe6, 0x0fffffe7,
+	0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9, 0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec,
+	0x0fffffed, 0x0fffffee, 0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+	0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9, 0x0ffffffa, 0x0ffffffb,
+	0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa, 0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa,
+	0x000003fa, 0x000003fb, 0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+	0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b, 0x0000001c, 0x0000001d,
+	0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb, 0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc,
+	0x00001ffa, 0x00000021, 0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+	0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068, 0x00000069, 0x0000006a,
+	0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e, 0x0000006f, 0x00000070, 0x00000071, 0x00000072,
+	0x000000fc, 0x00000073, 0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+	0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005, 0x00000025, 0x00000026,
+	0x00000027, 0x00000006, 0x00000074, 0x00000075, 0x00000028, 0x00000029, 0x0000002a, 0x00000007,
+	0x0000002b, 0x00000076, 0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+	0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd, 0x00001ffd, 0x0ffffffc,
+	0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8, 0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9,
+	0x003fffd6, 0x007fffda, 0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+	0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1, 0x007fffe2, 0x007fffe3,
+	0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5, 0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef,
+	0x003fffda, 0x001fffdd, 0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+	0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf, 0x007fffeb, 0x007fffec,
+	0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2, 0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef,
+	0x000fffea, 0x003fffe2, 0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+	0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2, 0x003fffe8, 0x01ffffec,
+	0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde, 0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed,
+	0x0007fff2, 0x001fffe3, 0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+	0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3, 0x07ffffe4, 0x07ffffe5,
+	0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6, 0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3,
+	0x003fffea, 0x003fffeb, 0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+	0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8, 0x07ffffe9, 0x07ffffea,
+	0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed, 0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+};
+
+static const std::uint8_t g_huffman_lengths[ 256 ] =
+{
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+
+// The static table as fields, plus lookups by name and by name and value.
+
+struct static_table
+{
+	hpack::fields									m_fields;
+	std::unordered_map< std::string, std::size_t >	m_names;
+	std::unordered_map< std::string, std::size_t >	m_pairs;
+};
+
+
+static const static_table&
+get_static_table()
+{
+	static const static_table table = []()
+	{
+		static_table table;
+
+		for ( std::size_t i = 0; i < sizeof( g_static_table ) / sizeof( g_static_table[ 0 ] ); i++ )
+		{
+			std::string name( g_static_table[ i ].m_name );
+			std::string value( g_static_table[ i ].m_value );
+
+			table.m_fields.push_back( hpack::field( name, value ) );
+			table.m_names.insert( std::make_pair( name, i + 1 ) );
+			table.m_pairs.insert( std::make_pair( name + '\0' + value, i + 1 ) );
+		}
+
+		return table;
+	}();
+
+	return table;
+}
+
+
+// Huffman decoding runs a nibble at a time over a state table built from
+// the code tree. No code is shorter than five bits, so each step emits at
+// most one symbol.
+
+struct huffman_table
+{
+	struct step
+	{
+		std::uint16_t	m_next;
+		std::int16_t	m_symbol;
+		bool			m_fail;
+	};
+
+	struct node
+	{
+		std::int16_t	m_child[ 2 ];
+		std::int16_t	m_symbol;
+	};
+
+	std::vector< node >		m_nodes;
+	std::vector< step >		m_steps;
+	std::vector< bool >		m_accept;
+};
+
+
+static const huffman_table&
+get_huffman_table()
+{
+	static const huffman_table table = []()
+	{
+		huffman_table	table;
+		huffman_table::node	root = { { -1, -1 }, -1 };
+
+		table.m_nodes.push_back( root );
+
+		for ( int symbol = 0; symbol <= 256; symbol++ )
+		{
+			std::uint32_t	code	= ( symbol < 256 ) ? g_huffman_codes[ symbol ] : 0x3fffffff;
+			int				len		= ( symbol < 256 ) ? g_huffman_lengths[ symbol ] : 30;
+			std::size_t		cur		= 0;
+
+			for ( int bit = len - 1; bit >= 0; bit-- )
+			{
+				int b = ( code >> bit ) & 1;
+
+				if ( table.m_nodes[ cur ].m_child[ b ] < 0 )
+				{
+					table.m_nodes[ cur ].m_child[ b ] = static_cast< std::int16_t >( table.m_nodes.size() );
+					table.m_nodes.push_back( root );
+				}
+
+				cur = table.m_nodes[ cur ].m_child[ b ];
+			}
+
+			table.m_nodes[ cur ].m_symbol = static_cast< std::int16_t >( symbol );
+		}
+
+		table.m_steps.resize( table.m_nodes.size() * 16 );
+		table.m_accept.resize( table.m_nodes.size(), false );
+
+		for ( std::size_t n = 0; n < table.m_nodes.size(); n++ )
+		{
+			if ( table.m_nodes[ n ].m_symbol >= 0 )
+			{
+				continue;
+			}
+
+			for ( int nibble = 0; nibble < 16; nibble++ )
+			{
+				huffman_table::step	&step	= table.m_steps[ n * 16 + nibble ];
+				std::size_t			cur		= n;
+
+				step.m_symbol	= -1;
+				step.m_fail		= false;
+
+				for ( int bit = 3; bit >= 0; bit-- )
+				{
+					cur = table.m_nodes[ cur ].m_child[ ( nibble >> bit ) & 1 ];
+
+					if ( table.m_nodes[ cur ].m_symbol == 256 )
+					{
+						step.m_fail = true;
+					}
+					else if ( table.m_nodes[ cur ].m_symbol >= 0 )
+					{
+						step.m_symbol	= table.m_nodes[ cur ].m_symbol;
+						cur				= 0;
+					}
+				}
+
+				step.m_next = static_cast< std::uint16_t >( cur );
+			}
+		}
+
+		// A string may end mid-code only on padding, which is fewer than
+		// eight bits of EOS.
+
+		for ( std::size_t depth = 0, cur = 0; depth < 8; depth++, cur = table.m_nodes[ cur ].m_child[ 1 ] )
+		{
+			table.m_accept[ cur ] = true;
+		}
+
+		return table;
+	}();
+
+	return table;
+}
+
+
+static bool
+huffman_decode( const std::uint8_t *buf, std::size_t len, std::string &out )
+{
+	const huffman_table	&table	= get_huffman_table();
+	std::size_t			state	= 0;
+
+	for ( std::size_t i = 0; i < len; i++ )
+	{
+		for ( int shift = 4; shift >= 0; shift -= 4 )
+		{
+			const huffman_table::step &step = table.m_steps[ state * 16 + ( ( buf[ i ] >> shift ) & 0xf ) ];
+
+			if ( step.m_fail )
+			{
+				return false;
+			}
+
+			if ( step.m_symbol >= 0 )
+			{
+				out.push_back( static_cast< char >( step.m_symbol ) );
+			}
+
+			state = step.m_next;
+		}
+	}
+
+	return table.m_accept[ state ];
+}
+
+
+static std::size_t
+huffman_length( const std::string &s )
+{
+	std::size_t bits = 0;
+
+	for ( auto it = s.begin(); it != s.end(); it++ )
+	{
+		bits += g_huffman_lengths[ static_cast< std::uint8_t >( *it ) ];
+	}
+
+	return ( bits + 7 ) / 8;
+}
+
+
+static void
+huffman_encode( std::string &out, const std::string &s )
+{
+	std::uint64_t	acc		= 0;
+	unsigned		bits	= 0;
+
+	for ( auto it = s.begin(); it != s.end(); it++ )
+	{
+		std::uint8_t c = static_cast< std::uint8_t >( *it );
+
+		acc		= ( acc << g_huffman_lengths[ c ] ) | g_huffman_codes[ c ];
+		bits	+= g_huffman_lengths[ c ];
+
+		while ( bits >= 8 )
+		{
+			bits -= 8;
+			out.push_back( static_cast< char >( acc >> bits ) );
+		}
+
+		acc &= ( std::uint64_t( 1 ) << bits ) - 1;
+	}
+
+	if ( bits > 0 )
+	{
+		out.push_back( static_cast< char >( ( acc << ( 8 - bits ) ) | ( 0xff >> bits ) ) );
+	}
+}
+
+
+static void
+write_integer( std::string &out, std::uint8_t first, unsigned prefix, std::uint64_t val )
+{
+	std::uint64_t max = ( 1u << prefix ) - 1;
+
+	if ( val < max )
+	{
+		out.push_back( static_cast< char >( first | val ) );
+		return;
+	}
+
+	out.push_back( static_cast< char >( first | max ) );
+
+	for ( val -= max; val >= 128; val >>= 7 )
+	{
+		out.push_back( static_cast< char >( ( val & 0x7f ) | 0x80 ) );
+	}
+
+	out.push_back( static_cast< char >( val ) );
+}
+
+
+static bool
+read_integer( const std::uint8_t *&p, const std::uint8_t *end, unsigned prefix, std::uint64_t &val )
+{
+	std::uint64_t max = ( 1u << prefix ) - 1;
+
+	if ( p == end )
+	{
+		return false;
+	}
+
+	val = *p++ & max;
+
+	if ( val < max )
+	{
+		return true;
+	}
+
+	for ( unsigned shift = 0; ( p != end ) && ( shift <= 28 ); shift += 7 )
+	{
+		std::uint8_t b = *p++;
+
+		val += std::uint64_t( b & 0x7f ) << shift;
+
+		if ( !( b & 0x80 ) )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+static void
+write_string( std::string &out, const std::string &s )
+{
+	std::size_t len = huffman_length( s );
+
+	if ( len < s.size() )
+	{
+		write_integer( out, 0x80, 7, len );
+		huffman_encode( out, s );
+	}
+	else
+	{
+		write_integer( out, 0x00, 7, s.size() );
+		out += s;
+	}
+}
+
+
+static bool
+read_string( const std::uint8_t *&p, const std::uint8_t *end, std::string &out )
+{
+	bool			huffman;
+	std::uint64_t	len;
+
+	if ( p == end )
+	{
+		return false;
+	}
+
+	huffman = ( *p & 0x80 ) != 0;
+
+	if ( !read_integer( p, end, 7, len ) || ( len > static_cast< std::uint64_t >( end - p ) ) )
+	{
+		return false;
+	}
+
+	out.clear();
+
+	if ( huffman )
+	{
+		if ( !huffman_decode( p, static_cast< std::size_t >( len ), out ) )
+		{
+			return false;
+		}
+	}
+	else
+	{
+		out.assign( reinterpret_cast< const char* >( p ), static_cast< std::size_t >( len ) );
+	}
+
+	p += len;
+
+	return true;
+}
+
+
+hpack::table::table()
+:
+	m_size( 0 ),
+	m_max_size( default_table_size )
+{
+}
+
+
+const hpack::field*
+hpack::table::get( std::size_t index ) const
+{
+	const fields &statics = get_static_table().m_fields;
+
+	if ( index == 0 )
+	{
+		return nullptr;
+	}
+	else if ( index <= statics.size() )
+	{
+		return &statics[ index - 1 ];
+	}
+
+	index -= statics.size() + 1;
+
+	return ( index < m_entries.size() ) ? &m_entries[ index ] : nullptr;
+}
+
+
+std::size_t
+hpack::table::find( const std::string &name, const std::string &value, std::size_t &name_index ) const
+{
+	const static_table	&statics	= get_static_table();
+	auto				pair		= statics.m_pairs.find( name + '\0' + value );
+	auto				it			= statics.m_names.find( name );
+
+	if ( pair != statics.m_pairs.end() )
+	{
+		return pair->second;
+	}
+
+	name_index = ( it != statics.m_names.end() ) ? it->second : 0;
+
+	for ( std::size_t i = 0; i < m_entries.size(); i++ )
+	{
+		if ( m_entries[ i ].first == name )
+		{
+			if ( m_entries[ i ].second == value )
+			{
+				return statics.m_fields.size() + 1 + i;
+			}
+
+			if ( !name_index )
+			{
+				name_index = statics.m_fields.size() + 1 + i;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+void
+hpack::table::add( const std::string &name, const std::string &value )
+{
+	std::size_t size = name.size() + value.size() + 32;
+
+	if ( size > m_max_size )
+	{
+		// Too big to fit, which empties the table (RFC 7541 4.4).
+
+		m_entries.clear();
+		m_size = 0;
+		return;
+	}
+
+	evict( size );
+
+	m_entries.push_front( field( name, value ) );
+	m_size += size;
+}
+
+
+void
+hpack::table::set_max_size( std::size_t val )
+{
+	m_max_size = val;
+	evict( 0 );
+}
+
+
+void
+hpack::table::evict( std::size_t room )
+{
+	while ( !m_entries.empty() && ( ( m_size + room ) > m_max_size ) )
+	{
+		m_size -= m_entries.back().first.size() + m_entries.back().second.size() + 32;
+		m_entries.pop_back();
+	}
+}
+
+
+hpack::encoder::encoder()
+:
+	m_pending_size( default_table_size ),
+	m_smallest_size( default_table_size ),
+	m_size_changed( false )
+{
+}
+
+
+void
+hpack::encoder::set_max_table_size( std::size_t val )
+{
+	// We never want more than the default, whatever the peer allows.
+
+	val = std::min( val, default_table_size );
+
+	if ( !m_size_changed && ( val == m_table.max_size() ) )
+	{
+		return;
+	}
+
+	m_smallest_size	= m_size_changed ? std::min( m_smallest_size, val ) : val;
+	m_pending_size	= val;
+	m_size_changed	= true;
+}
+
+
+void
+hpack::encoder::encode( const fields &in, std::string &out )
+{
+	if ( m_size_changed )
+	{
+		// If the table shrank and grew again since the last block, the
+		// peer has to hear about the low point too.
+
+		if ( m_smallest_size < m_pending_size )
+		{
+			write_integer( out, 0x20, 5, m_smallest_size );
+		}
+
+		write_integer( out, 0x20, 5, m_pending_size );
+		m_table.set_max_size( m_pending_size );
+		m_size_changed = false;
+	}
+
+	for ( auto it = in.begin(); it != in.end(); it++ )
+	{
+		std::size_t name_index	= 0;
+		std::size_t index		= m_table.find( it->first, it->second, name_index );
+
+		if ( index )
+		{
+			write_integer( out, 0x80, 7, index );
+			continue;
+		}
+
+		// Credentials are never indexed, by us or by any intermediary.
+		// Values that change from one message to the next would only push
+		// useful entries out of the table.
+
+		if ( ( it->first == "authorization" ) || ( it->first == "proxy-authorization" ) )
+		{
+			write_integer( out, 0x10, 4, name_index );
+		}
+		else if ( ( it->first == ":path" ) || ( it->first == "content-length" ) || ( it->first == "content-range" ) || ( it->first == "etag" ) )
+		{
+			write_integer( out, 0x00, 4, name_index );
+		}
+		else
+		{
+			write_integer( out, 0x40, 6, name_index );
+			m_table.add( it->first, it->second );
+		}
+
+		if ( !name_index )
+		{
+			write_string( out, it->first );
+		}
+
+		write_string( out, it->second );
+	}
+}
+
+
+hpack::decoder::decoder()
+:
+	m_max_table_size( default_table_size ),
+	m_max_list_size( 0 ),
+	m_too_large( false )
+{
+}
+
+
+bool
+hpack::decoder::decode( const std::uint8_t *buf, std::size_t len, fields &out )
+{
+	const std::uint8_t	*p			= buf;
+	const std::uint8_t	*end		= buf + len;
+	std::size_t			list_size	= 0;
+	bool				started		= false;
+	bool				ok			= false;
+
+	m_too_large = false;
+
+	while ( p < end )
+	{
+		const field		*entry;
+		std::uint64_t	index;
+		std::string		name;
+		std::string		value;
+
+		if ( *p & 0x80 )
+		{
+			if ( !read_integer( p, end, 7, index ) || ( ( entry = m_table.get( static_cast< std::size_t >( index ) ) ) == nullptr ) )
+			{
+				goto exit;
+			}
+
+			list_size	+= entry->first.size() + entry->second.size() + 32;
+			m_too_large	= m_too_large || ( m_max_list_size && ( list_size > m_max_list_size ) );
+
+			if ( !m_too_large )
+			{
+				out.push_back( *entry );
+			}
+
+			started = true;
+		}
+		else if ( ( *p & 0xe0 ) == 0x20 )
+		{
+			// Size updates are only allowed ahead of the first field.
+
+			if ( started || !read_integer( p, end, 5, index ) || ( index > m_max_table_size ) )
+			{
+				goto exit;
+			}
+
+			m_table.set_max_size( static_cast< std::size_t >( index ) );
+		}
+		else
+		{
+			bool add = ( *p & 0x40 ) != 0;
+
+			if ( !read_integer( p, end, add ? 6 : 4, index ) )
+			{
+				goto exit;
+			}
+
+			if ( index )
+			{
+				if ( ( entry = m_table.get( static_cast< std::size_t >( index ) ) ) == nullptr )
+				{
+					goto exit;
+				}
+
+				name = entry->first;
+			}
+			else if ( !read_string( p, end, name ) )
+			{
+				goto exit;
+			}
+
+			if ( !read_string( p, end, value ) )
+			{
+				goto exit;
+			}
+
+			if ( add )
+			{
+				m_table.add( name, value );
+			}
+
+			list_size	+= name.size() + value.size() + 32;
+			m_too_large	= m_too_large || ( m_max_list_size && ( list_size > m_max_list_size ) );
+
+			if ( !m_too_large )
+			{
+				out.push_back( field( name, value ) );
+			}
+
+			started = true;
+		}
+	}
+
+	if ( m_too_large )
+	{
+		out.clear();
+	}
+
+	ok = true;
+
+exit:
+
+	return ok;
+}
+
+#if defined( __APPLE__ )
+#	pragma mark connection implementation
+#endif
+
+namespace netkit {
+
+namespace http2 {
+
+static int
+method_from_string( const std::string &name )
+{
+	static const std::map< std::string, int > methods = []()
+	{
+		std::map< std::string, int > methods;
+
+		for ( int m = 0; m < 64; m++ )
+		{
+			methods.insert( std::make_pair( http::method::to_string( m ), m ) );
+		}
+
+		return methods;
+	}();
+
+	auto it = methods.find( name );
+
+	return ( it != methods.end() ) ? it->second : -1;
+}
+
+}
+
+}
+
+
+connection::stream::stream( std::uint32_t id, std::int64_t send_window, std::int64_t recv_window )
+:
+	m_id( id ),
+	m_send_window( send_window ),
+	m_recv_window( recv_window ),
+	m_recv_unacked( 0 ),
+	m_body_pos( 0 ),
+	m_head( false ),
+	m_sending( false ),
+	m_blocked( false ),
+	m_local_closed( false ),
+	m_remote_closed( false )
+{
+}
+
+
+connection::connection( bool is_server )
+:
+	m_is_server( is_server ),
+	m_preface_left( is_server ? preface_len : 0 ),
+	m_header_stream( 0 ),
+	m_header_end_stream( false ),
+	m_next_stream( 1 ),
+	m_last_stream( 0 ),
+	m_send_window( default_window ),
+	m_recv_window( local_window ),
+	m_recv_unacked( 0 ),
+	m_initial_window( default_window ),
+	m_max_frame_size( default_frame_size ),
+	m_max_streams( 100 ),
+	m_queued_acks( 0 ),
+	m_pending_acks( 0 ),
+	m_resets( 0 ),
+	m_reset_second( 0 ),
+	m_going_away( false ),
+	m_pumping( false ),
+	m_require_h2( false ),
+	m_fell_back( false )
+{
+	std::string settings;
+
+	if ( !is_server )
+	{
+		m_out.append( preface, preface_len );
+		write_setting( settings, setting::enable_push, 0 );
+	}
+
+	write_setting( settings, setting::max_concurrent_streams, local_max_streams );
+	write_setting( settings, setting::initial_window_size, local_stream_window );
+	write_setting( settings, setting::max_header_list_size, local_max_header_list );
+
+	frame::write_header( m_out, settings.size(), frame::settings, 0, 0 );
+	m_out += settings;
+
+	write_window_update( 0, static_cast< std::uint32_t >( local_window - default_window ) );
+
+	m_decoder.set_max_list_size( local_max_header_list );
+
+	on_close( nullptr, [=]()
+	{
+		fail_streams();
+	} );
+}
+
+
+connection::~connection()
+{
+	nklog( log::verbose, "" );
+}
+
+
+bool
+connection::accept( const std::uint8_t *buf, std::size_t len )
+{
+	return process( buf, len );
+}
+
+
+bool
+connection::can_send() const
+{
+	return !m_is_server && !m_going_away && ( m_next_stream <= max_stream_id ) && ( m_streams.size() < m_max_streams ) && ( !m_source || m_source->is_open() );
+}
+
+
+bool
+connection::send( http::request::ref request )
+{
+	const uri::ref	&uri	= request->uri();
+	std::string		path	= uri->path().empty() ? "/" : uri->path();
+	std::string		scheme	= ( uri->scheme() == "https" ) ? "https" : "http";
+	std::string		authority;
+	hpack::fields	fields;
+	stream::ref		s;
+	bool			ok = false;
+
+	if ( !can_send() )
+	{
+		goto exit;
+	}
+
+	if ( !uri->query().empty() )
+	{
+		path += "?" + uri->query();
+	}
+
+	authority = uri->host();
+
+	if ( ( uri->port() != 0 ) && ( uri->port() != ( ( scheme == "https" ) ? 443 : 80 ) ) )
+	{
+		authority += ":" + std::to_string( uri->port() );
+	}
+
+	s = new stream( m_next_stream, m_initial_window, local_stream_window );
+	m_next_stream += 2;
+
+	s->m_request	= request;
+	s->m_head		= ( request->method() == http::method::head );
+	s->m_producer	= request->producer();
+
+	if ( !s->m_producer )
+	{
+		s->m_body = request->body();
+	}
+
+	fields.push_back( hpack::field( ":method", http::method::to_string( request->method() ) ) );
+	fields.push_back( hpack::field( ":scheme", scheme ) );
+	fields.push_back( hpack::field( ":authority", authority ) );
+	fields.push_back( hpack::field( ":path", path ) );
+
+	add_fields( *request, fields );
+
+	if ( !s->m_body.empty() && request->find_in_header( http::field::content_length ).empty() )
+	{
+		fields.push_back( hpack::field( "content-length", std::to_string( s->m_body.size() ) ) );
+	}
+
+	m_streams[ s->m_id ] = s;
+
+	if ( s->m_producer || !s->m_body.empty() )
+	{
+		write_headers( s->m_id, fields, false );
+		s->m_sending = true;
+		pump();
+	}
+	else
+	{
+		write_headers( s->m_id, fields, true );
+		s->m_local_closed = true;
+	}
+
+	flush();
+
+	ok = true;
+
+exit:
+
+	return ok;
+}
+
+
+void
+connection::flush()
+{
+	if ( !m_out.empty() && m_source && m_source->is_open() )
+	{
+		connection::ref	self( this );
+		std::size_t		acks	= m_queued_acks;
+		std::string		out;
+
+		out.swap( m_out );
+
+		m_queued_acks = 0;
+
+		sink::send( reinterpret_cast< const std::uint8_t* >( out.data() ), out.size(), [=]( int status ) mutable
+		{
+			if ( status != 0 )
+			{
+				nklog( log::verbose, "send failed (%)", status );
+			}
+
+			// The acks that went out with this are off our hands.
+
+			self->m_pending_acks -= std::min( self->m_pending_acks, acks );
+		} );
+	}
+}
+
+
+void
+connection::close()
+{
+	if ( m_source )
+	{
+		sink::close();
+	}
+	else
+	{
+		source_was_closed();
+	}
+}
+
+
+bool
+connection::process( const std::uint8_t *buf, std::size_t len )
+{
+	connection::ref	self( this );
+	std::size_t		pos = 0;
+	bool			ok	= false;
+
+	if ( m_require_h2 )
+	{
+		// Anything from the peer means the handshake is done.
+
+		m_require_h2 = false;
+
+		if ( m_source->protocol() != "h2" )
+		{
+			fall_back();
+			goto exit;
+		}
+	}
+
+	m_in.append( reinterpret_cast< const char* >( buf ), len );
+
+	if ( m_preface_left )
+	{
+		std::size_t n = std::min( m_preface_left, m_in.size() );
+
+		if ( memcmp( m_in.data(), preface + ( preface_len - m_preface_left ), n ) != 0 )
+		{
+			nklog( log::error, "bad HTTP/2 connection preface" );
+			goto exit;
+		}
+
+		m_in.erase( 0, n );
+		m_preface_left -= n;
+	}
+
+	while ( !m_preface_left && ( ( m_in.size() - pos ) >= frame::header_size ) )
+	{
+		const std::uint8_t	*p		= reinterpret_cast< const std::uint8_t* >( m_in.data() ) + pos;
+		std::size_t			flen	= ( std::size_t( p[ 0 ] ) << 16 ) | ( std::size_t( p[ 1 ] ) << 8 ) | p[ 2 ];
+
+		// We never raise SETTINGS_MAX_FRAME_SIZE.
+
+		if ( flen > default_frame_size )
+		{
+			nklog( log::error, "received % byte frame", flen );
+			go_away( error::frame_size_error );
+			goto exit;
+		}
+
+		if ( ( m_in.size() - pos ) < ( frame::header_size + flen ) )
+		{
+			break;
+		}
+
+		pos += frame::header_size + flen;
+
+		if ( !frame_was_received( p[ 3 ], p[ 4 ], read32( p + 5 ) & max_stream_id, p + frame::header_size, flen ) )
+		{
+			goto exit;
+		}
+
+		if ( !is_open() )
+		{
+			break;
+		}
+	}
+
+	m_in.erase( 0, pos );
+
+	flush();
+
+	ok = true;
+
+exit:
+
+	return ok;
+}
+
+
+bool
+connection::frame_was_received( std::uint8_t type, std::uint8_t flags, std::uint32_t id, const std::uint8_t *buf, std::size_t len )
+{
+	bool ok = false;
+
+	if ( m_header_stream && ( ( type != frame::continuation ) || ( id != m_header_stream ) ) )
+	{
+		nklog( log::error, "expected CONTINUATION on stream %", m_header_stream );
+		go_away( error::protocol_error );
+		goto exit;
+	}
+
+	switch ( type )
+	{
+		case frame::data:
+		{
+			ok = data_was_received( flags, id, buf, len );
+		}
+		break;
+
+		case frame::headers:
+		{
+			std::size_t pad = 0;
+
+			if ( id == 0 )
+			{
+				go_away( error::protocol_error );
+				goto exit;
+			}
+
+			if ( flags & frame::padded )
+			{
+				if ( len < 1 )
+				{
+					go_away( error::frame_size_error );
+					goto exit;
+				}
+
+				pad = buf[ 0 ];
+				buf++;
+				len--;
+			}
+
+			if ( flags & frame::prioritized )
+			{
+				if ( len < 5 )
+				{
+					go_away( error::frame_size_error );
+					goto exit;
+				}
+
+				buf += 5;
+				len -= 5;
+			}
+
+			if ( pad > len )
+			{
+				go_away( error::protocol_error );
+				goto exit;
+			}
+
+			m_header_block.assign( reinterpret_cast< const char* >( buf ), len - pad );
+			m_header_stream		= id;
+			m_header_end_stream	= ( flags & frame::end_stream ) != 0;
+
+			ok = ( flags & frame::end_headers ) ? header_block_was_received( id, m_header_end_stream ) : true;
+		}
+		break;
+
+		case frame::continuation:
+		{
+			if ( ( id == 0 ) || ( id != m_header_stream ) )
+			{
+				go_away( error::protocol_error );
+				goto exit;
+			}
+
+			if ( ( m_header_block.size() + len ) > max_header_block )
+			{
+				nklog( log::error, "header block on stream % is too big", id );
+				go_away( error::enhance_your_calm );
+				goto exit;
+			}
+
+			m_header_block.append( reinterpret_cast< const char* >( buf ), len );
+
+			ok = ( flags & frame::end_headers ) ? header_block_was_received( id, m_header_end_stream ) : true;
+		}
+		break;
+
+		case frame::rst_stream:
+		{
+			auto it = m_streams.find( id );
+
+			if ( ( id == 0 ) || ( len != 4 ) )
+			{
+				go_away( ( id == 0 ) ? error::protocol_error : error::frame_size_error );
+				goto exit;
+			}
+
+			// Counted whether or not the stream is still around. A request
+			// that was answered before its reset arrived was paid for all
+			// the same.
+
+			if ( time( nullptr ) != m_reset_second )
+			{
+				m_reset_second	= time( nullptr );
+				m_resets		= 0;
+			}
+
+			if ( ++m_resets > max_resets_per_second )
+			{
+				nklog( log::error, "peer reset more than % streams in a second", max_resets_per_second );
+				go_away( error::enhance_your_calm );
+				goto exit;
+			}
+
+			if ( it != m_streams.end() )
+			{
+				stream::ref s = it->second;
+
+				nklog( log::verbose, "stream % was reset (%)", id, read32( buf ) );
+
+				m_streams.erase( it );
+
+				if ( !m_is_server && s->m_request )
+				{
+					s->m_request->reply( nullptr );
+				}
+			}
+
+			ok = true;
+		}
+		break;
+
+		case frame::settings:
+		{
+			if ( id != 0 )
+			{
+				go_away( error::protocol_error );
+				goto exit;
+			}
+
+			ok = settings_were_received( flags, buf, len );
+		}
+		break;
+
+		case frame::push_promise:
+		{
+			// We tell servers not to push, and clients can't.
+
+			go_away( error::protocol_error );
+		}
+		break;
+
+		case frame::ping:
+		{
+			if ( ( id != 0 ) || ( len != 8 ) )
+			{
+				go_away( ( id != 0 ) ? error::protocol_error : error::frame_size_error );
+				goto exit;
+			}
+
+			if ( !( flags & frame::ack ) )
+			{
+				if ( ++m_pending_acks > max_pending_acks )
+				{
+					nklog( log::error, "peer isn't reading its acks" );
+					go_away( error::enhance_your_calm );
+					goto exit;
+				}
+
+				frame::write_header( m_out, 8, frame::ping, frame::ack, 0 );
+				m_out.append( reinterpret_cast< const char* >( buf ), 8 );
+				m_queued_acks++;
+			}
+
+			ok = true;
+		}
+		break;
+
+		case frame::goaway:
+		{
+			std::uint32_t last;
+
+			if ( ( id != 0 ) || ( len < 8 ) )
+			{
+				go_away( error::protocol_error );
+				goto exit;
+			}
+
+			last			= read32( buf ) & max_stream_id;
+			m_going_away	= true;
+
+			nklog( log::verbose, "peer is going away (%), last stream %", read32( buf + 4 ), last );
+
+			// Streams the peer never got to can be retried elsewhere, but
+			// that's up to whoever sent them.
+
+			for ( auto it = m_streams.begin(); it != m_streams.end(); )
+			{
+				stream::ref s = it->second;
+
+				if ( s->m_id > last )
+				{
+					it = m_streams.erase( it );
+
+					if ( !m_is_server && s->m_request )
+					{
+						s->m_request->reply( nullptr );
+					}
+				}
+				else
+				{
+					it++;
+				}
+			}
+
+			ok = true;
+		}
+		break;
+
+		case frame::window_update:
+		{
+			std::uint32_t increment;
+
+			if ( len != 4 )
+			{
+				go_away( error::frame_size_error );
+				goto exit;
+			}
+
+			increment = read32( buf ) & max_stream_id;
+
+			if ( id == 0 )
+			{
+				if ( ( increment == 0 ) || ( ( m_send_window + increment ) > max_stream_id ) )
+				{
+					go_away( ( increment == 0 ) ? error::protocol_error : error::flow_control_error );
+					goto exit;
+				}
+
+				m_send_window += increment;
+			}
+			else
+			{
+				auto it = m_streams.find( id );
+
+				if ( it != m_streams.end() )
+				{
+					if ( ( increment == 0 ) || ( ( it->second->m_send_window + increment ) > max_stream_id ) )
+					{
+						reset( it->second, ( increment == 0 ) ? error::protocol_error : error::flow_control_error );
+					}
+					else
+					{
+						it->second->m_send_window += increment;
+					}
+				}
+			}
+
+			pump();
+
+			ok = true;
+		}
+		break;
+
+		default:
+		{
+			// PRIORITY, and anything we don't know about.
+
+			ok = true;
+		}
+		break;
+	}
+
+exit:
+
+	return ok;
+}
+
+
+bool
+connection::data_was_received( std::uint8_t flags, std::uint32_t id, const std::uint8_t *buf, std::size_t len )
+{
+	std::int64_t	consumed	= static_cast< std::int64_t >( len );
+	std::size_t		pad			= 0;
+	stream::ref		s;
+	bool			ok			= false;
+
+	if ( id == 0 )
+	{
+		go_away( error::protocol_error );
+		goto exit;
+	}
+
+	// Flow control counts the whole payload, padding and all. The window
+	// is opened back up once half of it has been used.
+
+	m_recv_window	-= consumed;
+	m_recv_unacked	+= consumed;
+
+	if ( m_recv_window < 0 )
+	{
+		go_away( error::flow_control_error );
+		goto exit;
+	}
+
+	if ( m_recv_unacked >= ( local_window / 2 ) )
+	{
+		write_window_update( 0, static_cast< std::uint32_t >( m_recv_unacked ) );
+		m_recv_window	+= m_recv_unacked;
+		m_recv_unacked	= 0;
+	}
+
+	if ( flags & frame::padded )
+	{
+		if ( ( len < 1 ) || ( buf[ 0 ] >= len ) )
+		{
+			go_away( error::protocol_error );
+			goto exit;
+		}
+
+		pad = buf[ 0 ];
+		buf++;
+		len -= 1 + pad;
+	}
+
+	{
+		auto it = m_streams.find( id );
+
+		if ( ( it == m_streams.end() ) || it->second->m_remote_closed )
+		{
+			// Most likely a stream we've reset and the peer hasn't heard
+			// about it yet.
+
+			ok = true;
+			goto exit;
+		}
+
+		s = it->second;
+	}
+
+	s->m_recv_window -= consumed;
+
+	if ( s->m_recv_window < 0 )
+	{
+		reset( s, error::flow_control_error );
+		ok = true;
+		goto exit;
+	}
+
+	if ( !( flags & frame::end_stream ) )
+	{
+		s->m_recv_unacked += consumed;
+
+		if ( s->m_recv_unacked >= ( local_stream_window / 2 ) )
+		{
+			write_window_update( id, static_cast< std::uint32_t >( s->m_recv_unacked ) );
+			s->m_recv_window	+= s->m_recv_unacked;
+			s->m_recv_unacked	= 0;
+		}
+	}
+
+	if ( len > 0 )
+	{
+		if ( m_is_server )
+		{
+			if ( s->m_binding && s->m_request )
+			{
+				s->m_binding->m_rbwr( s->m_request, buf, len, reply_to( s ) );
+			}
+		}
+		else if ( s->m_response )
+		{
+			s->m_request->body_reply( s->m_response, buf, len );
+		}
+	}
+
+	if ( flags & frame::end_stream )
+	{
+		stream_did_end( s );
+	}
+
+	ok = true;
+
+exit:
+
+	return ok;
+}
+
+
+bool
+connection::settings_were_received( std::uint8_t flags, const std::uint8_t *buf, std::size_t len )
+{
+	bool ok = false;
+
+	if ( flags & frame::ack )
+	{
+		ok = ( len == 0 );
+
+		if ( !ok )
+		{
+			go_away( error::frame_size_error );
+		}
+
+		goto exit;
+	}
+
+	if ( len % 6 )
+	{
+		go_away( error::frame_size_error );
+		goto exit;
+	}
+
+	for ( std::size_t i = 0; i < len; i += 6 )
+	{
+		std::uint16_t id	= ( std::uint16_t( buf[ i ] ) << 8 ) | buf[ i + 1 ];
+		std::uint32_t val	= read32( buf + i + 2 );
+
+		if ( id == setting::header_table_size )
+		{
+			m_encoder.set_max_table_size( val );
+		}
+		else if ( id == setting::enable_push )
+		{
+			if ( val > 1 )
+			{
+				go_away( error::protocol_error );
+				goto exit;
+			}
+		}
+		else if ( id == setting::max_concurrent_streams )
+		{
+			m_max_streams = val;
+		}
+		else if ( id == setting::initial_window_size )
+		{
+			if ( val > max_stream_id )
+			{
+				go_away( error::flow_control_error );
+				goto exit;
+			}
+
+			// Applies to streams already open, too. Their windows can go
+			// negative.
+
+			for ( auto it = m_streams.begin(); it != m_streams.end(); it++ )
+			{
+				it->second->m_send_window += static_cast< std::int64_t >( val ) - m_initial_window;
+			}
+
+			m_initial_window = val;
+		}
+		else if ( id == setting::max_frame_size )
+		{
+			if ( ( val < default_frame_size ) || ( val > 0xffffff ) )
+			{
+				go_away( error::protocol_error );
+				goto exit;
+			}
+
+			m_max_frame_size = val;
+		}
+	}
+
+	if ( ++m_pending_acks > max_pending_acks )
+	{
+		nklog( log::error, "peer isn't reading its acks" );
+		go_away( error::enhance_your_calm );
+		goto exit;
+	}
+
+	frame::write_header( m_out, 0, frame::settings, frame::ack, 0 );
+	m_queued_acks++;
+
+	pump();
+
+	ok = true;
+
+exit:
+
+	return ok;
+}
+
+
+bool
+connection::header_block_was_received( std::uint32_t id, bool end_stream )
+{
+	hpack::fields	fields;
+	stream::ref		s;
+	bool			ok = false;
+
+	m_header_stream = 0;
+
+	if ( !m_decoder.decode( reinterpret_cast< const std::uint8_t* >( m_header_block.data() ), m_header_block.size(), fields ) )
+	{
+		nklog( log::error, "unable to decode header block on stream %", id );
+		go_away( error::compression_error );
+		goto exit;
+	}
+
+	m_header_block.clear();
+
+	{
+		auto it = m_streams.find( id );
+
+		if ( it != m_streams.end() )
+		{
+			s = it->second;
+		}
+	}
+
+	if ( s && m_decoder.too_large() )
+	{
+		nklog( log::error, "header block on stream % is larger than % bytes", id, local_max_header_list );
+		reset( s, error::cancel );
+	}
+	else if ( s )
+	{
+		if ( !m_is_server && !s->m_response )
+		{
+			response_was_received( s, fields, end_stream );
+		}
+		else if ( end_stream )
+		{
+			// Trailers. Nothing looks at them.
+
+			stream_did_end( s );
+		}
+	}
+	else if ( m_is_server )
+	{
+		if ( !( id & 1 ) || ( id <= m_last_stream ) )
+		{
+			go_away( error::protocol_error );
+			goto exit;
+		}
+
+		m_last_stream = id;
+
+		s = new stream( id, m_initial_window, local_stream_window );
+
+		if ( m_going_away || ( m_streams.size() >= local_max_streams ) )
+		{
+			reset( s, error::refused_stream );
+		}
+		else if ( m_decoder.too_large() )
+		{
+			http::response::ref response = new http::response( 2, 0, http::status::header_fields_too_large, false );
+
+			// Answered with a 431 and nothing else. Whatever body is still
+			// on its way isn't wanted.
+
+			nklog( log::error, "request headers on stream % are larger than % bytes", id, local_max_header_list );
+
+			m_streams[ id ]		= s;
+			s->m_remote_closed	= end_stream;
+
+			response->add_to_header( "Content-Length", 0 );
+			respond( s, response );
+
+			if ( !s->m_remote_closed )
+			{
+				reset( s, error::no_error );
+			}
+		}
+		else
+		{
+			m_streams[ id ] = s;
+			request_was_received( s, fields, end_stream );
+		}
+	}
+
+	ok = true;
+
+exit:
+
+	return ok;
+}
+
+
+void
+connection::request_was_received( stream::ref s, hpack::fields &fields, bool end_stream )
+{
+	http::server::binding::ref	binding;
+	http::request::ref			request;
+	http::request::params		params;
+	std::string					method;
+	std::string					path;
+	std::string					authority;
+	std::string					content_type;
+	std::string					cookie;
+	int							m;
+
+	for ( auto it = fields.begin(); it != fields.end(); it++ )
+	{
+		if ( it->first == ":method" )
+		{
+			method = it->second;
+		}
+		else if ( it->first == ":path" )
+		{
+			path = it->second;
+		}
+		else if ( it->first == ":authority" )
+		{
+			authority = it->second;
+		}
+		else if ( it->first == "content-type" )
+		{
+			content_type = it->second;
+		}
+	}
+
+	m = method_from_string( method );
+
+	if ( ( m < 0 ) || path.empty() )
+	{
+		nklog( log::error, "malformed request on stream %", s->m_id );
+		reset( s, error::protocol_error );
+		return;
+	}
+
+	binding = http::server::resolve( static_cast< std::uint8_t >( m ), path, content_type, params );
+
+	if ( binding )
+	{
+		request = binding->m_rwb( m, 2, 0, new uri( path ) );
+	}
+
+	if ( !request )
+	{
+		http::response::ref response = new http::response( 2, 0, http::status::not_found, true );
+
+		nklog( log::error, "unable to find binding for method % -> %", method, path );
+
+		response->add_to_header( "Content-Type", "text/html" );
+		*response << "<html>Error 404: Content Not Found</html>";
+		response->add_to_header( "Content-Length", static_cast< int >( response->body().size() ) );
+		respond( s, response );
+
+		if ( end_stream )
+		{
+			stream_did_end( s );
+		}
+
+		return;
+	}
+
+	for ( auto it = fields.begin(); it != fields.end(); it++ )
+	{
+		if ( it->first[ 0 ] == ':' )
+		{
+			continue;
+		}
+
+		if ( it->first == "cookie" )
+		{
+			// Cookies may be split across fields to compress better.
+
+			cookie += cookie.empty() ? it->second : "; " + it->second;
+		}
+		else
+		{
+			request->add_to_header( it->first, it->second );
+		}
+	}
+
+	if ( !cookie.empty() )
+	{
+		request->add_to_header( "Cookie", cookie );
+	}
+
+	if ( !authority.empty() && request->find_in_header( http::field::host ).empty() )
+	{
+		request->add_to_header( "Host", authority );
+	}
+
+	request->set_path_params( params );
+
+	s->m_binding	= binding;
+	s->m_request	= request;
+	s->m_head		= ( m == http::method::head );
+
+	if ( end_stream )
+	{
+		stream_did_end( s );
+	}
+}
+
+
+void
+connection::response_was_received( stream::ref s, hpack::fields &fields, bool end_stream )
+{
+	http::response::ref	response;
+	int					status = 0;
+
+	for ( auto it = fields.begin(); it != fields.end(); it++ )
+	{
+		if ( it->first == ":status" )
+		{
+			status = atoi( it->second.c_str() );
+		}
+	}
+
+	if ( ( status < 100 ) || ( ( status < 200 ) && end_stream ) )
+	{
+		nklog( log::error, "malformed response on stream %", s->m_id );
+		reset( s, error::protocol_error );
+		return;
+	}
+
+	if ( status < 200 )
+	{
+		// Interim. The real one follows on the same stream.
+
+		return;
+	}
+
+	response = new http::response( 2, 0, static_cast< std::uint16_t >( status ), true );
+
+	for ( auto it = fields.begin(); it != fields.end(); it++ )
+	{
+		if ( it->first[ 0 ] != ':' )
+		{
+			response->add_to_header( it->first, it->second );
+		}
+	}
+
+	s->m_response = response;
+	s->m_request->headers_reply( response );
+
+	if ( end_stream )
+	{
+		stream_did_end( s );
+	}
+}
+
+
+void
+connection::stream_did_end( stream::ref s )
+{
+	s->m_remote_closed = true;
+
+	if ( m_is_server )
+	{
+		if ( s->m_binding && s->m_request )
+		{
+			http::server::binding::ref binding = s->m_binding;
+
+			s->m_binding = nullptr;
+			binding->m_r( s->m_request, reply_to( s ) );
+		}
+
+		finish( s );
+	}
+	else
+	{
+		http::request::ref	request		= s->m_request;
+		http::response::ref	response	= s->m_response;
+
+		// We're done with this stream even if the server answered before
+		// we finished sending.
+
+		if ( !s->m_local_closed )
+		{
+			reset( s, error::no_error );
+		}
+		else
+		{
+			m_streams.erase( s->m_id );
+		}
+
+		request->reply( response );
+	}
+}
+
+
+netkit::http::server::response_f
+connection::reply_to( stream::ref s )
+{
+	connection::ref self( this );
+
+	return [=]( http::response::ref response, bool close ) mutable
+	{
+		// There's no closing the connection for one stream's sake.
+
+		self->respond( s, response );
+		self->flush();
+	};
+}
+
+
+void
+connection::respond( stream::ref s, http::response::ref response )
+{
+	hpack::fields	fields;
+	bool			body;
+
+	if ( s->m_local_closed || ( m_streams.find( s->m_id ) == m_streams.end() ) )
+	{
+		nklog( log::verbose, "stream % is closed, dropping response", s->m_id );
+		return;
+	}
+
+	if ( response->status() < 200 )
+	{
+		return;
+	}
+
+	fields.push_back( hpack::field( ":status", std::to_string( response->status() ) ) );
+
+	if ( response->find_in_header( http::field::date ).empty() )
+	{
+		fields.push_back( hpack::field( "date", http::response::current_date() ) );
+	}
+
+	add_fields( *response, fields );
+
+	body = !s->m_head && ( response->status() != http::status::no_content ) && ( response->status() != http::status::not_modified );
+
+	if ( body )
+	{
+		s->m_producer = response->producer();
+
+		if ( !s->m_producer )
+		{
+			s->m_body = response->body();
+		}
+		else
+		{
+			connection::ref self( this );
+
+			response->set_wake( [=]() mutable
+			{
+				auto it = self->m_streams.find( s->m_id );
+
+				if ( ( it == self->m_streams.end() ) || ( it->second != s ) || !s->m_producer )
+				{
+					return false;
+				}
+
+				if ( s->m_blocked )
+				{
+					s->m_blocked	= false;
+					s->m_sending	= true;
+
+					self->pump();
+					self->flush();
+				}
+
+				return true;
+			} );
+		}
+	}
+
+	if ( s->m_producer || !s->m_body.empty() )
+	{
+		write_headers( s->m_id, fields, false );
+		s->m_sending = true;
+		pump();
+	}
+	else
+	{
+		write_headers( s->m_id, fields, true );
+		s->m_local_closed = true;
+		finish( s );
+	}
+}
+
+
+void
+connection::write_headers( std::uint32_t id, const hpack::fields &fields, bool end_stream )
+{
+	std::string	block;
+	std::size_t	pos = 0;
+
+	m_encoder.encode( fields, block );
+
+	do
+	{
+		std::size_t		n		= std::min( block.size() - pos, m_max_frame_size );
+		std::uint8_t	flags	= ( ( pos + n ) == block.size() ) ? frame::end_headers : 0;
+
+		if ( pos == 0 )
+		{
+			frame::write_header( m_out, n, frame::headers, flags | ( end_stream ? frame::end_stream : 0 ), id );
+		}
+		else
+		{
+			frame::write_header( m_out, n, frame::continuation, flags, id );
+		}
+
+		m_out.append( block, pos, n );
+		pos += n;
+	}
+	while ( pos < block.size() );
+}
+
+
+void
+connection::write_window_update( std::uint32_t id, std::uint32_t increment )
+{
+	frame::write_header( m_out, 4, frame::window_update, 0, id );
+	write32( m_out, increment );
+}
+
+
+void
+connection::reset( stream::ref s, std::uint32_t code )
+{
+	frame::write_header( m_out, 4, frame::rst_stream, 0, s->m_id );
+	write32( m_out, code );
+
+	s->m_sending		= false;
+	s->m_local_closed	= true;
+	s->m_remote_closed	= true;
+	s->m_producer		= nullptr;
+
+	if ( m_streams.erase( s->m_id ) && !m_is_server && s->m_request && ( code != error::no_error ) )
+	{
+		s->m_request->reply( nullptr );
+	}
+}
+
+
+void
+connection::go_away( std::uint32_t code )
+{
+	frame::write_header( m_out, 8, frame::goaway, 0, 0 );
+	write32( m_out, m_last_stream );
+	write32( m_out, code );
+
+	m_going_away = true;
+
+	flush();
+}
+
+
+void
+connection::pump()
+{
+	if ( m_pumping )
+	{
+		return;
+	}
+
+	m_pumping = true;
+
+	for ( auto it = m_streams.begin(); it != m_streams.end(); )
+	{
+		stream::ref s = it->second;
+
+		// finish() and reset() take s out of the map.
+
+		it++;
+
+		while ( s->m_sending )
+		{
+			std::size_t	left;
+			std::size_t	n;
+			bool		last;
+
+			if ( ( s->m_body_pos == s->m_body.size() ) && s->m_producer )
+			{
+				std::streamsize got;
+
+				s->m_body.resize( default_frame_size );
+				s->m_body_pos = 0;
+
+				got = s->m_producer( reinterpret_cast< std::uint8_t* >( &s->m_body[ 0 ] ), s->m_body.size() );
+
+				if ( got == http::message::would_block )
+				{
+					// Parked until the response's wake().
+
+					s->m_body.clear();
+					s->m_blocked	= true;
+					s->m_sending	= false;
+					break;
+				}
+
+				if ( got < 0 )
+				{
+					s->m_body.clear();
+					reset( s, error::internal_error );
+					break;
+				}
+
+				s->m_body.resize( static_cast< std::size_t >( got ) );
+
+				if ( got == 0 )
+				{
+					s->m_producer = nullptr;
+				}
+			}
+
+			left	= s->m_body.size() - s->m_body_pos;
+			n		= static_cast< std::size_t >( std::max< std::int64_t >( 0, std::min( m_send_window, s->m_send_window ) ) );
+			n		= std::min( std::min( left, n ), m_max_frame_size );
+			last	= !s->m_producer && ( n == left );
+
+			if ( ( n == 0 ) && !last )
+			{
+				// Out of window. A WINDOW_UPDATE starts us up again.
+
+				break;
+			}
+
+			frame::write_header( m_out, n, frame::data, last ? frame::end_stream : 0, s->m_id );
+			m_out.append( s->m_body, s->m_body_pos, n );
+
+			s->m_body_pos		+= n;
+			s->m_send_window	-= n;
+			m_send_window		-= n;
+
+			if ( last )
+			{
+				s->m_sending		= false;
+				s->m_local_closed	= true;
+				s->m_body.clear();
+				s->m_body_pos		= 0;
+
+				finish( s );
+			}
+		}
+	}
+
+	m_pumping = false;
+}
+
+
+void
+connection::finish( stream::ref s )
+{
+	if ( s->m_local_closed && s->m_remote_closed )
+	{
+		m_streams.erase( s->m_id );
+	}
+}
+
+
+void
+connection::fall_back()
+{
+	stream_map streams;
+
+	nklog( log::warning, "peer didn't agree to h2, sending % requests with HTTP/1.1", m_streams.size() );
+
+	streams.swap( m_streams );
+
+	m_going_away	= true;
+	m_fell_back		= true;
+
+	for ( auto it = streams.begin(); it != streams.end(); it++ )
+	{
+		http::request::ref request = it->second->m_request;
+
+		// A streamed body has been read from already.
+
+		if ( request->producer() )
+		{
+			request->reply( nullptr );
+		}
+		else
+		{
+			http::client::send( request );
+		}
+	}
+}
+
+
+void
+connection::fail_streams()
+{
+	stream_map streams;
+
+	streams.swap( m_streams );
+
+	m_going_away = true;
+
+	if ( !m_is_server )
+	{
+		for ( auto it = streams.begin(); it != streams.end(); it++ )
+		{
+			it->second->m_request->reply( nullptr );
+		}
+	}
+}
+
+
+void
+connection::add_fields( const http::message &message, hpack::fields &fields )
+{
+	for ( auto it = message.heeder().begin(); it != message.heeder().end(); it++ )
+	{
+		std::string name;
+
+		// Connection-specific fields mean nothing here (RFC 7540 8.1.2.2),
+		// and Host is carried as :authority.
+
+		if ( ( it->id() == http::field::connection ) || ( it->id() == http::field::keep_alive ) || ( it->id() == http::field::proxy_connection ) ||
+		     ( it->id() == http::field::transfer_encoding ) || ( it->id() == http::field::upgrade ) || ( it->id() == http::field::host ) || ( it->id() == http::field::te ) )
+		{
+			continue;
+		}
+
+		name = it->name();
+		std::transform( name.begin(), name.end(), name.begin(), ::tolower );
+
+		fields.push_back( hpack::field( name, it->value() ) );
+	}
+}
+
+#if defined( __APPLE__ )
+#	pragma mark client implementation
+#endif
+
+void
+client::send( http::request::ref request )
+{
+	const uri::ref	&uri	= request->uri();
+	std::string		key		= uri->scheme() + "://" + uri->host() + ":" + std::to_string( uri->port() );
+	connection_map	&map	= shared();
+	auto			it		= map.find( key );
+	connection::ref	conn;
+
+	if ( http1_hosts().count( key ) )
+	{
+		http::client::send( request );
+		return;
+	}
+
+	if ( ( it != map.end() ) && it->second->can_send() )
+	{
+		conn = it->second;
+	}
+	else
+	{
+		source::ref	source	= new ip::tcp::socket;
+		connection	*raw;
+
+		// Anything still running on a connection we're replacing finishes
+		// there.
+
+		conn		= new connection( false );
+		raw			= conn.get();
+		map[ key ]	= conn;
+
+		conn->set_require_h2( uri->scheme() == "https" );
+
+		conn->on_close( nullptr, [=]()
+		{
+			auto it = shared().find( key );
+
+			if ( raw->fell_back() )
+			{
+				http1_hosts().insert( key );
+			}
+
+			if ( ( it != shared().end() ) && ( it->second.get() == raw ) )
+			{
+				shared().erase( it );
+			}
+		} );
+
+		source->connect( uri, std::vector< std::string >( 1, "h2" ), [=]( int status, const endpoint::ref &peer ) mutable
+		{
+			if ( status == 0 )
+			{
+				conn->bind( source );
+				conn->flush();
+			}
+			else
+			{
+				nklog( log::error, "received error % trying to connect to %", status, key );
+				conn->close();
+			}
+		} );
+	}
+
+	if ( !conn->send( request ) )
+	{
+		request->reply( nullptr );
+	}
+}
+
+
+std::size_t
+client::connections()
+{
+	return shared().size();
+}
+
+
+void
+client::clear()
+{
+	connection_map map;
+
+	map.swap( shared() );
+
+	for ( auto it = map.begin(); it != map.end(); it++ )
+	{
+		it->second->close();
+	}
+}
+
+
+client::connection_map&
+client::shared()
+{
+	static connection_map *map = new connection_map;
+
+	return *map;
+}
+
+
+std::set< std::string >&
+client::http1_hosts()
+{
+	static std::set< std::string > *hosts = new std::set< std::string >;
+
+	return *hosts;
+}
@@ -54,6 +54,7 @@
 #include <NetKit/NKUnicode.h>
 #include <NetKit/NKPlatform.h>
 #include <NetKit/NKLog.h>
+#include <NetKit/NKMacros.h>
 #include <cassert>
 #include <sstream>
 #include <iomanip>
@@ -2946,6 +2947,8 @@ netkit::json::operator<<(std::ostream &output, const value &v)
 std::atomic< std::int32_t >	connection::m_id( 1 );
 
 connection::connection()
+:
+	m_registry( nullptr )
 {
 	init();
 }
@@ -3165,66 +3168,125 @@ connection::shutdown()
 #	pragma mark server implementation
 #endif
 
-server::preflight_f				server::m_preflight_handler = []( json::value::ref request ){ return netkit::status::ok; };
-server::notification_handlers	*server::m_notification_handlers;
-server::request_handlers		*server::m_request_handlers;
-connection::ref					server::m_active_connection;
-connection::list				*server::m_connections;
+server::handlers_ref			server::m_handlers;
+std::mutex						server::m_handlers_mutex;
+
+server::handlers::handlers()
+:
+	m_preflight_handler( []( json::value::ref request ){ return netkit::status::ok; } )
+{
+}
+
 
 void
 server::adopt( connection::ref connection )
 {
-	if ( !m_connections )
+	if ( !connection->m_registry )
 	{
-		m_connections = new connection::list;
-	}
+		connection::list *connections = &local().m_connections;
 
-	m_connections->push_back( connection );
+		connection->m_registered	= connections->insert( connections->end(), connection );
+		connection->m_registry		= connections;
+	}
 }
 
 
 void
 server::remove( connection *conn )
 {
-	auto it = std::find_if( m_connections->begin(), m_connections->end(), [=]( connection::ref inserted )
+	if ( conn->m_registry )
 	{
-		return ( inserted.get() == conn );
-	} );
+		connection::list *connections = conn->m_registry;
+
+		// The list holds a reference, so this may be the last one.
+
+		conn->m_registry = nullptr;
+		connections->erase( conn->m_registered );
+	}
+}
+
+
+server::registry&
+server::local()
+{
+	// One per thread that has ever adopted a connection, never freed.
+
+	static NETKIT_THREAD_LOCAL registry *r = nullptr;
+
+	if ( !r )
+	{
+		r = new registry;
+	}
 
-	if ( it != m_connections->end() )
+	return *r;
+}
+
+
+server::handlers_ref
+server::current()
+{
+	handlers_ref h = std::atomic_load( &m_handlers );
+
+	if ( !h )
 	{
-		m_connections->erase( it );
+		static const handlers_ref empty = std::make_shared< handlers >();
+
+		h = empty;
 	}
+
+	return h;
+}
+
+
+void
+server::update( update_f func )
+{
+	std::lock_guard< std::mutex >	guard( m_handlers_mutex );
+	auto							next = std::make_shared< handlers >( *current() );
+
+	func( *next );
+
+	std::atomic_store( &m_handlers, handlers_ref( next ) );
 }
 
 
 void
 server::preflight( preflight_f func )
 {
-	m_preflight_handler = func;
+	update( [=]( handlers &next )
+	{
+		next.m_preflight_handler = func;
+	} );
 }
 
 
 void
 server::bind( const std::string &method, std::size_t num_params, notification_f func )
 {
-	( *m_notification_handlers )[ method ] = std::make_pair( num_params, func );
+	update( [=]( handlers &next )
+	{
+		next.m_notification_handlers[ method ] = std::make_pair( num_params, func );
+	} );
 }
 
 
 void
 server::bind( const std::string &method, std::size_t num_params, request_f func )
 {
-	( *m_request_handlers )[ method ] = std::make_pair( num_params, func );
+	update( [=]( handlers &next )
+	{
+		next.m_request_handlers[ method ] = std::make_pair( num_params, func );
+	} );
 }
 
 
 void
 server::route_notification( const value::ref &notification )
 {
-	auto it = m_notification_handlers->find( notification[ "method" ]->as_string() );
+	handlers_ref	h	= current();
+	auto			it	= h->m_notification_handlers.find( notification[ "method" ]->as_string() );
 				
-	if ( it != m_notification_handlers->end() )
+	if ( it != h->m_notification_handlers.end() )
 	{
 		auto params = notification[ "params" ];
 						
@@ -3239,13 +3301,14 @@ server::route_notification( const value::ref &notification )
 void
 server::route_request( const value::ref &request, reply_f r )
 {
-	netkit::status status = m_preflight_handler( request );
+	handlers_ref	h		= current();
+	netkit::status	status	= h->m_preflight_handler( request );
 	
 	if ( status == netkit::status::ok )
 	{
-		auto it = m_request_handlers->find( request[ "method" ]->as_string() );
+		auto it = h->m_request_handlers.find( request[ "method" ]->as_string() );
 				
-		if ( it != m_request_handlers->end() )
+		if ( it != h->m_request_handlers.end() )
 		{
 			auto params = request[ "params" ];
 							
@@ -1,4 +1,6 @@
 #include <NetKit/NKMIME.h>
+#include <algorithm>
+#include <map>
 
 using namespace netkit;
 
@@ -10,3 +12,42 @@ const std::string mime::image::png( "image/png" );
 const std::string mime::application::pdf( "application/pdf" );
 const std::string mime::application::ipp( "application/ipp" );
 const std::string mime::application::postscript( "application/postscript" );
+
+
+const std::string&
+mime::from_extension( const std::string &ext )
+{
+	static const std::map< std::string, std::string > types =
+	{
+		{ "css",	"text/css" },
+		{ "csv",	"text/csv" },
+		{ "gif",	"image/gif" },
+		{ "htm",	"text/html" },
+		{ "html",	"text/html" },
+		{ "ico",	"image/x-icon" },
+		{ "jpeg",	"image/jpeg" },
+		{ "jpg",	"image/jpeg" },
+		{ "js",		"application/javascript" },
+		{ "json",	"application/json" },
+		{ "mp4",	"video/mp4" },
+		{ "pdf",	"application/pdf" },
+		{ "png",	"image/png" },
+		{ "svg",	"image/svg+xml" },
+		{ "txt",	"text/plain" },
+		{ "wasm",	"application/wasm" },
+		{ "webp",	"image/webp" },
+		{ "woff",	"font/woff" },
+		{ "woff2",	"font/woff2" },
+		{ "xml",	"application/xml" },
+	};
+
+	static const std::string octet_stream( "application/octet-stream" );
+
+	std::string lower( ext );
+
+	std::transform( lower.begin(), lower.end(), lower.begin(), ::tolower );
+
+	auto it = types.find( lower );
+
+	return ( it != types.end() ) ? it->second : octet_stream;
+}
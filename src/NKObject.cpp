@@ -57,7 +57,7 @@ netkit::ref_count_print( const std::string &message )
 
 object::object()
 :
-	m_refs( 0 )
+	m_attrs( nullptr )
 {
 	static bool first = true;
 	
@@ -71,15 +71,15 @@ object::object()
 
 object::object( const object &that )
 :
-	m_attrs( that.m_attrs ),
-	m_refs( 0 )
+	counted< object >( that ),
+	m_attrs( that.has_attrs() ? new attrs( *that.m_attrs ) : nullptr )
 {
 }
 
 
 object::object( const json::value_ref &root )
 :
-	m_refs( 0 )
+	m_attrs( nullptr )
 {
 	inflate( root );
 }
@@ -87,6 +87,17 @@ object::object( const json::value_ref &root )
 
 object::~object()
 {
+	if ( m_attrs )
+	{
+		delete m_attrs;
+	}
+}
+
+
+object&
+object::operator=( const object &that )
+{
+	return object::assign( that );
 }
 
 
@@ -138,11 +149,11 @@ object::inflate( const json::value_ref &root )
 expected< std::int8_t >
 object::int8_for_key( const std::string &key ) const
 {
-	auto it = m_attrs.find( key );
+	auto val = find_attr( key );
 
-	if ( it != m_attrs.end() )
+	if ( val )
 	{
-		return ( it->second.length() > 0 ) ? std::stoi( it->second ) : 0;
+		return ( val->length() > 0 ) ? std::stoi( *val ) : 0;
 	}
 	else
 	{
@@ -154,11 +165,11 @@ object::int8_for_key( const std::string &key ) const
 expected< std::uint8_t >
 object::uint8_for_key( const std::string &key ) const
 {
-	auto it = m_attrs.find( key );
+	auto val = find_attr( key );
 
-	if ( it != m_attrs.end() )
+	if ( val )
 	{
-		return ( it->second.length() > 0 ) ? std::stoi( it->second ) : 0;
+		return ( val->length() > 0 ) ? std::stoi( *val ) : 0;
 	}
 	else
 	{
@@ -169,11 +180,11 @@ object::uint8_for_key( const std::string &key ) const
 expected< std::int16_t >
 object::int16_for_key( const std::string &key ) const
 {
-	auto it = m_attrs.find( key );
+	auto val = find_attr( key );
 
-	if ( it != m_attrs.end() )
+	if ( val )
 	{
-		return ( it->second.length() > 0 ) ? std::stoi( it->second ) : 0;
+		return ( val->length() > 0 ) ? std::stoi( *val ) : 0;
 	}
 	else
 	{
@@ -185,11 +196,11 @@ object::int16_for_key( const std::string &key ) const
 expected< std::uint16_t >
 object::uint16_for_key( const std::string &key ) const
 {
-	auto it = m_attrs.find( key );
+	auto val = find_attr( key );
 
-	if ( it != m_attrs.end() )
+	if ( val )
 	{
-		return ( it->second.length() > 0 ) ? std::stoi( it->second ) : 0;
+		return ( val->length() > 0 ) ? std::stoi( *val ) : 0;
 	}
 	else
 	{
@@ -200,11 +211,11 @@ object::uint16_for_key( const std::string &key ) const
 expected< std::int32_t >
 object::int32_for_key( const std::string &key ) const
 {
-	auto it = m_attrs.find( key );
+	auto val = find_attr( key );
 
-	if ( it != m_attrs.end() )
+	if ( val )
 	{
-		return ( it->second.length() > 0 ) ? ( std::int32_t ) std::stol( it->second ) : 0;
+		return ( val->length() > 0 ) ? ( std::int32_t ) std::stol( *val ) : 0;
 	}
 	else
 	{
@@ -216,11 +227,11 @@ object::int32_for_key( const std::string &key ) const
 expected< std::uint32_t >
 object::uint32_for_key( const std::string &key ) const
 {
-	auto it = m_attrs.find( key );
+	auto val = find_attr( key );
 
-	if ( it != m_attrs.end() )
+	if ( val )
 	{
-		return ( it->second.length() > 0 ) ? ( std::uint32_t ) std::stoul( it->second ) : 0;
+		return ( val->length() > 0 ) ? ( std::uint32_t ) std::stoul( *val ) : 0;
 	}
 	else
 	{
@@ -232,11 +243,11 @@ object::uint32_for_key( const std::string &key ) const
 expected< std::int64_t >
 object::int64_for_key( const std::string &key ) const
 {
-	auto it = m_attrs.find( key );
+	auto val = find_attr( key );
 
-	if ( it != m_attrs.end() )
+	if ( val )
 	{
-		return ( it->second.length() > 0 ) ? std::stoll( it->second ) : 0;
+		return ( val->length() > 0 ) ? std::stoll( *val ) : 0;
 	}
 	else
 	{
@@ -248,11 +259,11 @@ object::int64_for_key( const std::string &key ) const
 expected< std::uint64_t >
 object::uint64_for_key( const std::string &key ) const
 {
-	auto it = m_attrs.find( key );
+	auto val = find_attr( key );
 
-	if ( it != m_attrs.end() )
+	if ( val )
 	{
-		return ( it->second.length() > 0 ) ? std::stoull( it->second ) : 0;
+		return ( val->length() > 0 ) ? std::stoull( *val ) : 0;
 	}
 	else
 	{
@@ -264,11 +275,11 @@ object::uint64_for_key( const std::string &key ) const
 expected< std::string >
 object::string_for_key( const std::string &key ) const
 {
-	auto it = m_attrs.find( key );
+	auto val = find_attr( key );
 
-	if ( it != m_attrs.end() )
+	if ( val )
 	{
-		return it->second;
+		return *val;
 	}
 	else
 	{
@@ -280,56 +291,56 @@ object::string_for_key( const std::string &key ) const
 void
 object::set_value_for_key( const std::string &key, std::int8_t val )
 {
-	m_attrs[ key ] = std::to_string( val );
+	writable_attrs()[ key ] = std::to_string( val );
 }
 
 
 void
 object::set_value_for_key( const std::string &key, std::uint8_t val )
 {
-	m_attrs[ key ] = std::to_string( val );
+	writable_attrs()[ key ] = std::to_string( val );
 }
 
 
 void
 object::set_value_for_key( const std::string &key, std::int16_t val )
 {
-	m_attrs[ key ] = std::to_string( val );
+	writable_attrs()[ key ] = std::to_string( val );
 }
 
 
 void
 object::set_value_for_key( const std::string &key, std::uint16_t val )
 {
-	m_attrs[ key ] = std::to_string( val );
+	writable_attrs()[ key ] = std::to_string( val );
 }
 
 
 void
 object::set_value_for_key( const std::string &key, std::int32_t val )
 {
-	m_attrs[ key ] = std::to_string( val );
+	writable_attrs()[ key ] = std::to_string( val );
 }
 
 
 void
 object::set_value_for_key( const std::string &key, std::uint32_t val )
 {
-	m_attrs[ key ] = std::to_string( val );
+	writable_attrs()[ key ] = std::to_string( val );
 }
 
 
 void
 object::set_value_for_key( const std::string &key, std::int64_t val )
 {
-	m_attrs[ key ] = std::to_string( val );
+	writable_attrs()[ key ] = std::to_string( val );
 }
 
 
 void
 object::set_value_for_key( const std::string &key, std::uint64_t val )
 {
-	m_attrs[ key ] = std::to_string( val );
+	writable_attrs()[ key ] = std::to_string( val );
 }
 
 
@@ -337,7 +348,7 @@ object::set_value_for_key( const std::string &key, std::uint64_t val )
 void
 object::set_value_for_key( const std::string &key, std::time_t val )
 {
-	m_attrs[ key ] = std::to_string( val );
+	writable_attrs()[ key ] = std::to_string( val );
 }
 #endif
 
@@ -345,18 +356,75 @@ object::set_value_for_key( const std::string &key, std::time_t val )
 void
 object::set_value_for_key( const std::string &key, const std::string &value )
 {
-	m_attrs[ key ] = value;
+	writable_attrs()[ key ] = value;
 }
 
 
 void
 object::remove_value_for_key( const std::string &key )
 {
-	auto it = m_attrs.find( key );
+	if ( m_attrs )
+	{
+		m_attrs->erase( key );
+	}
+}
+
+
+const std::string*
+object::find_attr( const std::string &key ) const
+{
+	if ( m_attrs )
+	{
+		auto it = m_attrs->find( key );
+
+		if ( it != m_attrs->end() )
+		{
+			return &it->second;
+		}
+	}
+
+	return nullptr;
+}
+
+
+object::attrs&
+object::writable_attrs()
+{
+	if ( !m_attrs )
+	{
+		m_attrs = new attrs;
+	}
+
+	return *m_attrs;
+}
+
+
+object::attrs&
+object::empty_attrs()
+{
+	static attrs empty;
+
+	return empty;
+}
 
-	if ( it != m_attrs.end() )
+
+void
+object::transfer_attrs( object &to )
+{
+	if ( has_attrs() )
 	{
-		m_attrs.erase( it );
+		if ( !to.m_attrs )
+		{
+			to.m_attrs	= m_attrs;
+			m_attrs		= nullptr;
+		}
+		else
+		{
+			for ( auto it = m_attrs->begin(); it != m_attrs->end(); it++ )
+			{
+				( *to.m_attrs )[ it->first ] = it->second;
+			}
+		}
 	}
 }
 
@@ -381,6 +449,17 @@ object::equals( const object &that ) const
 object&
 object::assign( const object &that )
 {
-	m_attrs = that.m_attrs;
+	if ( this != &that )
+	{
+		if ( that.has_attrs() )
+		{
+			writable_attrs() = *that.m_attrs;
+		}
+		else if ( m_attrs )
+		{
+			m_attrs->clear();
+		}
+	}
+
 	return *this;
 }
\ No newline at end of file
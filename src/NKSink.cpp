@@ -41,6 +41,9 @@
 using namespace netkit;
 
 sink::sink()
+:
+	m_paused( false ),
+	m_parked( false )
 {
 }
 
@@ -162,6 +165,26 @@ sink::close()
 }
 
 
+void
+sink::pause()
+{
+	m_paused = true;
+}
+
+
+void
+sink::resume()
+{
+	m_paused = false;
+
+	if ( m_parked && is_open() )
+	{
+		m_parked = false;
+		run();
+	}
+}
+
+
 void
 sink::run()
 {
@@ -177,7 +200,11 @@ sink::run()
 				{
 					if ( process( buf, len ) )
 					{
-						if ( is_open() )
+						if ( m_paused )
+						{
+							m_parked = true;
+						}
+						else if ( is_open() )
 						{
 							run();
 						}
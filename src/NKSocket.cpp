@@ -155,6 +155,13 @@ socket::start_recv( source::recv_reply_f reply )
 }
 
 
+bool
+socket::send_file( int file, std::uint64_t offset, std::size_t len, source::send_reply_f reply )
+{
+	return m_fd ? m_fd->sendfile( file, offset, len, reply ) : false;
+}
+
+
 void
 socket::close( bool notify )
 {
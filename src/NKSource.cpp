@@ -107,6 +107,13 @@ source::on_close( netkit::cookie::ref *cookie, close_f func )
 
 void
 source::connect( const uri::ref &uri, connect_reply_f reply )
+{
+	connect( uri, std::vector< std::string >(), reply );
+}
+
+
+void
+source::connect( const uri::ref &uri, const std::vector< std::string > &protocols, connect_reply_f reply )
 {
 	if ( ( uri->scheme() == "http" ) || ( uri->scheme() == "xmpp" ) || ( uri->scheme() == "ws" ) )
 	{
@@ -122,7 +129,7 @@ source::connect( const uri::ref &uri, connect_reply_f reply )
 			add( proxy::get()->create_adapter( true ) );
 		}
 
-		add( tls::client::create() );
+		add( protocols.empty() ? tls::client::create() : tls::client::create( protocols ) );
 	}
 
 	if ( ( uri->scheme() == "ws" ) || ( uri->scheme() == "wss" ) )
@@ -360,6 +367,20 @@ source::teardown_notifications()
 }
 
 
+std::string
+source::protocol() const
+{
+	std::string ret;
+
+	for ( adapter *a = m_adapters.head(); a && ret.empty(); a = a->m_next )
+	{
+		ret = a->protocol();
+	}
+
+	return ret;
+}
+
+
 source::adapter::adapter()
 :
 	m_prev( nullptr ),
@@ -402,3 +423,10 @@ source::adapter::recv( const std::uint8_t *in_buf, std::size_t in_len, recv_repl
 {
 	reply( 0, in_buf, in_len, false );
 }
+
+
+std::string
+source::adapter::protocol() const
+{
+	return std::string();
+}
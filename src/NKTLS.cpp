@@ -63,7 +63,7 @@ public:
 		server
 	};
 
-	tls_adapter( type t );
+	tls_adapter( type t, const std::vector< std::string > &protocols = std::vector< std::string >() );
 	
 	virtual ~tls_adapter();
 
@@ -78,6 +78,9 @@ public:
 		
 	virtual void
 	recv( const std::uint8_t *in_buf, std::size_t in_len, recv_reply_f reply );
+
+	virtual std::string
+	protocol() const;
 	
 private:
 	
@@ -89,12 +92,16 @@ private:
 	
 	static void
 	callback(int p, int n, void *arg);
+
+	static int
+	select_protocol( SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg );
 	
 	bool							m_handshake;
 	std::uint8_t					m_buffer[ 4192 ];
 	std::vector< std::uint8_t >		m_send_data;
 	bool							m_sending;
 	std::vector< std::uint8_t >		m_recv_data;
+	std::vector< unsigned char >	m_alpn;
 	static X509						*m_cert;
 	static EVP_PKEY					*m_pkey;
 	
@@ -167,6 +174,13 @@ tls::server::create()
 }
 
 
+source::adapter::ref
+tls::server::create( const std::vector< std::string > &protocols )
+{
+	return new tls_adapter( tls_adapter::server, protocols );
+}
+
+
 source::adapter::ref
 tls::client::create()
 {
@@ -174,7 +188,14 @@ tls::client::create()
 }
 
 
-tls_adapter::tls_adapter( type t )
+source::adapter::ref
+tls::client::create( const std::vector< std::string > &protocols )
+{
+	return new tls_adapter( tls_adapter::client, protocols );
+}
+
+
+tls_adapter::tls_adapter( type t, const std::vector< std::string > &protocols )
 :
 	m_read_required( false ),
 	m_handshake( false ),
@@ -208,6 +229,15 @@ tls_adapter::tls_adapter( type t )
 		init = true;
 	}
 
+	// Both sides want the protocols in wire format: each one prefixed with
+	// its length.
+
+	for ( auto it = protocols.begin(); it != protocols.end(); it++ )
+	{
+		m_alpn.push_back( static_cast< unsigned char >( it->size() ) );
+		m_alpn.insert( m_alpn.end(), it->begin(), it->end() );
+	}
+
 	switch ( t )
 	{
 		case server:
@@ -216,6 +246,14 @@ tls_adapter::tls_adapter( type t )
 			SSL_CTX_set_options( ssl_context, SSL_OP_NO_SSLv2 );
 			SSL_CTX_use_PrivateKey( ssl_context, m_pkey );
 			SSL_CTX_use_certificate( ssl_context, m_cert );
+			if ( !m_alpn.empty() )
+			{
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+				SSL_CTX_set_alpn_select_cb( ssl_context, select_protocol, this );
+#else
+				nklog( log::warning, "ALPN needs OpenSSL 1.0.2 or later" );
+#endif
+			}
 	
 			m_ssl = SSL_new( ssl_context );
 			SSL_set_bio( m_ssl, BIO_new( BIO_s_mem() ), BIO_new( BIO_s_mem() ) );
@@ -231,6 +269,15 @@ tls_adapter::tls_adapter( type t )
 			m_ssl = SSL_new( m_ssl_context );
 			SSL_set_bio( m_ssl, BIO_new( BIO_s_mem() ), BIO_new( BIO_s_mem() ) );
 			SSL_set_connect_state( m_ssl );
+
+			if ( !m_alpn.empty() )
+			{
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+				SSL_set_alpn_protos( m_ssl, &m_alpn[ 0 ], static_cast< unsigned int >( m_alpn.size() ) );
+#else
+				nklog( log::warning, "ALPN needs OpenSSL 1.0.2 or later" );
+#endif
+			}
 		}
 	}
 }
@@ -335,6 +382,30 @@ tls_adapter::recv( const std::uint8_t *in_buf, std::size_t in_len, recv_reply_f
 }
 
 
+std::string
+tls_adapter::protocol() const
+{
+	std::string ret;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	const unsigned char	*data	= nullptr;
+	unsigned int		len		= 0;
+
+	if ( m_ssl )
+	{
+		SSL_get0_alpn_selected( m_ssl, &data, &len );
+
+		if ( data && len )
+		{
+			ret.assign( reinterpret_cast< const char* >( data ), len );
+		}
+	}
+#endif
+
+	return ret;
+}
+
+
 void
 tls_adapter::process()
 {
@@ -653,6 +724,26 @@ exit:
 }
 
 
+int
+tls_adapter::select_protocol( SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg )
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	// Our own order wins, not the client's.
+
+	tls_adapter		*self		= static_cast< tls_adapter* >( arg );
+	unsigned char	*selected	= nullptr;
+
+	if ( SSL_select_next_proto( &selected, outlen, &self->m_alpn[ 0 ], static_cast< unsigned int >( self->m_alpn.size() ), in, inlen ) == OPENSSL_NPN_NEGOTIATED )
+	{
+		*out = selected;
+		return SSL_TLSEXT_ERR_OK;
+	}
+#endif
+
+	return SSL_TLSEXT_ERR_NOACK;
+}
+
+
 void
 tls_adapter::callback(int p, int n, void *arg)
 {
@@ -42,61 +42,24 @@
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <random>
 #include <sstream>
 #include <stdio.h>
 #include <string>
 #include <thread>
+#if defined( __SSE2__ ) || defined( _M_X64 )
+#	include <emmintrin.h>
+#endif
+#if defined( __AVX2__ )
+#	include <immintrin.h>
+#endif
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#	include <arm_neon.h>
+#endif
 
 using namespace netkit;
 
 
-static std::uint64_t
-ntohll( std::uint64_t val )
-{
-	static const int	one = 1;
-	static const char	sig = *( char* ) &one; 
-
-	if ( sig == 0 )
-	{
-		return val;
-	}
-	else
-	{
-		std::uint64_t ret;
-
-        char* src = ( char* ) &val + 7;
-        char* dst = ( char* ) &ret;
-
-		for ( auto i = 8; i > 0; i-- )
-		{
-			*dst++ = *src--;
-		}
-
-		return ret;
-	}
-}
-
-
-static std::uint64_t
-htonll( std::uint64_t val )
-{
-	static const int	one = 1;
-	static const char	sig = *( char* ) &one; 
-
-	if ( sig == 0 )
-	{
-		return val;
-	}
-	else
-    {
-		const uint32_t high_part	= htonl( static_cast< std::uint32_t >( val >> 32 ) );
-		const uint32_t low_part		= htonl( static_cast< std::uint32_t >( val & 0xFFFFFFFFLL ) );
-
-		return ( static_cast<uint64_t>(low_part) << 32) | high_part;
-	}
-}
-
-
 class frame
 {
 public:
@@ -107,32 +70,42 @@ public:
 		incomplete			= 0xFE00,
 
 		opening				= 0x3300,
-		closing				= 0x3400,
+		closing				= 0x3400
+	};
 
-		incomplete_text		= 0x01,
-		incomplete_binary	= 0x02,
+	// Opcodes (RFC 6455 section 5.2). Those with 0x8 set are control
+	// frames, which may turn up between the fragments of a message.
 
-		text				= 0x81,
-		binary				= 0x82,
+	static const std::uint8_t continuation	= 0x0;
+	static const std::uint8_t text			= 0x1;
+	static const std::uint8_t binary		= 0x2;
+	static const std::uint8_t close			= 0x8;
+	static const std::uint8_t ping			= 0x9;
+	static const std::uint8_t pong			= 0xA;
 
-		close				= 0x18,
-		ping				= 0x19,
-		pong				= 0x1A
-	};
+	// The longest a frame header gets: 2 bytes, an 8 byte length and a
+	// masking key.
+
+	static const std::size_t max_header		= 14;
+
+	// Close status codes (RFC 6455 section 7.4.1).
+
+	static const std::uint16_t protocol_error	= 1002;
+	static const std::uint16_t too_big			= 1009;
 };
 
 
-class ws_adapter : public netkit::source::adapter
+class ws_adapter : public ws::adapter
 {
 public:
 
-	enum type
+	enum role
 	{
 		client,
 		server
 	};
 
-	ws_adapter( type t );
+	ws_adapter( role r );
 	
 	virtual ~ws_adapter();
 
@@ -147,17 +120,47 @@ public:
 		
 	virtual void
 	recv( const std::uint8_t *in_buf, std::size_t in_len, recv_reply_f reply );
+
+	virtual void
+	send_fragment( type t, const std::uint8_t *buf, std::size_t len, bool last, source::send_reply_f reply );
 	
 private:
 
 	frame::type
 	parse_server_handshake( const std::uint8_t *buf, std::size_t in_len, std::size_t *out_len );
-	
+
+	// A whole frame, header and payload, in a buffer of exactly its size.
+
+	void
+	make_frame( std::uint8_t opcode, bool fin, const std::uint8_t *buf, std::size_t len, std::vector< std::uint8_t > &out );
+
+	// Sends a frame, or holds on to it until the handshake is done.
+
+	void
+	put( std::vector< std::uint8_t > &frame, source::send_reply_f reply );
+
+	// Runs received bytes through the frame parser. Returns 0, or the
+	// status the connection has to be failed with.
+
+	int
+	parse( const std::uint8_t *buf, std::size_t len, recv_reply_f reply );
+
+	// How long the header in m_head is, as far as can be told yet.
+
 	std::size_t
-	make_frame( frame::type type, std::uint8_t *msg, std::size_t msg_len, std::uint8_t *buffer, std::size_t buffer_len);
+	header_length() const;
 
-	frame::type
-	get_frame( std::uint8_t *in_buffer, std::size_t in_length, std::uint8_t *out_buffer, std::size_t out_size, std::size_t *out_length, std::size_t *out_parsed );
+	void
+	payload( const std::uint8_t *buf, std::size_t len, bool last );
+
+	int
+	frame_did_end( recv_reply_f reply );
+
+	// Starts the closing handshake with status and returns the error the
+	// connection is then failed with.
+
+	int
+	fail( std::uint16_t status );
 
 	std::string
 	trim( std::string str );
@@ -166,94 +169,80 @@ private:
 	explode( std::string string, std::string delim, bool include_empty_strings = false );
 
 	bool							m_handshake;
-	std::vector< std::uint8_t >		m_handshake_data;
 	std::string						m_expected_key;
-	std::vector< std::uint8_t >		m_send_data;
-	bool							m_sending;
 	std::vector< std::uint8_t >		m_unparsed_recv_data;
+	std::mt19937					m_keys;
+	bool							m_fragmenting;
+
+	// The frame being received.
+
+	std::uint8_t					m_head[ frame::max_header ];
+	std::size_t						m_head_len;
+	bool							m_in_frame;
+	std::uint8_t					m_opcode;
+	bool							m_fin;
+	bool							m_masked;
+	std::uint8_t					m_mask_key[ 4 ];
+	std::uint64_t					m_left;
+	std::uint64_t					m_offset;
+
+	// The message it belongs to. m_message only fills up when there is no
+	// message handler, and m_control holds a control frame's payload.
+
+	std::uint8_t					m_message_opcode;
+	std::vector< std::uint8_t >		m_message;
+	std::vector< std::uint8_t >		m_control;
+	std::vector< std::uint8_t >		m_unmasked;
 	
-protected:
-
-	void
-	process();
-
-	std::streamsize
-	data_to_write( std::uint8_t *data, size_t len );
-
-	std::streamsize
-	data_to_read( std::uint8_t *data, size_t len );
-
 protected:
 
 	struct buffer
 	{
-		send_reply_f				m_reply;
+		source::send_reply_f		m_reply;
 		std::vector< std::uint8_t > m_data;
 
-		inline buffer( send_reply_f reply, const std::uint8_t *data, std::size_t len )
+		inline buffer( source::send_reply_f reply, std::vector< std::uint8_t > &data )
 		:
-			m_reply( reply ),
-			m_data( data, data + len )
+			m_reply( reply )
 		{
+			m_data.swap( data );
 		}
 	};
 	
-	inline void
-	was_consumed( std::queue< buffer* > &queue, buffer *buf, std::size_t used )
-	{
-		if ( buf->m_data.size() == used )
-		{
-			queue.pop();
-			delete buf;
-		}
-		else if ( used > 0 )
-		{
-			std::rotate( buf->m_data.begin(), buf->m_data.begin() + used, buf->m_data.end() );
-			buf->m_data.resize( buf->m_data.size() - used );
-		}
-	}
-	
-	void
-	send_pending_data();
-	
 	std::queue< buffer* >	m_pending_send_list;
-	std::queue< buffer* >	m_pending_read_list;
-	bool					m_read_required;
-	bool					m_error;
-	type					m_type;
-	
-	std::string m_resource;
-	std::string m_host;
-	std::string m_origin;
-	std::string m_protocol;
-	std::string m_key;
-
+	role					m_role;
 };
 
 
-source::adapter::ref
+ws::adapter::ref
 ws::server::create()
 {
 	return new ws_adapter( ws_adapter::server );
 }
 
 
-source::adapter::ref
+ws::adapter::ref
 ws::client::create()
 {
 	return new ws_adapter( ws_adapter::client );
 }
 
 
-ws_adapter::ws_adapter( type t )
+ws_adapter::ws_adapter( role r )
 :
-	m_read_required( false ),
 	m_handshake( false ),
-	m_sending( false ),
-	m_error( false ),
-	m_type( t )
+	m_fragmenting( false ),
+	m_head_len( 0 ),
+	m_in_frame( false ),
+	m_opcode( 0 ),
+	m_fin( false ),
+	m_masked( false ),
+	m_left( 0 ),
+	m_offset( 0 ),
+	m_message_opcode( 0 ),
+	m_role( r )
 {
-	switch ( t )
+	switch ( r )
 	{
 		case server:
 		{
@@ -263,6 +252,13 @@ ws_adapter::ws_adapter( type t )
 
 		case client:
 		{
+			// Masking keys only have to keep a script from predicting what
+			// goes on the wire, so one seed from the OS per connection will
+			// do.
+
+			std::random_device seed;
+
+			m_keys.seed( seed() );
 		}
 	}
 }
@@ -271,6 +267,12 @@ ws_adapter::ws_adapter( type t )
 ws_adapter::~ws_adapter()
 {
 	nklog( log::verbose, "" );
+
+	while ( !m_pending_send_list.empty() )
+	{
+		delete m_pending_send_list.front();
+		m_pending_send_list.pop();
+	}
 }
 
 
@@ -316,26 +318,53 @@ ws_adapter::connect( const uri::ref &uri, const endpoint::ref &to, connect_reply
 void
 ws_adapter::send( const std::uint8_t *data, std::size_t len, send_reply_f reply )
 {
-	std::vector< std::uint8_t > raw( len * 2 );
-	auto						actual = make_frame( frame::type::text, ( std::uint8_t* ) data, len, &raw[ 0 ], raw.size() );
+	std::vector< std::uint8_t > out;
 
-	if ( actual > 0 )
+	if ( m_fragmenting )
 	{
-		if ( m_handshake )
-		{
-			m_next->send( &raw[ 0 ], actual, reply );
-		}
-		else
+		nklog( log::error, "can't start a message while a fragmented one is being sent" );
+		reply( -1, nullptr, 0 );
+		return;
+	}
+
+	make_frame( ( m_send_type == type::binary ) ? frame::binary : frame::text, true, data, len, out );
+
+	if ( m_handshake )
+	{
+		m_next->send( &out[ 0 ], out.size(), reply );
+	}
+	else
+	{
+		// Whoever called the source's send() hears back once the frame has
+		// actually gone out.
+
+		put( out, [=]( int status )
 		{
-			buffer *buf = new buffer( reply, &raw[ 0 ], actual );
+			reply( status, nullptr, 0 );
+		} );
+	}
+}
 
-			m_pending_send_list.push( buf );
-		}
+
+void
+ws_adapter::send_fragment( type t, const std::uint8_t *buf, std::size_t len, bool last, source::send_reply_f reply )
+{
+	std::vector< std::uint8_t >	out;
+	std::uint8_t				opcode;
+
+	if ( m_fragmenting )
+	{
+		opcode = frame::continuation;
 	}
 	else
 	{
-		reply( -1, nullptr, 0 );
+		opcode = ( t == type::binary ) ? frame::binary : frame::text;
 	}
+
+	m_fragmenting = !last;
+
+	make_frame( opcode, last, buf, len, out );
+	put( out, reply );
 }
 
 
@@ -344,107 +373,68 @@ ws_adapter::recv( const std::uint8_t *in_buf, std::size_t in_len, recv_reply_f r
 {
 	m_next->recv( in_buf, in_len, [=]( int status, const std::uint8_t *out_buf, std::size_t out_len, bool more_coming )
 	{
-		if ( status == 0 )
+		std::vector< std::uint8_t >	rest;
+		int							err = 0;
+
+		if ( status != 0 )
 		{
-			frame::type type		= frame::type::incomplete;
-			std::size_t	payload_len	= 0;
-			std::size_t parsed_len	= 0;
-			
-			if ( m_handshake )
-			{
-				if ( out_len )
-				{
-					m_unparsed_recv_data.insert( m_unparsed_recv_data.end(), out_buf, out_buf + out_len );
-				}
-			}
-			else if ( out_len > 0 )
+			nklog( log::error, "received error %...closing connection", status );
+			reply( status, nullptr, 0, false );
+			return;
+		}
+
+		if ( !m_handshake && ( out_len > 0 ) )
+		{
+			std::size_t	header_len;
+			frame::type	result;
+
+			m_unparsed_recv_data.insert( m_unparsed_recv_data.end(), out_buf, out_buf + out_len );
+
+			result = parse_server_handshake( &m_unparsed_recv_data[ 0 ], m_unparsed_recv_data.size(), &header_len );
+
+			if ( result == frame::type::error )
 			{
-				std::size_t out_header_len;
-				
-				m_unparsed_recv_data.insert( m_unparsed_recv_data.end(), out_buf, out_buf + out_len );
-				
-				type = parse_server_handshake( &m_unparsed_recv_data[ 0 ], m_unparsed_recv_data.size(), &out_header_len );
-				
-				if ( type == frame::type::opening )
-				{
-					m_handshake = true;
-					
-					if ( m_unparsed_recv_data.size() > out_header_len )
-					{
-						std::rotate( m_unparsed_recv_data.begin(), m_unparsed_recv_data.begin() + out_header_len, m_unparsed_recv_data.end() );
-						m_unparsed_recv_data.resize( m_unparsed_recv_data.size() - out_header_len );
-					}
-					else
-					{
-						m_unparsed_recv_data.clear();
-					}
-					
-					while ( m_pending_send_list.size() > 0 )
-					{
-						buffer *b = m_pending_send_list.front();
-						
-						m_source->send( m_next, &b->m_data[ 0 ], b->m_data.size(), [=]( int status )
-						{
-						} );
-
-						m_pending_send_list.pop();
-						
-						delete b;
-					}
-				}
+				nklog( log::error, "received a bad handshake...closing connection" );
+				reply( -1, nullptr, 0, false );
+				return;
 			}
-			
-			if ( type != frame::type::error ) 
+
+			if ( result == frame::type::opening )
 			{
-				while ( 1 )
+				m_handshake = true;
+
+				// Anything that came in behind the handshake is frames.
+
+				rest.assign( m_unparsed_recv_data.begin() + header_len, m_unparsed_recv_data.end() );
+				m_unparsed_recv_data.clear();
+
+				while ( !m_pending_send_list.empty() )
 				{
-					if ( m_unparsed_recv_data.size() > 0 )
-					{
-						std::vector< std::uint8_t > parsed_data( m_unparsed_recv_data.size() );
+					buffer *b = m_pending_send_list.front();
 
-						type = get_frame( &m_unparsed_recv_data[ 0 ], m_unparsed_recv_data.size(), &parsed_data[ 0 ], parsed_data.size(), &payload_len, &parsed_len );
-			
-						if ( type == frame::type::text )
-						{
-							reply( 0, &parsed_data[ 0 ], payload_len, true );
-							std::rotate( m_unparsed_recv_data.begin(), m_unparsed_recv_data.begin() + parsed_len, m_unparsed_recv_data.end() );
-							m_unparsed_recv_data.resize( m_unparsed_recv_data.size() - parsed_len );
-						}
-						else if ( ( type == frame::type::incomplete ) || ( type == frame::type::incomplete_text ) )
-						{
-							reply( 0, nullptr, 0, false );
-							break;
-						}
-						else if ( type == frame::type::close )
-						{
-							nklog( log::error, "received a close frame" );
-							reply( -2, nullptr, 0, false );
-							break;
-						}
-						else if ( type == frame::type::error )
-						{
-							nklog( log::error, "received a frame error...closing connection" );
-							reply( -1, nullptr, 0, false );
-							break;
-						}
-					}
-					else
-					{
-						reply( 0, nullptr, 0, false );
-						break;
-					}
+					m_pending_send_list.pop();
+					put( b->m_data, b->m_reply );
+
+					delete b;
 				}
 			}
-			else
-			{
-				nklog( log::error, "received a frame error...closing connection" );
-				reply( -1, nullptr, 0, false );
-			}
+
+			out_buf = rest.empty() ? nullptr : &rest[ 0 ];
+			out_len = rest.size();
+		}
+
+		if ( m_handshake && ( out_len > 0 ) )
+		{
+			err = parse( out_buf, out_len, reply );
+		}
+
+		if ( err != 0 )
+		{
+			reply( err, nullptr, 0, false );
 		}
 		else
 		{
-			nklog( log::error, "received error %...closing connection", status );
-			reply( status, nullptr, 0, false );
+			reply( 0, nullptr, 0, false );
 		}
 	} );
 }
@@ -484,7 +474,7 @@ ws_adapter::parse_server_handshake( const std::uint8_t *buf, std::size_t in_len,
 		goto exit;
 	}
 		
-	for ( int i = 1; i < lines.size(); i++ )
+	for ( std::size_t i = 1; i < lines.size(); i++ )
 	{
 		std::string& line = lines[ i ];
 		std::size_t pos = line.find( ":" );
@@ -578,152 +568,418 @@ ws_adapter::explode( std::string the_string, std::string delim, bool include_emp
 }
 
 
-std::size_t
-ws_adapter::make_frame( frame::type type, std::uint8_t *msg, std::size_t msg_length, std::uint8_t *buffer, std::size_t buffer_size)
+void
+ws_adapter::make_frame( std::uint8_t opcode, bool fin, const std::uint8_t *buf, std::size_t len, std::vector< std::uint8_t > &out )
 {
-	int			pos		= 0;
-	std::size_t size	= msg_length; 
+	bool			masked	= ( m_role == client );
+	std::size_t		head	= 2;
+	std::uint8_t	*p;
+
+	// Everything a client sends has to be masked (RFC 6455 section 5.1).
+
+	head += ( len <= 125 ) ? 0 : ( len <= 65535 ) ? 2 : 8;
+	head += masked ? 4 : 0;
 
-	buffer[ pos++ ] = ( std::uint8_t ) frame::type::text; // text frame
+	out.resize( head + len );
 
-	if ( size <= 125 )
+	p		= &out[ 0 ];
+	*p++	= ( fin ? 0x80 : 0x00 ) | opcode;
+
+	if ( len <= 125 )
 	{
-		buffer[ pos++ ] = ( std::uint8_t) size;
+		*p++ = ( masked ? 0x80 : 0x00 ) | static_cast< std::uint8_t >( len );
 	}
-	else if ( size <= 65535 )
+	else if ( len <= 65535 )
 	{
-		std::uint16_t tmp = htons( ( std::uint16_t ) size );
-
-		buffer[ pos++ ] = 126;
-
-		buffer[ pos++ ] = ( ( std::uint8_t* ) &tmp )[ 0 ];
-		buffer[ pos++ ] = ( ( std::uint8_t* ) &tmp )[ 1 ];
+		*p++ = ( masked ? 0x80 : 0x00 ) | 126;
+		*p++ = static_cast< std::uint8_t >( len >> 8 );
+		*p++ = static_cast< std::uint8_t >( len );
 	}
 	else
 	{
-		std::uint64_t tmp = htonll( size );
-
-		buffer[ pos++ ] = 127;
+		*p++ = ( masked ? 0x80 : 0x00 ) | 127;
 
-		for ( auto i = 0; i < 8; i++ )
+		for ( auto i = 7; i >= 0; i-- )
 		{
-			buffer[ pos++ ] = ( ( std::uint8_t* ) &tmp )[ i ];
+			*p++ = static_cast< std::uint8_t >( static_cast< std::uint64_t >( len ) >> ( i * 8 ) );
 		}
 	}
 
-	memcpy( ( void* )( buffer + pos ), msg, size );
+	if ( masked )
+	{
+		std::uint32_t key = static_cast< std::uint32_t >( m_keys() );
+
+		memcpy( p, &key, 4 );
+		p += 4;
+	}
+
+	if ( len > 0 )
+	{
+		memcpy( p, buf, len );
 
-	return ( size + pos );
+		if ( masked )
+		{
+			ws::mask( p, len, p - 4 );
+		}
+	}
 }
 
 
-frame::type
-ws_adapter::get_frame( std::uint8_t *in_buffer, std::size_t in_length, std::uint8_t *out_buffer, std::size_t out_size, std::size_t *out_length, std::size_t *out_parsed )
+void
+ws_adapter::put( std::vector< std::uint8_t > &out, source::send_reply_f reply )
 {
-	if ( in_length < 2 )
+	if ( !reply )
 	{
-		return frame::type::incomplete;
+		reply = []( int status )
+		{
+		};
 	}
 
-	std::uint8_t	msg_opcode		= in_buffer[ 0 ] & 0x0F;
-	std::uint8_t	msg_fin			= ( in_buffer[ 0 ] >> 7 ) & 0x01;
-	std::uint8_t	msg_masked		= ( in_buffer[ 1 ] >> 7 ) & 0x01;
-	std::uint64_t	payload_length	= 0;
-	int				pos				= 2;
-	int				length_field	= in_buffer[ 1 ] & ( ~0x80 );
-	unsigned int	mask			= 0;
-
-	if ( length_field <= 125 )
+	if ( m_handshake )
 	{
-		payload_length = length_field;
+		m_source->send( m_next, &out[ 0 ], out.size(), reply );
 	}
-	else if ( length_field == 126 )
+	else
 	{
-		std::uint16_t tmp;
+		m_pending_send_list.push( new buffer( reply, out ) );
+	}
+}
 
-		if ( in_length < 4 )
-		{
-			return frame::type::incomplete;
-		}
 
-		( ( std::uint8_t* ) &tmp )[ 0 ] = in_buffer[ pos++ ];
-		( ( std::uint8_t* ) &tmp )[ 1 ] = in_buffer[ pos++ ];
-		
-		payload_length = ntohs( tmp ); 
-	}
-	else if ( length_field == 127 )
-	{
-		std::uint64_t tmp;
+int
+ws_adapter::parse( const std::uint8_t *buf, std::size_t len, recv_reply_f reply )
+{
+	int err = 0;
 
-		if ( in_length < 10 )
+	while ( ( len > 0 ) && ( err == 0 ) )
+	{
+		if ( !m_in_frame )
 		{
-			return frame::type::incomplete;
-		}
+			// The header can be split across reads like anything else. How
+			// long it is depends on its second byte.
+
+			while ( ( len > 0 ) && ( m_head_len < header_length() ) )
+			{
+				m_head[ m_head_len++ ] = *buf++;
+				len--;
+			}
+
+			if ( m_head_len < header_length() )
+			{
+				break;
+			}
+
+			std::uint8_t	length_field	= m_head[ 1 ] & 0x7F;
+			std::size_t		pos				= 2;
 
-		for ( auto i = 0; i < 8; i++ )
+			m_fin		= ( m_head[ 0 ] & 0x80 ) != 0;
+			m_opcode	= m_head[ 0 ] & 0x0F;
+			m_masked	= ( m_head[ 1 ] & 0x80 ) != 0;
+			m_left		= length_field;
+
+			if ( length_field == 126 )
+			{
+				m_left	= ( static_cast< std::uint64_t >( m_head[ 2 ] ) << 8 ) | m_head[ 3 ];
+				pos		= 4;
+			}
+			else if ( length_field == 127 )
+			{
+				m_left	= 0;
+				pos		= 10;
+
+				for ( auto i = 2; i < 10; i++ )
+				{
+					m_left = ( m_left << 8 ) | m_head[ i ];
+				}
+			}
+
+			if ( m_masked )
+			{
+				memcpy( m_mask_key, m_head + pos, 4 );
+			}
+
+			m_head_len	= 0;
+			m_offset	= 0;
+			m_in_frame	= true;
+
+			if ( ( m_head[ 0 ] & 0x70 ) || ( m_left >> 63 ) )
+			{
+				nklog( log::error, "received a malformed frame header...closing connection" );
+				return fail( frame::protocol_error );
+			}
+
+			// Clients mask everything they send and servers nothing (RFC
+			// 6455 section 5.1).
+
+			if ( m_masked != ( m_role == server ) )
+			{
+				nklog( log::error, "received % frame...closing connection", m_masked ? "a masked" : "an unmasked" );
+				return fail( frame::protocol_error );
+			}
+
+			if ( m_opcode & 0x08 )
+			{
+				if ( ( ( m_opcode != frame::close ) && ( m_opcode != frame::ping ) && ( m_opcode != frame::pong ) ) || !m_fin || ( m_left > 125 ) )
+				{
+					nklog( log::error, "received a bad control frame (opcode %)...closing connection", static_cast< int >( m_opcode ) );
+					return fail( frame::protocol_error );
+				}
+
+				m_control.clear();
+			}
+			else if ( m_opcode == frame::continuation )
+			{
+				if ( !m_message_opcode )
+				{
+					nklog( log::error, "received a continuation frame outside of a message...closing connection" );
+					return fail( frame::protocol_error );
+				}
+			}
+			else if ( ( m_opcode == frame::text ) || ( m_opcode == frame::binary ) )
+			{
+				if ( m_message_opcode )
+				{
+					nklog( log::error, "received a new message before the last one ended...closing connection" );
+					return fail( frame::protocol_error );
+				}
+
+				m_message_opcode = m_opcode;
+			}
+			else
+			{
+				nklog( log::error, "received a frame with unknown opcode %...closing connection", static_cast< int >( m_opcode ) );
+				return fail( frame::protocol_error );
+			}
+
+			// Messages only pile up here when there is nobody to hand them
+			// to as they come in.
+
+			if ( !( m_opcode & 0x08 ) && !m_message_handler && m_max_message_size && ( m_left > ( m_max_message_size - m_message.size() ) ) )
+			{
+				nklog( log::error, "received a message over % bytes...closing connection", m_max_message_size );
+				return fail( frame::too_big );
+			}
+
+			if ( m_left == 0 )
+			{
+				err = frame_did_end( reply );
+			}
+		}
+		else
 		{
-			( ( std::uint8_t* ) &tmp )[ i ] = in_buffer[ pos++ ];
+			std::size_t			n = static_cast< std::size_t >( std::min< std::uint64_t >( len, m_left ) );
+			const std::uint8_t	*p = buf;
+
+			if ( m_masked )
+			{
+				m_unmasked.assign( buf, buf + n );
+				ws::mask( &m_unmasked[ 0 ], n, m_mask_key, m_offset );
+				p = &m_unmasked[ 0 ];
+			}
+
+			buf			+= n;
+			len			-= n;
+			m_left		-= n;
+			m_offset	+= n;
+
+			if ( m_opcode & 0x08 )
+			{
+				m_control.insert( m_control.end(), p, p + n );
+			}
+			else
+			{
+				payload( p, n, m_fin && ( m_left == 0 ) );
+			}
+
+			if ( m_left == 0 )
+			{
+				err = frame_did_end( reply );
+			}
 		}
+	}
+
+	return err;
+}
+
+
+std::size_t
+ws_adapter::header_length() const
+{
+	std::size_t len = 2;
 
-		payload_length = ntohll( tmp );
+	if ( m_head_len >= 2 )
+	{
+		std::uint8_t length_field = m_head[ 1 ] & 0x7F;
+
+		len += ( length_field == 126 ) ? 2 : ( length_field == 127 ) ? 8 : 0;
+		len += ( m_head[ 1 ] & 0x80 ) ? 4 : 0;
 	}
 
-	if ( in_length < payload_length + pos )
+	return len;
+}
+
+
+void
+ws_adapter::payload( const std::uint8_t *buf, std::size_t len, bool last )
+{
+	if ( m_message_handler )
 	{
-		return frame::type::incomplete;
+		m_message_handler( ( m_message_opcode == frame::binary ) ? type::binary : type::text, buf, len, last );
 	}
+	else
+	{
+		m_message.insert( m_message.end(), buf, buf + len );
+	}
+}
+
+
+int
+ws_adapter::frame_did_end( recv_reply_f reply )
+{
+	std::vector< std::uint8_t >	out;
+	int							ret = 0;
 
-	if ( msg_masked )
+	m_in_frame = false;
+
+	switch ( m_opcode )
 	{
-		mask = *( ( unsigned int* )( in_buffer + pos ) );
-		pos += 4;
+		case frame::close:
+		{
+			// Answer with the same status code, which completes the
+			// closing handshake from our side.
+
+			nklog( log::verbose, "received a close frame" );
+
+			make_frame( frame::close, true, m_control.data(), std::min< std::size_t >( m_control.size(), 2 ), out );
+			put( out, nullptr );
 
-		std::uint8_t* c = in_buffer + pos;
+			ret = -2;
+		}
+		break;
+
+		case frame::ping:
+		{
+			make_frame( frame::pong, true, m_control.data(), m_control.size(), out );
+			put( out, nullptr );
+		}
+		break;
+
+		case frame::pong:
+		{
+		}
+		break;
 
-		for ( int i = 0; i < payload_length; i++ )
+		default:
 		{
-			c[ i ] = c[ i ] ^ ( ( std::uint8_t* )( &mask ) )[ i % 4 ];
+			if ( !m_fin )
+			{
+				break;
+			}
+
+			if ( m_message_handler )
+			{
+				// An empty last frame hasn't been passed on yet.
+
+				if ( m_offset == 0 )
+				{
+					payload( nullptr, 0, true );
+				}
+			}
+			else if ( !m_message.empty() )
+			{
+				reply( 0, &m_message[ 0 ], m_message.size(), true );
+				m_message.clear();
+			}
+
+			m_message_opcode = 0;
 		}
 	}
 
-	assert( payload_length <= out_size );
+	return ret;
+}
 
-	memcpy( ( void* ) out_buffer, ( void* )( in_buffer + pos ), payload_length );
-	out_buffer[ payload_length ] = 0;
-	*out_length = payload_length + 1;
-	*out_parsed = pos + payload_length;
 
-	if ( msg_opcode == 0x0 )
+int
+ws_adapter::fail( std::uint16_t status )
+{
+	std::vector< std::uint8_t >	out;
+	std::uint8_t				code[ 2 ];
+
+	code[ 0 ] = static_cast< std::uint8_t >( status >> 8 );
+	code[ 1 ] = static_cast< std::uint8_t >( status );
+
+	make_frame( frame::close, true, code, sizeof( code ), out );
+	put( out, nullptr );
+
+	return -1;
+}
+
+
+void
+ws::mask( std::uint8_t *buf, std::size_t len, const std::uint8_t key[ 4 ], std::uint64_t pos )
+{
+	std::uint8_t	k[ 8 ];
+	std::uint64_t	word;
+	std::size_t		i = 0;
+
+	// The key turned so that k[ 0 ] goes with buf[ 0 ], twice over. Every
+	// step below moves a multiple of 4 bytes, so it stays lined up.
+
+	for ( auto j = 0; j < 8; j++ )
 	{
-		return ( msg_fin ) ? frame::type::text : frame::type::incomplete_text;
+		k[ j ] = key[ ( pos + j ) & 3 ];
 	}
 
-	if( msg_opcode == 0x1 )
+	memcpy( &word, k, 8 );
+
+#if defined( __AVX2__ )
+
+	__m256i wide = _mm256_set1_epi64x( static_cast< long long >( word ) );
+
+	for ( ; ( i + 32 ) <= len; i += 32 )
 	{
-		return ( msg_fin ) ? frame::type::text : frame::type::incomplete_text;
+		__m256i v = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( buf + i ) );
+
+		_mm256_storeu_si256( reinterpret_cast< __m256i* >( buf + i ), _mm256_xor_si256( v, wide ) );
 	}
 
-	if ( msg_opcode == 0x2 )
+#endif
+
+#if defined( __SSE2__ ) || defined( _M_X64 )
+
+	__m128i narrow = _mm_set1_epi64x( static_cast< long long >( word ) );
+
+	for ( ; ( i + 16 ) <= len; i += 16 )
 	{
-		return ( msg_fin ) ? frame::type::binary : frame::type::incomplete_binary;
+		__m128i v = _mm_loadu_si128( reinterpret_cast< const __m128i* >( buf + i ) );
+
+		_mm_storeu_si128( reinterpret_cast< __m128i* >( buf + i ), _mm_xor_si128( v, narrow ) );
 	}
 
-	if ( msg_opcode == 0x8 )
+#elif defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+
+	uint8x16_t narrow = vreinterpretq_u8_u64( vdupq_n_u64( word ) );
+
+	for ( ; ( i + 16 ) <= len; i += 16 )
 	{
-		return frame::type::close;
+		vst1q_u8( buf + i, veorq_u8( vld1q_u8( buf + i ), narrow ) );
 	}
 
-	if ( msg_opcode == 0x9 )
+#endif
+
+	for ( ; ( i + 8 ) <= len; i += 8 )
 	{
-		return frame::type::ping;
+		std::uint64_t v;
+
+		memcpy( &v, buf + i, 8 );
+		v ^= word;
+		memcpy( buf + i, &v, 8 );
 	}
 
-	if ( msg_opcode == 0xA )
+	for ( ; i < len; i++ )
 	{
-		return frame::type::pong;
+		buf[ i ] ^= k[ i & 7 ];
 	}
-
-	return frame::type::error;
 }
 
 
@@ -34,12 +34,6 @@ netkit::initialize()
 
         netkit::component::m_instances                  = new netkit::component::list;
 
-        netkit::http::server::m_connections				= new netkit::http::connection::list;
-
-        netkit::json::server::m_connections				= new netkit::json::connection::list;
-        netkit::json::server::m_notification_handlers   = new netkit::json::server::notification_handlers;
-        netkit::json::server::m_request_handlers        = new netkit::json::server::request_handlers;
-
         first = false;
     }
 }
@@ -546,6 +540,18 @@ platform::copy_file( const std::string &from, const std::string &to )
 }
 
 
+std::string
+platform::temp_folder()
+{
+	TCHAR path[ MAX_PATH + 1 ];
+	DWORD len;
+
+	len = GetTempPath( MAX_PATH + 1, path );
+
+	return ( len > 0 ) ? narrow( path ) : std::string( "." );
+}
+
+
 uuid::ref
 uuid::create()
 {
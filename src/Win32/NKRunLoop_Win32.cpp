@@ -1,6 +1,7 @@
 #include "NKRunLoop_Win32.h"
 #include <NetKit/NKStackWalk.h>
 #include <NetKit/NKLog.h>
+#include <NetKit/NKMacros.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -23,6 +24,8 @@ static runloop_win32 *g_instance;
 
 using namespace netkit;
 
+static NETKIT_THREAD_LOCAL runloop *g_current = nullptr;
+
 runloop::ref
 runloop::main()
 {
@@ -30,6 +33,13 @@ runloop::main()
 }
 
 
+runloop::ref
+runloop::current()
+{
+	return g_current ? runloop::ref( g_current ) : main();
+}
+
+
 runloop_win32*
 runloop_win32::main()
 {
@@ -339,7 +349,10 @@ runloop_win32::dispatch( dispatch_f f )
 void
 runloop_win32::run( mode how )
 {
-	m_running = TRUE;
+	runloop *prev = g_current;
+
+	g_current	= this;
+	m_running	= TRUE;
 
 	do
 	{
@@ -357,6 +370,8 @@ runloop_win32::run( mode how )
 		}
 	}
 	while ( m_running );
+
+	g_current = prev;
 }
 
 
@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2013, Porchdog Software Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are those
+ * of the authors and should not be interpreted as representing official policies,
+ * either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+// A wrk style load generator for NetKit's own HTTP stack. It keeps a fixed
+// number of keep-alive connections busy through http::client, either
+// closed loop (each connection sends again as soon as it hears back) or at
+// a fixed overall rate. Without a URL it benchmarks against an in-process
+// http::server running on the same runloop.
+//
+// Latency is corrected for coordinated omission. At a fixed rate each
+// request is timed from when it was due to go out rather than from when
+// it went out, so a stall counts against every request queued behind it.
+// Closed loop, the requests a stall kept from being sent are filled in
+// afterwards at the median interval, the way HdrHistogram does it.
+
+#include <NetKit/NetKit.h>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+using namespace netkit;
+
+typedef std::chrono::steady_clock clock_type;
+
+struct options
+{
+	std::size_t	m_connections;
+	std::time_t	m_seconds;
+	double		m_rate;
+	std::size_t	m_body_size;
+	std::string	m_url;
+};
+
+struct results
+{
+	std::vector< std::uint64_t >	m_latencies;	// usec
+	std::uint64_t					m_requests;
+	std::uint64_t					m_errors;
+	std::uint64_t					m_non_2xx;
+	std::uint64_t					m_bytes;
+	bool							m_done;
+};
+
+struct worker
+{
+	clock_type::time_point		m_due;
+	clock_type::duration		m_interval;
+};
+
+
+static void
+usage()
+{
+	std::cerr << "usage: http_bench [-c connections] [-d seconds] [-R requests/sec] [-s response bytes] [url]" << std::endl;
+	std::cerr << "  -c  connections to keep busy (10)" << std::endl;
+	std::cerr << "  -d  how long to run (10)" << std::endl;
+	std::cerr << "  -R  total request rate; 0 runs closed loop (0)" << std::endl;
+	std::cerr << "  -s  body size served when there is no url (1024)" << std::endl;
+}
+
+
+static bool
+parse( int argc, char * const argv[], options &opts )
+{
+	opts.m_connections	= 10;
+	opts.m_seconds		= 10;
+	opts.m_rate			= 0;
+	opts.m_body_size	= 1024;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		std::string arg( argv[ i ] );
+
+		if ( ( arg.size() == 2 ) && ( arg[ 0 ] == '-' ) && ( ( i + 1 ) < argc ) )
+		{
+			const char *val = argv[ ++i ];
+
+			switch ( arg[ 1 ] )
+			{
+				case 'c':
+				{
+					opts.m_connections = static_cast< std::size_t >( std::strtoul( val, nullptr, 10 ) );
+				}
+				break;
+
+				case 'd':
+				{
+					opts.m_seconds = static_cast< std::time_t >( std::strtoul( val, nullptr, 10 ) );
+				}
+				break;
+
+				case 'R':
+				{
+					opts.m_rate = std::strtod( val, nullptr );
+				}
+				break;
+
+				case 's':
+				{
+					opts.m_body_size = static_cast< std::size_t >( std::strtoul( val, nullptr, 10 ) );
+				}
+				break;
+
+				default:
+				{
+					return false;
+				}
+			}
+		}
+		else if ( ( arg[ 0 ] != '-' ) && opts.m_url.empty() )
+		{
+			opts.m_url = arg;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return ( opts.m_connections > 0 ) && ( opts.m_seconds > 0 ) && ( opts.m_rate >= 0 );
+}
+
+
+static std::string
+serve( std::size_t body_size )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::string				body( body_size, 'x' );
+	std::ostringstream		os;
+
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		if ( status == 0 )
+		{
+			sink::ref sink = http::server::adopt( sock.get() );
+			sink->bind( sock.get() );
+		}
+	} );
+
+	http::server::bind( http::method::get, "/bench", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+
+		response->add_to_header( "Content-Type", "text/plain" );
+		response->add_to_header( "Content-Length", static_cast< int >( body.size() ) );
+		*response << body;
+
+		reply( response, false );
+
+		return 0;
+	} );
+
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/bench";
+
+	return os.str();
+}
+
+
+static void
+send( std::shared_ptr< worker > w, const options &opts, std::shared_ptr< results > r )
+{
+	http::request::ref		request;
+	clock_type::time_point	now = clock_type::now();
+
+	if ( r->m_done )
+	{
+		return;
+	}
+
+	if ( opts.m_rate > 0 )
+	{
+		if ( w->m_due > now )
+		{
+			// Early. Come back when it's due; timers only go down to the
+			// millisecond, so round up.
+
+			std::time_t msec = static_cast< std::time_t >( std::chrono::duration_cast< std::chrono::microseconds >( w->m_due - now ).count() + 999 ) / 1000;
+
+			runloop::main()->schedule_oneshot_timer( msec, [=]( runloop::event e )
+			{
+				send( w, opts, r );
+			} );
+
+			return;
+		}
+	}
+	else
+	{
+		w->m_due = now;
+	}
+
+	request = new http::request( http::method::get, 1, 1, new uri( opts.m_url ) );
+
+	request->on_reply( [=]( http::response::ref response )
+	{
+		clock_type::time_point now = clock_type::now();
+
+		if ( r->m_done )
+		{
+			return;
+		}
+
+		r->m_requests++;
+
+		if ( !response )
+		{
+			r->m_errors++;
+		}
+		else
+		{
+			if ( ( response->status() < 200 ) || ( response->status() > 299 ) )
+			{
+				r->m_non_2xx++;
+			}
+
+			r->m_bytes += response->body_size();
+		}
+
+		// Timed from when the request was due, not from when it went out.
+
+		r->m_latencies.push_back( static_cast< std::uint64_t >( std::chrono::duration_cast< std::chrono::microseconds >( now - w->m_due ).count() ) );
+
+		w->m_due += w->m_interval;
+
+		if ( !response )
+		{
+			// Failures can come back before send() returns. Don't spin
+			// on a server that isn't there.
+
+			runloop::main()->schedule_oneshot_timer( 1, [=]( runloop::event e )
+			{
+				send( w, opts, r );
+			} );
+		}
+		else
+		{
+			send( w, opts, r );
+		}
+	} );
+
+	http::client::send( request );
+}
+
+
+static std::uint64_t
+percentile( const std::vector< std::uint64_t > &sorted, double p )
+{
+	std::size_t index;
+
+	if ( sorted.empty() )
+	{
+		return 0;
+	}
+
+	index = static_cast< std::size_t >( std::ceil( ( p / 100.0 ) * sorted.size() ) );
+
+	return sorted[ ( index > 0 ) ? ( index - 1 ) : 0 ];
+}
+
+
+static std::string
+format_usec( double usec )
+{
+	std::ostringstream os;
+
+	os << std::fixed << std::setprecision( 2 );
+
+	if ( usec >= 1000000 )
+	{
+		os << ( usec / 1000000 ) << "s";
+	}
+	else if ( usec >= 1000 )
+	{
+		os << ( usec / 1000 ) << "ms";
+	}
+	else
+	{
+		os << usec << "us";
+	}
+
+	return os.str();
+}
+
+
+static void
+report( const std::string &title, std::vector< std::uint64_t > latencies )
+{
+	static const double	points[] = { 50, 75, 90, 99, 99.9, 99.99, 100 };
+	double				mean	= 0;
+	double				stdev	= 0;
+
+	std::sort( latencies.begin(), latencies.end() );
+
+	for ( auto it = latencies.begin(); it != latencies.end(); it++ )
+	{
+		mean += *it;
+	}
+
+	mean = latencies.empty() ? 0 : ( mean / latencies.size() );
+
+	for ( auto it = latencies.begin(); it != latencies.end(); it++ )
+	{
+		stdev += ( *it - mean ) * ( *it - mean );
+	}
+
+	stdev = latencies.empty() ? 0 : std::sqrt( stdev / latencies.size() );
+
+	std::cout << "  " << title << std::endl;
+	std::cout << "    mean " << format_usec( mean ) << ", stdev " << format_usec( stdev ) << std::endl;
+
+	for ( std::size_t i = 0; i < sizeof( points ) / sizeof( points[ 0 ] ); i++ )
+	{
+		std::cout << "    " << std::setw( 7 ) << points[ i ] << "%  " << format_usec( static_cast< double >( percentile( latencies, points[ i ] ) ) ) << std::endl;
+	}
+}
+
+
+static std::vector< std::uint64_t >
+corrected( const std::vector< std::uint64_t > &latencies )
+{
+	// Each connection would have sent another request every expected
+	// usec had nothing stalled, so a response that took longer hid the
+	// ones it held up. They would have waited for what was left of it.
+
+	std::vector< std::uint64_t >	sorted( latencies );
+	std::vector< std::uint64_t >	out( latencies );
+	std::uint64_t					expected;
+
+	std::sort( sorted.begin(), sorted.end() );
+
+	expected = percentile( sorted, 50 );
+
+	if ( expected == 0 )
+	{
+		return out;
+	}
+
+	for ( auto it = latencies.begin(); it != latencies.end(); it++ )
+	{
+		for ( std::uint64_t missing = ( *it > expected ) ? ( *it - expected ) : 0; missing >= expected; missing -= expected )
+		{
+			out.push_back( missing );
+		}
+	}
+
+	return out;
+}
+
+
+int
+main( int argc, char * const argv[] )
+{
+	std::shared_ptr< results >	r = std::make_shared< results >();
+	options						opts;
+	clock_type::time_point		start;
+	double						elapsed;
+
+	if ( !parse( argc, argv, opts ) )
+	{
+		usage();
+		return 1;
+	}
+
+#if defined( _WIN32 )
+	netkit::log::init( TEXT( "http_bench" ) );
+#else
+	netkit::log::init( "http_bench" );
+#endif
+	netkit::log::set_level( netkit::log::warning );
+
+	if ( opts.m_url.empty() )
+	{
+		opts.m_url = serve( opts.m_body_size );
+	}
+
+	// Every connection has to be able to go back in the pool between
+	// requests, or we'd be measuring connection setup. And all of them
+	// have to be allowed to be busy at once.
+
+	http::client::pool::instance().set_max_idle( std::max< std::size_t >( opts.m_connections, http::client::pool::instance().max_idle() ) );
+	http::client::pool::instance().set_max_per_host( std::max< std::size_t >( opts.m_connections, http::client::pool::instance().max_per_host() ) );
+	http::client::pool::instance().set_max_active_per_host( opts.m_connections );
+
+	r->m_requests	= 0;
+	r->m_errors		= 0;
+	r->m_non_2xx	= 0;
+	r->m_bytes		= 0;
+	r->m_done		= false;
+
+	std::cout << "Running " << opts.m_seconds << "s test @ " << opts.m_url << std::endl;
+	std::cout << "  " << opts.m_connections << " connections, ";
+
+	if ( opts.m_rate > 0 )
+	{
+		std::cout << opts.m_rate << " requests/sec" << std::endl;
+	}
+	else
+	{
+		std::cout << "closed loop" << std::endl;
+	}
+
+	start = clock_type::now();
+
+	for ( std::size_t i = 0; i < opts.m_connections; i++ )
+	{
+		std::shared_ptr< worker > w = std::make_shared< worker >();
+
+		// Spread the connections out over one interval so they don't all
+		// fire together.
+
+		w->m_interval	= ( opts.m_rate > 0 ) ? std::chrono::duration_cast< clock_type::duration >( std::chrono::duration< double >( opts.m_connections / opts.m_rate ) ) : clock_type::duration::zero();
+		w->m_due		= start + ( w->m_interval * i ) / opts.m_connections;
+
+		send( w, opts, r );
+	}
+
+	runloop::main()->schedule_oneshot_timer( opts.m_seconds * 1000, [=]( runloop::event e )
+	{
+		r->m_done = true;
+		runloop::main()->stop();
+	} );
+
+	runloop::main()->run();
+
+	elapsed = std::chrono::duration< double >( clock_type::now() - start ).count();
+
+	std::cout << std::fixed << std::setprecision( 2 );
+	std::cout << "  " << r->m_requests << " requests in " << elapsed << "s, " << ( r->m_bytes / ( 1024.0 * 1024.0 ) ) << "MB read" << std::endl;
+
+	if ( r->m_errors || r->m_non_2xx )
+	{
+		std::cout << "  " << r->m_errors << " errors, " << r->m_non_2xx << " non-2xx responses" << std::endl;
+	}
+
+	std::cout << "Requests/sec: " << ( r->m_requests / elapsed ) << std::endl;
+	std::cout << "Transfer/sec: " << ( r->m_bytes / elapsed / ( 1024.0 * 1024.0 ) ) << "MB" << std::endl;
+	std::cout << "Latency" << std::endl;
+
+	if ( opts.m_rate > 0 )
+	{
+		report( "from when each request was due", r->m_latencies );
+	}
+	else
+	{
+		report( "as measured", r->m_latencies );
+		report( "corrected for coordinated omission", corrected( r->m_latencies ) );
+	}
+
+	return 0;
+}
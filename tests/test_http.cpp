@@ -31,6 +31,9 @@
 #include "catch.hpp"
 #include <NetKit/NetKit.h>
 #include <sstream>
+#include <fstream>
+#include <chrono>
+#include <thread>
 
 using namespace netkit;
 
@@ -225,3 +228,2283 @@ TEST_CASE( "NetKit/http/server/5", "http stress tests" )
 
 	runloop::main()->run();
 }
+
+
+TEST_CASE( "NetKit/http/router/1", "http router tests" )
+{
+	http::server::request_f	noop = []( http::request::ref request, http::server::response_f reply ) { return 0; };
+	http::server::router	router;
+	http::request::params	params;
+
+	http::server::binding::ref users	= new http::server::binding( "/users/{id}/posts", "*", noop );
+	http::server::binding::ref files	= new http::server::binding( "/files/*.txt", "*", noop );
+	http::server::binding::ref version	= new http::server::binding( "/v?/status", "*", noop );
+	http::server::binding::ref json		= new http::server::binding( "/rpc", "application/json", noop );
+	http::server::binding::ref any		= new http::server::binding( "/rpc", "*", noop );
+	http::server::binding::ref shadowed	= new http::server::binding( "/users/{id}/posts", "*", noop );
+
+	router.add( http::method::get, users );
+	router.add( http::method::get, files );
+	router.add( http::method::get, version );
+	router.add( http::method::post, json );
+	router.add( http::method::post, any );
+	router.add( http::method::get, shadowed );
+
+	REQUIRE( router.resolve( http::method::get, "/users/42/posts?page=2", "", params ).get() == users.get() );
+	REQUIRE( params[ "id" ] == "42" );
+	REQUIRE( !router.resolve( http::method::get, "/users//posts", "", params ) );
+	REQUIRE( !router.resolve( http::method::delet, "/users/42/posts", "", params ) );
+
+	REQUIRE( router.resolve( http::method::get, "/files/a/b/notes.txt", "", params ).get() == files.get() );
+	REQUIRE( !router.resolve( http::method::get, "/files/notes.pdf", "", params ) );
+
+	REQUIRE( router.resolve( http::method::get, "/v2/status", "", params ).get() == version.get() );
+	REQUIRE( !router.resolve( http::method::get, "/v/status", "", params ) );
+
+	REQUIRE( router.resolve( http::method::post, "/rpc", "application/json; charset=utf-8", params ).get() == json.get() );
+	REQUIRE( router.resolve( http::method::post, "/rpc", "text/plain", params ).get() == any.get() );
+	REQUIRE( router.resolve( http::method::post, "/rpc", "", params ).get() == any.get() );
+
+	// Each star is tried from each position at most once, so a miss
+	// against many stars doesn't take exponential time.
+
+	http::server::binding::ref stars = new http::server::binding( "/s/*a*a*a*a*a*a*a*a*b", "*", noop );
+
+	router.add( http::method::get, stars );
+
+	REQUIRE( !router.resolve( http::method::get, "/s/" + std::string( 200, 'a' ), "", params ) );
+	REQUIRE( router.resolve( http::method::get, "/s/" + std::string( 200, 'a' ) + "b", "", params ).get() == stars.get() );
+}
+
+
+static double
+time_lookups( const http::server::router &router, const std::string &target, int iterations )
+{
+	http::request::params	params;
+	int						found = 0;
+	auto					start = std::chrono::high_resolution_clock::now();
+
+	for ( auto i = 0; i < iterations; i++ )
+	{
+		if ( router.resolve( http::method::get, target, "", params ) )
+		{
+			found++;
+		}
+	}
+
+	REQUIRE( found == iterations );
+
+	return std::chrono::duration< double, std::nano >( std::chrono::high_resolution_clock::now() - start ).count() / iterations;
+}
+
+
+TEST_CASE( "./NetKit/http/router/benchmark", "http router lookup benchmark" )
+{
+	http::server::request_f	noop = []( http::request::ref request, http::server::response_f reply ) { return 0; };
+	http::server::router	small;
+	http::server::router	large;
+	std::string				target = "/api/v1/resource7/items";
+	int						iterations = 200000;
+
+	for ( auto i = 0; i < 10; i++ )
+	{
+		small.add( http::method::get, new http::server::binding( "/api/v1/resource" + std::to_string( i ) + "/items", "*", noop ) );
+	}
+
+	for ( auto i = 0; i < 10000; i++ )
+	{
+		large.add( http::method::get, new http::server::binding( "/api/v1/resource" + std::to_string( i ) + "/items", "*", noop ) );
+	}
+
+	double small_ns = time_lookups( small, target, iterations );
+	double large_ns = time_lookups( large, target, iterations );
+
+	fprintf( stdout, "router lookup: %.1f ns with 10 routes, %.1f ns with 10000 routes\n", small_ns, large_ns );
+
+	// Cost depends on the length of the target, not the number of routes
+
+	REQUIRE( large_ns < small_ns * 4 );
+
+	for ( std::size_t len = 16; len <= 1024; len *= 4 )
+	{
+		http::server::router	router;
+		std::string				path( len, 'a' );
+
+		path[ 0 ] = '/';
+		router.add( http::method::get, new http::server::binding( path, "*", noop ) );
+
+		fprintf( stdout, "router lookup: %.1f ns for a %zu byte target\n", time_lookups( router, path, iterations / 10 ), len );
+	}
+}
+
+
+TEST_CASE( "NetKit/http/client/pool", "http keep-alive pool tests" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::int32_t			*accepted	= new std::int32_t( 0 );
+	std::ostringstream		os;
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		*accepted = *accepted + 1;
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::get, "/pooled", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		
+		response->add_to_header( "Content-Length", 2 );
+		*response << "ok";
+		
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/pooled";
+	
+	http::request::ref first = new http::request( http::method::get, 1, 1, new uri( os.str() ) );
+	std::string target = os.str();
+	
+	first->on_reply( [=]( http::response::ref response )
+	{
+		REQUIRE( response->status() == 200 );
+
+		runloop::main()->dispatch( [=]()
+		{
+			REQUIRE( http::client::pool::instance().idle() == 1 );
+
+			http::request::ref second = new http::request( http::method::get, 1, 1, new uri( target ) );
+
+			second->on_reply( [=]( http::response::ref response )
+			{
+				REQUIRE( response->status() == 200 );
+				REQUIRE( *accepted == 1 );
+				runloop::main()->stop();
+			} );
+
+			http::client::send( second );
+		} );
+	} );
+	
+	http::client::send( first );
+	
+	runloop::main()->run();
+
+	http::client::pool::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http/client/pool/evict", "http keep-alive pool eviction tests" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::size_t				max_idle	= http::client::pool::instance().max_idle();
+	std::int32_t			*replies	= new std::int32_t( 0 );
+	std::ostringstream		os;
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::get, "/evicted", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		
+		response->add_to_header( "Content-Length", 2 );
+		*response << "ok";
+		
+		reply( response, false );
+		
+		return 0;
+	} );
+
+	// With room for one idle connection, checking in the second one has to evict the
+	// first, which is the only entry for this host
+
+	http::client::pool::instance().clear();
+	http::client::pool::instance().set_max_idle( 1 );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/evicted";
+
+	for ( auto i = 0; i < 2; i++ )
+	{
+		http::request::ref request = new http::request( http::method::get, 1, 1, new uri( os.str() ) );
+		
+		request->on_reply( [=]( http::response::ref response )
+		{
+			REQUIRE( response->status() == 200 );
+
+			if ( ++*replies == 2 )
+			{
+				runloop::main()->dispatch( [=]()
+				{
+					REQUIRE( http::client::pool::instance().idle() == 1 );
+					runloop::main()->stop();
+				} );
+			}
+		} );
+		
+		http::client::send( request );
+	}
+	
+	runloop::main()->run();
+
+	REQUIRE( *replies == 2 );
+
+	http::client::pool::instance().set_max_idle( max_idle );
+	http::client::pool::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http/server/pipelining", "pipelined requests are answered in order" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	ip::tcp::socket::ref	sock		= new ip::tcp::socket;
+	std::string				*received	= new std::string;
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	// The first request is answered after the second one, but its response
+	// must still be written first.
+	
+	http::server::bind( http::method::get, "/pipeline/slow", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		runloop::main()->schedule_oneshot_timer( 50, [=]( runloop::event e ) mutable
+		{
+			http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+			response->add_to_header( "Content-Length", 4 );
+			*response << "slow";
+			reply( response, false );
+		} );
+		
+		return 0;
+	} );
+	
+	http::server::bind( http::method::get, "/pipeline/fast", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		response->add_to_header( "Content-Length", 4 );
+		*response << "fast";
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	std::shared_ptr< source::recv_reply_f > on_recv = std::make_shared< source::recv_reply_f >();
+	
+	*on_recv = [=]( int status, const std::uint8_t *buf, std::size_t len ) mutable
+	{
+		REQUIRE( status == 0 );
+		received->append( buf, buf + len );
+		
+		std::size_t slow = received->find( "slow" );
+		std::size_t fast = received->find( "fast" );
+		
+		if ( ( slow != std::string::npos ) && ( fast != std::string::npos ) )
+		{
+			REQUIRE( slow < fast );
+			runloop::main()->stop();
+		}
+		else
+		{
+			sock->recv( *on_recv );
+		}
+	};
+	
+	sock->connect( new uri( "http", "127.0.0.1", acceptor->endpoint()->port() ), [=]( int status, const endpoint::ref &peer ) mutable
+	{
+		static const char requests[] =
+			"GET /pipeline/slow HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n"
+			"GET /pipeline/fast HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+		
+		REQUIRE( status == 0 );
+		
+		sock->send( ( const std::uint8_t* ) requests, sizeof( requests ) - 1, [=]( int status )
+		{
+			REQUIRE( status == 0 );
+		} );
+		
+		sock->recv( *on_recv );
+	} );
+	
+	runloop::main()->run();
+	
+	*on_recv = nullptr;
+	delete received;
+}
+
+
+TEST_CASE( "NetKit/http/header", "http header tests" )
+{
+	SECTION( "interning", "well-known names intern regardless of case" )
+	{
+		REQUIRE( http::field::intern( "Content-Type" ) == http::field::content_type );
+		REQUIRE( http::field::intern( "content-type" ) == http::field::content_type );
+		REQUIRE( http::field::intern( "CONTENT-LENGTH" ) == http::field::content_length );
+		REQUIRE( http::field::intern( "X-Custom" ) == http::field::unknown );
+		REQUIRE( http::field::to_string( http::field::etag ) == "ETag" );
+	}
+	
+	SECTION( "lookup", "lookups are case-insensitive" )
+	{
+		http::header header;
+		
+		header.set( "content-type", "text/html" );
+		header.set( "X-Custom", "1" );
+		header.set( "CONTENT-TYPE", "application/json" );
+		
+		REQUIRE( header.size() == 2 );
+		REQUIRE( header.find( http::field::content_type ) != header.end() );
+		REQUIRE( header.find( http::field::content_type )->value() == "application/json" );
+		REQUIRE( header.find( http::field::content_type )->name() == "Content-Type" );
+		REQUIRE( header.find( "x-custom" ) != header.end() );
+		REQUIRE( header.find( "x-custom" )->name() == "X-Custom" );
+		
+		header.erase( "X-CUSTOM" );
+		
+		REQUIRE( header.size() == 1 );
+		REQUIRE( header.find( "X-Custom" ) == header.end() );
+	}
+	
+	SECTION( "message", "messages parse well-known headers case-insensitively" )
+	{
+		http::request::ref request = new http::request( http::method::post, 1, 1, new uri( "http://127.0.0.1/" ) );
+		
+		request->add_to_header( "content-length", "12" );
+		request->add_to_header( "host", "127.0.0.1" );
+		
+		REQUIRE( request->content_length() == 12 );
+		REQUIRE( request->find_in_header( "Content-Length" ) == "12" );
+		REQUIRE( request->find_in_header( http::field::host ) == "127.0.0.1" );
+	}
+}
+
+
+TEST_CASE( "NetKit/http/server/split", "headers that straddle reads are reassembled" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	ip::tcp::socket::ref	sock		= new ip::tcp::socket;
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::get, "/split/{name}", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		REQUIRE( request->path_params().find( "name" )->second == "target" );
+		REQUIRE( request->find_in_header( "host" ) == "127.0.0.1" );
+		REQUIRE( request->find_in_header( "X-Split" ) == "across-reads" );
+		
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		response->add_to_header( "Content-Length", 2 );
+		*response << "ok";
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	sock->connect( new uri( "http", "127.0.0.1", acceptor->endpoint()->port() ), [=]( int status, const endpoint::ref &peer ) mutable
+	{
+		static const char first[]	= "GET /split/tar";
+		static const char second[]	= "get HTTP/1.1\r\nHo";
+		static const char third[]	= "st: 127.0.0.1\r\nX-Split: across-";
+		static const char fourth[]	= "reads\r\n\r\n";
+		
+		REQUIRE( status == 0 );
+		
+		sock->send( ( const std::uint8_t* ) first, sizeof( first ) - 1, [=]( int status ) {} );
+		
+		runloop::main()->schedule_oneshot_timer( 20, [=]( runloop::event e ) mutable
+		{
+			sock->send( ( const std::uint8_t* ) second, sizeof( second ) - 1, [=]( int status ) {} );
+			
+			runloop::main()->schedule_oneshot_timer( 20, [=]( runloop::event e ) mutable
+			{
+				sock->send( ( const std::uint8_t* ) third, sizeof( third ) - 1, [=]( int status ) {} );
+				
+				runloop::main()->schedule_oneshot_timer( 20, [=]( runloop::event e ) mutable
+				{
+					sock->send( ( const std::uint8_t* ) fourth, sizeof( fourth ) - 1, [=]( int status ) {} );
+				} );
+			} );
+		} );
+		
+		sock->recv( [=]( int status, const std::uint8_t *buf, std::size_t len )
+		{
+			REQUIRE( status == 0 );
+			REQUIRE( std::string( buf, buf + len ).find( "200" ) != std::string::npos );
+			runloop::main()->stop();
+		} );
+	} );
+	
+	runloop::main()->run();
+}
+
+
+TEST_CASE( "NetKit/http/server/body", "streaming and spilled request bodies" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::size_t				*streamed	= new std::size_t( 0 );
+	std::size_t				*pauses		= new std::size_t( 0 );
+	const std::size_t		size		= 512 * 1024;
+	std::ostringstream		base;
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	// Pause after every chunk and pick up again a little later.
+	
+	http::server::bind( http::method::post, "/body/stream", "*", [=]( http::request::ref request, const std::uint8_t *buf, size_t len, http::server::response_f reply )
+	{
+		http::connection::ref connection = http::server::active_connection();
+		
+		*streamed = *streamed + len;
+		*pauses = *pauses + 1;
+		
+		runloop::main()->schedule_oneshot_timer( 1, [=]( runloop::event e ) mutable
+		{
+			connection->resume();
+		} );
+		
+		return http::connection::pause_body;
+	},
+	[=]( http::request::ref request, http::server::response_f reply )
+	{
+		REQUIRE( request->body_size() == 0 );
+		
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		response->add_to_header( "Content-Length", 0 );
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	// The default binding buffers the body, spilling it to disk past the threshold.
+	
+	http::server::bind( http::method::post, "/body/spill", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		REQUIRE( request->body_spilled() );
+		REQUIRE( request->body_size() == size );
+		REQUIRE( request->body() == std::string( size, 'x' ) );
+		
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		response->add_to_header( "Content-Length", 0 );
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	http::message::set_spill_threshold( 64 * 1024 );
+	
+	base << "http://127.0.0.1:" << acceptor->endpoint()->port();
+	
+	std::string				prefix = base.str();
+	http::request::ref		first = new http::request( http::method::post, 1, 1, new uri( prefix + "/body/stream" ) );
+	
+	*first << std::string( size, 'x' );
+	
+	first->on_reply( [=]( http::response::ref response )
+	{
+		REQUIRE( response->status() == 200 );
+		REQUIRE( *streamed == size );
+		REQUIRE( *pauses > 1 );
+		
+		http::request::ref second = new http::request( http::method::post, 1, 1, new uri( prefix + "/body/spill" ) );
+		
+		*second << std::string( size, 'x' );
+		
+		second->on_reply( [=]( http::response::ref response )
+		{
+			REQUIRE( response->status() == 200 );
+			runloop::main()->stop();
+		} );
+		
+		http::client::send( second );
+	} );
+	
+	http::client::send( first );
+	
+	runloop::main()->run();
+	
+	http::message::set_spill_threshold( 1024 * 1024 );
+	http::client::pool::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http/server/stream", "streamed response bodies" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	const std::size_t		size		= 1024 * 1024 + 17;
+	std::ostringstream		os;
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::get, "/stream", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref	response	= new http::response( request->major(), request->minor(), http::status::ok, true );
+		std::size_t			*left		= new std::size_t( size );
+		
+		response->set_producer( [=]( std::uint8_t *buf, std::size_t len ) -> std::streamsize
+		{
+			std::size_t n = std::min( len, *left );
+			
+			memset( buf, 'z', n );
+			*left -= n;
+			
+			if ( n == 0 )
+			{
+				delete left;
+			}
+			
+			return n;
+		} );
+		
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/stream";
+	
+	http::request::ref request = new http::request( http::method::get, 1, 1, new uri( os.str() ) );
+	
+	request->on_reply( [=]( http::response::ref response )
+	{
+		REQUIRE( response->status() == 200 );
+		REQUIRE( response->find_in_header( http::field::transfer_encoding ) == "chunked" );
+		REQUIRE( response->body_size() == size );
+		runloop::main()->stop();
+	} );
+	
+	http::client::send( request );
+	
+	runloop::main()->run();
+	
+	http::client::pool::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http/server/files", "static files with conditional and range requests" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::string				root		= platform::temp_folder();
+	std::ostringstream		os;
+	std::string				*etag		= new std::string;
+	
+	{
+		std::ofstream out( root + "/netkit-files-test.txt", std::ios::binary );
+		out << "0123456789abcdefghij";
+	}
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind_files( "/files", root );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/files/netkit-files-test.txt";
+	
+	std::string url = os.str();
+	
+	http::request::ref request = new http::request( http::method::get, 1, 1, new uri( url ) );
+	
+	request->on_reply( [=]( http::response::ref response )
+	{
+		REQUIRE( response->status() == 200 );
+		REQUIRE( response->body() == "0123456789abcdefghij" );
+		REQUIRE( response->find_in_header( http::field::accept_ranges ) == "bytes" );
+		REQUIRE( response->find_in_header( http::field::date ).find( " GMT" ) == 25 );
+		*etag = response->find_in_header( http::field::etag );
+		REQUIRE( !etag->empty() );
+		
+		http::request::ref request = new http::request( http::method::get, 1, 1, new uri( url ) );
+		request->add_to_header( "If-None-Match", *etag );
+		
+		request->on_reply( [=]( http::response::ref response )
+		{
+			REQUIRE( response->status() == 304 );
+			
+			http::request::ref request = new http::request( http::method::get, 1, 1, new uri( url ) );
+			request->add_to_header( "Range", "bytes=2-5" );
+			
+			request->on_reply( [=]( http::response::ref response )
+			{
+				REQUIRE( response->status() == 206 );
+				REQUIRE( response->body() == "2345" );
+				REQUIRE( response->find_in_header( http::field::content_range ) == "bytes 2-5/20" );
+				
+				http::request::ref request = new http::request( http::method::get, 1, 1, new uri( url ) );
+				request->add_to_header( "Range", "bytes=0-1,-3" );
+				
+				request->on_reply( [=]( http::response::ref response )
+				{
+					REQUIRE( response->status() == 206 );
+					REQUIRE( response->content_type().find( "multipart/byteranges" ) == 0 );
+					REQUIRE( response->body().find( "Content-Range: bytes 0-1/20\r\n\r\n01\r\n" ) != std::string::npos );
+					REQUIRE( response->body().find( "Content-Range: bytes 17-19/20\r\n\r\nhij\r\n" ) != std::string::npos );
+					
+					http::request::ref request = new http::request( http::method::get, 1, 1, new uri( url ) );
+					request->add_to_header( "Range", "bytes=50-" );
+					
+					request->on_reply( [=]( http::response::ref response )
+					{
+						REQUIRE( response->status() == 416 );
+						REQUIRE( response->find_in_header( http::field::content_range ) == "bytes */20" );
+						runloop::main()->stop();
+					} );
+					
+					http::client::send( request );
+				} );
+				
+				http::client::send( request );
+			} );
+			
+			http::client::send( request );
+		} );
+		
+		http::client::send( request );
+	} );
+	
+	http::client::send( request );
+	
+	runloop::main()->run();
+	
+	delete etag;
+	remove( ( root + "/netkit-files-test.txt" ).c_str() );
+	http::file_cache::instance().clear();
+	http::client::pool::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http/server/files/escaped", "static file names are only unescaped once" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	ip::tcp::socket::ref	sock		= new ip::tcp::socket;
+	std::string				root		= platform::temp_folder();
+	std::string				*received	= new std::string;
+	
+	{
+		std::ofstream out( root + "/netkit-100%25.txt", std::ios::binary );
+		out << "escaped";
+	}
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind_files( "/files", root );
+	
+	std::shared_ptr< source::recv_reply_f > on_recv = std::make_shared< source::recv_reply_f >();
+	
+	*on_recv = [=]( int status, const std::uint8_t *buf, std::size_t len ) mutable
+	{
+		REQUIRE( status == 0 );
+		received->append( buf, buf + len );
+		
+		if ( received->find( "escaped" ) != std::string::npos )
+		{
+			REQUIRE( received->find( "HTTP/1.1 200" ) == 0 );
+			runloop::main()->stop();
+		}
+		else
+		{
+			REQUIRE( received->find( "HTTP/1.1 404" ) == std::string::npos );
+			sock->recv( *on_recv );
+		}
+	};
+	
+	sock->connect( new uri( "http", "127.0.0.1", acceptor->endpoint()->port() ), [=]( int status, const endpoint::ref &peer ) mutable
+	{
+		static const char request[] = "GET /files/netkit-100%2525.txt HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+		
+		REQUIRE( status == 0 );
+		
+		sock->send( ( const std::uint8_t* ) request, sizeof( request ) - 1, [=]( int status )
+		{
+			REQUIRE( status == 0 );
+		} );
+		
+		sock->recv( *on_recv );
+	} );
+	
+	runloop::main()->run();
+	
+	*on_recv = nullptr;
+	delete received;
+	remove( ( root + "/netkit-100%25.txt" ).c_str() );
+	http::file_cache::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http/coding", "content-coding tests" )
+{
+	std::string body( 4096, 'a' );
+	std::string cached;
+
+	// Only the encoded copy is kept.
+
+	http::compression_cache::instance().put( "gzip 4096 \"1\"", "compressed" );
+
+	REQUIRE( !http::compression_cache::instance().get( "gzip 4096 \"2\"", cached ) );
+	REQUIRE( http::compression_cache::instance().get( "gzip 4096 \"1\"", cached ) );
+	REQUIRE( cached == "compressed" );
+	REQUIRE( http::compression_cache::instance().bytes() == std::string( "gzip 4096 \"1\"" ).size() + cached.size() );
+
+	http::compression_cache::instance().clear();
+
+	if ( !http::coding::supported() )
+	{
+		REQUIRE( http::coding::negotiate( "gzip, deflate" ) == http::coding::identity );
+		return;
+	}
+	
+	REQUIRE( http::coding::negotiate( "gzip, deflate" ) == http::coding::gzip );
+	REQUIRE( http::coding::negotiate( "gzip;q=0.5, deflate" ) == http::coding::deflate );
+	REQUIRE( http::coding::negotiate( "gzip;q=0, *" ) == http::coding::deflate );
+	REQUIRE( http::coding::negotiate( "br" ) == http::coding::identity );
+	REQUIRE( http::coding::negotiate( "" ) == http::coding::identity );
+	
+	for ( std::uint8_t c = http::coding::gzip; c <= http::coding::deflate; c++ )
+	{
+		std::string encoded;
+		std::string decoded;
+		
+		REQUIRE( http::coding::encode( c, reinterpret_cast< const std::uint8_t* >( body.data() ), body.size(), encoded ) );
+		REQUIRE( encoded.size() < body.size() );
+		
+		http::coding::decoder::ref decoder = new http::coding::decoder( c );
+		
+		// Feed it a byte at a time to make sure state carries across writes.
+		
+		for ( std::size_t i = 0; i < encoded.size(); i++ )
+		{
+			REQUIRE( decoder->write( reinterpret_cast< const std::uint8_t* >( &encoded[ i ] ), 1, [&]( const std::uint8_t *buf, std::size_t len )
+			{
+				decoded.append( reinterpret_cast< const char* >( buf ), len );
+			} ) );
+		}
+		
+		REQUIRE( decoded == body );
+
+		// A body that would decode to more than the limit is refused.
+
+		std::size_t total = 0;
+
+		decoder = new http::coding::decoder( c, body.size() / 2 );
+
+		REQUIRE( !decoder->write( reinterpret_cast< const std::uint8_t* >( encoded.data() ), encoded.size(), [&]( const std::uint8_t *buf, std::size_t len )
+		{
+			total += len;
+		} ) );
+
+		REQUIRE( total <= body.size() / 2 );
+	}
+}
+
+
+TEST_CASE( "NetKit/http/server/compression", "responses are compressed and transparently decoded" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::ostringstream		os;
+	std::string				json;
+	
+	if ( !http::coding::supported() )
+	{
+		return;
+	}
+
+	for ( int i = 0; i < 200; i++ )
+	{
+		json += ( i == 0 ) ? "[" : ",";
+		json += "{\"id\":" + std::to_string( i ) + ",\"name\":\"item\"}";
+	}
+	
+	json += "]";
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::get, "/json", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		std::string				match		= request->find_in_header( http::field::if_none_match );
+		http::response::ref		response;
+
+		// Weak comparison, like serve_file()
+
+		if ( match.compare( 0, 2, "W/" ) == 0 )
+		{
+			match.erase( 0, 2 );
+		}
+
+		if ( match == "\"j1\"" )
+		{
+			response = new http::response( request->major(), request->minor(), http::status::not_modified, true );
+			response->add_to_header( "ETag", "\"j1\"" );
+			reply( response, false );
+			return 0;
+		}
+
+		response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		
+		response->add_to_header( "Content-Type", "application/json" );
+		response->add_to_header( "ETag", "\"j1\"" );
+		*response << json;
+		response->add_to_header( "Content-Length", static_cast< int >( json.size() ) );
+		
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/json";
+
+	std::string url = os.str();
+	
+	http::request::ref request = new http::request( http::method::get, 1, 1, new uri( url ) );
+	
+	request->on_reply( [=]( http::response::ref response )
+	{
+		REQUIRE( response->status() == 200 );
+		REQUIRE( response->find_in_header( http::field::vary ) == "Accept-Encoding" );
+		REQUIRE( response->find_in_header( http::field::content_encoding ).empty() );
+		REQUIRE( response->body() == json );
+		REQUIRE( http::compression_cache::instance().size() == 1 );
+
+		// The coded body's validator is weakened rather than renamed, so it
+		// still matches the binding's own tag.
+
+		REQUIRE( response->find_in_header( http::field::etag ) == "W/\"j1\"" );
+
+		http::request::ref request = new http::request( http::method::get, 1, 1, new uri( url ) );
+		request->add_to_header( "If-None-Match", response->find_in_header( http::field::etag ) );
+
+		request->on_reply( [=]( http::response::ref response )
+		{
+			REQUIRE( response->status() == 304 );
+
+			// Too big once decoded
+
+			http::client::set_max_decoded_size( json.size() / 2 );
+
+			http::request::ref request = new http::request( http::method::get, 1, 1, new uri( url ) );
+
+			request->on_reply( [=]( http::response::ref response )
+			{
+				REQUIRE( !response );
+				runloop::main()->stop();
+			} );
+
+			http::client::send( request );
+		} );
+
+		http::client::send( request );
+	} );
+	
+	http::client::send( request );
+	
+	runloop::main()->run();
+
+	http::client::set_max_decoded_size( 64 * 1024 * 1024 );
+	http::compression_cache::instance().clear();
+	http::client::pool::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http/client/cache", "client response cache tests" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	int						*hits		= new int[ 4 ]();
+	std::ostringstream		os;
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::get, "/cache/fresh", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		
+		hits[ 0 ]++;
+		response->add_to_header( "Cache-Control", "max-age=60" );
+		*response << "fresh";
+		response->add_to_header( "Content-Length", 5 );
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	http::server::bind( http::method::get, "/cache/validate", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response;
+		
+		hits[ 1 ]++;
+		
+		if ( request->find_in_header( http::field::if_none_match ) == "\"v1\"" )
+		{
+			response = new http::response( request->major(), request->minor(), http::status::not_modified, true );
+		}
+		else
+		{
+			response = new http::response( request->major(), request->minor(), http::status::ok, true );
+			*response << "validated";
+			response->add_to_header( "Content-Length", 9 );
+		}
+		
+		response->add_to_header( "Cache-Control", "no-cache" );
+		response->add_to_header( "ETag", "\"v1\"" );
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	http::server::bind( http::method::get, "/cache/slow", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		hits[ 2 ]++;
+		
+		runloop::main()->schedule_oneshot_timer( 100, [=]( runloop::event e )
+		{
+			http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+			*response << "slow";
+			response->add_to_header( "Content-Length", 4 );
+			reply( response, false );
+		} );
+		
+		return 0;
+	} );
+	
+	// Fresh for a minute, but only for whoever asked.
+	
+	http::server::bind( http::method::get, "/cache/private", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref	response	= new http::response( request->major(), request->minor(), http::status::ok, true );
+		std::string			who			= request->find_in_header( http::field::authorization );
+		
+		hits[ 3 ]++;
+		response->add_to_header( "Cache-Control", "max-age=60" );
+		*response << ( who.empty() ? "nobody" : who );
+		response->add_to_header( "Content-Length", static_cast< int >( who.empty() ? 6 : who.size() ) );
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	http::client::cache::instance().set_enabled( true );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/cache/";
+	
+	std::string base = os.str();
+	
+	auto get_as = [=]( const std::string &path, const std::string &who, std::function< void ( http::response::ref ) > func )
+	{
+		http::request::ref request = new http::request( http::method::get, 1, 1, new uri( base + path ) );
+		
+		if ( !who.empty() )
+		{
+			request->add_to_header( "Authorization", who );
+		}
+		
+		request->on_reply( func );
+		http::client::send( request );
+	};
+	
+	auto get = [=]( const std::string &path, std::function< void ( http::response::ref ) > func )
+	{
+		get_as( path, std::string(), func );
+	};
+	
+	get( "fresh", [=]( http::response::ref response )
+	{
+		REQUIRE( response->body() == "fresh" );
+		
+		get( "fresh", [=]( http::response::ref response )
+		{
+			REQUIRE( response->body() == "fresh" );
+			REQUIRE( hits[ 0 ] == 1 );
+			REQUIRE( !response->find_in_header( http::field::age ).empty() );
+			
+			get( "validate", [=]( http::response::ref response )
+			{
+				REQUIRE( response->body() == "validated" );
+				
+				get( "validate", [=]( http::response::ref response )
+				{
+					// Asked again, and answered from the cache after a 304.
+					
+					REQUIRE( hits[ 1 ] == 2 );
+					REQUIRE( response->status() == 200 );
+					REQUIRE( response->body() == "validated" );
+					
+					auto done = std::make_shared< int >( 0 );
+					
+					for ( int i = 0; i < 3; i++ )
+					{
+						get( "slow", [=]( http::response::ref response )
+						{
+							REQUIRE( response->body() == "slow" );
+							
+							if ( ++*done == 3 )
+							{
+								REQUIRE( hits[ 2 ] == 1 );
+								
+								// Nobody gets what was fetched with someone
+								// else's credentials.
+								
+								get_as( "private", "Bearer alice", [=]( http::response::ref response )
+								{
+									REQUIRE( response->body() == "Bearer alice" );
+									
+									get_as( "private", "Bearer bob", [=]( http::response::ref response )
+									{
+										REQUIRE( response->body() == "Bearer bob" );
+										REQUIRE( hits[ 3 ] == 2 );
+										
+										get( "private", [=]( http::response::ref response )
+										{
+											REQUIRE( response->body() == "nobody" );
+											REQUIRE( hits[ 3 ] == 3 );
+											runloop::main()->stop();
+										} );
+									} );
+								} );
+							}
+						} );
+					}
+				} );
+			} );
+		} );
+	} );
+	
+	runloop::main()->run();
+	
+	delete [] hits;
+	http::client::cache::instance().clear();
+	http::client::cache::instance().set_enabled( false );
+	http::client::pool::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http/server/microcache", "cached bindings are not called again" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	int						*calls		= new int( 0 );
+	std::ostringstream		os;
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::get, "/micro", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		int n = ++*calls;
+		
+		runloop::main()->schedule_oneshot_timer( 100, [=]( runloop::event e )
+		{
+			http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+			std::string body = "call " + std::to_string( n );
+			
+			// Only whole directives count, not ones that happen to contain
+			// a name.
+
+			*response << body;
+			response->add_to_header( "Content-Length", static_cast< int >( body.size() ) );
+			response->add_to_header( "Cache-Control", "public, x-not-private" );
+			reply( response, false );
+		} );
+		
+		return 0;
+	} )->set_cache_policy( 10 * 1000 );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/micro";
+	
+	std::string	base = os.str();
+	auto		done = std::make_shared< int >( 0 );
+	
+	for ( int i = 0; i < 3; i++ )
+	{
+		http::request::ref request = new http::request( http::method::get, 1, 1, new uri( base ) );
+		
+		request->on_reply( [=]( http::response::ref response )
+		{
+			REQUIRE( response->body() == "call 1" );
+			
+			if ( ++*done < 3 )
+			{
+				return;
+			}
+			
+			REQUIRE( *calls == 1 );
+			
+			http::request::ref request = new http::request( http::method::get, 1, 1, new uri( base + "?other" ) );
+			
+			request->on_reply( [=]( http::response::ref response )
+			{
+				REQUIRE( response->body() == "call 2" );
+				REQUIRE( !response->find_in_header( http::field::date ).empty() );
+				
+				http::request::ref again = new http::request( http::method::get, 1, 1, new uri( base + "?other" ) );
+				
+				again->on_reply( [=]( http::response::ref response )
+				{
+					REQUIRE( response->body() == "call 2" );
+					REQUIRE( *calls == 2 );
+					runloop::main()->stop();
+				} );
+				
+				http::client::send( again );
+			} );
+			
+			http::client::send( request );
+		} );
+		
+		http::client::send( request );
+	}
+	
+	runloop::main()->run();
+	
+	delete calls;
+	http::client::pool::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http2/hpack", "http/2 header compression tests" )
+{
+	// RFC 7541 C.4: three requests with Huffman coding, sharing one
+	// dynamic table.
+
+	static const char *blocks[] =
+	{
+		"\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4\xff",
+		"\x82\x86\x84\xbe\x58\x86\xa8\xeb\x10\x64\x9c\xbf",
+		"\x82\x87\x85\xbf\x40\x88\x25\xa8\x49\xe9\x5b\xa9\x7d\x7f\x89\x25\xa8\x49\xe9\x5b\xb8\xe8\xb4\xbf"
+	};
+
+	static const std::size_t sizes[] = { 17, 12, 24 };
+
+	http2::hpack::decoder	decoder;
+	http2::hpack::fields	fields;
+
+	REQUIRE( decoder.decode( reinterpret_cast< const std::uint8_t* >( blocks[ 0 ] ), sizes[ 0 ], fields ) );
+	REQUIRE( fields.size() == 4 );
+	REQUIRE( fields[ 3 ].first == ":authority" );
+	REQUIRE( fields[ 3 ].second == "www.example.com" );
+	REQUIRE( decoder.table_size() == 57 );
+
+	fields.clear();
+	REQUIRE( decoder.decode( reinterpret_cast< const std::uint8_t* >( blocks[ 1 ] ), sizes[ 1 ], fields ) );
+	REQUIRE( fields.size() == 5 );
+	REQUIRE( fields[ 3 ].second == "www.example.com" );
+	REQUIRE( fields[ 4 ].second == "no-cache" );
+	REQUIRE( decoder.table_size() == 110 );
+
+	fields.clear();
+	REQUIRE( decoder.decode( reinterpret_cast< const std::uint8_t* >( blocks[ 2 ] ), sizes[ 2 ], fields ) );
+	REQUIRE( fields.size() == 5 );
+	REQUIRE( fields[ 2 ].second == "/index.html" );
+	REQUIRE( fields[ 4 ].first == "custom-key" );
+	REQUIRE( fields[ 4 ].second == "custom-value" );
+	REQUIRE( decoder.table_size() == 164 );
+
+	// Whatever we encode, we can decode, and repeats shrink to an index.
+
+	http2::hpack::encoder	encoder;
+	http2::hpack::decoder	other;
+	http2::hpack::fields	in;
+	std::string				first;
+	std::string				second;
+
+	in.push_back( http2::hpack::field( ":status", "200" ) );
+	in.push_back( http2::hpack::field( "content-type", "application/json; charset=utf-8" ) );
+	in.push_back( http2::hpack::field( "authorization", "Bearer secret" ) );
+	in.push_back( http2::hpack::field( "x-binary", std::string( "\x00\xff\x7f", 3 ) ) );
+
+	encoder.encode( in, first );
+	encoder.encode( in, second );
+
+	REQUIRE( second.size() < first.size() );
+
+	fields.clear();
+	REQUIRE( other.decode( reinterpret_cast< const std::uint8_t* >( first.data() ), first.size(), fields ) );
+	REQUIRE( fields == in );
+
+	fields.clear();
+	REQUIRE( other.decode( reinterpret_cast< const std::uint8_t* >( second.data() ), second.size(), fields ) );
+	REQUIRE( fields == in );
+
+	// Padding longer than seven bits is an error.
+
+	fields.clear();
+	REQUIRE( !other.decode( reinterpret_cast< const std::uint8_t* >( "\x40\x82\x1f\xff\x00" ), 5, fields ) );
+
+	// A small block that points at one big table entry over and over is
+	// held to the list size, and the table stays usable afterwards.
+
+	http2::hpack::encoder	big_encoder;
+	http2::hpack::decoder	limited;
+	http2::hpack::fields	big;
+	std::string				block;
+
+	limited.set_max_list_size( 64 * 1024 );
+
+	big.push_back( http2::hpack::field( "x-big", std::string( 4000, 'a' ) ) );
+	big_encoder.encode( big, block );
+
+	fields.clear();
+	REQUIRE( limited.decode( reinterpret_cast< const std::uint8_t* >( block.data() ), block.size(), fields ) );
+	REQUIRE( !limited.too_large() );
+	REQUIRE( fields == big );
+
+	std::string bomb( 1000, '\xbe' );
+
+	fields.clear();
+	REQUIRE( limited.decode( reinterpret_cast< const std::uint8_t* >( bomb.data() ), bomb.size(), fields ) );
+	REQUIRE( limited.too_large() );
+	REQUIRE( fields.empty() );
+
+	fields.clear();
+	REQUIRE( limited.decode( reinterpret_cast< const std::uint8_t* >( bomb.data() ), 1, fields ) );
+	REQUIRE( !limited.too_large() );
+	REQUIRE( fields == big );
+}
+
+
+TEST_CASE( "NetKit/http2/server", "multiplexed requests share one connection" )
+{
+	ip::tcp::acceptor::ref	acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::string				big( 200 * 1024, 'x' );
+	std::ostringstream		os;
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::get, "/h2/{n}", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		REQUIRE( request->major() == 2 );
+
+		// Answer the first request last, so the streams finish out of order.
+
+		std::string n = request->path_params().find( "n" )->second;
+		
+		runloop::main()->schedule_oneshot_timer( ( n == "0" ) ? 200 : 10, [=]( runloop::event e )
+		{
+			http::response::ref response = new http::response( 2, 0, http::status::ok, true );
+			
+			*response << ( n == "big" ? big : "stream " + n );
+			response->add_to_header( "Content-Type", "text/plain" );
+			reply( response, false );
+		} );
+		
+		return 0;
+	} );
+
+	http::server::bind( http::method::post, "/h2/echo", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( 2, 0, http::status::ok, true );
+			
+		*response << std::to_string( request->body().size() );
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/h2/";
+	
+	std::string	base = os.str();
+	auto		done = std::make_shared< int >( 0 );
+	auto		last = std::make_shared< std::string >();
+	auto		check = [=]()
+	{
+		if ( ++*done == 5 )
+		{
+			REQUIRE( *last == "0" );
+			runloop::main()->stop();
+		}
+	};
+	
+	for ( int i = 0; i < 3; i++ )
+	{
+		http::request::ref request = new http::request( http::method::get, 1, 1, new uri( base + std::to_string( i ) ) );
+		
+		request->on_reply( [=]( http::response::ref response )
+		{
+			REQUIRE( response );
+			REQUIRE( response->status() == http::status::ok );
+			REQUIRE( response->body() == "stream " + std::to_string( i ) );
+			*last = std::to_string( i );
+			check();
+		} );
+		
+		http2::client::send( request );
+	}
+
+	// Larger than the initial flow control window, in both directions.
+
+	http::request::ref request = new http::request( http::method::post, 1, 1, new uri( base + "echo" ) );
+
+	request->write( reinterpret_cast< const std::uint8_t* >( big.data() ), big.size() );
+	request->on_reply( [=]( http::response::ref response )
+	{
+		REQUIRE( response );
+		REQUIRE( response->body() == std::to_string( big.size() ) );
+		check();
+	} );
+
+	http2::client::send( request );
+
+	request = new http::request( http::method::get, 1, 1, new uri( base + "big" ) );
+	request->on_reply( [=]( http::response::ref response )
+	{
+		REQUIRE( response );
+		REQUIRE( response->body() == big );
+		REQUIRE( response->find_in_header( http::field::date ).size() > 0 );
+		check();
+	} );
+
+	http2::client::send( request );
+
+	REQUIRE( http2::client::connections() == 1 );
+	
+	runloop::main()->run();
+
+	http2::client::clear();
+}
+
+
+TEST_CASE( "NetKit/http2/server/abuse", "peers that reset streams too fast are sent away" )
+{
+	ip::tcp::acceptor::ref			acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	ip::tcp::socket::ref			sock		= new ip::tcp::socket;
+	std::shared_ptr< std::string >	received	= std::make_shared< std::string >();
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	std::shared_ptr< source::recv_reply_f > on_recv = std::make_shared< source::recv_reply_f >();
+	
+	*on_recv = [=]( int status, const std::uint8_t *buf, std::size_t len ) mutable
+	{
+		REQUIRE( status == 0 );
+		received->append( buf, buf + len );
+		
+		// Look for a GOAWAY among the frames that came back.
+		
+		for ( std::size_t pos = 0; ( pos + 9 ) <= received->size(); )
+		{
+			const std::uint8_t	*f		= reinterpret_cast< const std::uint8_t* >( received->data() + pos );
+			std::size_t			flen	= ( std::size_t( f[ 0 ] ) << 16 ) | ( std::size_t( f[ 1 ] ) << 8 ) | f[ 2 ];
+			
+			if ( ( pos + 9 + flen ) > received->size() )
+			{
+				break;
+			}
+			
+			if ( f[ 3 ] == http2::frame::goaway )
+			{
+				REQUIRE( flen >= 8 );
+				REQUIRE( f[ 9 + 7 ] == http2::error::enhance_your_calm );
+				runloop::main()->stop();
+				return;
+			}
+			
+			pos += 9 + flen;
+		}
+		
+		sock->recv( *on_recv );
+	};
+	
+	sock->connect( new uri( "http", "127.0.0.1", acceptor->endpoint()->port() ), [=]( int status, const endpoint::ref &peer ) mutable
+	{
+		std::string out( http2::preface, http2::preface_len );
+		
+		REQUIRE( status == 0 );
+		
+		// An empty SETTINGS, then far more resets than anyone needs.
+		
+		out.append( "\x00\x00\x00\x04\x00\x00\x00\x00\x00", 9 );
+		
+		for ( std::uint32_t id = 1; id < 1000; id += 2 )
+		{
+			char frame[] = { 0, 0, 4, 3, 0, 0, 0, 0, 0, 0, 0, 0, 8 };
+			
+			frame[ 7 ] = static_cast< char >( id >> 8 );
+			frame[ 8 ] = static_cast< char >( id );
+			out.append( frame, sizeof( frame ) );
+		}
+		
+		sock->send( reinterpret_cast< const std::uint8_t* >( out.data() ), out.size(), [=]( int status )
+		{
+			REQUIRE( status == 0 );
+		} );
+		
+		sock->recv( *on_recv );
+	} );
+	
+	runloop::main()->run();
+	
+	*on_recv = nullptr;
+}
+
+
+TEST_CASE( "NetKit/http/server/routes", "route snapshots and per thread registries" )
+{
+	http::server::request_f				noop = []( http::request::ref request, http::server::response_f reply ) { return 0; };
+	http::connection::ref				active = new http::connection( nullptr );
+	http::server::router::ref			before;
+	http::request::params				params;
+	std::vector< std::thread >			threads;
+	std::atomic< int >					failures( 0 );
+
+	http::server::bind( http::method::get, "/snapshot/first", "*", noop );
+	http::server::set_active_connection( active.get() );
+
+	before = http::server::routes();
+
+	// Bind from several threads at once, each resolving against the table
+	// it started with. None of them sees this thread's active connection.
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		threads.push_back( std::thread( [=, &failures]()
+		{
+			http::request::params p;
+
+			for ( int j = 0; j < 25; j++ )
+			{
+				http::server::bind( http::method::get, "/snapshot/" + std::to_string( i ) + "/" + std::to_string( j ), "*", noop );
+
+				if ( !before->resolve( http::method::get, "/snapshot/first", "", p ) )
+				{
+					failures++;
+				}
+			}
+
+			if ( http::server::active_connection() )
+			{
+				failures++;
+			}
+		} ) );
+	}
+
+	for ( auto it = threads.begin(); it != threads.end(); it++ )
+	{
+		it->join();
+	}
+
+	REQUIRE( failures.load() == 0 );
+	REQUIRE( http::server::active_connection().get() == active.get() );
+	REQUIRE( !before->resolve( http::method::get, "/snapshot/3/24", "", params ) );
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		for ( int j = 0; j < 25; j++ )
+		{
+			REQUIRE( http::server::resolve( http::method::get, "/snapshot/" + std::to_string( i ) + "/" + std::to_string( j ), "", params ) );
+		}
+	}
+
+	http::server::set_active_connection( nullptr );
+}
+
+
+TEST_CASE( "NetKit/http/server/limits", "slow and oversized requests are turned away" )
+{
+	typedef std::function< void () > step_f;
+
+	ip::tcp::acceptor::ref	acceptor		= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::time_t				header_timeout	= http::server::header_timeout();
+	std::size_t				header_bytes	= http::server::max_header_bytes();
+	std::size_t				headers			= http::server::max_headers();
+	std::size_t				body_rate		= http::server::min_body_rate();
+	std::uint16_t			port			= acceptor->endpoint()->port();
+
+	// Off unless asked for.
+
+	REQUIRE( header_timeout == 0 );
+	REQUIRE( body_rate == 0 );
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::get, "/limits", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		response->add_to_header( "Content-Length", 2 );
+		*response << "ok";
+		reply( response, false );
+		
+		return 0;
+	} );
+
+	http::server::bind( http::method::post, "/limits", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		response->add_to_header( "Content-Length", 0 );
+		reply( response, false );
+		
+		return 0;
+	} );
+
+	http::server::set_header_timeout( 200 );
+	http::server::set_max_header_bytes( 1024 );
+	http::server::set_max_headers( 5 );
+
+	// Sends head and expects a response with the given status back.
+
+	auto expect = [=]( const std::string &head, const std::string &status, step_f next )
+	{
+		ip::tcp::socket::ref sock = new ip::tcp::socket;
+
+		sock->connect( new uri( "http", "127.0.0.1", port ), [=]( int err, const endpoint::ref &peer ) mutable
+		{
+			REQUIRE( err == 0 );
+
+			sock->send( ( const std::uint8_t* ) head.data(), head.size(), [=]( int err ) {} );
+
+			sock->recv( [=]( int err, const std::uint8_t *buf, std::size_t len ) mutable
+			{
+				REQUIRE( err == 0 );
+				REQUIRE( std::string( buf, buf + len ).substr( 0, 12 ) == "HTTP/1.1 " + status );
+				sock->close();
+				next();
+			} );
+		} );
+	};
+
+	step_f busy = [=]()
+	{
+		http::server::set_max_connections( http::server::connections() );
+
+		expect( "GET /limits HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", "503", [=]()
+		{
+			runloop::main()->stop();
+		} );
+	};
+
+	// A trickle of body, well under the rate, once the grace period is up.
+
+	step_f slow = [=]()
+	{
+		http::server::set_min_body_rate( 1000 );
+
+		expect( "POST /limits HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: 100000\r\n\r\n0123456789", "408", [=]()
+		{
+			http::server::set_min_body_rate( 0 );
+			busy();
+		} );
+	};
+
+	step_f many = [=]()
+	{
+		std::string head( "GET /limits HTTP/1.1\r\nHost: 127.0.0.1\r\n" );
+
+		for ( int i = 0; i < 8; i++ )
+		{
+			head += "X-Field-" + std::to_string( i ) + ": " + std::to_string( i ) + "\r\n";
+		}
+
+		expect( head + "\r\n", "431", slow );
+	};
+
+	step_f large = [=]()
+	{
+		expect( "GET /limits HTTP/1.1\r\nHost: 127.0.0.1\r\nX-Large: " + std::string( 4096, 'x' ) + "\r\n\r\n", "431", many );
+	};
+
+	// Never finishes the head.
+
+	expect( "GET /limits HTTP/1.1\r\nHost: 127.0.0.1\r\n", "408", large );
+
+	runloop::main()->run();
+
+	http::server::set_header_timeout( header_timeout );
+	http::server::set_max_header_bytes( header_bytes );
+	http::server::set_max_headers( headers );
+	http::server::set_min_body_rate( body_rate );
+	http::server::set_max_connections( 0 );
+}
+
+
+TEST_CASE( "NetKit/http/server/events", "events fan out to every subscriber" )
+{
+	typedef std::function< void ( int err, const std::uint8_t *buf, std::size_t len ) > reader_f;
+
+	http::event_channel::ref	slow		= new http::event_channel( 64, http::event_channel::overflow::compact );
+	http::response::ref			response	= new http::response( 1, 1, http::status::ok, true );
+	http::message::producer_f	producer	= slow->subscribe( response );
+	std::uint8_t				buf[ 1024 ];
+	std::streamsize				n;
+
+	// Over the limit, only the newest event of each type is kept.
+
+	REQUIRE( producer( buf, sizeof( buf ) ) == http::message::would_block );
+
+	slow->publish( "1", "a" );
+	slow->publish( "1", "b" );
+	slow->publish( "2", "a" );
+	slow->publish( "2", "b" );
+
+	REQUIRE( slow->dropped() == 2 );
+
+	n = producer( buf, sizeof( buf ) );
+	REQUIRE( n > 0 );
+	REQUIRE( std::string( buf, buf + n ) == "event: a\ndata: 2\n\nevent: b\ndata: 2\n\n" );
+
+	slow->close();
+
+	REQUIRE( slow->subscribers() == 0 );
+	REQUIRE( producer( buf, sizeof( buf ) ) == 0 );
+
+	ip::tcp::acceptor::ref			acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::uint16_t					port		= acceptor->endpoint()->port();
+	http::event_channel::ref		channel		= new http::event_channel;
+	std::shared_ptr< std::size_t >	open		= std::make_shared< std::size_t >( 0 );
+	std::shared_ptr< std::size_t >	done		= std::make_shared< std::size_t >( 0 );
+	static const std::size_t		clients		= 3;
+
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+
+	http::server::bind_events( "/events", channel );
+
+	for ( std::size_t i = 0; i < clients; i++ )
+	{
+		ip::tcp::socket::ref			sock	= new ip::tcp::socket;
+		std::shared_ptr< std::string >	got		= std::make_shared< std::string >();
+		std::shared_ptr< reader_f >		reader	= std::make_shared< reader_f >();
+
+		*reader = [=]( int err, const std::uint8_t *buf, std::size_t len ) mutable
+		{
+			if ( ( err != 0 ) || ( len == 0 ) )
+			{
+				// The channel closed, and the stream with it.
+
+				REQUIRE( got->find( "Content-Type: text/event-stream" ) != std::string::npos );
+				REQUIRE( got->find( "event: tick\ndata: one\n\n" ) != std::string::npos );
+				REQUIRE( got->find( "data: a\ndata: b\n\n" ) != std::string::npos );
+				REQUIRE( got->find( "0\r\n\r\n" ) != std::string::npos );
+
+				sock->close();
+
+				if ( ++*done == clients )
+				{
+					runloop::main()->stop();
+				}
+
+				return;
+			}
+
+			bool head = got->empty();
+
+			got->append( buf, buf + len );
+
+			if ( head && ( ++*open == clients ) )
+			{
+				REQUIRE( channel->subscribers() == clients );
+
+				channel->publish( "one", "tick", "1" );
+				channel->publish( "a\r\nb" );
+				channel->close();
+			}
+
+			sock->recv( *reader );
+		};
+
+		sock->connect( new uri( "http", "127.0.0.1", port ), [=]( int err, const endpoint::ref &peer ) mutable
+		{
+			std::string request( "GET /events HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n" );
+
+			REQUIRE( err == 0 );
+
+			sock->send( ( const std::uint8_t* ) request.data(), request.size(), [=]( int err ) {} );
+			sock->recv( *reader );
+		} );
+	}
+
+	runloop::main()->run();
+
+	REQUIRE( channel->dropped() == 0 );
+}
+
+
+TEST_CASE( "NetKit/http/client/queue", "requests to one host wait their turn" )
+{
+	ip::tcp::acceptor::ref			acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::shared_ptr< int >			busy		= std::make_shared< int >( 0 );
+	std::shared_ptr< int >			most		= std::make_shared< int >( 0 );
+	std::shared_ptr< std::string >	order		= std::make_shared< std::string >();
+	std::shared_ptr< int >			replies		= std::make_shared< int >( 0 );
+	std::shared_ptr< int >			failed		= std::make_shared< int >( 0 );
+	std::size_t						max_active	= http::client::pool::instance().max_active_per_host();
+	std::time_t						timeout		= http::client::pool::instance().queue_timeout();
+	std::ostringstream				os;
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::get, "/queue/*", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		*order += request->uri()->path().substr( 7 );
+		*most = std::max( *most, ++*busy );
+		
+		runloop::main()->schedule_oneshot_timer( 50, [=]( runloop::event e )
+		{
+			http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+			response->add_to_header( "Content-Length", 0 );
+			--*busy;
+			reply( response, false );
+		} );
+		
+		return 0;
+	} );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/queue/";
+
+	// Two at a time, in the order they were sent.
+
+	http::client::pool::instance().set_max_active_per_host( 2 );
+
+	for ( int i = 0; i < 6; i++ )
+	{
+		http::request::ref request = new http::request( http::method::get, 1, 1, new uri( os.str() + std::to_string( i ) ) );
+	
+		request->on_reply( [=]( http::response::ref response )
+		{
+			REQUIRE( response );
+			REQUIRE( response->status() == 200 );
+			
+			if ( ++*replies == 6 )
+			{
+				runloop::main()->stop();
+			}
+		} );
+	
+		http::client::send( request );
+	}
+	
+	REQUIRE( http::client::pool::instance().queued() == 4 );
+	
+	runloop::main()->run();
+	
+	REQUIRE( *most == 2 );
+	REQUIRE( *order == "012345" );
+	REQUIRE( http::client::pool::instance().queued() == 0 );
+
+	// One at a time, and nobody waits long enough for the second.
+
+	http::client::pool::instance().set_max_active_per_host( 1 );
+	http::client::pool::instance().set_queue_timeout( 10 );
+	
+	*replies = 0;
+	
+	for ( int i = 0; i < 2; i++ )
+	{
+		http::request::ref request = new http::request( http::method::get, 1, 1, new uri( os.str() + std::to_string( i ) ) );
+	
+		request->on_reply( [=]( http::response::ref response )
+		{
+			if ( !response )
+			{
+				++*failed;
+			}
+			
+			if ( ++*replies == 2 )
+			{
+				runloop::main()->stop();
+			}
+		} );
+	
+		http::client::send( request );
+	}
+	
+	runloop::main()->run();
+	
+	REQUIRE( *failed == 1 );
+
+	http::client::pool::instance().set_max_active_per_host( max_active );
+	http::client::pool::instance().set_queue_timeout( timeout );
+	http::client::pool::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http/server/fastparse", "pipelined and split requests through the fast parser" )
+{
+	ip::tcp::acceptor::ref			acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	ip::tcp::socket::ref			sock		= new ip::tcp::socket;
+	std::shared_ptr< std::string >	got			= std::make_shared< std::string >();
+	std::shared_ptr< std::function< void ( int, const std::uint8_t*, std::size_t ) > > reader = std::make_shared< std::function< void ( int, const std::uint8_t*, std::size_t ) > >();
+	std::size_t						fast		= http::connection::fast_parsed();
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	auto echo = [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		std::string			body;
+		
+		body = ( request->method() == http::method::post ) ? "POST" : "GET";
+		body += " " + request->uri()->path() + " " + request->find_in_header( "X-Test" ) + " " + request->body() + "|";
+		
+		response->add_to_header( "Content-Length", static_cast< int >( body.size() ) );
+		*response << body;
+		reply( response, false );
+		
+		return 0;
+	};
+	
+	http::server::bind( http::method::get, "/fast/*", "*", echo );
+	http::server::bind( http::method::post, "/fast/*", "*", echo );
+	
+	REQUIRE( http::connection::fast_parse() );
+	
+	*reader = [=]( int err, const std::uint8_t *buf, std::size_t len ) mutable
+	{
+		if ( ( err != 0 ) || ( len == 0 ) )
+		{
+			// The body that needed http_parser sits between two that didn't,
+			// and the last one arrived in two pieces.
+			
+			std::size_t a = got->find( "GET /fast/a one |" );
+			std::size_t b = got->find( "POST /fast/b two abc|" );
+			std::size_t c = got->find( "GET /fast/c three |" );
+			std::size_t d = got->find( "GET /fast/d four |" );
+			
+			REQUIRE( a != std::string::npos );
+			REQUIRE( b != std::string::npos );
+			REQUIRE( c != std::string::npos );
+			REQUIRE( d != std::string::npos );
+			REQUIRE( ( ( a < b ) && ( b < c ) && ( c < d ) ) );
+			
+			// At least the first and third never went near http_parser.
+			
+			REQUIRE( http::connection::fast_parsed() >= ( fast + 2 ) );
+			
+			sock->close();
+			runloop::main()->stop();
+			return;
+		}
+		
+		got->append( buf, buf + len );
+		sock->recv( *reader );
+	};
+	
+	sock->connect( new uri( "http", "127.0.0.1", acceptor->endpoint()->port() ), [=]( int err, const endpoint::ref &peer ) mutable
+	{
+		std::string pipelined =
+			"GET /fast/a HTTP/1.1\r\nHost: 127.0.0.1\r\nX-Test:  one \r\n\r\n"
+			"POST /fast/b HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: 3\r\nX-Test: two\r\n\r\nabc"
+			"GET /fast/c HTTP/1.1\r\nHost: 127.0.0.1\r\nX-Test: three\r\n\r\n"
+			"GET /fast/d HTTP/1.1\r\nHost: 127.0.0.1\r\nX-Te";
+		
+		REQUIRE( err == 0 );
+		
+		sock->send( ( const std::uint8_t* ) pipelined.data(), pipelined.size(), [=]( int err ) {} );
+		
+		runloop::main()->schedule_oneshot_timer( 50, [=]( runloop::event e ) mutable
+		{
+			std::string rest = "st: four\r\nConnection: close\r\n\r\n";
+			
+			sock->send( ( const std::uint8_t* ) rest.data(), rest.size(), [=]( int err ) {} );
+		} );
+		
+		sock->recv( *reader );
+	} );
+	
+	runloop::main()->run();
+}
+
+
+TEST_CASE( "NetKit/http/multipart", "multipart bodies parsed as they arrive" )
+{
+	ip::tcp::acceptor::ref			acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::shared_ptr< std::string >	saved		= std::make_shared< std::string >();
+	std::string						boundary	= "----NetKitTest7MA4YWxkTrZu0gW";
+	std::string						data;
+	std::string						body;
+	std::string						log;
+	std::ostringstream				os;
+	
+	// File data full of things that almost look like a delimiter.
+	
+	for ( int i = 0; i < 20000; i++ )
+	{
+		data += ( i % 3 ) ? "\r\n--" + boundary.substr( 0, i % boundary.size() ) + "\r" : std::string( "\r\n-\r\r\n--" );
+	}
+	
+	body =	"ignored preamble\r\n"
+			"--" + boundary + "\r\n"
+			"Content-Disposition: form-data; name=\"title\"\r\n"
+			"\r\n"
+			"a \"quoted\" value\r\n"
+			"--" + boundary + " \t\r\n"
+			"Content-Disposition: form-data; name=\"doc\"; filename=\"a; b.bin\"\r\n"
+			"Content-Type: application/octet-stream\r\n"
+			"\r\n" +
+			data + "\r\n"
+			"--" + boundary + "\r\n"
+			"Content-Disposition: form-data; name=\"title\"\r\n"
+			"\r\n"
+			"\r\n"
+			"--" + boundary + "--\r\n"
+			"ignored epilogue";
+	
+	REQUIRE( http::multipart::boundary( "multipart/form-data; boundary=" + boundary ) == boundary );
+	REQUIRE( http::multipart::boundary( "Multipart/Form-Data; charset=utf-8; boundary=\"a b\"" ) == "a b" );
+	REQUIRE( http::multipart::boundary( "text/plain; boundary=x" ).empty() );
+	REQUIRE( http::multipart::boundary( "multipart/form-data" ).empty() );
+	
+	// One byte at a time, so every delimiter and head is split every way it can be.
+	
+	http::multipart::ref parser = new http::multipart( boundary, [&]( const http::multipart::part &p )
+	{
+		log += "<" + p.name() + ":" + p.filename() + ":" + p.content_type() + ">";
+		return 0;
+	},
+	[&]( const http::multipart::part &p, const std::uint8_t *buf, std::size_t len )
+	{
+		log.append( reinterpret_cast< const char* >( buf ), len );
+		return 0;
+	},
+	[&]( const http::multipart::part &p )
+	{
+		log += "</" + p.name() + ">";
+		return 0;
+	} );
+	
+	for ( std::size_t i = 0; i < body.size(); i++ )
+	{
+		REQUIRE( parser->write( reinterpret_cast< const std::uint8_t* >( body.data() ) + i, 1 ) );
+	}
+	
+	REQUIRE( parser->done() );
+	REQUIRE( log == "<title::text/plain>a \"quoted\" value</title><doc:a; b.bin:application/octet-stream>" + data + "</doc><title::text/plain></title>" );
+	
+	// And through a server, with the file going to disk.
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind_upload( "/upload", platform::temp_folder(), [=]( http::request::ref request, const http::server::upload &upload, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		
+		REQUIRE( upload.m_fields.count( "title" ) == 2 );
+		REQUIRE( upload.m_fields.find( "title" )->second == "a \"quoted\" value" );
+		REQUIRE( upload.m_files.size() == 1 );
+		REQUIRE( upload.m_files[ 0 ].m_name == "doc" );
+		REQUIRE( upload.m_files[ 0 ].m_filename == "a; b.bin" );
+		REQUIRE( upload.m_files[ 0 ].m_size == data.size() );
+		
+		std::ifstream		in( upload.m_files[ 0 ].m_path.c_str(), std::ios::binary );
+		std::ostringstream	contents;
+		
+		contents << in.rdbuf();
+		REQUIRE( contents.str() == data );
+		
+		*saved = upload.m_files[ 0 ].m_path;
+		
+		response->add_to_header( "Content-Length", 0 );
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/upload";
+	
+	std::string			url		= os.str();
+	http::request::ref	request	= new http::request( http::method::post, 1, 1, new uri( url ) );
+	
+	request->add_to_header( "Content-Type", "multipart/form-data; boundary=" + boundary );
+	*request << body;
+	
+	request->on_reply( [=]( http::response::ref response )
+	{
+		REQUIRE( response );
+		REQUIRE( response->status() == 200 );
+		
+		// Nobody kept the file, so it went with the request.
+		
+		REQUIRE( !saved->empty() );
+		REQUIRE( !std::ifstream( saved->c_str() ).is_open() );
+		
+		http::request::ref bad = new http::request( http::method::post, 1, 1, new uri( url ) );
+		
+		bad->add_to_header( "Content-Type", "text/plain" );
+		*bad << "not multipart";
+		
+		bad->on_reply( [=]( http::response::ref response )
+		{
+			REQUIRE( response );
+			REQUIRE( response->status() == 415 );
+			runloop::main()->stop();
+		} );
+		
+		http::client::send( bad );
+	} );
+	
+	http::client::send( request );
+	
+	runloop::main()->run();
+	
+	http::client::pool::instance().clear();
+}
+
+
+TEST_CASE( "NetKit/http/client/continue", "bodies wait for 100 Continue" )
+{
+	typedef std::function< void ( int err, const std::uint8_t *buf, std::size_t len ) > reader_f;
+	
+	ip::tcp::acceptor::ref			acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	ip::tcp::acceptor::ref			refuser		= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	ip::tcp::acceptor::ref			failer		= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::shared_ptr< std::string >	got			= std::make_shared< std::string >();
+	std::shared_ptr< int >			failed		= std::make_shared< int >( 0 );
+	std::shared_ptr< socket::ref >	peer		= std::make_shared< socket::ref >();
+	std::shared_ptr< reader_f >		reader		= std::make_shared< reader_f >();
+	std::size_t						threshold	= http::client::expect_threshold();
+	std::time_t						timeout		= http::client::continue_timeout();
+	std::ostringstream				os;
+	std::ostringstream				refused;
+	std::ostringstream				expect_failed;
+	
+	// Long enough that only a 100 Continue gets the body sent.
+	
+	http::client::set_expect_threshold( 1000 );
+	http::client::set_continue_timeout( 5000 );
+	
+	acceptor->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		sink::ref sink = http::server::adopt( sock.get() );
+		sink->bind( sock.get() );
+	} );
+	
+	http::server::bind( http::method::post, "/continue", "*", [=]( http::request::ref request, http::server::response_f reply )
+	{
+		http::response::ref response = new http::response( request->major(), request->minor(), http::status::ok, true );
+		
+		REQUIRE( request->expect() == "100-continue" );
+		
+		response->add_to_header( "Content-Length", 0 );
+		response->add_to_header( "X-Size", static_cast< int >( request->body_size() ) );
+		reply( response, false );
+		
+		return 0;
+	} );
+	
+	// A server that says no right away and reads whatever comes after.
+	
+	refuser->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		
+		*peer = sock;
+		
+		*reader = [=]( int err, const std::uint8_t *buf, std::size_t len )
+		{
+			if ( ( err != 0 ) || ( len == 0 ) )
+			{
+				return;
+			}
+			
+			bool head = ( got->find( "\r\n\r\n" ) == std::string::npos );
+			
+			got->append( buf, buf + len );
+			
+			if ( head && ( got->find( "\r\n\r\n" ) != std::string::npos ) )
+			{
+				std::string reply( "HTTP/1.1 401 Unauthorized\r\nContent-Length: 0\r\n\r\n" );
+				
+				( *peer )->send( ( const std::uint8_t* ) reply.data(), reply.size(), [=]( int err ) {} );
+			}
+			
+			( *peer )->recv( *reader );
+		};
+		
+		sock->recv( *reader );
+	} );
+	
+	// A server that doesn't do Expect at all, and answers it with 417.
+	
+	failer->accept( 0, [=]( int status, socket::ref sock, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+		
+		std::shared_ptr< std::string >	in		= std::make_shared< std::string >();
+		std::shared_ptr< reader_f >		read	= std::make_shared< reader_f >();
+		
+		*read = [=]( int err, const std::uint8_t *buf, std::size_t len ) mutable
+		{
+			if ( ( err != 0 ) || ( len == 0 ) )
+			{
+				return;
+			}
+			
+			in->append( buf, buf + len );
+			
+			std::size_t end = in->find( "\r\n\r\n" );
+			
+			if ( ( end != std::string::npos ) && ( in->find( "Expect: 100-continue\r\n" ) < end ) )
+			{
+				std::string reply( "HTTP/1.1 417 Expectation Failed\r\nContent-Length: 0\r\n\r\n" );
+				
+				*failed = *failed + 1;
+				in->clear();
+				sock->send( ( const std::uint8_t* ) reply.data(), reply.size(), [=]( int err ) {} );
+			}
+			else if ( ( end != std::string::npos ) && ( in->size() == ( end + 4 + 4000 ) ) )
+			{
+				std::string reply( "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nX-Size: 4000\r\n\r\n" );
+				
+				in->clear();
+				sock->send( ( const std::uint8_t* ) reply.data(), reply.size(), [=]( int err ) {} );
+			}
+			
+			sock->recv( *read );
+		};
+		
+		sock->recv( *read );
+	} );
+	
+	os << "http://127.0.0.1:" << acceptor->endpoint()->port() << "/continue";
+	refused << "http://127.0.0.1:" << refuser->endpoint()->port() << "/continue";
+	expect_failed << "http://127.0.0.1:" << failer->endpoint()->port() << "/continue";
+	
+	std::string			retry	= expect_failed.str();
+	
+	std::string			url		= refused.str();
+	http::request::ref	small	= new http::request( http::method::post, 1, 1, new uri( os.str() ) );
+	
+	// Asked for, whatever the size.
+	
+	small->add_to_header( "Expect", "100-continue" );
+	*small << "hello";
+	
+	small->on_reply( [=]( http::response::ref response )
+	{
+		REQUIRE( response );
+		REQUIRE( response->status() == 200 );
+		REQUIRE( response->find_in_header( "X-Size" ) == "5" );
+		
+		http::request::ref large = new http::request( http::method::post, 1, 1, new uri( url ) );
+		
+		http::request		*sent = large.get();
+		
+		*large << std::string( 4000, 'x' );
+		
+		large->on_reply( [=]( http::response::ref response )
+		{
+			REQUIRE( response );
+			REQUIRE( response->status() == 401 );
+			
+			// The Expect we added went out on the wire only.
+			
+			REQUIRE( sent->expect().empty() );
+			REQUIRE( sent->find_in_header( "Expect" ).empty() );
+			
+			runloop::main()->schedule_oneshot_timer( 100, [=]( runloop::event e )
+			{
+				// Turned down before the body went out, so it never did.
+				
+				REQUIRE( got->find( "Expect: 100-continue\r\n" ) != std::string::npos );
+				REQUIRE( got->size() == ( got->find( "\r\n\r\n" ) + 4 ) );
+				
+				( *peer )->close();
+				
+				// We added the Expect, so a 417 is ours to deal with, and the
+				// caller only sees the answer to the retry without it.
+				
+				http::request::ref refused = new http::request( http::method::post, 1, 1, new uri( retry ) );
+				
+				*refused << std::string( 4000, 'x' );
+				
+				refused->on_reply( [=]( http::response::ref response )
+				{
+					REQUIRE( response );
+					REQUIRE( response->status() == 200 );
+					REQUIRE( response->find_in_header( "X-Size" ) == "4000" );
+					REQUIRE( *failed == 1 );
+					runloop::main()->stop();
+				} );
+				
+				http::client::send( refused );
+			} );
+		} );
+		
+		http::client::send( large );
+	} );
+	
+	http::client::send( small );
+	
+	runloop::main()->run();
+	
+	http::client::set_expect_threshold( threshold );
+	http::client::set_continue_timeout( timeout );
+	http::client::pool::instance().clear();
+}
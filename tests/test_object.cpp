@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2013, Porchdog Software Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are those
+ * of the authors and should not be interpreted as representing official policies,
+ * either expressed or implied, of the FreeBSD Project.
+ *
+ */
+ 
+#include "catch.hpp"
+#include <NetKit/NetKit.h>
+
+using namespace netkit;
+
+namespace {
+
+template < class Policy >
+struct tracked : public counted< tracked< Policy >, Policy >
+{
+	typedef smart_ref< tracked > ref;
+
+	tracked( int *deleted )
+	:
+		m_deleted( deleted )
+	{
+	}
+
+	~tracked()
+	{
+		( *m_deleted )++;
+	}
+
+	int *m_deleted;
+};
+
+}
+
+TEST_CASE( "NetKit/object/refs", "smart_ref moves, adoption and ref policies" )
+{
+	SECTION( "move", "moving a ref leaves the count alone" )
+	{
+		int								deleted = 0;
+		tracked< thread_safe >::ref		a		= new tracked< thread_safe >( &deleted );
+		tracked< thread_safe >::ref		b( std::move( a ) );
+
+		REQUIRE( !a );
+		REQUIRE( b->refs() == 1 );
+
+		a = std::move( b );
+
+		REQUIRE( !b );
+		REQUIRE( a->refs() == 1 );
+
+		a = nullptr;
+
+		REQUIRE( deleted == 1 );
+	}
+
+	SECTION( "adopt", "detach and adopt hand a reference over without a retain" )
+	{
+		int								deleted = 0;
+		tracked< thread_safe >::ref		a		= new tracked< thread_safe >( &deleted );
+		tracked< thread_safe >			*raw	= a.detach();
+
+		REQUIRE( !a );
+		REQUIRE( raw->refs() == 1 );
+
+		{
+			tracked< thread_safe >::ref b = tracked< thread_safe >::ref::adopt( raw );
+
+			REQUIRE( b->refs() == 1 );
+			REQUIRE( deleted == 0 );
+		}
+
+		REQUIRE( deleted == 1 );
+	}
+
+	SECTION( "confined", "the plain counter counts the same way" )
+	{
+		int									deleted = 0;
+		tracked< thread_confined >::ref		a		= new tracked< thread_confined >( &deleted );
+
+		{
+			tracked< thread_confined >::ref b = a;
+
+			REQUIRE( a->refs() == 2 );
+		}
+
+		REQUIRE( a->refs() == 1 );
+
+		a = nullptr;
+
+		REQUIRE( deleted == 1 );
+	}
+}
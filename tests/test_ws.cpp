@@ -55,7 +55,7 @@ TEST_CASE( "NetKit/ws", "websocket tests" )
 			sock->recv( [=]( int status, const std::uint8_t *buf, std::size_t len ) mutable
 			{
 				REQUIRE( status == 0 );
-				REQUIRE( strstr( ( const char* ) buf, "echo" ) != NULL );
+				REQUIRE( std::string( buf, buf + len ) == "echo" );
 				
 				sock->send( ( const std::uint8_t* ) "hello", 5, [=]( int status ) mutable
 				{
@@ -64,7 +64,7 @@ TEST_CASE( "NetKit/ws", "websocket tests" )
 				sock->recv( [=]( int status, const std::uint8_t *buf, std::size_t len ) mutable
 				{
 					REQUIRE( status == 0 );
-					REQUIRE( strstr( ( const char* ) buf, "hello" ) != NULL );
+					REQUIRE( std::string( buf, buf + len ) == "hello" );
 				
 					runloop::main()->stop();
 				} );
@@ -74,3 +74,348 @@ TEST_CASE( "NetKit/ws", "websocket tests" )
 		netkit::runloop::main()->run();
 	}
 }
+
+
+TEST_CASE( "NetKit/ws/mask", "masking in every alignment" )
+{
+	const std::uint8_t key[ 4 ] = { 0x12, 0x34, 0x56, 0x78 };
+
+	for ( std::size_t offset = 0; offset < 32; offset++ )
+	{
+		for ( std::size_t len = 0; len < 160; len++ )
+		{
+			for ( std::uint64_t pos = 0; pos < 4; pos++ )
+			{
+				std::uint8_t in[ 200 ];
+				std::uint8_t out[ 200 ];
+
+				for ( std::size_t i = 0; i < sizeof( in ); i++ )
+				{
+					in[ i ] = out[ i ] = static_cast< std::uint8_t >( i * 7 + len );
+				}
+
+				ws::mask( out + offset, len, key, pos );
+
+				for ( std::size_t i = 0; i < sizeof( in ); i++ )
+				{
+					bool inside = ( i >= offset ) && ( i < ( offset + len ) );
+
+					REQUIRE( out[ i ] == ( inside ? ( in[ i ] ^ key[ ( pos + i - offset ) & 3 ] ) : in[ i ] ) );
+				}
+			}
+		}
+	}
+}
+
+
+TEST_CASE( "NetKit/ws/client/mask", "client frames are masked" )
+{
+	typedef std::function< void ( int err, const std::uint8_t *buf, std::size_t len ) > reader_f;
+
+	ip::tcp::acceptor::ref			acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::shared_ptr< std::string >	got			= std::make_shared< std::string >();
+	std::shared_ptr< bool >			upgraded	= std::make_shared< bool >( false );
+	std::shared_ptr< socket::ref >	peer		= std::make_shared< socket::ref >();
+	std::shared_ptr< reader_f >		reader		= std::make_shared< reader_f >();
+	source::ref						sock		= new ip::tcp::socket;
+
+	// Plays the server by hand, so it sees exactly what went on the wire.
+
+	acceptor->accept( 0, [=]( int status, socket::ref s, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+
+		*peer = s;
+
+		*reader = [=]( int err, const std::uint8_t *buf, std::size_t len )
+		{
+			REQUIRE( err == 0 );
+
+			std::size_t end;
+
+			got->append( buf, buf + len );
+
+			if ( !*upgraded && ( ( end = got->find( "\r\n\r\n" ) ) != std::string::npos ) )
+			{
+				std::size_t	start	= got->find( "Sec-WebSocket-Key: " ) + 19;
+				std::string	key		= got->substr( start, got->find( "\r\n", start ) - start );
+				std::string	reply	= "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + ws::server::accept_key( key ) + "\r\n\r\n";
+
+				( *peer )->send( ( const std::uint8_t* ) reply.data(), reply.size(), [=]( int err ) {} );
+				got->erase( 0, end + 4 );
+				*upgraded = true;
+			}
+
+			if ( *upgraded && ( got->size() >= 11 ) )
+			{
+				std::uint8_t *frame = reinterpret_cast< std::uint8_t* >( &( *got )[ 0 ] );
+
+				REQUIRE( frame[ 0 ] == 0x81 );
+				REQUIRE( frame[ 1 ] == ( 0x80 | 5 ) );
+
+				ws::mask( frame + 6, 5, frame + 2 );
+
+				REQUIRE( got->substr( 6, 5 ) == "hello" );
+
+				std::string echo( "\x81\x02ok" );
+
+				( *peer )->send( ( const std::uint8_t* ) echo.data(), echo.size(), [=]( int err ) {} );
+				return;
+			}
+
+			( *peer )->recv( *reader );
+		};
+
+		s->recv( *reader );
+	} );
+
+	// The ws scheme brings its own adapter.
+
+	sock->connect( new uri( "ws", "127.0.0.1", acceptor->endpoint()->port() ), [=]( int status, const endpoint::ref &to ) mutable
+	{
+		REQUIRE( status == 0 );
+
+		sock->send( ( const std::uint8_t* ) "hello", 5, [=]( int status ) {} );
+
+		sock->recv( [=]( int status, const std::uint8_t *buf, std::size_t len ) mutable
+		{
+			REQUIRE( status == 0 );
+			REQUIRE( std::string( buf, buf + len ) == "ok" );
+
+			( *peer )->close();
+			runloop::main()->stop();
+		} );
+	} );
+
+	runloop::main()->run();
+}
+
+
+TEST_CASE( "NetKit/ws/fragments", "binary and fragmented messages" )
+{
+	typedef std::function< void ( int err, const std::uint8_t *buf, std::size_t len ) > reader_f;
+
+	ip::tcp::acceptor::ref			acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::shared_ptr< std::string >	got			= std::make_shared< std::string >();
+	std::shared_ptr< std::string >	message		= std::make_shared< std::string >();
+	std::shared_ptr< bool >			upgraded	= std::make_shared< bool >( false );
+	std::shared_ptr< int >			frames		= std::make_shared< int >( 0 );
+	std::shared_ptr< socket::ref >	peer		= std::make_shared< socket::ref >();
+	std::shared_ptr< reader_f >		reader		= std::make_shared< reader_f >();
+	source::ref						sock		= new ip::tcp::socket;
+
+	acceptor->accept( 0, [=]( int status, socket::ref s, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		REQUIRE( status == 0 );
+
+		*peer = s;
+
+		*reader = [=]( int err, const std::uint8_t *buf, std::size_t len )
+		{
+			REQUIRE( err == 0 );
+
+			std::size_t end;
+
+			got->append( buf, buf + len );
+
+			if ( !*upgraded && ( ( end = got->find( "\r\n\r\n" ) ) != std::string::npos ) )
+			{
+				std::size_t	start	= got->find( "Sec-WebSocket-Key: " ) + 19;
+				std::string	key		= got->substr( start, got->find( "\r\n", start ) - start );
+				std::string	reply	= "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + ws::server::accept_key( key ) + "\r\n\r\n";
+
+				// A binary message in two fragments with a ping between them.
+
+				const std::uint8_t burst[] = { 0x02, 0x03, 'a', 'b', 'c', 0x89, 0x02, 'h', 'i', 0x80, 0x02, 'd', 'e' };
+
+				reply.append( burst, burst + sizeof( burst ) );
+
+				( *peer )->send( ( const std::uint8_t* ) reply.data(), reply.size(), [=]( int err ) {} );
+				got->erase( 0, end + 4 );
+				*upgraded = true;
+			}
+
+			// Expect the pong, then the client's message in two frames.
+
+			while ( *upgraded && ( got->size() >= 6 ) && ( got->size() >= ( 6 + static_cast< std::size_t >( ( *got )[ 1 ] & 0x7F ) ) ) )
+			{
+				std::uint8_t	*frame	= reinterpret_cast< std::uint8_t* >( &( *got )[ 0 ] );
+				std::size_t		size	= frame[ 1 ] & 0x7F;
+
+				REQUIRE( ( frame[ 1 ] & 0x80 ) != 0 );
+
+				ws::mask( frame + 6, size, frame + 2 );
+
+				switch ( ( *frames )++ )
+				{
+					case 0:
+					{
+						REQUIRE( frame[ 0 ] == 0x8A );
+						REQUIRE( got->substr( 6, size ) == "hi" );
+					}
+					break;
+
+					case 1:
+					{
+						REQUIRE( frame[ 0 ] == 0x02 );
+						REQUIRE( got->substr( 6, size ) == "12" );
+					}
+					break;
+
+					case 2:
+					{
+						REQUIRE( frame[ 0 ] == 0x80 );
+						REQUIRE( got->substr( 6, size ) == "3" );
+
+						( *peer )->close();
+						runloop::main()->stop();
+					}
+					return;
+				}
+
+				got->erase( 0, 6 + size );
+			}
+
+			( *peer )->recv( *reader );
+		};
+
+		s->recv( *reader );
+	} );
+
+	sock->connect( new uri( "ws", "127.0.0.1", acceptor->endpoint()->port() ), [=]( int status, const endpoint::ref &to ) mutable
+	{
+		REQUIRE( status == 0 );
+
+		ws::adapter::ref adapter = sock->find_adapter< ws::adapter >();
+
+		REQUIRE( adapter );
+
+		adapter->set_message_handler( [=]( ws::adapter::type t, const std::uint8_t *buf, std::size_t len, bool last )
+		{
+			REQUIRE( t == ws::adapter::type::binary );
+
+			message->append( buf, buf + len );
+
+			if ( last )
+			{
+				REQUIRE( *message == "abcde" );
+
+				adapter->send_fragment( ws::adapter::type::binary, ( const std::uint8_t* ) "12", 2, false, [=]( int status ) {} );
+				adapter->send_fragment( ws::adapter::type::binary, ( const std::uint8_t* ) "3", 1, true, [=]( int status ) {} );
+			}
+		} );
+
+		// With a message handler set, recv() only has to keep data coming.
+
+		sock->recv( [=]( int status, const std::uint8_t *buf, std::size_t len )
+		{
+		} );
+	} );
+
+	runloop::main()->run();
+}
+
+
+TEST_CASE( "NetKit/ws/close", "protocol errors close with a status" )
+{
+	typedef std::function< void ( int err, const std::uint8_t *buf, std::size_t len ) > reader_f;
+	typedef std::function< void () > step_f;
+
+	ip::tcp::acceptor::ref				acceptor	= new ip::tcp::acceptor( new ip::endpoint( AF_INET, 0 ) );
+	std::shared_ptr< std::string >		frame		= std::make_shared< std::string >();
+	std::shared_ptr< std::uint16_t >	expected	= std::make_shared< std::uint16_t >( 0 );
+	std::shared_ptr< step_f >			next		= std::make_shared< step_f >();
+
+	// Plays the server by hand: sends frame right behind the handshake, and
+	// waits for the close frame the client answers with.
+
+	acceptor->accept( 0, [=]( int status, socket::ref s, const std::uint8_t *peek_buf, std::size_t peek_len )
+	{
+		std::shared_ptr< std::string >	got			= std::make_shared< std::string >();
+		std::shared_ptr< bool >			upgraded	= std::make_shared< bool >( false );
+		std::shared_ptr< reader_f >		reader		= std::make_shared< reader_f >();
+		socket::ref						peer		= s;
+
+		REQUIRE( status == 0 );
+
+		*reader = [=]( int err, const std::uint8_t *buf, std::size_t len ) mutable
+		{
+			REQUIRE( err == 0 );
+
+			std::size_t end;
+
+			got->append( buf, buf + len );
+
+			if ( !*upgraded && ( ( end = got->find( "\r\n\r\n" ) ) != std::string::npos ) )
+			{
+				std::size_t	start	= got->find( "Sec-WebSocket-Key: " ) + 19;
+				std::string	key		= got->substr( start, got->find( "\r\n", start ) - start );
+				std::string	reply	= "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + ws::server::accept_key( key ) + "\r\n\r\n";
+
+				reply += *frame;
+
+				peer->send( ( const std::uint8_t* ) reply.data(), reply.size(), [=]( int err ) {} );
+				got->erase( 0, end + 4 );
+				*upgraded = true;
+			}
+
+			if ( *upgraded && ( got->size() >= 8 ) )
+			{
+				std::uint8_t *close = reinterpret_cast< std::uint8_t* >( &( *got )[ 0 ] );
+
+				REQUIRE( close[ 0 ] == 0x88 );
+				REQUIRE( close[ 1 ] == ( 0x80 | 2 ) );
+
+				ws::mask( close + 6, 2, close + 2 );
+
+				REQUIRE( ( ( close[ 6 ] << 8 ) | close[ 7 ] ) == *expected );
+
+				peer->close();
+				( *next )();
+				return;
+			}
+
+			peer->recv( *reader );
+		};
+
+		s->recv( *reader );
+	} );
+
+	auto connect = [=]( std::size_t max_message_size )
+	{
+		source::ref sock = new ip::tcp::socket;
+
+		sock->connect( new uri( "ws", "127.0.0.1", acceptor->endpoint()->port() ), [=]( int status, const endpoint::ref &to ) mutable
+		{
+			REQUIRE( status == 0 );
+
+			sock->find_adapter< ws::adapter >()->set_max_message_size( max_message_size );
+
+			sock->recv( [=]( int status, const std::uint8_t *buf, std::size_t len )
+			{
+			} );
+		} );
+	};
+
+	// Servers never mask what they send.
+
+	*frame		= std::string( "\x81\x82\x01\x02\x03\x04\x69\x6b", 8 );
+	*expected	= 1002;
+	*next		= [=]()
+	{
+		// Without a message handler, messages are held to the limit.
+
+		*frame		= "\x81\x08" + std::string( 8, 'x' );
+		*expected	= 1009;
+		*next		= [=]()
+		{
+			runloop::main()->stop();
+		};
+
+		connect( 4 );
+	};
+
+	connect( 0 );
+
+	runloop::main()->run();
+}
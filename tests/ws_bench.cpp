@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2013, Porchdog Software Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are those
+ * of the authors and should not be interpreted as representing official policies,
+ * either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+// Times ws::mask() against the byte at a time loop it replaced, over
+// payload sizes from a chat message to a large binary frame. The buffer
+// starts one byte off alignment, the way a payload does behind a 6 or 8
+// byte frame header.
+
+#include <NetKit/NetKit.h>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+using namespace netkit;
+
+typedef std::chrono::steady_clock clock_type;
+
+
+static void
+bytewise( std::uint8_t *buf, std::size_t len, const std::uint8_t key[ 4 ] )
+{
+	for ( std::size_t i = 0; i < len; i++ )
+	{
+		buf[ i ] ^= key[ i % 4 ];
+	}
+}
+
+
+// GB/s over at least 256MB worth of passes.
+
+template< class F >
+static double
+measure( F f, std::uint8_t *buf, std::size_t len, const std::uint8_t key[ 4 ] )
+{
+	std::size_t				passes	= std::max< std::size_t >( 1, ( 256 * 1024 * 1024 ) / len );
+	clock_type::time_point	start	= clock_type::now();
+	double					elapsed;
+
+	for ( std::size_t i = 0; i < passes; i++ )
+	{
+		f( buf, len, key );
+	}
+
+	elapsed = std::chrono::duration< double >( clock_type::now() - start ).count();
+
+	return ( static_cast< double >( passes ) * len ) / elapsed / 1e9;
+}
+
+
+int
+main( int argc, char * const argv[] )
+{
+	static const std::size_t	sizes[] = { 16, 64, 125, 1024, 16 * 1024, 64 * 1024, 1024 * 1024 };
+	const std::uint8_t			key[ 4 ] = { 0x37, 0xfa, 0x21, 0x3d };
+	std::vector< std::uint8_t >	buf( 1024 * 1024 + 1 );
+
+	for ( std::size_t i = 0; i < buf.size(); i++ )
+	{
+		buf[ i ] = static_cast< std::uint8_t >( std::rand() );
+	}
+
+	std::cout << std::setw( 10 ) << "bytes" << std::setw( 14 ) << "bytewise GB/s" << std::setw( 14 ) << "mask GB/s" << std::setw( 10 ) << "speedup" << std::endl;
+
+	for ( auto size : sizes )
+	{
+		double slow = measure( bytewise, &buf[ 1 ], size, key );
+		double fast = measure( []( std::uint8_t *buf, std::size_t len, const std::uint8_t key[ 4 ] )
+		{
+			ws::mask( buf, len, key );
+		}, &buf[ 1 ], size, key );
+
+		std::cout << std::setw( 10 ) << size << std::fixed << std::setprecision( 2 ) << std::setw( 14 ) << slow << std::setw( 14 ) << fast << std::setw( 9 ) << ( fast / slow ) << "x" << std::endl;
+	}
+
+	return 0;
+}